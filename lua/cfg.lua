@@ -376,6 +376,9 @@ local function set_class_defaults()
     t.conf_boost  = t.conf_boost  or 0
     t.hr          = t.hr     == nil and true or t.hr
     t.resend      = t.resend == nil and true or t.resend
+    t.shards      = t.shards or 1
+    util.insistf(type(t.shards) == 'number' and t.shards >= 1,
+                 "Class %s has a bad number of shards", class)
     class_of_tag[t.sfid]               = class
     class_of_tag[string.upper(t.sfid)] = class
     setmetatable(t, class_meta)
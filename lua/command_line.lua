@@ -16,6 +16,7 @@ local commands = require (_PACKAGE .. 'commands')
 local filter   = require (_PACKAGE .. 'filter')
 local lists    = require (_PACKAGE .. 'lists')
 local log      = require (_PACKAGE .. 'log')
+local milter   = require (_PACKAGE .. 'milter')
 local mlearn   = require (_PACKAGE .. 'mlearn')
 local msg      = require (_PACKAGE .. 'msg')
 local options  = require (_PACKAGE .. 'options')
@@ -629,22 +630,47 @@ Valid options: -notag   => disables subject tagging
                -nosfid  => disables sfid (implies -nocache)
 ]]
 
+-- classify and tag a message that has no subject-line command,
+-- and cache it
+local function filter_and_cache(m, options)
+  local sfid = commands.filter(m, options)
+  if sfid and not options.nocache and cfg.cache.use then
+    cache.store(sfid, msg.to_orig_string(m))
+  end
+end
+
+-- the same, returning the text to be delivered
+local function filtered_message(m, options)
+  filter_and_cache(m, options)
+  return msg.to_string(m)
+end
+
+-- report a filtering error in the headers of m; returns the text
+-- to be delivered
+local function filter_error_message(m, err)
+  filter.add_osbf_header(m, 'Error', err or 'unknown error')
+  local maybe_class = err and err:match [[^Couldn't lock the file /.*/(.-)%.cfc%.$]]
+  if maybe_class then -- salvage locking error on classification update
+    local suffixes = cfg.header_suffixes
+    filter.add_osbf_header(m, suffixes.class, maybe_class)
+    filter.add_osbf_header(m, suffixes.confidence, '0.0')
+    filter.add_osbf_header(m, suffixes.needs_training, 'yes')
+  end
+  return msg.to_string(m)
+end
+
+local filter_options =
+  {nocache = options.std.bool, notag = options.std.bool, nosfid = options.std.bool}
+
 _M.filter = function(...)
-  local options, argv =
-    options.parse({...},
-      {nocache = options.std.bool, notag = options.std.bool,
-       nosfid = options.std.bool})
+  local options, argv = options.parse({...}, filter_options)
 
   local function filter_one(m)
     local have_subject_cmd, cmd = _G.pcall(filter.parse_subject_command, m)
     if have_subject_cmd then
       exec_subject_line_command(cmd, m)
     else
-      local sfid = commands.filter(m, options)
-      if sfid and not options.nocache and cfg.cache.use then
-        cache.store(sfid, msg.to_orig_string(m))
-      end
-      io.stdout:write(msg.to_string(m))
+      io.stdout:write(filtered_message(m, options))
     end
   end
 
@@ -655,15 +681,7 @@ _M.filter = function(...)
     if ok then ok2, err = _G.pcall(filter_one, m) end -- cannot use 'and' here
     if ok then
       if not ok2 then
-        filter.add_osbf_header(m, 'Error', err or 'unknown error')
-        local maybe_class = err:match [[^Couldn't lock the file /.*/(.-)%.cfc%.$]]
-        if maybe_class then -- salvage locking error on classification update
-          local suffixes = cfg.header_suffixes
-          filter.add_osbf_header(m, suffixes.class, maybe_class)
-          filter.add_osbf_header(m, suffixes.confidence, '0.0')
-          filter.add_osbf_header(m, suffixes.needs_training, 'yes')
-        end
-        io.stdout:write(msg.to_string(m))
+        io.stdout:write(filter_error_message(m, err))
       end
     else
       io.stdout:write(s) -- never a loss on stdin
@@ -688,6 +706,229 @@ cfg.after_loading_do(
 table.insert(usage_lines,
   'filter [-nosfid] [-nocache] [-notag] [<sfid|filename> ...]')
  
+__doc.daemon = [[function(...)
+Runs a server that keeps the databases open and answers requests
+from osbf-client over a Unix-domain socket, so that a message can be
+filtered without starting a new process.  Databases are reopened
+whenever another process changes or replaces them.  Classification
+counts are written when the databases are next closed, at the latest
+a second after the last request.
+Valid options: -socket <path> => socket to listen on
+                                 (default osbf.sock in the user directory)
+               -timeout <sec> => longest wait for a client (default 10)
+
+Each connection carries one request, a line followed by a message:
+  FILTER <length> [-notag] [-nocache] [-nosfid]
+  CLASSIFY <length>
+The answer is one of
+  OK <length>      followed by the filtered message, or by a line
+                   'class=<class> confidence=<pR> train=<yes|no>'
+  PASS             the message holds a subject-line command, which
+                   the client should run with 'osbf filter'
+  ERR <reason>
+]]
+
+__doc.milter = [[function(...)
+Like daemon, but speaks the milter protocol of Sendmail and Postfix,
+so that the MTA itself has each message classified as it arrives.
+At the end of each message the milter adds the summary, class,
+confidence, needs_training and sfid headers, tags the subject and
+inserts the sfid, as 'osbf filter' does, and caches the message.
+Connections are served together, a packet at a time.  A message
+holding a subject-line command is passed on unchanged, for
+'osbf filter' to run the command at delivery.
+Valid options: -socket <path> => socket to listen on
+                                 (default milter.sock in the user directory)
+               -timeout <sec> => longest wait for a packet (default 10)
+               -notag, -nocache, -nosfid => as for filter
+
+With Postfix, for example:
+  smtpd_milters = unix:/home/user/.osbf-lua/milter.sock
+]]
+
+do
+  local function classify_message(m)
+    local probs, conf = commands.multiclassify(commands.extract_feature(m))
+    local bc = commands.classify(m, probs, conf)
+    return string.format('class=%s confidence=%.2f train=%s\n',
+                         bc.class, bc.pR, bc.train and 'yes' or 'no')
+  end
+
+  local function answer(request, s)
+    local ok, m = _G.pcall(msg.of_string, s)
+    if not ok then
+      return s -- never a loss
+    elseif request.command == 'CLASSIFY' then
+      return classify_message(m)
+    elseif _G.pcall(filter.parse_subject_command, m) then
+      return nil -- PASS
+    else
+      local ok, text = _G.pcall(filtered_message, m, request.options)
+      return ok and text or filter_error_message(m, text)
+    end
+  end
+
+  local function serve(fd)
+    local line = assert(core.fd_read(fd, '*l'))
+    local words = { }
+    for w in line:gmatch '%S+' do table.insert(words, w) end
+    local command, len = words[1], tonumber(words[2])
+    assert(command == 'FILTER' or command == 'CLASSIFY', 'unknown request')
+    assert(len and len >= 0, 'bad message length')
+    local request = { command = command,
+                      options = options.parse({select(3, unpack(words))},
+                                              filter_options) }
+    local s = core.fd_read(fd, len) or ''
+    assert(#s == len, 'message truncated')
+    local text = answer(request, s)
+    if text then
+      assert(core.fd_write(fd, 'OK ', #text, '\n', text))
+    else
+      assert(core.fd_write(fd, 'PASS\n'))
+    end
+  end
+
+  -- The classes stay open from one request to the next and are
+  -- reopened when another process replaces a class file (new inode)
+  -- or writes it (new size or mtime, to the nanosecond), or does the
+  -- same to its journal.  Files are stamped only while the classes are
+  -- closed, just before they are opened again, so that no change made
+  -- meanwhile passes for one already seen.  Our own classification
+  -- counts would pass for changes, so they are kept in memory and
+  -- written once the classes are closed: when another process changes
+  -- them, when no request comes for a while, or when max_pending wait.
+  local stamps = { }
+  local pending, num_pending = { }, 0
+  local max_pending, idle = 100, 1
+
+  local function stamp(file)
+    local function one(f)
+      local mtime, size, ino, dev, nsec = core.filestat(f)
+      return mtime and table.concat({mtime, nsec, size, ino, dev}, ':') or '-'
+    end
+    return one(file) .. '/' .. one(file .. '.log')
+  end
+
+  local function count_later(class)
+    local db = cfg.classes[class].db
+    pending[db] = (pending[db] or 0) + 1
+    num_pending = num_pending + 1
+  end
+
+  -- closes the classes and writes the counts kept for them
+  local function close_classes()
+    core.close()
+    for db, n in pairs(pending) do
+      local ok, err = pcall(core.increment, db, 'classifications', n)
+      if not ok then log.logf('%s: %s', db, tostring(err)) end
+    end
+    pending, num_pending, stamps = { }, 0, { }
+  end
+
+  local function reopen_if_changed()
+    for _, t in pairs(cfg.classes) do
+      if stamps[t.db] ~= stamp(t.db) then
+        close_classes()
+        break
+      end
+    end
+    if _G.next(stamps) == nil then
+      for _, t in pairs(cfg.classes) do stamps[t.db] = stamp(t.db) end
+    end
+  end
+
+  local function after_request()
+    if num_pending >= max_pending then close_classes() end
+  end
+
+  function daemon(...)
+    local opts, argv = options.parse({...},
+      {socket = options.std.val, timeout = options.std.num})
+    if #argv > 0 then usage() end
+    local path = opts.socket or cfg.dirfilename('user', 'osbf.sock')
+    local server = assert(core.socket_listen(path))
+    commands.count_classification = count_later
+    while true do
+      local ready = assert(core.fd_poll({ server }, num_pending > 0 and idle or nil))
+      local fd, err
+      if #ready == 0 then
+        close_classes()
+      else
+        fd, err = core.socket_accept(server, opts.timeout or 10)
+      end
+      if fd then
+        reopen_if_changed()
+        local ok, err = pcall(serve, fd)
+        if not ok then
+          core.fd_write(fd, 'ERR ', (tostring(err):gsub('%s+', ' ')), '\n')
+          log.logf('daemon: %s', tostring(err))
+        end
+        core.fd_close(fd)
+        after_request()
+      elseif err then
+        log.logf('daemon: %s', err)
+      end
+    end
+  end
+
+  -- the header changes that filtering the message calls for
+  local function milter_changes(text, options)
+    local ok, m = _G.pcall(msg.of_string, text)
+    if not ok then return { } end
+    local before = { unpack(m.__headers) }
+    if not _G.pcall(filter.parse_subject_command, m) then
+      reopen_if_changed()
+      local ok, err = _G.pcall(filter_and_cache, m, options)
+      if not ok then
+        filter_error_message(m, err)
+        log.logf('milter: %s', tostring(err))
+      end
+      after_request()
+    end
+    return milter.header_changes(before, m.__headers)
+  end
+
+  local milter_options = { socket = options.std.val, timeout = options.std.num }
+  for k, v in pairs(filter_options) do milter_options[k] = v end
+
+  function _M.milter(...)
+    local opts, argv = options.parse({...}, milter_options)
+    if #argv > 0 then usage() end
+    local path = opts.socket or cfg.dirfilename('user', 'milter.sock')
+    local server = assert(core.socket_listen(path))
+    local function eom(text) return milter_changes(text, opts) end
+    local sessions = { }
+    commands.count_classification = count_later
+    while true do
+      local fds = { server }
+      for fd in pairs(sessions) do table.insert(fds, fd) end
+      local ready = assert(core.fd_poll(fds, num_pending > 0 and idle or nil))
+      if #ready == 0 then close_classes() end
+      for _, fd in ipairs(ready) do
+        if fd == server then
+          local conn, err = core.socket_accept(server, opts.timeout or 10)
+          if conn then
+            sessions[conn] = milter.session(eom)
+          else
+            log.logf('milter: %s', err)
+          end
+        else
+          local ok, more = pcall(sessions[fd].serve, sessions[fd], fd)
+          if not ok then log.logf('milter: %s', tostring(more)) end
+          if not (ok and more) then
+            core.fd_close(fd)
+            sessions[fd] = nil
+          end
+        end
+      end
+    end
+  end
+end
+
+table.insert(usage_lines, 'daemon [-socket <path>] [-timeout <seconds>]')
+table.insert(usage_lines,
+  'milter [-socket <path>] [-timeout <seconds>] [-nosfid] [-nocache] [-notag]')
+
 __doc.stats = [[function(...)
 Writes classification and database statistics to stdout.
 Valid options: -v, --verbose => adds more database statistics.
@@ -804,6 +1045,8 @@ Changes the size of a class database.
 newsize is the new size in bytes.
 If the new size is lesser than the original size, contents are
 pruned, less significative buckets first, to fit the new size.
+The database stays in use meanwhile: classifications go on with the
+old database, and trainings made during the resize are kept.
 XXX if resized back to 1.1M we get 95778 buckets, not 94321.
 ]]
 
@@ -815,14 +1058,7 @@ function resize(class, newsize, ...)
     util.die('Unknown class to resize: "', class,
              '".\nValid classes are: ', table.concat(cfg.classlist(), ', '))
   else
-    local dbname = cfg.classes[class].db
-    local stats = core.stats(core.open_class(dbname))
-    local tmpname = util.validate(util.tmpname(dbname))
-    -- XXX non atomic...
-    os.remove(tmpname) -- core.create_db doesn't overwite files (add flag to force?)
-    local real_bytes = commands.create_single_db(tmpname, nb)
-    core.import(tmpname, dbname)
-    util.validate(os.rename(tmpname, dbname))
+    local real_bytes = commands.resize_single_db(cfg.classes[class].db, nb)
     class = util.capitalize(class)
     output.writeln(class, ' database resized to ', util.human_of_bytes(real_bytes))
   end
@@ -49,10 +49,10 @@ Removes key tag with value arg from listname's pattern table.
 ]]
 list_del_pat    = mk_list_command('del', 'pats')
 
-__doc.create_single_db = [[function(db_path, size_in_bytes)
-Creates a class database named db_path, with no more than size_in_bytes bytes.
-Returns the real size in bytes, which is the greatest multiple of the size
-of a bucket not greater than size_in_bytes
+__doc.create_single_db = [[function(db_path, buckets[, shards])
+Creates a class database named db_path, with the given number of buckets,
+split into shards files if shards is greater than 1 (see core.create_db).
+Returns the size in bytes.
 ]]
 
 local function buckets_of_bytes(bytes) 
@@ -67,13 +67,30 @@ local function bytes_of_buckets(buckets)
   return buckets * core.bucket_size + core.header_size
 end
 
-function create_single_db(db_path, buckets)
+local function check_buckets(buckets)
   assert(type(buckets) == 'number') 
   local min_buckets =   100 --- minimum number of buckets acceptable
   util.checkf(buckets >= min_buckets, 'Database of %d buckets is too small; ' ..
               'must use at least %d buckets or %s\n', buckets,
                min_buckets, util.human_of_bytes(bytes_of_buckets(min_buckets)))
-  core.create_db(db_path, buckets)
+end
+
+function create_single_db(db_path, buckets, shards)
+  check_buckets(buckets)
+  shards = shards or 1
+  core.create_db(db_path, buckets, nil, shards)
+  return bytes_of_buckets(buckets) + (shards - 1) * core.header_size
+end
+
+__doc.resize_single_db = [[function(db_path, buckets)
+Resizes the class database db_path to the given number of buckets,
+while other processes may go on using it (see core.resize).
+Returns the new size in bytes.
+]]
+
+function resize_single_db(db_path, buckets)
+  check_buckets(buckets)
+  core.resize(db_path, buckets)
   return bytes_of_buckets(buckets)
 end
 
@@ -122,7 +139,7 @@ do
     -- create new, empty databases
     local totalbytes = 0
     for c, tbl in pairs(cfg.classes) do
-      totalbytes = totalbytes + create_single_db(tbl.db, buckets)
+      totalbytes = totalbytes + create_single_db(tbl.db, buckets, tbl.shards)
     end
     local config = cfg.configfile
     if util.file_is_readable(config) then
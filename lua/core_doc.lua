@@ -14,20 +14,40 @@ module(modname)
 __doc = __doc or { }
 
 __doc.__order = {
-  'class', 'open_class',
+  'class', 'open_class', 'increment',
   'create_db', 'header_size', 'bucket_size',
-  'classify', 'learn', 'unlearn', 'train', 'pR', 'stats', 'config', 'dump',
-  'restore', 'import', 'chdir', 'getdir', 'dir', 'isdir',
+  'classify', 'classify_batch', 'learn', 'unlearn', 'train', 'features', 'pR', 'stats',
+  'config', 'dump',
+  'restore', 'import', 'merge', 'resize', 'chdir', 'getdir', 'dir', 'isdir',
   'crc32', 'md5sum', 'b64encode', 'b64decode', 'unsigned2string',
+  'filestat', 'socket_listen', 'socket_accept', 'socket_connect',
+  'fd_read', 'fd_write', 'fd_close', 'fd_poll',
 }
 
 
-__doc.create_db = [[function(filename, num_buckets) returns nothing or calls lua_error
+__doc.create_db = [[function(filename, num_buckets[, max_buckets[, shards]])
+     returns nothing or calls lua_error
 Creates an OSBF database with the given filename and
 using the given number of buckets.  On success it returns nothing;
 on failure it calls lua_error.
+If max_buckets is greater than num_buckets, the database is growable:
+once the fraction of its buckets in use passes the growth_use
+option of core.config, or once a chain grows long enough to be
+pruned, each learning adds a few buckets to it, until it has doubled
+or has max_buckets buckets.  Chains are not pruned before that.  A growable database is as fast
+as a fixed one, but it takes the disk space of max_buckets buckets
+while it is open for training.
+If shards is greater than 1, the database is split into that many
+files, each with its share of the buckets: filename itself and
+filename .. '.1' up to filename .. '.' .. (shards - 1).  It is
+opened, classified, trained and resized by filename alone, like any
+other database, but a training locks one shard at a time, so that
+several processes can train it at once.  A sharded database cannot
+be dumped, imported or merged, and its counters cannot be set.
 Example:
   core.create_db('spam.cfc', 94321)
+  core.create_db('spam.cfc', 94321, 4000037)
+  core.create_db('spam.cfc', 400000, nil, 4)
 ]]
 
 __doc.pR = [[function(p1, p2) returns log(p1/p2)
@@ -47,7 +67,8 @@ Classifies the string text using the databases in dblist
 
 Arguments are as follows:
 
-  text: String with the text to be classified
+  text: String with the text to be classified, or the features of
+        that text as returned by core.features
 
   dbtable: table in which each key is the name of a class and each value
            is an open database representing that class.
@@ -74,7 +95,8 @@ Arguments are as follows:
     by sequences of printable chars except tab, new line, vertical
     tab, form feed, carriage return, or space. If delimiters is not
     empty, its chars will be considered as extra token delimiters,
-    like space, tab, new line, etc.
+    like space, tab, new line, etc.  Must be omitted if text is
+    features; the delimiters are then those given to core.features.
 
 Results are as follows:
   returns probs, trainings
@@ -84,6 +106,37 @@ Results are as follows:
 In case of error, core.classify calls lua_error.
 ]=]
 
+__doc.classify_batch = [=[
+function(texts, dbtable, [flags, [min_p_ratio, [delimiters, [threads]]]])
+  returns names, probs, trainings
+  or calls lua_error
+
+Classifies every text in the list texts using the databases in dbtable,
+in a single call, with the same results as calling core.classify on
+each text in turn.
+
+Arguments are as follows:
+
+  texts: list whose elements are strings or features returned by
+         core.features; delimiters must be omitted if any is features
+
+  dbtable, flags, min_p_ratio, delimiters: as in core.classify
+
+  threads: optional number of threads classifying the texts at once;
+     defaults to 1, which classifies them in the calling thread.
+     The classes must not be trained, imported, or closed by another
+     thread in the meantime.
+
+Results are as follows:
+  returns names, probs, trainings
+    * names:     list of the class names of dbtable, in a fixed order
+    * probs:     list of #texts * #names probabilities; the probability
+                 that texts[i] belongs to class names[k] is
+                 probs[(i-1) * #names + k]
+    * trainings: list with number of trainings of class names[k] at k
+In case of error, core.classify_batch calls lua_error.
+]=]
+
 __doc.learn = [=[
 function(text, db, [flags, [delimiters]]) 
   returns nothing or calls lua_error
@@ -92,7 +145,8 @@ Learns the string text as belonging to named class.a
 
 Arguments are as follows:
 
-  text: string with the text to be learned
+  text: string with the text to be learned, or its features as
+        returned by core.features
 
   db: a class database open for read and write
             Example: core.open_class('ham.cfc', 'rw')
@@ -113,6 +167,23 @@ Arguments are as follows:
   delimiters: optional extra delimiters as in core.classify
 ]=]
 
+__doc.features = [=[
+function(text, [delimiters]) returns features or calls lua_error
+
+Tokenizes text and returns its features, which may be passed to
+core.classify, core.learn, core.unlearn and core.train in place of
+the text.  A text that is classified and learned several times, as
+in training on or near error, then needs to be tokenized only once.
+
+  text: string with the text
+
+  delimiters: optional extra delimiters as in core.classify
+
+The features reflect the token-size options of core.config in effect
+when they are computed.  #features is the number of features the
+classifier uses.
+]=]
+
 __doc.unlearn = [=[
 function(text, db, [flags, [delimiters]]) 
   returns nothing or calls lua_error
@@ -140,16 +211,66 @@ If sense = -1 it's equivalent to core.unlearn.
 do
   local ap_options = a_priori_strings
   a_priori_strings = nil  -- private, not to be docuemented
+  local scoring_options = scoring_strings
+  scoring_strings = nil  -- private, not to be documented
+  local insertion_options = insertion_strings
+  insertion_strings = nil  -- private, not to be documented
 
 __doc.config = ([[function(option_table)
 Configures internal parameters. This function is intended for
 testing.  option_table is a table whose keys are the options to be set
-to their respective values.
+to their respective values.  The options belong to the Lua state: each
+state that loads the core starts with the defaults, and a class keeps
+the options of the state that opened it.
 
 The available options are:
    * a_priori: the method used to compute the prior probability of
      each class.  Must be one of these strings:
        %s
+   * scoring: how the classifier combines the probabilities of the
+     features.  Must be one of these strings:
+       %s
+     PRODUCT, the default, multiplies and renormalizes the class
+     probabilities at each feature; LOG adds their logarithms and
+     normalizes once, which is faster with many classes and agrees
+     with PRODUCT except for messages with extreme pR.
+   * insertion: where learning puts a feature new to a database.
+     Must be one of these strings:
+       %s
+     LINEAR, the default, puts it at the first free bucket after its
+     home; ROBIN_HOOD moves it ahead of buckets that are closer to
+     their homes, which keeps displacements short, so that features
+     are found in fewer probes; chains are pruned about as often,
+     but learning is slower.  Databases written either way are the
+     same format.
+   * journal_limit: if not 0, a database open for training is not
+     updated in place when it is closed; the buckets changed are
+     appended to a journal named after the database with ".log"
+     appended, which everyone who opens the database applies.  The
+     journal is written back into the database by the first training
+     to end after it reaches journal_limit bytes.  The default is 0,
+     which writes every training in place.  The journal belongs to
+     the database file: copy a database only after a training with
+     journal_limit 0, or with core.dump.
+   * snapshots: if true, a database open for training is not
+     updated in place when it is closed; it is written whole into a
+     new file that replaces it, so that a classification in another
+     process never sees a training half done.  As this writes the
+     whole database, it is best used with journal_limit, when the
+     database is written only as the journal is emptied into it.
+     With snapshots, a classification takes no lock and never waits
+     for a training, so every process that opens the database must
+     set snapshots alike.  The default is false.
+   * lock_timeout: the number of seconds to wait for the lock of a
+     database before giving up with an error.  With the ofd and
+     fcntl locking methods, a waiting process tries again at least
+     every 50 milliseconds, so it gets the lock soon after it is
+     released.  A database replaced while a process waits for it, as
+     with snapshots, is opened again until the timeout has passed.
+     The default is 20.
+   * growth_use: the fraction of the buckets of a growable
+     database that may be in use before it grows.  The default
+     is 0.75.
    * max_chain: the max number of buckets allowed in a database
      chain. From that size on, the chain is pruned before
      inserting a new bucket.
@@ -168,7 +289,8 @@ The available options are:
 Return the number of options set.
 
    Ex: core.config {max_chain = 50, stop_after = 100}
-]]):format(table.concat(ap_options, ', '))
+]]):format(table.concat(ap_options, ', '), table.concat(scoring_options, ', '),
+           table.concat(insertion_options, ', '))
 end
 
 
@@ -178,8 +300,10 @@ database, which must be open at least for read.
 The keys of the result table are:
    * db_version - version of the database
    * buckets - total number of buckets in the database
+   * max_buckets - number of buckets the database can grow to;
+     equal to buckets if it is not growable
    * bucket_size - size of the bucket, in bytes
-   * header_size - size of the header, in buckets
+   * header_size - size of the header, in bytes
    * learnings - number of learnings
    * extra_learnings - number of extra learnings done internally
      when a single learning is not enough
@@ -188,13 +312,26 @@ The keys of the result table are:
      of misclassifications as this one
    * false_negatives - number of learnings done because
      of misclassifications
+   * lock_wait - seconds spent waiting for locks since the database
+     was opened
+   * shards - number of files the database is split into
    * chains - number of bucket chains
    * max_chain - length of the longest chain
    * avg_chain - average length of a chain
    * max_displacement - max distance a bucket is from the "right"
      place
+   * avg_displacement - mean distance a bucket is from the "right"
+     place; a lookup of a bucket takes that many probes plus one
+   * microgrooms - number of times a chain was pruned since the
+     database was opened
    * used_buckets - number of buckets used
    * use - percentage of buckets used
+   * displacement_histogram - distances of the buckets from the "right"
+     place, counted by bit length: element 1 is the number of buckets
+     in their right place, element k+1 the number at a distance from
+     2^(k-1) to 2^k-1.  Trailing zeros are omitted.
+   * chain_histogram - lengths of the chains, counted the same way
+   * count_histogram - counts of the buckets, counted the same way
 
 Arguments are as follows:
 
@@ -250,6 +387,45 @@ larger or smaller empty one.
 
 In case of error, it calls lua_error.]]
 
+__doc.merge = [[function(to_dbfile, from_dbfile, [threads]) returns nothing or calls lua_error
+Merges the buckets of one or more databases into to_dbfile, like
+import, but rebuilding to_dbfile in a single sweep instead of
+inserting the buckets one at a time; it is much faster when buckets
+must be dropped, as in shrinking a database or merging full ones,
+and it needs memory for a copy of all the nonempty buckets. Buckets for the same feature are combined by adding their
+counts. If the result would fill more than 90% of to_dbfile, the
+buckets with the smallest counts are dropped; where chains are still
+too long, the weakest buckets in the way are dropped, as the
+microgroomer would. The counters of to_dbfile are incremented as by
+import.
+
+   to_dbfile: string with the database filename.
+   from_dbfile: string with the database filename, or a table of them
+   threads: number of threads to use in sorting the buckets (default 1)
+
+In case of error, it calls lua_error.]]
+
+__doc.resize = [[function(dbfile, num_buckets, [threads]) returns nothing or calls lua_error
+Gives dbfile num_buckets buckets while other processes go on using it.
+The buckets are copied under the database lock and merged, as by
+merge, into a new file named dbfile .. '.resize', without the lock;
+meanwhile classifications go on with the old file and trainings go
+on updating it.  Under the lock again, the trainings made since the
+copy are replayed into the new file, which is then renamed over
+dbfile.  Processes that have dbfile open keep the old file until they
+open it again; a writer that was waiting for the lock opens the new
+file.  If dbfile .. '.resize' exists, the resize fails: either another
+resize of dbfile is running or one failed and the file must be removed.
+A database that grows keeps its max_buckets, unless num_buckets is
+not below it; then it stops growing.  Each shard of a sharded
+database is resized in turn, to its share of num_buckets.
+
+   dbfile: string with the database filename.
+   num_buckets: the new number of buckets
+   threads: number of threads to use in sorting the buckets (default 1)
+
+In case of error, it calls lua_error.]]
+
 __doc.chdir = [[function(dir) returns returns nothing or calls lua_error
 Change the current working dir to dir.
 
@@ -334,6 +510,21 @@ Modes are
   rw   read and write (suitable for training)
 Changes to the class are not visible on disk until the class is
 closed or garbage-collected.
+A class in an older format is read as it is; when one opened for
+writing is closed, it is converted to the current format, and the old
+file is kept as filename .. '.v' .. its version (e.g., spam.cfc.v7).
+]]
+
+__doc.increment = [[function(filename, counter[, delta]) returns number or calls error()
+Adds delta (default 1) to a counter in the header of OSBF filename
+and returns the counter's new value.  Counter is one of the mutable
+class fields: 'classifications', 'learnings', 'extra_learnings',
+'fn' or 'fp' (or 'false_negatives' or 'false_positives').
+The counter stays between 0 and its maximum value.
+If the class is open for writing, the change is made in memory and
+reaches the disk when the class is closed.  Otherwise the counter is
+updated on disk at once, without mapping the class or rewriting its
+buckets, so this is much cheaper than opening the class with mode 'rwh'.
 ]]
 
 __doc.close_class = [[function(class) returns nothing or calls error()
@@ -400,4 +591,44 @@ Returns a string of length 4 containing the bytes of the argument
 in little-endian order.
 ]]
 
-
+__doc.filestat = [[function(pathname) returns mtime, size, inode, device, nsec
+Returns the modification time in seconds, size, inode number and
+device of the file, and the nanoseconds of its modification time;
+on failure returns nil and an error message.]]
+
+__doc.socket_listen = [[function(pathname[, backlog]) returns fd
+Creates a Unix-domain stream socket bound to pathname and listens on
+it.  A socket already at pathname is removed if connecting to it is
+refused, as when the server that made it died; one that a server is
+listening on, or a file that is not a socket, makes socket_listen
+fail.  Returns the descriptor as a number; on failure returns nil and
+an error message.]]
+
+__doc.socket_accept = [[function(fd[, timeout]) returns fd
+Waits for a connection on a listening socket and returns the descriptor
+of the connection.  If timeout (in seconds) is given, reads and writes
+on the connection give up after that long.  On failure returns nil
+and an error message.]]
+
+__doc.socket_connect = [[function(pathname) returns fd
+Connects to the Unix-domain socket pathname and returns the descriptor;
+on failure returns nil and an error message.]]
+
+__doc.fd_read = [[function(fd, n | '*l') returns string
+Reads n bytes from fd, or fewer at end of file, or with '*l' reads a
+line (at most 1024 bytes) without its newline.  Returns nil at end of
+file, or nil and an error message on failure.]]
+
+__doc.fd_write = [[function(fd, string, ...) returns true
+Writes all the strings to fd.  Writing to a closed socket does not
+raise SIGPIPE.  On failure returns nil and an error message.]]
+
+__doc.fd_close = [[function(fd) returns true
+Closes fd.  On failure returns nil and an error message.]]
+
+__doc.fd_poll = [[function(fds[, timeout]) returns list of fd
+Waits until some of the descriptors in the list fds can be read
+without blocking, or have been closed at the other end, and returns
+the list of those.  If timeout (in seconds) passes first, the list is
+empty; without timeout the wait has no limit.  On failure returns nil
+and an error message.]]
@@ -12,6 +12,9 @@ return {
   --        train_below -- confidence below which training is recommended (default 20)
   --        conf_boost  -- a number added to confidence for this class (default 0)
   --        resend      -- if this message is trained, resend it with new headers
+  --        shards      -- number of files the database is split into when it
+  --                       is created, so several trainings can run at once
+  --                       (default 1)
   classes = {
     ham  = { sfid = 'h', sure = '',   unsure = '+', train_below = 20 },
     spam = { sfid = 's', sure = '--', unsure = '-', train_below = 20, resend = false },
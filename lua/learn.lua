@@ -52,6 +52,7 @@ local output = require(_PACKAGE .. 'output')
 
 local function fingerprint(s)
   local function hex(s) return string.format('%02x', string.byte(s)) end
+  if type(s) ~= 'string' then return tostring(s) end -- features
   return (md5.sum(s):gsub('.', hex))
 end
 
@@ -132,13 +133,7 @@ local function tone_inner(text, target_class, count_as_classif)
     -- first classification, but, because of other trainings in between,
     -- the present classification is wrong. And vice-versa.
     core.learn(text, db, cfg.constants.learn_flags + core.FALSE_NEGATIVE)
-    do
-      local c = cfg.classes[bc.class]:open 'rwh'
-      -- increment if less than max uint32_t
-      -- should limits be hidden in lua_set_classfields?
-      c.fp = c.fp + 1
-      -- don't close; OK for c to be garbage collected
-    end
+    core.increment(cfg.classes[bc.class].db, 'fp') -- saturates at max uint32_t
 
     local new_bc = most_likely_pR_and_class(text, false, target_class )
     debugf("Tone after 1 FALSE_NEGATIVE training: classified %s (pR %.2f); target class %s\n",
@@ -201,8 +196,9 @@ end
 extract_header_feature = util.memoize(extract_header_feature)
   
 local function tone_msg_and_reinforce_header(msg, target_class, count_as_classif)
-  -- train on the whole message if on or near error
-  local lim_orig_msg = extract_feature(msg)
+  -- train on the whole message if on or near error;
+  -- the message is classified and learned many times, so tokenize it once
+  local lim_orig_msg = core.features(extract_feature(msg))
   local old_bc, new_bc = tone(lim_orig_msg, target_class, count_as_classif)
   local old_pR, new_pR =  old_bc.target_pR, new_bc.target_pR
   if cfg.classes[target_class].hr 
@@ -218,7 +214,7 @@ local function tone_msg_and_reinforce_header(msg, target_class, count_as_classif
     local trd   = threshold_reinforcement_degree * 
                     cfg.classes[target_class].train_below
     local rd    = reinforcement_degree * header_learn_threshold
-    local lim_orig_header = extract_header_feature(msg)
+    local lim_orig_header = core.features(extract_header_feature(msg))
     for i = 1, reinforcement_limit do
       -- (may exit early if the change in new_pR is big enough)
       local pR = new_pR
@@ -326,7 +322,8 @@ but the message was previously learned as %s.]],
 
   local table_of_sfid = cache.table_of_sfid(sfid)
   local msg = msg.of_string(contents)
-  local lim_msg, lim_header = extract_feature(msg), extract_header_feature(msg)
+  local lim_msg    = core.features(extract_feature(msg))
+  local lim_header = core.features(extract_header_feature(msg))
   local k = cfg.constants
   -- find old best class
   local old_bc = most_likely_pR_and_class(lim_msg)
@@ -348,9 +345,7 @@ but the message was previously learned as %s.]],
   -- decrement false positives of the original class if the
   -- original classification was wrong
   if original_class ~= old_class then
-    local c = cfg.classes[original_class]:open 'rwh'
-    -- should limits be hidden in lua_set_classfields?
-    if c.fp > 0 then c.fp = c.fp - 1 end
+    core.increment(cfg.classes[original_class].db, 'fp', -1) -- stops at 0
   end
 
   cache.change_file_status(sfid, old_class, 'unlearned')
@@ -401,6 +396,15 @@ local function wrap_subj_tag(s)
   if s and s ~= '' then return '[' .. s .. ']' else return '' end
 end
 
+__doc.count_classification = [[function(class) returns nothing
+Increments the number of classifications in the database of the class.
+A long-running process that keeps the databases open, such as the
+daemon, replaces it to put off its writes.]]
+
+function count_classification(class)
+  core.increment(cfg.classes[class].db, 'classifications')
+end
+
 __doc.most_likely_pR_and_class = 
 [[function(text, count, target_class, probs, conf) returns best-class table
 text is the text to be classified.
@@ -429,14 +433,18 @@ do
   do
     local cache
     function dbtable() -- must re-open every trip through...
+      -- ...because core.close() may have closed the classes since;
+      -- reopening a class that is still open costs only a lookup
       if not cache then
         cache = { }
         num_classes = 0
-        for class, t in pairs(cfg.classes) do
-          cache[class] = t:open 'r'
+        for class in pairs(cfg.classes) do
           num_classes = num_classes + 1
         end
       end
+      for class, t in pairs(cfg.classes) do
+        cache[class] = t:open 'r'
+      end
       return cache
     end
   end
@@ -477,9 +485,7 @@ do
     local pR = conf[class]
 
     if count then
-      local c = cfg.classes[class]:open 'rwh'
-      c.classifications = c.classifications + 1 -- errors on overflow
-      -- no close needed; let it be garbage-collected
+      count_classification(class)
     end
     local train = pR < cfg.classes[class].train_below
     debugf('Classified %s as class %s with confidence %.2f%s\n',
@@ -641,6 +647,22 @@ function write_stats(verbose)
     report('Average chain len (buckets)', 'avg_chain', ffmt)
     report('Max bucket displacement', 'max_displacement')
     report('Buckets unreachable', 'unreachable')
+    -- histograms, one row per nonempty bin: k is the bit length of the values
+    local function histogram(what, key)
+      local bins = 0
+      for _, c in ipairs(classes) do bins = math.max(bins, #stats[c][key]) end
+      for k = 0, bins - 1 do
+        local function n(c) return stats[c][key][k+1] or 0 end
+        if math.max(classmap(n)) > 0 then
+          local label = k < 2 and string.format('%s %d', what, k)
+                        or string.format('%s %d-%d', what, 2^(k-1), 2^k - 1)
+          writef(dfmt, label, classmap(n))
+        end
+      end
+    end
+    histogram('Displacement', 'displacement_histogram')
+    histogram('Chain length', 'chain_histogram')
+    histogram('Bucket count', 'count_histogram')
   end
 
   report('Classifications', 'classifications', ffmt)
@@ -0,0 +1,208 @@
+-- The Sendmail/Postfix milter protocol, as much of it as a filter needs
+-- that only adds and changes headers at the end of each message
+--
+-- See Copyright Notice in osbf.lua
+
+local require, ipairs, assert, error, setmetatable
+    = require, ipairs, assert, error, setmetatable
+
+local string, table, math
+    = string, table, math
+
+module(...)
+
+local core = require(_PACKAGE .. 'core')
+
+__doc = __doc or { }
+
+__doc.__overview = [[
+Every milter packet is a 4-byte length in network order, counting
+what follows, a command letter and the data of the command.  The MTA
+sends a command for each stage of each SMTP transaction and, for most
+of them, waits for a reply.  We ask it to leave out the stages before
+the headers, keep the headers and body of the current message, and
+at the end of the message pass its text to a function that returns
+the header changes to send back.  Every other command is answered
+with 'continue'.
+
+A connection may carry several messages, one after the other; 'abort'
+discards the message in progress.
+]]
+
+local max_packet = 2^20 -- the MTA sends body chunks of 64KB at most
+
+-- commands from the MTA
+local ABORT, BODY, EOB, HEADER, MACRO, OPTNEG, QUIT, QUIT_NC
+    = 'A', 'B', 'E', 'L', 'D', 'O', 'Q', 'K'
+
+-- replies
+local ADDHEADER, CHGHEADER, CONTINUE = 'h', 'm', 'c'
+
+-- actions we may take and stages we can do without [SMFIF_*, SMFIP_*]
+local ADDHDRS, CHGHDRS = 0x01, 0x10
+local NOCONNECT, NOHELO, NOMAIL, NORCPT, NOUNKNOWN, NODATA
+    = 0x01, 0x02, 0x04, 0x08, 0x100, 0x200
+local version = 6
+
+local function uint32(s, i)
+  local a, b, c, d = s:byte(i, i + 3)
+  assert(d, 'milter packet too short')
+  return ((a * 256 + b) * 256 + c) * 256 + d
+end
+
+local function uint32_string(n)
+  return string.char(math.floor(n / 2^24) % 256, math.floor(n / 2^16) % 256,
+                     math.floor(n / 2^8) % 256, n % 256)
+end
+
+local function band(a, b) -- bitwise and, for flag words
+  local r, bit = 0, 1
+  while a > 0 and b > 0 do
+    if a % 2 == 1 and b % 2 == 1 then r = r + bit end
+    a, b, bit = math.floor(a / 2), math.floor(b / 2), bit * 2
+  end
+  return r
+end
+
+__doc.read_packet = [[function(fd) returns command, data
+Reads a milter packet from fd and returns its command letter and its
+data; returns nil when the MTA has closed the connection, or calls
+error on a bad packet.]]
+
+function read_packet(fd)
+  local head = core.fd_read(fd, 4)
+  if not head then return nil end
+  local len = uint32(head, 1)
+  if len < 1 or len > max_packet then
+    error('bad milter packet length ' .. len)
+  end
+  local packet = core.fd_read(fd, len)
+  if not packet or #packet < len then
+    error('milter packet truncated')
+  end
+  return packet:sub(1, 1), packet:sub(2)
+end
+
+__doc.write_packet = [[function(fd, command, data) returns nothing
+Writes a milter packet to fd or calls error.]]
+
+function write_packet(fd, command, data)
+  data = data or ''
+  assert(core.fd_write(fd, uint32_string(#data + 1), command, data))
+end
+
+-- the reply to option negotiation: the MTA offers a protocol version,
+-- the actions it allows and the stages it can leave out, and we take
+-- what we need of them
+local function negotiate(data)
+  local mta_version, actions, protocol =
+    uint32(data, 1), uint32(data, 5), uint32(data, 9)
+  if mta_version < 2 then
+    error('milter protocol version ' .. mta_version .. ' is too old')
+  end
+  if band(actions, ADDHDRS + CHGHDRS) ~= ADDHDRS + CHGHDRS then
+    error('the MTA does not let a milter add and change headers')
+  end
+  local skip = NOCONNECT + NOHELO + NOMAIL + NORCPT + NOUNKNOWN + NODATA
+  return table.concat { uint32_string(math.min(mta_version, version)),
+                        uint32_string(ADDHDRS + CHGHDRS),
+                        uint32_string(band(protocol, skip)) }
+end
+
+-- the text of a message from the headers and body chunks the MTA sent;
+-- the MTA strips the space after the colon of a header, and its body
+-- chunks already end lines with CRLF
+local function message_text(headers, body)
+  local lines = { }
+  for i, h in ipairs(headers) do
+    local value = h.value:gsub('\r?\n', '\r\n')
+    if not value:find '^%s' then value = ' ' .. value end
+    lines[i] = h.name .. ':' .. value
+  end
+  table.insert(lines, '')
+  table.insert(lines, table.concat(body))
+  return table.concat(lines, '\r\n')
+end
+
+__doc.header_changes = [[function(before, after) returns list of changes
+Compares the headers of a message, as lists of 'Name: value' strings,
+before and after a filter worked on it.  The filter may change headers
+in place and append new ones, but not delete or reorder them.  Each
+change is a table { name = ..., value = ..., index = ... }, where index
+is nil for a new header and otherwise counts the headers of that name,
+starting at 1, as the milter protocol does.]]
+
+function header_changes(before, after)
+  local changes, seen = { }, { }
+  for i, h in ipairs(after) do
+    local name, value = h:match '^(.-):[ \t]?(.*)$'
+    value = value:gsub('\r\n', '\n')
+    if before[i] then
+      local key = before[i]:match('^(.-):'):lower()
+      seen[key] = (seen[key] or 0) + 1
+      if h ~= before[i] then
+        table.insert(changes, { name = name, value = value, index = seen[key] })
+      end
+    else
+      table.insert(changes, { name = name, value = value })
+    end
+  end
+  return changes
+end
+
+__doc.session = [[function(eom) returns session
+Returns the state of one milter connection.  session:serve(fd) reads
+and answers one packet, and returns false when the MTA has closed the
+connection or said goodbye.  At the end of each message it calls
+eom(text), which must return the header changes to make, as from
+header_changes.]]
+
+local session_meta = { }
+session_meta.__index = session_meta
+
+function session(eom)
+  return setmetatable({ eom = eom, headers = { }, body = { } }, session_meta)
+end
+
+function session_meta:reset()
+  self.headers, self.body = { }, { }
+end
+
+function session_meta:serve(fd)
+  local command, data = read_packet(fd)
+  if command == nil or command == QUIT then
+    return false
+  elseif command == OPTNEG then
+    write_packet(fd, OPTNEG, negotiate(data))
+  elseif command == MACRO then
+    -- no reply
+  elseif command == ABORT or command == QUIT_NC then
+    self:reset() -- no reply
+  elseif command == HEADER then
+    local name, value = data:match '^(%Z*)%z(%Z*)'
+    assert(name, 'malformed header packet')
+    table.insert(self.headers, { name = name, value = value })
+    write_packet(fd, CONTINUE)
+  elseif command == BODY then
+    table.insert(self.body, data)
+    write_packet(fd, CONTINUE)
+  elseif command == EOB then
+    table.insert(self.body, data)
+    local changes = self.eom(message_text(self.headers, self.body))
+    self:reset()
+    for _, c in ipairs(changes) do
+      if c.index then
+        write_packet(fd, CHGHEADER,
+                     table.concat { uint32_string(c.index), c.name, '\0', c.value, '\0' })
+      else
+        write_packet(fd, ADDHEADER, table.concat { c.name, '\0', c.value, '\0' })
+      end
+    end
+    write_packet(fd, CONTINUE)
+  else -- a stage we asked to skip, or one we do not care about
+    write_packet(fd, CONTINUE)
+  end
+  return true
+end
+
+return _M
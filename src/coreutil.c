@@ -5,6 +5,9 @@
  *
  */
 
+/* for lstat, S_ISSOCK and st_mtim */
+#define _POSIX_C_SOURCE 200809L
+
 #include <ctype.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -18,6 +21,10 @@
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <poll.h>
 
 #include "lua.h"
 
@@ -592,6 +599,254 @@ static int lmd5 (lua_State *L) {
   return 1;
 }
 
+/**********************************************************/
+
+/* Unix-domain sockets and file status, just enough for a daemon and
+   its clients.  Descriptors are plain numbers.  Like the io library,
+   these functions return nil plus an error message on failure. */
+
+static int push_errno(lua_State *L, const char *what) {
+  lua_pushnil(L);
+  lua_pushfstring(L, "%s: %s", what, strerror(errno));
+  return 2;
+}
+
+static int unix_address(lua_State *L, int narg, struct sockaddr_un *addr) {
+  size_t len;
+  const char *path = luaL_checklstring(L, narg, &len);
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (len >= sizeof(addr->sun_path))
+    return luaL_argerror(L, narg, "socket path too long");
+  memcpy(addr->sun_path, path, len);
+  return 0;
+}
+
+/* Removes the socket at addr if it is stale, left by a server that
+   died: it is a socket, and connecting to it is refused.  Anything
+   else at the path, a live server's socket above all, is left for
+   bind to refuse. */
+static void remove_stale_socket(const struct sockaddr_un *addr) {
+  struct stat st;
+  int fd;
+
+  if (lstat(addr->sun_path, &st) != 0 || !S_ISSOCK(st.st_mode))
+    return;
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return;
+  if (connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) != 0
+      && errno == ECONNREFUSED)
+    unlink(addr->sun_path);
+  close(fd);
+}
+
+static int
+lua_socket_listen (lua_State *L)      /* socket_listen(path[, backlog]) */
+{
+  struct sockaddr_un addr;
+  int fd, backlog = luaL_optint(L, 2, 16);
+
+  unix_address(L, 1, &addr);
+  remove_stale_socket(&addr);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return push_errno(L, "socket");
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+      || listen(fd, backlog) != 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return push_errno(L, addr.sun_path);
+  }
+  lua_pushnumber(L, fd);
+  return 1;
+}
+
+static int
+lua_socket_accept (lua_State *L)      /* socket_accept(fd[, timeout]) */
+{
+  int fd;
+  lua_Number timeout = luaL_optnumber(L, 2, 0);
+
+  do {
+    fd = accept(luaL_checkint(L, 1), NULL, NULL);
+  } while (fd < 0 && errno == EINTR);
+  if (fd < 0)
+    return push_errno(L, "accept");
+  if (timeout > 0) {  /* a stuck client must not hang the server */
+    struct timeval tv;
+    tv.tv_sec  = (long) timeout;
+    tv.tv_usec = (long) ((timeout - tv.tv_sec) * 1e6);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  }
+  lua_pushnumber(L, fd);
+  return 1;
+}
+
+static int
+lua_socket_connect (lua_State *L)     /* socket_connect(path) */
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  unix_address(L, 1, &addr);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return push_errno(L, "socket");
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return push_errno(L, addr.sun_path);
+  }
+  lua_pushnumber(L, fd);
+  return 1;
+}
+
+/* fd_read(fd, n) reads exactly n bytes, or fewer at end of file;
+   fd_read(fd, '*l') reads a line of at most 1024 bytes, without the
+   newline.  Returns nil at end of file. */
+static int
+lua_fd_read (lua_State *L)
+{
+  int fd = luaL_checkint(L, 1);
+  luaL_Buffer b;
+  ssize_t r = 0;
+  size_t got = 0;
+
+  luaL_buffinit(L, &b);
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    char c = 0;
+    if (strcmp(lua_tostring(L, 2), "*l") != 0)
+      return luaL_argerror(L, 2, "invalid format");
+    while (got < 1024 && ((r = read(fd, &c, 1)) == 1 || (r < 0 && errno == EINTR)))
+      if (r == 1) {
+        if (c == '\n')
+          break;
+        luaL_addchar(&b, c);
+        got++;
+      }
+    if (r < 0)
+      return push_errno(L, "read");
+    if (r == 0 && got == 0)
+      return (lua_pushnil(L), 1);
+  } else {
+    size_t n = (size_t) luaL_checknumber(L, 2);
+    while (got < n) {
+      char *p = luaL_prepbuffer(&b);
+      size_t want = n - got < LUAL_BUFFERSIZE ? n - got : LUAL_BUFFERSIZE;
+      r = read(fd, p, want);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r < 0)
+        return push_errno(L, "read");
+      if (r == 0)
+        break;
+      luaL_addsize(&b, r);
+      got += r;
+    }
+    if (got == 0 && n > 0)
+      return (lua_pushnil(L), 1);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int
+lua_fd_write (lua_State *L)           /* fd_write(fd, s1, s2, ...) */
+{
+  int fd = luaL_checkint(L, 1);
+  int i, n = lua_gettop(L);
+#ifdef MSG_NOSIGNAL
+  int flags = MSG_NOSIGNAL; /* a vanished peer must not kill us */
+#else
+  int flags = 0;
+#endif
+
+  for (i = 2; i <= n; i++) {
+    size_t len;
+    const char *s = luaL_checklstring(L, i, &len);
+    while (len > 0) {
+      ssize_t r = send(fd, s, len, flags);
+      if (r < 0 && errno == ENOTSOCK)
+        r = write(fd, s, len);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r < 0)
+        return push_errno(L, "write");
+      s += r;
+      len -= r;
+    }
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int
+lua_fd_close (lua_State *L)           /* fd_close(fd) */
+{
+  if (close(luaL_checkint(L, 1)) != 0)
+    return push_errno(L, "close");
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* fd_poll(fds[, timeout]) waits until some of the descriptors in the
+   list fds can be read without blocking, which includes a peer having
+   closed its end, and returns the list of those; the list is empty if
+   timeout seconds pass first.  Without timeout it waits forever. */
+static int
+lua_fd_poll (lua_State *L)
+{
+  struct pollfd *fds;
+  int i, j, n, r;
+  lua_Number timeout = luaL_optnumber(L, 2, -1);
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = (int) lua_objlen(L, 1);
+  fds = lua_newuserdata(L, (n > 0 ? n : 1) * sizeof(*fds));
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    if (!lua_isnumber(L, -1))
+      return luaL_argerror(L, 1, "list of descriptors expected");
+    fds[i].fd = (int) lua_tonumber(L, -1);
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+    lua_pop(L, 1);
+  }
+  do {
+    r = poll(fds, n, timeout < 0 ? -1 : (int) (timeout * 1000));
+  } while (r < 0 && errno == EINTR);
+  if (r < 0)
+    return push_errno(L, "poll");
+  lua_newtable(L);
+  for (i = j = 0; i < n; i++)
+    if (fds[i].revents != 0) {
+      lua_pushnumber(L, fds[i].fd);
+      lua_rawseti(L, -2, ++j);
+    }
+  return 1;
+}
+
+/* filestat(path) returns modification time, size, inode, device and
+   the nanoseconds of the modification time */
+static int
+lua_filestat (lua_State *L)
+{
+  struct stat st;
+  const char *path = luaL_checkstring(L, 1);
+  if (stat(path, &st) != 0)
+    return push_errno(L, path);
+  lua_pushnumber(L, (lua_Number) st.st_mtime);
+  lua_pushnumber(L, (lua_Number) st.st_size);
+  lua_pushnumber(L, (lua_Number) st.st_ino);
+  lua_pushnumber(L, (lua_Number) st.st_dev);
+  lua_pushnumber(L, (lua_Number) st.st_mtim.tv_nsec);
+  return 5;
+}
+
 const struct luaL_reg osbf_lua_utils[] = {
   {"getdir", lua_osbf_getdir},
   {"chdir", lua_osbf_changedir},
@@ -603,6 +858,14 @@ const struct luaL_reg osbf_lua_utils[] = {
   {"unsigned2string", lua_unsigned2string},
   {"utf8tohtml", lua_utf8tohtml},
   {"md5sum", lmd5},
+  {"socket_listen", lua_socket_listen},
+  {"socket_accept", lua_socket_accept},
+  {"socket_connect", lua_socket_connect},
+  {"fd_read", lua_fd_read},
+  {"fd_write", lua_fd_write},
+  {"fd_close", lua_fd_close},
+  {"fd_poll", lua_fd_poll},
+  {"filestat", lua_filestat},
   {NULL, NULL}
 };
 
@@ -51,16 +51,17 @@ static uint64_t lua_checkuint64(lua_State *L, int idx);
 
 #define check_class(L, i) (CLASS_STRUCT *) luaL_checkudata(L, i, CLASS_METANAME)
 
-static CLASS_STRUCT *check_open_class(lua_State *L, int i, osbf_class_usage usage);
+/* support for feature vectors as userdata */
+#define FEATURES_METANAME QUOTE(OSBF_MODNAME)".features"
+
+#define check_features(L, i) \
+  (OSBF_FEATURE_VECTOR *) luaL_checkudata(L, i, FEATURES_METANAME)
+
+static OSBF_FEATURE_VECTOR *to_features(lua_State *L, int i);
 
+static CLASS_STRUCT *check_open_class(lua_State *L, int i, osbf_class_usage usage);
 
 
-/* configurable constants */
-extern uint32_t microgroom_displacement_trigger;
-extern uint32_t microgroom_stop_after;
-extern double K1, K2, K3;
-extern uint32_t max_token_size, max_long_tokens;
-extern uint32_t limit_token_size;
 
 /* macro to `unsign' a character */
 #ifndef uchar
@@ -76,7 +77,29 @@ extern uint32_t limit_token_size;
    but can be changed using the osbf.config call.
    
 */
-static double pR_SCF = 0.59;
+#define DEFAULT_PR_SCF 0.59
+
+/* Each Lua state has settings of its own, which osbf.config changes:
+   the context of the core [Note Contexts in osbflib.h] and the pR
+   scale.  They live in a userdata kept in the environment shared by
+   the library's functions, which also keeps them alive as long as any
+   class opened under them can still be closed. */
+
+struct settings {
+  OSBF_CONTEXT ctx;
+  double pR_SCF;
+};
+
+static struct settings *settings_of(lua_State *L) {
+  struct settings *s;
+
+  lua_getfield(L, LUA_ENVIRONINDEX, "settings");
+  s = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return s;
+}
+
+#define context_of(L) (&settings_of(L)->ctx)
 
 /**********************************************************/
 
@@ -84,75 +107,120 @@ static int
 lua_osbf_config (lua_State * L)
 {
   int options_set = 0;
+  struct settings *settings = settings_of(L);
+  OSBF_CONTEXT *ctx = &settings->ctx;
 
   luaL_checktype (L, 1, LUA_TTABLE);
 
   lua_getfield (L, 1, "max_chain");
   if (!lua_isnil(L, -1)) {
-    microgroom_displacement_trigger = luaL_checknumber (L, -1);
+    ctx->microgroom_displacement_trigger = luaL_checknumber (L, -1);
     options_set++;
   }
   lua_pop (L, 1);
 
   lua_getfield (L, 1, "stop_after");
   if (!lua_isnil (L, -1)) {
-    microgroom_stop_after = luaL_checknumber (L, -1);
+    ctx->microgroom_stop_after = luaL_checknumber (L, -1);
     options_set++;
   }
   lua_pop (L, 1);
 
   lua_getfield (L, 1, "K1");
   if (!lua_isnil (L, -1)) {
-    K1 = luaL_checknumber (L, -1);
+    ctx->K1 = luaL_checknumber (L, -1);
     options_set++;
   }
   lua_pop (L, 1);
 
   lua_getfield (L, 1, "K2");
   if (!lua_isnil (L, -1)) {
-    K2 = luaL_checknumber (L, -1);
+    ctx->K2 = luaL_checknumber (L, -1);
     options_set++;
   }
   lua_pop (L, 1);
 
   lua_getfield (L, 1, "K3");
   if (!lua_isnil (L, -1)) {
-    K3 = luaL_checknumber (L, -1);
+    ctx->K3 = luaL_checknumber (L, -1);
     options_set++;
   }
   lua_pop (L, 1);
 
   lua_getfield (L, 1, "limit_token_size");
   if (!lua_isnil (L, -1)) {
-    limit_token_size = luaL_checknumber (L, -1);
+    ctx->limit_token_size = luaL_checknumber (L, -1);
     options_set++;
   }
   lua_pop (L, 1);
 
   lua_getfield(L, 1, "max_token_size");
   if (!lua_isnil (L, -1)) {
-    max_token_size = luaL_checknumber (L, -1);
+    ctx->max_token_size = luaL_checknumber (L, -1);
     options_set++;
   }
   lua_pop (L, 1);
 
   lua_getfield(L, 1, "max_long_tokens");
   if (!lua_isnil (L, -1)) {
-    max_long_tokens = luaL_checknumber (L, -1);
+    ctx->max_long_tokens = luaL_checknumber (L, -1);
     options_set++;
   }
   lua_pop (L, 1);
 
   lua_getfield(L, 1, "pR_SCF");
   if (!lua_isnil (L, -1)) {
-    pR_SCF = luaL_checknumber (L, -1);
+    settings->pR_SCF = luaL_checknumber (L, -1);
     options_set++;
   }
   lua_pop (L, 1);
 
   lua_getfield(L, 1, "a_priori");
   if (!lua_isnil (L, -1)) {
-    a_priori = luaL_checkoption (L, -1, NULL, a_priori_strings);
+    ctx->a_priori = luaL_checkoption (L, -1, NULL, a_priori_strings);
+    options_set++;
+  }
+  lua_pop (L, 1);
+
+  lua_getfield(L, 1, "scoring");
+  if (!lua_isnil (L, -1)) {
+    ctx->scoring = luaL_checkoption (L, -1, NULL, scoring_strings);
+    options_set++;
+  }
+  lua_pop (L, 1);
+
+  lua_getfield(L, 1, "insertion");
+  if (!lua_isnil (L, -1)) {
+    ctx->insertion = luaL_checkoption (L, -1, NULL, insertion_strings);
+    options_set++;
+  }
+  lua_pop (L, 1);
+
+  lua_getfield(L, 1, "journal_limit");
+  if (!lua_isnil (L, -1)) {
+    ctx->journal_limit = luaL_checknumber (L, -1);
+    options_set++;
+  }
+  lua_pop (L, 1);
+
+  lua_getfield(L, 1, "snapshots");
+  if (!lua_isnil (L, -1)) {
+    luaL_checktype (L, -1, LUA_TBOOLEAN);
+    ctx->snapshots = lua_toboolean (L, -1);
+    options_set++;
+  }
+  lua_pop (L, 1);
+
+  lua_getfield(L, 1, "lock_timeout");
+  if (!lua_isnil (L, -1)) {
+    ctx->lock_timeout = luaL_checknumber (L, -1);
+    options_set++;
+  }
+  lua_pop (L, 1);
+
+  lua_getfield(L, 1, "growth_use");
+  if (!lua_isnil (L, -1)) {
+    ctx->growth_use = luaL_checknumber (L, -1);
     options_set++;
   }
   lua_pop (L, 1);
@@ -166,7 +234,9 @@ lua_osbf_config (lua_State * L)
 static int
 lua_osbf_createdb (lua_State * L)
 {
-  osbf_create_cfcfile (luaL_checkstring(L, 1), (uint32_t) luaL_checkint(L, 2), L);
+  osbf_create_sharded (luaL_checkstring(L, 1), (uint32_t) luaL_checkint(L, 2),
+                       (uint32_t) luaL_optnumber(L, 3, 0),
+                       (uint32_t) luaL_optint(L, 4, 1), L);
   return 0;
 }
 
@@ -323,6 +393,17 @@ static unsigned class_table_members(lua_State *L,
     return n;
 }
   
+/* the buckets of a class, counting those of all its shards [Note Shards] */
+static uint32_t class_num_buckets(const CLASS_STRUCT *c) {
+  uint32_t k, n = 0;
+
+  if (c->shards == NULL)
+    return c->header->num_buckets;
+  for (k = 0; k < c->num_shards; k++)
+    n += c->shards[k].header->num_buckets;
+  return n;
+}
+
 #define DEFINE_FIELD_FUN(fname, push)                                \
   static int lua_osbf_class_ ## fname(lua_State *L) {                \
     CLASS_STRUCT *c = check_class(L, 1);                             \
@@ -340,10 +421,10 @@ static unsigned class_table_members(lua_State *L,
 DEFINE_FIELD_FUN(filename,        lua_pushstring(L, c->classname))
 DEFINE_FIELD_FUN(version,         lua_pushnumber(L, c->header->db_version))
 DEFINE_FIELD_FUN(version_name,    lua_pushstring(L, c->fmt_name))
-DEFINE_FIELD_FUN(num_buckets,     lua_pushnumber(L, c->header->num_buckets))
+DEFINE_FIELD_FUN(num_buckets,     lua_pushnumber(L, class_num_buckets(c)))
 DEFINE_FIELD_FUN(id,              lua_pushnumber(L, c->header->db_version))
 DEFINE_FIELD_FUN(bucket_size,     lua_pushnumber(L, sizeof(*c->buckets)))
-DEFINE_FIELD_FUN(header_size,     lua_pushnumber(L, sizeof(*c->header)))
+DEFINE_FIELD_FUN(header_size,     lua_pushnumber(L, OSBF_HEADER_SIZE))
 DEFINE_FIELD_FUN(learnings,       lua_pushnumber(L, c->header->learnings))
 DEFINE_FIELD_FUN(classifications, lua_pushnumber(L, c->header->classifications))
 DEFINE_FIELD_FUN(extra_learnings, lua_pushnumber(L, c->header->extra_learnings))
@@ -362,6 +443,8 @@ DEFINE_FIELD_FUN(, lua_pushnil(L))
       return luaL_error(L, "Asked for " #fname " of closed class");  \
     } else if (c->usage == OSBF_READ_ONLY) {                         \
       return luaL_error(L, "Cannot mutate a read-only class");       \
+    } else if (c->shards != NULL) {                                  \
+      return luaL_error(L, "Cannot mutate a sharded class");         \
     } else {                                                         \
       lvalue = value;                                                \
       return 0;                                                      \
@@ -377,6 +460,8 @@ DEFINE_FIELD_FUN(, lua_pushnil(L))
       return luaL_error(L, "Asked for " #fname " of closed class");  \
     } else if (c->usage == OSBF_READ_ONLY) {                         \
       return luaL_error(L, "Cannot mutate a read-only class");       \
+    } else if (c->shards != NULL) {                                  \
+      return luaL_error(L, "Cannot mutate a sharded class");         \
     } else {                                                         \
       lvalue = value;                                                \
       return 0;                                                      \
@@ -421,7 +506,7 @@ push_open_class_using_cache(lua_State *L, const char *filename, osbf_class_usage
     CLASS_STRUCT *c = lua_newuserdata(L, sizeof(*c));  /* s: cache nil class */
     luaL_getmetatable(L, CLASS_METANAME);
     lua_setmetatable(L, -2);
-    osbf_open_class(filename, usage, c, L);
+    osbf_open_class(filename, usage, c, context_of(L), L);
     lua_remove(L, -2); /* remove loathesome nil */
     lua_pushvalue(L, -1);
     lua_setfield(L, -3, filename);             /* s: cache class */
@@ -438,7 +523,7 @@ push_open_class_using_cache(lua_State *L, const char *filename, osbf_class_usage
                 c->state == OSBF_CLOSED ? "closed" : "usage too low");
       if (c->state != OSBF_CLOSED)
         osbf_close_class(c, L);
-      osbf_open_class(filename, usage, c, L);
+      osbf_open_class(filename, usage, c, context_of(L), L);
     }
     if (strcmp(filename, c->classname))
       luaL_error(L, "Tried to load %s from the cache but found %s instead",
@@ -483,6 +568,41 @@ lua_osbf_open_class(lua_State *L) {
   return 1;
 }
 
+/* core.increment(filename, counter[, delta]) adds delta to a header
+   counter.  A class in the cache that is open for writing is changed in
+   memory, where it will be written on close; otherwise only the counter
+   is written to disk, without opening the class. */
+
+static int
+lua_osbf_increment(lua_State *L) {
+  static const char *const names[] = {
+    "classifications", "learnings", "extra_learnings",
+    "fn", "fp", "false_negatives", "false_positives", NULL
+  };
+  static const enum osbf_counter counters[] = {
+    OSBF_COUNT_CLASSIFICATIONS, OSBF_COUNT_LEARNINGS, OSBF_COUNT_EXTRA_LEARNINGS,
+    OSBF_COUNT_FALSE_NEGATIVES, OSBF_COUNT_FALSE_POSITIVES,
+    OSBF_COUNT_FALSE_NEGATIVES, OSBF_COUNT_FALSE_POSITIVES
+  };
+  const char *filename = luaL_checkstring(L, 1);
+  enum osbf_counter counter = counters[luaL_checkoption(L, 2, NULL, names)];
+  int64_t delta = (int64_t) luaL_optnumber(L, 3, 1);
+
+  lua_getfield(L, LUA_ENVIRONINDEX, "cache");  /* s: cache */
+  lua_getfield(L, -1, filename);               /* s: cache class */
+  if (!lua_isnil(L, -1)) {
+    CLASS_STRUCT *c = check_class(L, -1);
+    if (c->state != OSBF_CLOSED && c->usage >= OSBF_WRITE_HEADER
+        && c->shards == NULL) {
+      lua_pushnumber(L, (lua_Number) osbf_add_to_counter(c->header, counter, delta, L));
+      return 1;
+    }
+  }
+  lua_pushnumber(L, (lua_Number) osbf_increment_counter(filename, counter, delta,
+                                                             context_of(L), L));
+  return 1;
+}
+
 static int
 lua_osbf_class_gc(lua_State *L) {
   CLASS_STRUCT *c = check_class(L, 1);
@@ -499,10 +619,11 @@ lua_osbf_class_gc(lua_State *L) {
 static int
 lua_osbf_classify (lua_State * L)
      /* classify(text, dbtable, flags, min_p_ratio, delimiters)
-        returns probs, trainings */
+        returns probs, trainings; text may be a string or features */
 {
   const unsigned char *text;
-  size_t text_len;
+  size_t text_len = 0;
+  OSBF_FEATURE_VECTOR *features;
   const char *delimiters;	/* extra token delimiters */
   size_t delimiters_len;
   uint32_t flags = 0;		/* default value */
@@ -515,7 +636,9 @@ lua_osbf_classify (lua_State * L)
   unsigned i, num_classes;
 
   /* get the arguments */
-  text        = (const unsigned char *) luaL_checklstring (L, 1, &text_len);
+  features    = to_features(L, 1);
+  text        = features != NULL ? NULL :
+                (const unsigned char *) luaL_checklstring (L, 1, &text_len);
   luaL_checktype (L, 2, LUA_TTABLE);
   num_classes = class_table_members(L, 2, classnames, classes, OSBF_READ_ONLY,
                                     NELEMS(classnames));
@@ -524,9 +647,17 @@ lua_osbf_classify (lua_State * L)
   delimiters  = luaL_optlstring (L, 5, "", &delimiters_len);
 
   /* call osbf_classify */
-  osbf_bayes_classify (text, text_len, delimiters, classes, num_classes,
-                       flags, min_p_ratio,
-                       p_classes, p_trainings, L);
+  if (features != NULL) {
+    luaL_argcheck(L, lua_isnoneornil(L, 5), 5,
+                  "delimiters must be given to core.features");
+    osbf_bayes_classify_features (features, classes, num_classes,
+                                  flags, min_p_ratio,
+                                  p_classes, p_trainings, context_of(L), L);
+  } else {
+    osbf_bayes_classify (text, text_len, delimiters, classes, num_classes,
+                         flags, min_p_ratio,
+                         p_classes, p_trainings, context_of(L), L);
+  }
 
   /* push table of probabilities onto the stack */
   lua_newtable (L);
@@ -542,6 +673,154 @@ lua_osbf_classify (lua_State * L)
   return 2;
 }
 
+static int
+lua_osbf_classify_batch (lua_State * L)
+     /* classify_batch(texts, dbtable, flags, min_p_ratio, delimiters, threads)
+        returns names, probs, trainings; each text may be a string or
+        features, and probs[(i-1)*#names+k] is the probability that
+        text i belongs to class names[k] */
+{
+  OSBF_TEXT *texts;
+  const char *delimiters;	/* extra token delimiters */
+  uint32_t flags = 0;		/* default value */
+  double min_p_ratio;		/* min pmax/p,in ratio */
+  unsigned num_threads;
+  CLASS_STRUCT *classes[OSBF_MAX_CLASSES];
+  const char *classnames[OSBF_MAX_CLASSES];
+  double *p_classes;
+  uint32_t p_trainings[OSBF_MAX_CLASSES];
+  unsigned i, k, num_texts, num_classes;
+  int has_features = 0;
+
+  /* get the arguments */
+  luaL_checktype (L, 1, LUA_TTABLE);
+  luaL_checktype (L, 2, LUA_TTABLE);
+  num_classes = class_table_members(L, 2, classnames, classes, OSBF_READ_ONLY,
+                                    NELEMS(classnames));
+  flags       = (uint32_t) luaL_optnumber (L, 3, 0);
+  min_p_ratio = (double) luaL_optnumber (L, 4, OSBF_MIN_PMAX_PMIN_RATIO);
+  delimiters  = luaL_optstring (L, 5, "");
+  luaL_argcheck(L, luaL_optint (L, 6, 1) >= 1, 6,
+                "number of threads must be positive");
+  num_threads = (unsigned) luaL_optint (L, 6, 1);
+
+  /* scratch memory lives in userdata, so an error cannot leak it */
+  num_texts = lua_objlen (L, 1);
+  texts = lua_newuserdata (L, num_texts * sizeof(*texts) + 1);
+  p_classes = lua_newuserdata (L, num_texts * num_classes * sizeof(*p_classes)
+                                  + 1);
+  for (i = 0; i < num_texts; i++) {
+    lua_rawgeti (L, 1, i + 1);
+    texts[i].fv = to_features(L, -1);
+    texts[i].text = NULL;
+    texts[i].len = 0;
+    if (texts[i].fv != NULL) {
+      has_features = 1;
+    } else if (lua_type (L, -1) == LUA_TSTRING) {
+      /* the string is kept alive by the table of texts */
+      size_t len;
+      texts[i].text = (const unsigned char *) lua_tolstring (L, -1, &len);
+      texts[i].len = len;
+    } else {
+      return luaL_error (L, "text %d of batch is neither a string nor features",
+                         i + 1);
+    }
+    lua_pop (L, 1);
+  }
+  luaL_argcheck(L, !has_features || lua_isnoneornil(L, 5), 5,
+                "delimiters must be given to core.features");
+
+  osbf_bayes_classify_batch (texts, num_texts, delimiters,
+                             classes, num_classes, flags, min_p_ratio,
+                             num_threads, p_classes, p_trainings,
+                             context_of(L), L);
+
+  /* push list of class names */
+  lua_createtable (L, num_classes, 0);
+  for (k = 0; k < num_classes; k++) {
+    lua_pushstring (L, classnames[k]);
+    lua_rawseti (L, -2, k + 1);
+  }
+  /* push list of probabilities, num_classes per text */
+  lua_createtable (L, num_texts * num_classes, 0);
+  for (i = 0; i < num_texts; i++) {
+    double *p = p_classes + (size_t) i * num_classes;
+    for (k = 0; k < num_classes; k++) {
+      lua_pushnumber (L, (lua_Number) p[k]);
+      lua_rawseti (L, -2, i * num_classes + k + 1);
+    }
+    check_sum_is_one(p, num_classes);
+  }
+  /* push list with number of trainings per class */
+  lua_createtable (L, num_classes, 0);
+  for (k = 0; k < num_classes; k++) {
+    lua_pushnumber (L, (lua_Number) p_trainings[k]);
+    lua_rawseti (L, -2, k + 1);
+  }
+  return 3;
+}
+
+static int
+lua_osbf_features (lua_State * L)
+     /* features(text, [delimiters]) returns features */
+{
+  const unsigned char *text;
+  size_t text_len;
+  const char *delimiters;
+  OSBF_FEATURE_VECTOR *fv;
+
+  text       = (const unsigned char *) luaL_checklstring (L, 1, &text_len);
+  delimiters = luaL_optstring (L, 2, "");
+
+  /* the userdata owns the vector from the start, so that the garbage
+     collector frees it even if the extraction fails */
+  fv = lua_newuserdata (L, sizeof(*fv));
+  memset (fv, 0, sizeof(*fv));
+  luaL_getmetatable (L, FEATURES_METANAME);
+  lua_setmetatable (L, -2);
+  osbf_extract_features (text, text_len, delimiters, fv, context_of(L), L);
+  return 1;
+}
+
+static OSBF_FEATURE_VECTOR *to_features(lua_State *L, int i) {
+  OSBF_FEATURE_VECTOR *fv = lua_touserdata(L, i);
+
+  if (fv != NULL && lua_getmetatable(L, i)) {
+    luaL_getmetatable(L, FEATURES_METANAME);
+    if (!lua_rawequal(L, -1, -2))
+      fv = NULL;
+    lua_pop(L, 2);
+    return fv;
+  }
+  return NULL;
+}
+
+static int lua_osbf_features_tostring(lua_State *L) {
+  OSBF_FEATURE_VECTOR *fv = check_features(L, 1);
+  lua_pushfstring(L, "OSBF features (%d)", (int) fv->num_features);
+  return 1;
+}
+
+static int lua_osbf_features_len(lua_State *L) {
+  OSBF_FEATURE_VECTOR *fv = check_features(L, 1);
+  lua_pushnumber(L, fv->num_features);
+  return 1;
+}
+
+static int lua_osbf_features_gc(lua_State *L) {
+  osbf_free_features(check_features(L, 1));
+  return 0;
+}
+
+static const struct luaL_reg featuresmeta[] = {
+  {"__tostring", lua_osbf_features_tostring},
+  {"__len", lua_osbf_features_len},
+  {"__gc", lua_osbf_features_gc},
+  {NULL, NULL}
+};
+
+/**********************************************************/
+
 static int
 lua_osbf_pR (lua_State * L)
      /* core.pR(p1, p2) returns log(p1/p2) */
@@ -557,7 +836,7 @@ lua_osbf_pR (lua_State * L)
     ratio = p1 / p2;
     if (ratio <= 0.0)
       ratio = OSBF_SMALLP;
-    lua_pushnumber (L, (lua_Number) pR_SCF * log10 (ratio));
+    lua_pushnumber (L, (lua_Number) settings_of(L)->pR_SCF * log10 (ratio));
     return 1;
   }
 }
@@ -566,11 +845,13 @@ lua_osbf_pR (lua_State * L)
 
 static int
 lua_osbf_train (lua_State * L)
-     /* train(sense, text, db, [flags, [delimiters]]) returns true or nil, error */
+     /* train(sense, text, db, [flags, [delimiters]]) returns true or nil, error;
+        text may be a string or features */
 {
   int sense;
   const unsigned char *text;
-  size_t text_len;
+  size_t text_len = 0;
+  OSBF_FEATURE_VECTOR *features;
   CLASS_STRUCT *db;
   uint32_t flags = 0;		/* default value */
   const char *delimiters = "";	/* extra token delimiters */
@@ -578,13 +859,22 @@ lua_osbf_train (lua_State * L)
 
   /* get args */
   sense  = luaL_checkint(L, 1);
-  text   = (unsigned char *) luaL_checklstring (L, 2, &text_len);
+  features = to_features(L, 2);
+  text   = features != NULL ? NULL :
+           (unsigned char *) luaL_checklstring (L, 2, &text_len);
   db     = check_open_class(L, 3, OSBF_WRITE_ALL);
   flags  = (uint32_t) luaL_optint(L, 4, 0);
   delimiters = luaL_optlstring(L, 5, "", &delimiters_len);
   luaL_checktype (L, 6, LUA_TNONE);
 
-  osbf_bayes_train(text, text_len, delimiters, db, sense, flags, L);
+  if (features != NULL) {
+    luaL_argcheck(L, lua_isnoneornil(L, 5), 5,
+                  "delimiters must be given to core.features");
+    osbf_bayes_train_features(features, db, sense, flags, L);
+  } else {
+    osbf_bayes_train(text, text_len, delimiters, db, sense, flags,
+                     context_of(L), L);
+  }
   return 0;
 }
 
@@ -641,6 +931,93 @@ lua_osbf_import (lua_State * L)
 
 /**********************************************************/
 
+/* core.merge(to_dbfile, from_dbfile(s), [threads]): the sources are a
+   filename or a table of filenames */
+static int
+lua_osbf_merge (lua_State * L)
+{
+  CLASS_STRUCT **from;
+  int i, n;
+  unsigned threads = (unsigned) luaL_optint (L, 3, 1);
+
+  if (lua_istable (L, 2))
+    n = (int) lua_objlen (L, 2);
+  else
+    {
+      luaL_checkstring (L, 2);
+      n = 1;
+    }
+  luaL_argcheck (L, n > 0, 2, "no database to merge from");
+  if (!lua_checkstack (L, n + 4))
+    luaL_error (L, "Too many databases to merge");
+
+  from = lua_newuserdata (L, n * sizeof (*from));
+  push_open_class_using_cache(L, luaL_checkstring(L, 1), OSBF_WRITE_ALL);
+  for (i = 0; i < n; i++)
+    {
+      if (lua_istable (L, 2))
+        {
+          lua_rawgeti (L, 2, i + 1);
+          push_open_class_using_cache(L, luaL_checkstring(L, -1), OSBF_READ_ONLY);
+          lua_remove (L, -2);
+        }
+      else
+        push_open_class_using_cache(L, lua_tostring(L, 2), OSBF_READ_ONLY);
+      from[i] = check_class(L, -1);
+    }
+
+  osbf_merge (check_class(L, -(n + 1)), from, (unsigned) n, threads, L);
+  return 0;
+}
+
+/**********************************************************/
+
+/* core.resize(filename, num_buckets[, threads]) resizes a class while
+   other processes go on using it [Note Online resize].  A cached copy
+   of the class is closed first: it would otherwise hold (and, closed
+   later, write back) the old file. */
+
+static int
+lua_osbf_resize (lua_State * L)
+{
+  const char *filename = luaL_checkstring (L, 1);
+  uint32_t num_buckets = (uint32_t) luaL_checknumber (L, 2);
+  unsigned threads = (unsigned) luaL_optint (L, 3, 1);
+
+  lua_getfield (L, LUA_ENVIRONINDEX, "cache");  /* s: cache */
+  lua_getfield (L, -1, filename);               /* s: cache class */
+  if (!lua_isnil (L, -1))
+    {
+      CLASS_STRUCT *c = check_class (L, -1);
+      if (c->state != OSBF_CLOSED)
+        osbf_close_class (c, L);
+    }
+  lua_pop (L, 2);
+
+  osbf_resize_class (filename, num_buckets, threads, context_of(L), L);
+  return 0;
+}
+
+/**********************************************************/
+
+/* sets field name of the table on top to an array with the histogram,
+   without its trailing empty bins */
+static void
+set_histogram (lua_State * L, const char *name, const uint32_t bins[])
+{
+  int i, n = OSBF_HISTOGRAM_BINS;
+
+  while (n > 0 && bins[n-1] == 0)
+    n--;
+  lua_createtable (L, n, 0);
+  for (i = 0; i < n; i++)
+    {
+      lua_pushnumber (L, (lua_Number) bins[i]);
+      lua_rawseti (L, -2, i + 1);
+    }
+  lua_setfield (L, -2, name);
+}
+
 static int
 lua_osbf_stats (lua_State * L)
 {
@@ -659,6 +1036,9 @@ lua_osbf_stats (lua_State * L)
   lua_pushnumber (L, (lua_Number) stats.total_buckets);
   lua_setfield(L, -2, "buckets");
 
+  lua_pushnumber (L, (lua_Number) stats.max_buckets);
+  lua_setfield(L, -2, "max_buckets");
+
   lua_pushnumber (L, (lua_Number) stats.bucket_size);
   lua_setfield(L, -2, "bucket_size");
 
@@ -683,6 +1063,15 @@ lua_osbf_stats (lua_State * L)
   lua_pushnumber (L, (lua_Number) stats.classifications);
   lua_setfield(L, -2, "classifications");
 
+  lua_pushnumber (L, (lua_Number) stats.microgrooms);
+  lua_setfield(L, -2, "microgrooms");
+
+  lua_pushnumber (L, (lua_Number) stats.lock_wait);
+  lua_setfield(L, -2, "lock_wait");
+
+  lua_pushnumber (L, (lua_Number) stats.num_shards);
+  lua_setfield(L, -2, "shards");
+
   if (full == 1)
     {
       lua_pushnumber (L, (lua_Number) stats.num_chains);
@@ -697,12 +1086,19 @@ lua_osbf_stats (lua_State * L)
       lua_pushnumber (L, (lua_Number) stats.max_displacement);
       lua_setfield(L, -2, "max_displacement");
 
+      lua_pushnumber (L, (lua_Number) stats.avg_displacement);
+      lua_setfield(L, -2, "avg_displacement");
+
       lua_pushnumber (L, (lua_Number) stats.unreachable);
       lua_setfield(L, -2, "unreachable");
 
       lua_pushnumber (L, (lua_Number) stats.used_buckets);
       lua_setfield(L, -2, "used_buckets");
 
+      set_histogram (L, "displacement_histogram", stats.displacement_histogram);
+      set_histogram (L, "chain_histogram", stats.chain_histogram);
+      set_histogram (L, "count_histogram", stats.count_histogram);
+
       if (stats.total_buckets > 0)
         lua_pushnumber (L, (lua_Number) ((double) stats.used_buckets /
                                      stats.total_buckets));
@@ -731,7 +1127,7 @@ set_info (lua_State * L, int idx)
   lua_setfield (L, idx, "_NAME");
   lua_pushliteral (L, VERSION);
   lua_setfield (L, idx, "_VERSION");
-  lua_pushnumber (L, (lua_Number) sizeof(OSBF_HEADER_STRUCT));
+  lua_pushnumber (L, (lua_Number) OSBF_HEADER_SIZE);
   lua_setfield (L, idx, "header_size");
   lua_pushnumber (L, (lua_Number) sizeof(OSBF_BUCKET_STRUCT));
   lua_setfield (L, idx, "bucket_size");
@@ -743,6 +1139,20 @@ set_info (lua_State * L, int idx)
   }
   lua_setfield(L, idx, "a_priori_strings");
 
+  lua_newtable(L);
+  for (i=0; scoring_strings[i] != NULL; i++) {
+    lua_pushstring(L, scoring_strings[i]);
+    lua_rawseti(L, -2, i+1);
+  }
+  lua_setfield(L, idx, "scoring_strings");
+
+  lua_newtable(L);
+  for (i=0; insertion_strings[i] != NULL; i++) {
+    lua_pushstring(L, insertion_strings[i]);
+    lua_rawseti(L, -2, i+1);
+  }
+  lua_setfield(L, idx, "insertion_strings");
+
 #define add_const(C) lua_pushnumber(L, (lua_Number) C); lua_setfield(L, idx, #C)
 
   add_const(NO_EDDC);
@@ -838,21 +1248,28 @@ static int lua_classfields(lua_State *L) {
   if (lua_isuint32(L, 2)) {
     CLASS_STRUCT *class = check_class(L, 1);
     uint32_t n = (uint32_t) lua_tonumber(L, 2);
-    if (n == 0 || n > class->header->num_buckets)
-      return luaL_error(L, "Index %d out of range; class %s has buckets 1..%d",
-                        n, class->classname, class->header->num_buckets);
-    else if (class->state == OSBF_CLOSED)
+    if (class->state == OSBF_CLOSED)
       return luaL_error(L, "Cannot look at buckets of a closed class");
+    else if (n == 0 || n > class_num_buckets(class))
+      return luaL_error(L, "Index %d out of range; class %s has buckets 1..%d",
+                        n, class->classname, class_num_buckets(class));
     else {
       /* TODO: all sorts of things wrong here---
          at minimum should make result immutable---at maximum should make table
          a real proxy for bucket including having it keep the class alive---but
          this will do for experiments */
-      OSBF_BUCKET_STRUCT *b = &class->buckets[n-1];
+      OSBF_BUCKET_STRUCT *b;
+      CLASS_STRUCT *shard = class->shards != NULL ? class->shards : class;
+      /* the buckets of the shards follow one another */
+      while (n > shard->header->num_buckets) {
+        n -= shard->header->num_buckets;
+        shard++;
+      }
+      b = &shard->buckets[n-1];
       lua_newtable(L);
       lua_pushnumber(L, b->hash1);
       lua_setfield(L, -2, "hash1");
-      lua_pushnumber(L, b->hash2);
+      lua_pushnumber(L, FINGERPRINT_KEY(b->fingerprint));
       lua_setfield(L, -2, "hash2");
       lua_pushnumber(L, b->count);
       lua_setfield(L, -2, "count");
@@ -905,15 +1322,20 @@ static const struct luaL_reg osbf[] = {
   {"create_db", lua_osbf_createdb},
   {"config", lua_osbf_config},
   {"classify", lua_osbf_classify},
+  {"classify_batch", lua_osbf_classify_batch},
+  {"features", lua_osbf_features},
   {"learn", lua_osbf_learn},
   {"unlearn", lua_osbf_unlearn},
   {"train", lua_osbf_train},
   {"open_class", lua_osbf_open_class},
+  {"increment", lua_osbf_increment},
   {"close_class", lua_osbf_class_gc},
   {"pR", lua_osbf_pR},
   {"dump", lua_osbf_dump},
   {"restore", lua_osbf_restore},
   {"import", lua_osbf_import},
+  {"merge", lua_osbf_merge},
+  {"resize", lua_osbf_resize},
   {"stats", lua_osbf_stats},
   {"hash", lua_hash},
   {NULL, NULL}
@@ -927,6 +1349,7 @@ int
 OPENFUN (lua_State * L)
 {
   const char *libname = luaL_checkstring(L, -1);
+  struct settings *settings;
 
   init_core_util(L);
   
@@ -944,6 +1367,10 @@ OPENFUN (lua_State * L)
   lua_setfield(L, -3, "exit");       /* s: os env */
   lua_newtable(L);
   lua_setfield(L, -2, "cache");      /* s: os env */
+  settings = lua_newuserdata(L, sizeof(*settings));
+  settings->ctx = osbf_default_context;
+  settings->pR_SCF = DEFAULT_PR_SCF;
+  lua_setfield(L, -2, "settings");   /* s: os env */
   lua_pop(L, 2); 
 
 
@@ -963,6 +1390,11 @@ OPENFUN (lua_State * L)
   
   lua_pop(L, 1); /* goodbye metatable */
 
+  /* feature vector as userdata */
+  luaL_newmetatable(L, FEATURES_METANAME);
+  luaL_register(L, NULL, featuresmeta);
+  lua_pop(L, 1);
+
                                                 /* s: libname */
   luaL_register (L, libname, osbf);
   // check to be sure osbf_lua_utils has no duplicates, then register
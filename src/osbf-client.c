@@ -0,0 +1,233 @@
+/*
+ * osbf-client: hand a message to a running 'osbf daemon' and write
+ * the answer to stdout.
+ *
+ * Usage: osbf-client [-s socket] [-c] [-t seconds] [-- command args...]
+ *
+ *   -s socket  socket of the daemon (default $OSBF_SOCKET, or else
+ *              $HOME/.osbf-lua/osbf.sock)
+ *   -c         classify instead of filter
+ *   -t seconds longest wait for the daemon to take a connection, read
+ *              the message or send a piece of the answer (default 30);
+ *              a daemon that takes longer is given up on
+ *   --         fallback command, run with the message on its standard
+ *              input whenever the daemon cannot answer, e.g.,
+ *              osbf-client -- osbf filter
+ *
+ * Any other argument beginning with '-' (-notag, -nocache, -nosfid)
+ * is passed on to the daemon's filter.  Like 'osbf filter', the client
+ * must never lose a message: if the daemon cannot be reached and there
+ * is no fallback command, the message is written out unchanged.
+ *
+ * See Copyright Notice in osbflib.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define MAX_FILTER_OPTIONS 8
+#define DEFAULT_TIMEOUT 30
+
+static const char *progname = "osbf-client";
+
+/* read all of fd into malloc'd memory; return NULL on failure */
+static char *read_all(int fd, size_t *len) {
+  size_t size = 64 * 1024, n = 0;
+  char *buf = malloc(size);
+
+  while (buf != NULL) {
+    ssize_t r;
+    if (n == size) {
+      char *bigger = realloc(buf, size *= 2);
+      if (bigger == NULL) {
+        free(buf);
+        return NULL;
+      }
+      buf = bigger;
+    }
+    r = read(fd, buf + n, size - n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0) {
+      free(buf);
+      return NULL;
+    }
+    if (r == 0)
+      break;
+    n += r;
+  }
+  *len = n;
+  return buf;
+}
+
+static int write_all(int fd, const char *p, size_t len) {
+  while (len > 0) {
+    ssize_t r = write(fd, p, len);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0)
+      return -1;
+    p += r;
+    len -= r;
+  }
+  return 0;
+}
+
+/* read a line of at most size-1 bytes, without the newline */
+static int read_line(int fd, char *line, size_t size) {
+  size_t n = 0;
+  char c;
+  while (n < size - 1) {
+    ssize_t r = read(fd, &c, 1);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    if (c == '\n')
+      break;
+    line[n++] = c;
+  }
+  line[n] = '\0';
+  return 0;
+}
+
+/* Send the message to the daemon.  Returns 0 and writes the answer to
+   stdout, or returns -1 if the caller must fall back, as when the
+   daemon leaves a socket operation waiting for timeout seconds. */
+static int ask_daemon(const char *path, const char *request,
+                      const char *msg, size_t len, long timeout) {
+  struct sockaddr_un addr;
+  struct timeval tv;
+  char line[1024];
+  char *answer;
+  size_t answer_len;
+  int fd, ok;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  tv.tv_sec = timeout;
+  tv.tv_usec = 0;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0
+      || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0
+      || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+      || write_all(fd, request, strlen(request)) != 0
+      || write_all(fd, msg, len) != 0
+      || read_line(fd, line, sizeof(line)) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (strncmp(line, "OK ", 3) != 0) {
+    if (strncmp(line, "ERR", 3) == 0)
+      fprintf(stderr, "%s: %s\n", progname, line);
+    close(fd);
+    return -1;
+  }
+  answer = read_all(fd, &answer_len);
+  close(fd);
+  ok = answer != NULL && answer_len == strtoul(line + 3, NULL, 10)
+       && write_all(1, answer, answer_len) == 0;
+  free(answer);
+  return ok ? 0 : -1;
+}
+
+/* run argv with the message on its standard input */
+static int fall_back(char **argv, const char *msg, size_t len) {
+  int fds[2], status;
+  pid_t pid;
+
+  if (argv[0] == NULL)
+    return write_all(1, msg, len) == 0 ? 0 : 1;
+  if (pipe(fds) != 0 || (pid = fork()) < 0) {
+    perror(progname);
+    return write_all(1, msg, len) == 0 ? 0 : 1;
+  }
+  if (pid == 0) {
+    dup2(fds[0], 0);
+    close(fds[0]);
+    close(fds[1]);
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+  close(fds[0]);
+  write_all(fds[1], msg, len);
+  close(fds[1]);
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR)
+      return 1;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int main(int argc, char **argv) {
+  const char *path = getenv("OSBF_SOCKET");
+  const char *command = "FILTER";
+  const char *filter_options[MAX_FILTER_OPTIONS];
+  char **fallback = argv + argc; /* empty */
+  char default_path[1024], request[1024];
+  size_t len, used;
+  char *msg, *end;
+  long timeout = DEFAULT_TIMEOUT;
+  int i, nopts = 0;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--") == 0) {
+      fallback = argv + i + 1;
+      break;
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    } else if (strcmp(argv[i], "-c") == 0) {
+      command = "CLASSIFY";
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc
+               && (timeout = strtol(argv[i + 1], &end, 10)) > 0
+               && *end == '\0') {
+      i++;
+    } else if (argv[i][0] == '-' && strcmp(argv[i], "-t") != 0
+               && nopts < MAX_FILTER_OPTIONS) {
+      filter_options[nopts++] = argv[i];
+    } else {
+      fprintf(stderr, "Usage: %s [-s socket] [-c] [-t seconds] [-notag] "
+              "[-nocache] [-nosfid] [-- command args...]\n", progname);
+      return 2;
+    }
+  }
+  if (path == NULL) {
+    const char *home = getenv("HOME");
+    snprintf(default_path, sizeof(default_path), "%s/.osbf-lua/osbf.sock",
+             home ? home : ".");
+    path = default_path;
+  }
+
+  msg = read_all(0, &len);
+  if (msg == NULL) {
+    perror(progname);
+    return 1;
+  }
+
+  used = snprintf(request, sizeof(request), "%s %lu", command,
+                  (unsigned long) len);
+  for (i = 0; i < nopts && used < sizeof(request); i++)
+    used += snprintf(request + used, sizeof(request) - used, " %s",
+                     filter_options[i]);
+  if (used + 1 < sizeof(request)) {
+    strcpy(request + used, "\n");
+    if (ask_daemon(path, request, msg, len, timeout) == 0)
+      return 0;
+  }
+  return fall_back(fallback, msg, len);
+}
@@ -0,0 +1,242 @@
+/*
+ * See Copyright Notice in osbflib.h
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "osbf_api.h"
+
+/* Each function packs its arguments, runs the core under osbf_pcall_buf,
+   and turns a raised error into OSBF_API_ERROR [Note C API]. */
+
+static int protected(osbf_error_fun f, void *args, char *errmsg)
+{
+  return osbf_pcall_buf(f, args, errmsg, OSBF_ERROR_MESSAGE_LEN) == 0
+    ? 0 : OSBF_API_ERROR;
+}
+
+#define CONTEXT(ctx) ((ctx) != NULL ? (ctx) : &osbf_default_context)
+
+/*****************************************************************/
+
+struct create_args {
+  const char *classname;
+  uint32_t num_buckets, max_buckets, num_shards;
+};
+
+static void create_class(OSBF_HANDLER *h, void *data)
+{
+  struct create_args *a = data;
+  osbf_create_sharded(a->classname, a->num_buckets, a->max_buckets,
+                      a->num_shards, h);
+}
+
+int
+osbf_api_create_class (const char *classname, uint32_t num_buckets,
+                       uint32_t max_buckets, uint32_t num_shards,
+                       char *errmsg)
+{
+  struct create_args a;
+
+  a.classname   = classname;
+  a.num_buckets = num_buckets;
+  a.max_buckets = max_buckets;
+  a.num_shards  = num_shards;
+  return protected(create_class, &a, errmsg);
+}
+
+/*****************************************************************/
+
+struct open_args {
+  const char *classname;
+  osbf_class_usage usage;
+  CLASS_STRUCT *class;
+  const OSBF_CONTEXT *ctx;
+};
+
+static void open_class(OSBF_HANDLER *h, void *data)
+{
+  struct open_args *a = data;
+  osbf_open_class(a->classname, a->usage, a->class, a->ctx, h);
+}
+
+int
+osbf_api_open_class (const char *classname, osbf_class_usage usage,
+                     CLASS_STRUCT *class, const OSBF_CONTEXT *ctx,
+                     char *errmsg)
+{
+  struct open_args a;
+
+  a.classname = classname;
+  a.usage     = usage;
+  a.class     = class;
+  a.ctx       = CONTEXT(ctx);
+  if (protected(open_class, &a, errmsg) == 0)
+    return 0;
+  /* whatever the open left behind was released or is lost; the class
+     must look closed so that closing it does nothing */
+  memset(class, 0, sizeof(*class));
+  class->fd = -1;
+  class->state = OSBF_CLOSED;
+  return OSBF_API_ERROR;
+}
+
+static void close_class(OSBF_HANDLER *h, void *data)
+{
+  osbf_close_class((CLASS_STRUCT *) data, h);
+}
+
+int
+osbf_api_close_class (CLASS_STRUCT *class, char *errmsg)
+{
+  if (class->state == OSBF_CLOSED && class->shards == NULL)
+    return 0;
+  return protected(close_class, class, errmsg);
+}
+
+/*****************************************************************/
+
+struct classify_args {
+  const unsigned char *text;
+  unsigned long len;
+  const char *delims;
+  CLASS_STRUCT **classes;
+  unsigned num_classes;
+  enum classify_flags flags;
+  double *ptc;
+  uint32_t *ptt;
+  const OSBF_CONTEXT *ctx;
+};
+
+static void classify(OSBF_HANDLER *h, void *data)
+{
+  struct classify_args *a = data;
+  osbf_bayes_classify(a->text, a->len, a->delims, a->classes, a->num_classes,
+                      a->flags, OSBF_MIN_PMAX_PMIN_RATIO, a->ptc, a->ptt,
+                      a->ctx, h);
+}
+
+int
+osbf_api_classify (const unsigned char *text, unsigned long len,
+                   const char *delims, CLASS_STRUCT *classes[],
+                   unsigned num_classes, enum classify_flags flags,
+                   double ptc[], uint32_t ptt[],
+                   const OSBF_CONTEXT *ctx, char *errmsg)
+{
+  struct classify_args a;
+
+  a.text        = text;
+  a.len         = len;
+  a.delims      = delims != NULL ? delims : "";
+  a.classes     = classes;
+  a.num_classes = num_classes;
+  a.flags       = flags;
+  a.ptc         = ptc;
+  a.ptt         = ptt;
+  a.ctx         = CONTEXT(ctx);
+  return protected(classify, &a, errmsg);
+}
+
+/*****************************************************************/
+
+struct train_args {
+  const unsigned char *text;
+  unsigned long len;
+  const char *delims;
+  CLASS_STRUCT *class;
+  int sense;
+  enum learn_flags flags;
+  const OSBF_CONTEXT *ctx;
+};
+
+static void train(OSBF_HANDLER *h, void *data)
+{
+  struct train_args *a = data;
+  osbf_raise_unless(a->sense == 1 || a->sense == -1, h,
+                    "Training sense must be 1 or -1, not %d", a->sense);
+  osbf_bayes_train(a->text, a->len, a->delims, a->class, a->sense, a->flags,
+                   a->ctx, h);
+}
+
+int
+osbf_api_train (const unsigned char *text, unsigned long len,
+                const char *delims, CLASS_STRUCT *class,
+                int sense, enum learn_flags flags,
+                const OSBF_CONTEXT *ctx, char *errmsg)
+{
+  struct train_args a;
+
+  a.text   = text;
+  a.len    = len;
+  a.delims = delims != NULL ? delims : "";
+  a.class  = class;
+  a.sense  = sense;
+  a.flags  = flags;
+  a.ctx    = CONTEXT(ctx);
+  return protected(train, &a, errmsg);
+}
+
+/*****************************************************************/
+
+struct stats_args {
+  const CLASS_STRUCT *class;
+  STATS_STRUCT *stats;
+  int full;
+};
+
+static void stats(OSBF_HANDLER *h, void *data)
+{
+  struct stats_args *a = data;
+  osbf_stats(a->class, a->stats, h, a->full);
+}
+
+int
+osbf_api_stats (const CLASS_STRUCT *class, STATS_STRUCT *stats_out, int full,
+                char *errmsg)
+{
+  struct stats_args a;
+
+  a.class = class;
+  a.stats = stats_out;
+  a.full  = full;
+  return protected(stats, &a, errmsg);
+}
+
+/*****************************************************************/
+
+struct import_args {
+  CLASS_STRUCT *class_to;
+  const CLASS_STRUCT *class_from;
+};
+
+static void import(OSBF_HANDLER *h, void *data)
+{
+  struct import_args *a = data;
+  osbf_import(a->class_to, a->class_from, h);
+}
+
+int
+osbf_api_import (CLASS_STRUCT *class_to, const CLASS_STRUCT *class_from,
+                 char *errmsg)
+{
+  struct import_args a;
+
+  a.class_to   = class_to;
+  a.class_from = class_from;
+  return protected(import, &a, errmsg);
+}
+
+/*****************************************************************/
+
+double osbf_api_pR (double p1, double p2)
+{
+  double ratio;
+
+  if (p2 <= 0.0)
+    p2 = OSBF_SMALLP;
+  ratio = p1 / p2;
+  if (ratio <= 0.0)
+    ratio = OSBF_SMALLP;
+  return OSBF_PR_SCF * log10 (ratio);
+}
@@ -0,0 +1,107 @@
+/*
+ * See Copyright Notice in osbflib.h
+ */
+
+#ifndef OSBF_API_H
+#define OSBF_API_H 1
+
+#include "osbflib.h"
+
+/* [Note C API]
+   ~~~~~~~~~~~~
+   The core raises its errors through an OSBF_HANDLER, which in the Lua
+   module is the lua_State, so that a failure unwinds straight into Lua.
+   libosbf links the same core with the handler of osbferrs.c instead
+   and wraps the calls a program needs in these functions, so that a C
+   program, a mail filter say, can classify and train without Lua.
+
+   No error ever unwinds out of a function below.  Each returns 0 on
+   success and OSBF_API_ERROR on failure, in which case the message is
+   copied into errmsg, which may be NULL and otherwise has room for
+   OSBF_ERROR_MESSAGE_LEN characters.  Each call catches its own errors
+   on its own stack, so calls may be made from several threads; what
+   they may share is as in [Note Threads] in osbf_bayes.c: any number
+   of classifications may run at once against the same open classes,
+   but nothing may train, import into, or close a class meanwhile.
+
+   Whether two threads may open the same class file, each into a class
+   of its own, depends on the locking method [Note Locks in
+   osbf_disk.c].  OFD locks, the default where the system has them,
+   belong to an open file, so threads exclude one another as processes
+   do, and lockfile locks are files that a thread waits for like any
+   other process.  fcntl locks, though, belong to the process: a
+   thread gets a lock that another thread holds, and closing any
+   descriptor of the file drops every lock the process has on it.
+   With the fcntl method, or with locking disabled, a program must
+   itself keep threads from opening a class file that another thread
+   has open for writing, and from opening or closing any class file
+   while another thread has it open.
+
+   A context may be NULL, meaning osbf_default_context; otherwise it is
+   read, never written, and must outlive the classes opened under it
+   [Note Contexts].  A class is a CLASS_STRUCT owned by the caller.
+   After a failed open the class is closed; after any other failure it
+   may or may not be, and osbf_api_close_class(), which does nothing to
+   a closed class, must still be called to release it. */
+
+#define OSBF_API_ERROR (-1)
+
+#define OSBF_PR_SCF 0.59
+  /* scale of osbf_api_pR, the default of the Lua module's pR_SCF */
+
+extern int
+osbf_api_create_class (const char *classname, uint32_t num_buckets,
+                       uint32_t max_buckets, uint32_t num_shards,
+                       char *errmsg);
+  /* creates an empty class; max_buckets above num_buckets makes a class
+     that grows [Note Growth], and num_shards above 1 a sharded class
+     [Note Shards] */
+
+extern int
+osbf_api_open_class (const char *classname, osbf_class_usage usage,
+                     CLASS_STRUCT *class, const OSBF_CONTEXT *ctx,
+                     char *errmsg);
+  /* opens a class for classifying (OSBF_READ_ONLY) or for training
+     (OSBF_WRITE_ALL); a writer holds the lock of the class until it
+     closes it */
+
+extern int
+osbf_api_close_class (CLASS_STRUCT *class, char *errmsg);
+  /* writes back what a writer changed and releases the class */
+
+extern int
+osbf_api_classify (const unsigned char *text, unsigned long len,
+                   const char *delims, CLASS_STRUCT *classes[],
+                   unsigned num_classes, enum classify_flags flags,
+                   double ptc[], uint32_t ptt[],
+                   const OSBF_CONTEXT *ctx, char *errmsg);
+  /* stores in ptc[k] the probability that the text belongs to class k
+     and in ptt[k] the number of trainings of class k; delims are extra
+     token delimiters, NULL for none */
+
+extern int
+osbf_api_train (const unsigned char *text, unsigned long len,
+                const char *delims, CLASS_STRUCT *class,
+                int sense, enum learn_flags flags,
+                const OSBF_CONTEXT *ctx, char *errmsg);
+  /* learns the text into the class if sense is 1 or unlearns it if
+     sense is -1 */
+
+extern int
+osbf_api_stats (const CLASS_STRUCT *class, STATS_STRUCT *stats, int full,
+                char *errmsg);
+  /* fills in the statistics of the class; without full, only those
+     read from its header */
+
+extern int
+osbf_api_import (CLASS_STRUCT *class_to, const CLASS_STRUCT *class_from,
+                 char *errmsg);
+  /* adds the buckets and counters of class_from to class_to, which must
+     be open for OSBF_WRITE_ALL */
+
+extern double osbf_api_pR (double p1, double p2);
+  /* the pR of probabilities p1 and p2, OSBF_PR_SCF * log10(p1 / p2):
+     positive if p1 is more likely, and within [-20, 20] where the
+     classification calls for reinforcement training */
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * osbf_api_check: checks libosbf [Note C API in osbf_api.h] from C.
+ *
+ * Usage: osbf_api_check [directory]
+ *
+ * Creates two classes in the directory (default $TMPDIR, or else /tmp),
+ * trains one message into each, classifies a third, checks the errors
+ * of a missing class and of a bad training, closes the classes and
+ * removes them.  Prints "ok" and exits 0 if every check passes.
+ *
+ * See Copyright Notice in osbflib.h
+ */
+
+/* for getpid */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "osbf_api.h"
+
+static int failures = 0;
+
+static void check(int ok, const char *what, const char *errmsg)
+{
+  if (!ok) {
+    printf("FAILED: %s%s%s\n", what, errmsg != NULL ? ": " : "",
+           errmsg != NULL ? errmsg : "");
+    failures++;
+  }
+}
+
+static int train(const char *classname, const char *text, char *errmsg)
+{
+  CLASS_STRUCT class;
+  int r = osbf_api_open_class(classname, OSBF_WRITE_ALL, &class, NULL, errmsg);
+
+  if (r == 0)
+    r = osbf_api_train((const unsigned char *) text, strlen(text), NULL,
+                       &class, 1, 0, NULL, errmsg);
+  if (osbf_api_close_class(&class, r == 0 ? errmsg : NULL) != 0)
+    r = OSBF_API_ERROR;
+  return r;
+}
+
+int main(int argc, char *argv[])
+{
+  static const char *ham_text =
+    "the meeting is moved to tomorrow after lunch; the agenda follows";
+  static const char *spam_text =
+    "buy cheap pills now and make money fast from home";
+  static const char *unknown_text = "cheap pills, make money now";
+  const char *dir = argc > 1 ? argv[1] : getenv("TMPDIR");
+  char ham[512], spam[512], missing[512];
+  char errmsg[OSBF_ERROR_MESSAGE_LEN];
+  CLASS_STRUCT classes[2], *open[2];
+  STATS_STRUCT stats;
+  double p[2];
+  uint32_t trainings[2];
+  int r;
+
+  if (dir == NULL || *dir == '\0')
+    dir = "/tmp";
+  sprintf(ham,     "%.400s/osbf-api-check-%ld-ham.cfc", dir, (long) getpid());
+  sprintf(spam,    "%.400s/osbf-api-check-%ld-spam.cfc", dir, (long) getpid());
+  sprintf(missing, "%.400s/osbf-api-check-%ld-none.cfc", dir, (long) getpid());
+
+  r = osbf_api_create_class(ham, 10007, 0, 0, errmsg);
+  check(r == 0, "create a class", errmsg);
+  r = osbf_api_create_class(spam, 10007, 0, 0, errmsg);
+  check(r == 0, "create a class", errmsg);
+  check(train(ham, ham_text, errmsg) == 0, "train a class", errmsg);
+  check(train(spam, spam_text, errmsg) == 0, "train a class", errmsg);
+
+  /* errors are returned, not raised */
+  r = osbf_api_open_class(missing, OSBF_READ_ONLY, &classes[0], NULL, errmsg);
+  check(r == OSBF_API_ERROR && *errmsg != '\0', "open of a missing class", NULL);
+  check(osbf_api_close_class(&classes[0], errmsg) == 0,
+        "close after a failed open", errmsg);
+  r = osbf_api_open_class(spam, OSBF_WRITE_ALL, &classes[0], NULL, errmsg);
+  check(r == 0, "open a class for training", errmsg);
+  r = osbf_api_train((const unsigned char *) spam_text, strlen(spam_text),
+                     NULL, &classes[0], 2, 0, NULL, errmsg);
+  check(r == OSBF_API_ERROR && *errmsg != '\0', "training with sense 2", NULL);
+  check(osbf_api_close_class(&classes[0], errmsg) == 0, "close a class", errmsg);
+
+  r = osbf_api_open_class(ham, OSBF_READ_ONLY, &classes[0], NULL, errmsg);
+  check(r == 0, "open a class for reading", errmsg);
+  r = osbf_api_open_class(spam, OSBF_READ_ONLY, &classes[1], NULL, errmsg);
+  check(r == 0, "open a class for reading", errmsg);
+  if (failures == 0) {
+    open[0] = &classes[0];
+    open[1] = &classes[1];
+    r = osbf_api_classify((const unsigned char *) unknown_text,
+                          strlen(unknown_text), NULL, open, 2, 0,
+                          p, trainings, NULL, errmsg);
+    check(r == 0, "classify", errmsg);
+    check(r != 0 || (p[1] > p[0] && osbf_api_pR(p[0], p[1]) < 0),
+          "the spam class was not the more likely", NULL);
+    check(r != 0 || (trainings[0] == 1 && trainings[1] == 1),
+          "wrong numbers of trainings", NULL);
+    r = osbf_api_stats(&classes[1], &stats, 1, errmsg);
+    check(r == 0 && stats.learnings == 1 && stats.used_buckets > 0,
+          "statistics", r == 0 ? NULL : errmsg);
+  }
+  check(osbf_api_close_class(&classes[0], errmsg) == 0, "close a class", errmsg);
+  check(osbf_api_close_class(&classes[1], errmsg) == 0, "close a class", errmsg);
+
+  remove(ham);
+  remove(spam);
+  if (failures == 0)
+    printf("ok\n");
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
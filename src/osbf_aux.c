@@ -35,11 +35,19 @@ static uint32_t osbf_last_in_chain  (CLASS_STRUCT * dbclass, uint32_t bindex);
 
 #define BUCKET_BUFFER_SIZE 5000
 
-uint32_t microgroom_displacement_trigger = OSBF_MICROGROOM_DISPLACEMENT_TRIGGER;
-uint32_t microgroom_stop_after = OSBF_MICROGROOM_STOP_AFTER;
+/* maps strings to insertion_options enum */
+const char *insertion_strings[] = {
+  "LINEAR",
+  "ROBIN_HOOD",
+  NULL
+};
 
 /*****************************************************************/
 
+/* offset of bucket i from bucket start, to its right */
+#define OFFSET_IN_CHAIN(cd, start, i) \
+  ((i) >= (start) ? (i) - (start) : NUM_BUCKETS(cd) - (start) + (i))
+
 /*
  * Pack a chain moving buckets to a place closer to their
  * right positions whenever possible, using the buckets marked as free.
@@ -78,28 +86,49 @@ osbf_packchain(CLASS_STRUCT * class, uint32_t packstart, uint32_t packlen)
     if (MARKED_FREE(class, free_start))
       break;
 
+  /* The marked-free buckets to the left of ifrom all lie between
+   * first_free and last_free, so only that part of the way from a
+   * bucket's right position to ifrom needs to be searched.  Positions
+   * are compared by their offsets from packstart; a right position that
+   * seems to be to the right of ifrom is in fact to the left of
+   * packstart, when packing the tail of a chain.
+   */
   if (free_start != packend) {
+    uint32_t first_free = free_start, last_free = free_start;
+    uint32_t right_offset;
+
     for (ifrom = NEXT_BUCKET(class, free_start);
          ifrom != packend; ifrom = NEXT_BUCKET(class, ifrom)) {
-      if (!MARKED_FREE(class, ifrom)) {
-        /* see if there's a free bucket closer to its right place */
-        thash = BUCKET_HASH(class, ifrom);
-        ito = HASH_INDEX(class, thash);
-
-        while (ito != ifrom && !MARKED_FREE(class, ito))
-          ito = NEXT_BUCKET(class, ito);
-
-        /* if found a marked-free bucket, use it */
-        if (MARKED_FREE(class, ito)) {
-          /* copy bucket and flags */
-          BUCKET_HASH(class, ito) = thash;
-          BUCKET_KEY(class, ito) = BUCKET_KEY(class, ifrom);
-          BUCKET_VALUE(class, ito) = BUCKET_VALUE(class, ifrom);
-          BUCKET_FLAGS(class, ito) = BUCKET_FLAGS(class, ifrom);
-          /* mark the from bucket as free */
-          MARK_IT_FREE(class, ifrom);
-        }
+      if (MARKED_FREE(class, ifrom)) {
+        last_free = ifrom;
+        continue;
       }
+      /* see if there's a free bucket closer to its right place */
+      thash = BUCKET_HASH(class, ifrom);
+      ito = HASH_INDEX(class, thash);
+      right_offset = OFFSET_IN_CHAIN(class, packstart, ito);
+      if (right_offset > OFFSET_IN_CHAIN(class, packstart, ifrom))
+        right_offset = 0;
+      if (right_offset > OFFSET_IN_CHAIN(class, packstart, last_free))
+        continue;
+      if (right_offset <= OFFSET_IN_CHAIN(class, packstart, first_free))
+        ito = first_free;
+      while (!MARKED_FREE(class, ito))
+        ito = NEXT_BUCKET(class, ito);
+
+      /* use the marked-free bucket found: copy bucket and flags */
+      BUCKET_HASH(class, ito) = thash;
+      BUCKET_KEY(class, ito) = BUCKET_KEY(class, ifrom);
+      BUCKET_VALUE(class, ito) = BUCKET_VALUE(class, ifrom);
+      SET_BUCKET_FLAGS(class, ito, BUCKET_FLAGS(class, ifrom));
+      MARK_BUCKET_DIRTY(class, ito);
+      /* mark the from bucket as free */
+      MARK_IT_FREE(class, ifrom);
+      last_free = ifrom;
+      if (ito == first_free)
+        do
+          first_free = NEXT_BUCKET(class, first_free);
+        while (!MARKED_FREE(class, first_free));
     }
   }
 
@@ -119,10 +148,13 @@ osbf_packchain(CLASS_STRUCT * class, uint32_t packstart, uint32_t packlen)
     }
   }
 
-  for (ito = packstart; ito != packend; ito = NEXT_BUCKET(class, ito))
+  for (ito = free_start; ito != packend; ito = NEXT_BUCKET(class, ito))
     if (MARKED_FREE(class, ito)) {
       BUCKET_VALUE(class, ito) = 0;
+      MARK_BUCKET_DIRTY(class, ito);
       UNMARK_IT_FREE(class, ito);
+      if (CLASS_GROWS(class))
+        class->header->used_buckets--;
     }
 
   if (DEBUG_packchain) {
@@ -148,177 +180,142 @@ osbf_packchain(CLASS_STRUCT * class, uint32_t packstart, uint32_t packlen)
  * Prune and pack a chain in a class database
  * Returns the number of freed (zeroed) buckets
  */
+
+/*
+ *   This pruning method zeroes buckets with minimum count in the chain.
+ *   Among those, it zeroes the buckets with minimum distance to their
+ *   right position, to increase the chance of zeroing older buckets
+ *   first.  At most microgroom_stop_after buckets of the class's context
+ *   are zeroed, the first ones in the chain.
+ *
+ *   The chain used to be scanned once for the minimum count and then
+ *   once more for each distance tried, starting at 0, until some bucket
+ *   was zeroed: up to 5 passes or more when the .cfc file is full.
+ *   Now a single sweep finds the candidates, ordering them by (count,
+ *   distance), and remembers where the first of the best ones is; the
+ *   buckets are then marked from there on.  The result is the same.
+ *
+ *   We keep track of how many buckets we've marked to be zeroed and we
+ *   stop marking additional buckets after that point. That messes up
+ *   the tail length, and if we don't repack the tail, then features in
+ *   the tail can become permanently inaccessible! Therefore, we really
+ *   can't stop in the middle of the tail (well, we could stop marking,
+ *   but we need to pass the full length of the tail in).
+ */
+
+struct groom_candidate {
+  uint32_t value, distance, first;
+};
+
+/* is a bucket with this value and distance better than the best so far? */
+static int
+better_candidate (struct groom_candidate *best, uint32_t value,
+                  uint32_t distance)
+{
+  return value < best->value
+    || (value == best->value && distance < best->distance);
+}
+
 static uint32_t osbf_microgroom(CLASS_STRUCT * class, uint32_t bindex)
 {
-  uint32_t i_aux, j_aux, right_position;
-  static uint32_t microgroom_count = 0;
+  uint32_t i_aux, j_aux, n, right_position;
   uint32_t packstart, packlen;
-  uint32_t zeroed_countdown, min_value, min_value_any;
-  uint32_t distance, max_distance;
+  uint32_t zeroed_countdown, value, distance;
   uint32_t groom_locked = OSBF_MICROGROOM_LOCKED;
+  struct groom_candidate unlocked, any, *best;
+  /* how much farther from home than the nearest a bucket may be and
+     still be zeroed [Note Robin Hood] */
+  uint32_t spread = class->ctx->insertion == ROBIN_HOOD_INSERTION ? 1 : 0;
 
-  j_aux = 0;
-  zeroed_countdown = microgroom_stop_after;
-
-  i_aux = j_aux = 0;
-  microgroom_count++;
+  zeroed_countdown = class->ctx->microgroom_stop_after;
+  class->microgrooms++;
 
   /*  move to start of chain that overflowed,
    *  then prune just that chain.
    */
-  min_value = OSBF_MAX_BUCKET_VALUE;
   i_aux = j_aux = HASH_INDEX(class, bindex);
-  min_value_any = BUCKET_VALUE(class, i_aux);
 
   if (!BUCKET_IN_CHAIN(class, i_aux))
     return 0;                   /* initial bucket not in a chain! */
 
   while (BUCKET_IN_CHAIN(class, i_aux)) {
-    if (BUCKET_VALUE(class, i_aux) < min_value_any)
-      min_value_any = BUCKET_VALUE(class, i_aux);
-    if (BUCKET_VALUE(class, i_aux) < min_value &&
-        !BUCKET_IS_LOCKED(class, i_aux))
-      min_value = BUCKET_VALUE(class, i_aux);
     i_aux = PREV_BUCKET(class, i_aux);
     if (i_aux == j_aux)
       break;                    /* don't hang if we have a 100% full .css file */
-    /* fprintf (stderr, "-"); */
   }
 
   /*  now, move the index to the first bucket in this chain. */
   i_aux = NEXT_BUCKET(class, i_aux);
   packstart = i_aux;
-  /* find the end of the chain */
-  while (BUCKET_IN_CHAIN(class, i_aux)) {
+
+  /* Find the best candidates, locked or not, and the end of the chain.
+   * Unlocked buckets with the maximum value are not candidates.
+   */
+  unlocked.value = OSBF_MAX_BUCKET_VALUE;
+  unlocked.distance = 0;
+  unlocked.first = packstart;
+  any.value = OSBF_MAX_BUCKET_VALUE + 1;
+  any.distance = 0;
+  any.first = packstart;
+  n = 0;
+  while (BUCKET_IN_CHAIN(class, i_aux) && n < NUM_BUCKETS(class)) {
+    int locked = BUCKET_IS_LOCKED(class, i_aux);
+    value = BUCKET_VALUE(class, i_aux);
+    /* the distance costs a division; most buckets don't need it */
+    if (value <= any.value || (!locked && value <= unlocked.value)) {
+      right_position = HASH_INDEX(class, BUCKET_HASH(class, i_aux));
+      if (right_position <= i_aux)
+        distance = i_aux - right_position;
+      else
+        distance = NUM_BUCKETS(class) + i_aux - right_position;
+      if (better_candidate(&any, value, distance)) {
+        any.value = value;
+        any.distance = distance;
+        any.first = i_aux;
+      }
+      if (!locked && better_candidate(&unlocked, value, distance)) {
+        unlocked.value = value;
+        unlocked.distance = distance;
+        unlocked.first = i_aux;
+      }
+    }
     i_aux = NEXT_BUCKET(class, i_aux);
-    if (i_aux == packstart)
-      break;                    /* don't hang if we have a 100% full .cfc file */
+    n++;
   }
   /*  now, the index is right after the last bucket in this chain. */
-
-  /* only >, not >= in this case, otherwise the packlen would be 0
-   * instead of NUM_BUCKETS (class).
-   */
-  if (i_aux > packstart)
-    packlen = i_aux - packstart;
-  else                          /* if i_aux == packstart, packlen = header->buckets */
-    packlen = NUM_BUCKETS(class) + i_aux - packstart;
+  packlen = n;
 
   /* if no unlocked bucket can be zeroed, zero any */
-  if (groom_locked > 0 || min_value == OSBF_MAX_BUCKET_VALUE) {
+  if (groom_locked > 0 || unlocked.value == OSBF_MAX_BUCKET_VALUE) {
     groom_locked = 1;
-    min_value = min_value_any;
-  } else
+    best = &any;
+  } else {
     groom_locked = 0;
+    best = &unlocked;
+  }
 
-/*
- *   This pruning method zeroes buckets with minimum count in the chain.
- *   It tries first buckets with minimum distance to their right position,
- *   to increase the chance of zeroing older buckets first. If none with
- *   distance 0 is found, the distance is increased until at least one
- *   bucket is zeroed.
- *
- *   We keep track of how many buckets we've marked to be zeroed and we
- *   stop marking additional buckets after that point. That messes up
- *   the tail length, and if we don't repack the tail, then features in
- *   the tail can become permanently inaccessible! Therefore, we really
- *   can't stop in the middle of the tail (well, we could stop marking,
- *   but we need to pass the full length of the tail in).
- * 
- *   This is a statistics report of microgroomings for 4147 messages
- *   of the SpamAssassin corpus. It shows that 77% is done in a single
- *   pass, 95.2% in 1 or 2 passes and 99% in at most 3 passes.
- *
- *   # microgrommings   passes   %    accum. %
- *        232584           1    76.6   76.6
- *         56396           2    18.6   95.2
- *         11172           3     3.7   98.9
- *          2502           4     0.8   99.7
- *           726           5     0.2   99.9
- *           ...
- *   -----------
- *        303773
- *
- *   If we consider only the last 100 microgroomings, when the cfc
- *   file is full, we'll have the following numbers showing that most
- *   microgroomings (61%) are still done in a single pass, almost 90%
- *   is done in 1 or 2 passes and 97% are done in at most 3 passes:
- *
- *   # microgrommings   passes   %    accum. %
- *          61             1    61      61
- *          27             2    27      88
- *           9             3     9      97
- *           3             4     3     100
- *         ---
- *         100
- *
- *   So, it's not so slow. Anyway, a better algorithm could be
- *   implemented using 2 additional arrays, with MICROGROOM_STOP_AFTER
- *   positions each, to store the indexes of the candidate buckets
- *   found with distance equal to 1 or 2 while we scan for distance 0.
- *   Those with distance 0 are zeroed immediatelly. If none with
- *   distance 0 is found, we'll zero the indexes stored in the first
- *   array. Again, if none is found in the first array, we'll try the
- *   second one. Finally, if none is found in both arrays, the loop
- *   will continue until one bucket is zeroed.
- *
- *   But now comes the question: do the numbers above justify the
- *   additional code/work? I'll try to find out the answer
- *   implementing it :), but this has low priority for now.
- *
- */
-
-
-  /* try features in their right place first */
-  max_distance = 1;
-  /* fprintf(stderr, "packstart: %ld,  packlen: %ld, max_zeroed_buckets: %ld\n",
-     packstart, packlen, microgroom_stop_after); */
-
-  /* while no bucket is zeroed...  */
-  while (zeroed_countdown == microgroom_stop_after) {
-    /*
-       fprintf(stderr, "Start: %lu, stop_after: %u, max_distance: %lu,
-       min_value: %lu\n", packstart,
-       microgroom_stop_after, max_distance, min_value);
-     */
-    i_aux = packstart;
-    while (BUCKET_IN_CHAIN(class, i_aux) && zeroed_countdown > 0) {
-      /* check if it's a candidate */
-      if ((BUCKET_VALUE(class, i_aux) == min_value) &&
-          (!BUCKET_IS_LOCKED(class, i_aux) || (groom_locked != 0))) {
-        /* if it is, check the distance */
-        right_position = HASH_INDEX(class, BUCKET_HASH(class, i_aux));
-        if (right_position <= i_aux)
-          distance = i_aux - right_position;
-        else
-          distance = NUM_BUCKETS(class) + i_aux - right_position;
-        if (distance < max_distance) {
-          MARK_IT_FREE(class, i_aux);
-          zeroed_countdown--;
-        }
+  /* mark the best candidates, starting with the first one */
+  for (i_aux = best->first, n = 0;
+       n < packlen && zeroed_countdown > 0 && BUCKET_IN_CHAIN(class, i_aux);
+       i_aux = NEXT_BUCKET(class, i_aux), n++)
+    if ((BUCKET_VALUE(class, i_aux) == best->value) &&
+        (!BUCKET_IS_LOCKED(class, i_aux) || (groom_locked != 0))) {
+      right_position = HASH_INDEX(class, BUCKET_HASH(class, i_aux));
+      if (right_position <= i_aux)
+        distance = i_aux - right_position;
+      else
+        distance = NUM_BUCKETS(class) + i_aux - right_position;
+      if (distance <= best->distance + spread) {
+        MARK_IT_FREE(class, i_aux);
+        zeroed_countdown--;
       }
-      i_aux++;
-      if (i_aux >= NUM_BUCKETS(class))
-        i_aux = 0;
     }
 
-    /*  if none was zeroed, increase the allowed distance between the */
-    /*  candidade's position and its right place. */
-    if (zeroed_countdown == microgroom_stop_after)
-      max_distance++;
-  }
-
-  /*
-     fprintf (stderr,
-     "Leaving microgroom: %ld buckets with value %ld zeroed at distance %ld\n",
-     microgroom_stop_after - zeroed_countdown, h[i].value, max_distance - 1);
-   */
-
   /* now we pack the chains */
   osbf_packchain(class, packstart, packlen);
 
   /* return the number of zeroed buckets */
-  return (microgroom_stop_after - zeroed_countdown);
+  return (class->ctx->microgroom_stop_after - zeroed_countdown);
 }
 
 /*****************************************************************/
@@ -425,6 +422,7 @@ osbf_update_bucket (CLASS_STRUCT * class, uint32_t bindex, int delta)
     {
       BUCKET_VALUE (class, bindex) = OSBF_MAX_BUCKET_VALUE;
       LOCK_BUCKET(class, bindex);
+      MARK_BUCKET_DIRTY (class, bindex);
     }
   else if (delta < 0 && BUCKET_VALUE (class, bindex) <= (uint32_t) (-delta))
     {
@@ -451,18 +449,129 @@ osbf_update_bucket (CLASS_STRUCT * class, uint32_t bindex, int delta)
     {
       BUCKET_VALUE (class, bindex) = BUCKET_VALUE (class, bindex) + delta;
       LOCK_BUCKET (class, bindex);
+      MARK_BUCKET_DIRTY (class, bindex);
     }
 }
 
 
 /*****************************************************************/
 
+/* clear all bucket flags by starting a new epoch [Note Flags] */
+void
+osbf_reset_bflags (CLASS_STRUCT * class)
+{
+  if (class->bflags_epoch >= BFLAGS_MAX_EPOCH)
+    {
+      /* wraparound: stale stamps could be mistaken for current ones */
+      memset (class->bflags, 0, NUM_BUCKETS (class) * sizeof (*class->bflags));
+      class->bflags_epoch = 0;
+    }
+  class->bflags_epoch++;
+}
+
+/*****************************************************************/
+
+/* max displacement before a chain is microgroomed */
+uint32_t
+osbf_displacement_trigger (CLASS_STRUCT * class)
+{
+  uint32_t trigger = class->ctx->microgroom_displacement_trigger;
+
+  /* if not specified, max chain len is computed for the class */
+  if (trigger == 0)
+    {
+      /* from experimental values */
+      trigger = 14.85 + 1.5E-4 * NUM_BUCKETS (class);
+      /* not less than 29 */
+      if (trigger < 29)
+	trigger = 29;
+    }
+  return trigger;
+}
+
+/* [Note Robin Hood]
+   ~~~~~~~~~~~~~~~~~
+   Linear insertion puts a new bucket at the end of its chain, so the
+   bucket inserted last pays for every collision before it.  With Robin
+   Hood insertion the new bucket walks its chain from home and takes
+   the place of the first bucket closer to its own home than the walker
+   is; the displaced bucket then walks on in the same way, and whatever
+   walker reaches the free bucket at the end of the chain stays there.
+   Displacements are spread evenly, so the longest search for a bucket
+   that is present is much shorter.
+
+   The microgroomer is triggered as before, by the distance from home to
+   the free bucket, because that is what a search for an absent bigram
+   costs, and Robin Hood insertion doesn't change it.  Triggering it by
+   the largest displacement the insertion makes instead, which is never
+   more, lets chains run into one another until the class is full.
+
+   But the pruned chains differ.  The microgroomer zeroes the buckets
+   of least count that are nearest to their homes, taking nearness for
+   age; Robin Hood insertion evens out the displacements, so few
+   buckets tie for the nearest, and each microgrooming zeroed so few
+   that it ran more than twice as often as with linear insertion, and
+   training took about twice as long.  With Robin Hood insertion the
+   microgroomer therefore also zeroes the buckets one bucket farther
+   from home than the nearest: it then runs about as often as with
+   linear insertion, and still leaves a little more training in the
+   class; see testing/robin_hood.lua.
+
+   Every bucket still lies in the chain containing its home, to the
+   right of its home: a bucket is moved only to the right, and only
+   within the chain.  Files written either way are read the same way.
+   A moved bucket takes its flags with it, because the trainer must
+   still see it as locked. */
+
+static uint32_t
+displacement_of (CLASS_STRUCT * class, uint32_t bindex)
+{
+  uint32_t right_index = HASH_INDEX (class, BUCKET_HASH (class, bindex));
+  return (bindex >= right_index) ? bindex - right_index :
+    NUM_BUCKETS (class) - (right_index - bindex);
+}
+
+static void grow_if_needed (CLASS_STRUCT * class, int crowded);
+
+static void
+robin_hood_insert (CLASS_STRUCT * class, uint32_t right_index,
+                   uint32_t bindex, const OSBF_BUCKET_STRUCT *new_bucket)
+{
+  OSBF_BUCKET_STRUCT walker = *new_bucket;
+  uint32_t walker_flags = BUCKET_LOCK_MASK;
+  uint32_t i, walker_displacement = 0;
+
+  for (i = right_index; i != bindex;
+       i = NEXT_BUCKET (class, i), walker_displacement++)
+    {
+      uint32_t d = displacement_of (class, i);
+      if (d < walker_displacement)
+        {
+          OSBF_BUCKET_STRUCT b = BUCKET (class, i);
+          uint32_t flags = BUCKET_FLAGS (class, i);
+
+          BUCKET (class, i) = walker;
+          SET_BUCKET_FLAGS (class, i, walker_flags);
+          MARK_BUCKET_DIRTY (class, i);
+          walker = b;
+          walker_flags = flags;
+          walker_displacement = d;
+        }
+    }
+  BUCKET (class, bindex) = walker;
+  SET_BUCKET_FLAGS (class, bindex, walker_flags);
+  MARK_BUCKET_DIRTY (class, bindex);
+}
+
 void
 osbf_insert_bucket (CLASS_STRUCT * class,
 		    uint32_t bindex, uint32_t hash, uint32_t key, int value)
 {
   uint32_t right_index, displacement;
-  int microgroom = 1;
+  int robin_hood = class->ctx->insertion == ROBIN_HOOD_INSERTION;
+  /* a class that can still grow does so instead of microgrooming */
+  int microgroom = !CLASS_GROWS (class)
+    || NUM_BUCKETS (class) >= class->header->max_buckets;
 
   /* "right" bucket index */
   right_index = HASH_INDEX (class, hash);
@@ -470,18 +579,8 @@ osbf_insert_bucket (CLASS_STRUCT * class,
   displacement = (bindex >= right_index) ? bindex - right_index :
     NUM_BUCKETS (class) - (right_index - bindex);
 
-  /* if not specified, max chain len is automatically specified */
-  if (microgroom_displacement_trigger == 0)
-    {
-      /* from experimental values */
-      microgroom_displacement_trigger = 14.85 + 1.5E-4 * NUM_BUCKETS (class);
-      /* not less than 29 */
-      if (microgroom_displacement_trigger < 29)
-	microgroom_displacement_trigger = 29;
-    }
-
   if (microgroom && (value > 0))
-    while (displacement > microgroom_displacement_trigger)
+    while (displacement > osbf_displacement_trigger (class))
       {
 	/*
 	 * fprintf (stderr, "hindex: %lu, bindex: %lu, displacement: %lu\n",
@@ -500,10 +599,157 @@ osbf_insert_bucket (CLASS_STRUCT * class,
    *         bindex, hash, key, displacement);
    */
 
-  BUCKET_VALUE (class, bindex) = value;
-  BUCKET_HASH (class, bindex) = hash;
-  BUCKET_KEY (class, bindex) = key;
-  LOCK_BUCKET(class, bindex);
+  if (robin_hood)
+    {
+      OSBF_BUCKET_STRUCT b;
+      b.hash1 = hash;
+      b.fingerprint = KEY_FINGERPRINT (key);
+      b.count = value > OSBF_MAX_BUCKET_VALUE ? OSBF_MAX_BUCKET_VALUE : value;
+      robin_hood_insert (class, right_index, bindex, &b);
+    }
+  else
+    {
+      BUCKET_VALUE (class, bindex) =
+        value > OSBF_MAX_BUCKET_VALUE ? OSBF_MAX_BUCKET_VALUE : value;
+      BUCKET_HASH (class, bindex) = hash;
+      BUCKET_KEY (class, bindex) = KEY_FINGERPRINT (key);
+      LOCK_BUCKET(class, bindex);
+      MARK_BUCKET_DIRTY (class, bindex);
+    }
+
+  if (CLASS_GROWS (class))
+    {
+      class->header->used_buckets++;
+      grow_if_needed (class, displacement > osbf_displacement_trigger (class));
+    }
+}
+
+/*****************************************************************/
+
+/* Growth by linear hashing [Note Growth] */
+
+/* a bucket taken out to be laid down again, with its flags, which say
+   whether the trainer has locked it */
+struct moved_bucket {
+  OSBF_BUCKET_STRUCT bucket;
+  uint32_t flags;
+};
+
+struct moved_buckets {
+  struct moved_bucket *b;       /* managed with malloc/free */
+  uint32_t n, capacity;
+};
+
+/* Takes out the chain holding bucket i, if any, appending its buckets
+   to moved and zeroing them.  Returns 0 if memory ran out or the class
+   has no free bucket, in which case nothing is taken out. */
+static int
+take_chain (CLASS_STRUCT * class, uint32_t i, struct moved_buckets *moved)
+{
+  uint32_t start, len, n;
+
+  if (!BUCKET_IN_CHAIN (class, i))
+    return 1;
+  for (start = i, n = 0; BUCKET_IN_CHAIN (class, PREV_BUCKET (class, start));
+       start = PREV_BUCKET (class, start))
+    if (++n == NUM_BUCKETS (class))
+      return 0;
+  for (len = 0, i = start; BUCKET_IN_CHAIN (class, i); i = NEXT_BUCKET (class, i))
+    len++;
+
+  if (moved->n + len > moved->capacity)
+    {
+      uint32_t capacity = 2 * (moved->n + len);
+      struct moved_bucket *b = realloc (moved->b, capacity * sizeof (*b));
+      if (b == NULL)
+        return 0;
+      moved->b = b;
+      moved->capacity = capacity;
+    }
+
+  for (i = start; len > 0; i = NEXT_BUCKET (class, i), len--)
+    {
+      struct moved_bucket *m = &moved->b[moved->n++];
+      m->bucket = BUCKET (class, i);
+      m->flags = BUCKET_FLAGS (class, i);
+      BUCKET_VALUE (class, i) = 0;
+      SET_BUCKET_FLAGS (class, i, 0);
+      MARK_BUCKET_DIRTY (class, i);
+    }
+  return 1;
+}
+
+/* lays the moved buckets down again, each at the first free bucket
+   from its right position */
+static void
+lay_down_moved (CLASS_STRUCT * class, const struct moved_buckets *moved)
+{
+  uint32_t k;
+
+  for (k = 0; k < moved->n; k++)
+    {
+      uint32_t i = HASH_INDEX (class, moved->b[k].bucket.hash1);
+      while (BUCKET_IN_CHAIN (class, i))
+        i = NEXT_BUCKET (class, i);
+      BUCKET (class, i) = moved->b[k].bucket;
+      SET_BUCKET_FLAGS (class, i, moved->b[k].flags);
+      MARK_BUCKET_DIRTY (class, i);
+    }
+}
+
+/* Splits the next home, adding one bucket.  Returns 0 if the class
+   can't grow now, because the file can't be extended or memory ran
+   out; it is then left as it was. */
+static int
+split_home (CLASS_STRUCT * class, struct moved_buckets *moved)
+{
+  OSBF_HEADER_STRUCT *header = class->header;
+  uint32_t n = header->num_buckets;
+
+  if (osbf_extend_class (class, n + 1) != 0)
+    return 0;
+
+  moved->n = 0;
+  if (!take_chain (class, n - header->base_buckets, moved)
+      || !take_chain (class, n - 1, moved))
+    {
+      lay_down_moved (class, moved);
+      return 0;
+    }
+
+  memset (&BUCKET (class, n), 0, sizeof (BUCKET (class, n)));
+  SET_BUCKET_FLAGS (class, n, 0);
+  MARK_BUCKET_DIRTY (class, n);
+  header->num_buckets = n + 1;
+  if (header->num_buckets == 2 * header->base_buckets)
+    header->base_buckets = header->num_buckets;
+
+  lay_down_moved (class, moved);
+  return 1;
+}
+
+/* A round of B splits ends within B / 4 insertions, so the homes
+   still unsplit at its end are at most a quarter fuller than at its
+   start, and no one insertion is slow. */
+#define MAX_SPLITS_PER_INSERTION 4
+
+/* splits homes while a round is on, or begins one if the class is
+   too full or crowded, a chain having grown long enough to microgroom */
+static void
+grow_if_needed (CLASS_STRUCT * class, int crowded)
+{
+  struct moved_buckets moved = { NULL, 0, 0 };
+  int splits = 0;
+
+  /* once begun, a round of splits goes on until the class has doubled */
+  while (splits++ < MAX_SPLITS_PER_INSERTION
+         && (NUM_BUCKETS (class) > class->header->base_buckets || crowded
+             || class->header->used_buckets
+                > class->ctx->growth_use * NUM_BUCKETS (class))
+         && NUM_BUCKETS (class) < class->header->max_buckets
+         && split_home (class, &moved))
+    ;
+  free (moved.b);
 }
 
 /*****************************************************************/
@@ -624,6 +870,26 @@ osbf_unlock_file (int fd, uint32_t start, uint32_t len)
 
 /*****************************************************************/
 
+/* adds delta to the count of the feature (hash, key) in class,
+   inserting or removing its bucket as needed */
+static void
+add_to_bucket (CLASS_STRUCT *class, uint32_t hash, uint32_t key, int32_t delta,
+               OSBF_HANDLER *h)
+{
+  uint32_t bindex;
+
+  if (delta == 0)
+    return;
+  bindex = osbf_find_bucket (class, hash, key);
+  if (bindex >= class->header->num_buckets)
+    osbf_raise(h, ".cfc file %s is full!",
+               class->classname == NULL ? "(name unknown)" : class->classname);
+  if (BUCKET_IN_CHAIN (class, bindex))
+    osbf_update_bucket (class, bindex, delta);
+  else if (delta > 0)
+    osbf_insert_bucket (class, bindex, hash, key, delta);
+}
+
 void
 osbf_import (CLASS_STRUCT *class_to, const CLASS_STRUCT *class_from, OSBF_HANDLER *h)
 {
@@ -639,44 +905,95 @@ osbf_import (CLASS_STRUCT *class_to, const CLASS_STRUCT *class_from, OSBF_HANDLE
                  ? "(name unknown)"
                  : class_from->classname);
 
+  if (class_to->shards != NULL || class_from->shards != NULL)
+    osbf_raise(h, "Cannot import into or from a sharded class");
+
   class_to->header->learnings       += class_from->header->learnings;
   class_to->header->extra_learnings += class_from->header->extra_learnings;
   class_to->header->classifications += class_from->header->classifications;
   class_to->header->false_negatives += class_from->header->false_negatives;
   class_to->header->false_positives += class_from->header->false_positives;
 
-  memset(class_to->bflags, 0, class_to->header->num_buckets * sizeof(unsigned char));
+  osbf_reset_bflags(class_to);
           /* make sure that the microgroomer is not confused by leftover bflags info */
 
   for (i = 0; i < class_from->header->num_buckets; i++)
-    {
-      uint32_t bindex;
+    if (class_from->buckets[i].count != 0)
+      add_to_bucket (class_to, class_from->buckets[i].hash1,
+                     FINGERPRINT_KEY (class_from->buckets[i].fingerprint),
+                     class_from->buckets[i].count, h);
+}
 
-      if (class_from->buckets[i].count == 0)
-        continue;
+/*****************************************************************/
 
-      bindex = osbf_find_bucket (class_to,
-      			   class_from->buckets[i].hash1,
-      			   class_from->buckets[i].hash2);
-      if (bindex < class_to->header->num_buckets) {
-        if (BUCKET_IN_CHAIN (class_to, bindex)) {
-          osbf_update_bucket (class_to, bindex,
-                              class_from->buckets[i].count);
-        } else {
-          osbf_insert_bucket (class_to, bindex,
-                              class_from->buckets[i].hash1,
-                              class_from->buckets[i].hash2,
-                              class_from->buckets[i].count);
-        }
-      } else {
-        osbf_raise(h, ".cfc file %s is full!",
-                   class_to->classname == NULL
-                     ? "(name unknown)"
-                     : class_to->classname);
-        return;
-      }
-    }
+/* the count of the feature in class, 0 if absent */
+static uint32_t
+feature_count (CLASS_STRUCT *class, uint32_t hash, uint32_t key)
+{
+  uint32_t bindex = osbf_find_bucket (class, hash, key);
+
+  return bindex < class->header->num_buckets && BUCKET_IN_CHAIN (class, bindex)
+    ? class->buckets[bindex].count : 0;
+}
 
+/* Adds to class_to the changes that turned class_before into
+   class_after, two images of one class taken at different times: this
+   replays on a copy of a class the trainings made on the class since
+   the copy was taken.  Buckets that are bytewise unchanged are skipped,
+   so the work is proportional to the number of buckets touched.  The
+   features of a changed bucket may have been moved rather than counted
+   (by insertions, microgrooming and growth), so each is looked up in
+   both images and only the difference of its counts is applied.  The
+   class may have grown in between, so the images may differ in size. */
+
+void
+osbf_replay (CLASS_STRUCT *class_to, CLASS_STRUCT *class_before,
+             CLASS_STRUCT *class_after, OSBF_HANDLER *h)
+{
+  static const OSBF_BUCKET_STRUCT empty = { 0, 0, 0 };
+  OSBF_HEADER_STRUCT *before, *after;
+  uint32_t i, n;
+
+  if (class_to->state == OSBF_CLOSED || class_to->usage < OSBF_WRITE_ALL)
+    osbf_raise(h, "Destination class %s is not open for full write",
+               class_to->classname == NULL ? "(name unknown)" : class_to->classname);
+  if (class_before->state == OSBF_CLOSED || class_after->state == OSBF_CLOSED)
+    osbf_raise(h, "Replay from a class that is not open");
+
+  before = class_before->header;
+  after  = class_after->header;
+
+  /* the counters advance as the class's did; unsigned subtraction is exact */
+  class_to->header->learnings       += after->learnings - before->learnings;
+  class_to->header->extra_learnings += after->extra_learnings - before->extra_learnings;
+  class_to->header->classifications += after->classifications - before->classifications;
+  class_to->header->false_negatives += after->false_negatives - before->false_negatives;
+  class_to->header->false_positives += after->false_positives - before->false_positives;
+
+  osbf_reset_bflags(class_to);
+
+  n = after->num_buckets > before->num_buckets
+    ? after->num_buckets : before->num_buckets;
+  for (i = 0; i < n; i++) {
+    const OSBF_BUCKET_STRUCT *a =
+      i < after->num_buckets ? &class_after->buckets[i] : &empty;
+    const OSBF_BUCKET_STRUCT *b =
+      i < before->num_buckets ? &class_before->buckets[i] : &empty;
+
+    if (memcmp(a, b, sizeof(*a)) == 0)
+      continue;
+    if (a->count != 0) {
+      uint32_t key = FINGERPRINT_KEY (a->fingerprint);
+      add_to_bucket (class_to, a->hash1, key,
+                     (int32_t) a->count
+                     - (int32_t) feature_count(class_before, a->hash1, key), h);
+    }
+    if (b->count != 0) {
+      uint32_t key = FINGERPRINT_KEY (b->fingerprint);
+      if (feature_count(class_after, b->hash1, key) == 0)
+        add_to_bucket (class_to, b->hash1, key, -(int32_t) b->count, h);
+    }
+  }
 }
 
 /****************************************************************/
@@ -17,6 +17,7 @@
 #include <sys/mman.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <pthread.h>
 
 #define DEBUG 0                 /* usefully 0, 1, 2, or > 2 */
 
@@ -29,17 +30,16 @@ struct token_search {
   unsigned char *ptok_max;
   uint32_t toklen;
   uint32_t hash;
-  const char *delims;
+  uint32_t delimiters[256 / 32]; /* bit set of token delimiters */
+  const OSBF_CONTEXT *ctx;      /* limits on the size of tokens */
 };
 
-#define TMPBUFFSIZE 512
-char tempbuf[TMPBUFFSIZE + 2];
-
-extern uint32_t microgroom_displacement_trigger;
-uint32_t max_token_size = OSBF_MAX_TOKEN_SIZE;
-uint32_t max_long_tokens = OSBF_MAX_LONG_TOKENS;
-uint32_t limit_token_size = 0;
-enum a_priori_options a_priori = LEARNINGS;
+/* A character is a delimiter if it is not graphic or if it is one of
+   the extra delimiters supplied by the caller.  The set is computed
+   for all 256 characters when a search is initialized, so the inner
+   loops of the tokenizer look up a bit instead of calling isgraph()
+   and strchr() on every character. */
+#define IS_DELIMITER(SET, C) (((SET)[(C) >> 5] >> ((C) & 31)) & 1)
 
 /*
  *   the hash coefficient tables should be full of relatively prime numbers,
@@ -50,8 +50,22 @@ static uint32_t hctable1[] = { 1, 3, 5, 11, 23, 47, 97, 197, 397, 797 };
 static uint32_t hctable2[] =
     { 7, 13, 29, 51, 101, 203, 407, 817, 1637, 3277 };
 
-/* constants used in the CF formula */
-double K1 = 0.25, K2 = 12, K3 = 8;
+/* settings the engine starts with [Note Contexts] */
+const OSBF_CONTEXT osbf_default_context = {
+  OSBF_MAX_TOKEN_SIZE,                  /* max_token_size */
+  OSBF_MAX_LONG_TOKENS,                 /* max_long_tokens */
+  0,                                    /* limit_token_size */
+  LEARNINGS,                            /* a_priori */
+  PRODUCT_SCORING,                      /* scoring */
+  0.25, 12, 8,                          /* K1, K2, K3 */
+  OSBF_MICROGROOM_DISPLACEMENT_TRIGGER, /* microgroom_displacement_trigger */
+  OSBF_MICROGROOM_STOP_AFTER,           /* microgroom_stop_after */
+  LINEAR_INSERTION,                     /* insertion */
+  OSBF_GROWTH_USE,                      /* growth_use */
+  0,                                    /* journal_limit */
+  0,                                    /* snapshots */
+  20                                    /* lock_timeout */
+};
 
 /* maps strings to a_priori_options enum */
 const char *a_priori_strings[] = {
@@ -62,6 +76,13 @@ const char *a_priori_strings[] = {
   NULL
 };
 
+/* maps strings to scoring_options enum */
+const char *scoring_strings[] = {
+  "PRODUCT",
+  "LOG",
+  NULL
+};
+
 /*****************************************************************/
 /* experimental code */
 #if (0)
@@ -108,31 +129,49 @@ static double conf_factor(uint32_t n, uint32_t k, double interval)
 
 /*****************************************************************/
 
+static void init_token_search(struct token_search *pts,
+                              const unsigned char *p_text,
+                              unsigned long text_len,
+                              const char *delims,
+                              const OSBF_CONTEXT *ctx)
+{
+  unsigned c;
+
+  pts->ptok = (unsigned char *) p_text;
+  pts->ptok_max = (unsigned char *) (p_text + text_len);
+  pts->toklen = 0;
+  pts->hash = 0;
+  pts->ctx = ctx;
+
+  /* strchr() finds the terminating NUL, so '\0' is always a delimiter */
+  memset(pts->delimiters, 0, sizeof(pts->delimiters));
+  for (c = 0; c < 256; c++)
+    if (!isgraph((int) c) || strchr(delims, (int) c))
+      pts->delimiters[c >> 5] |= (uint32_t) 1 << (c & 31);
+}
+
+/*****************************************************************/
+
 static unsigned char *get_next_token(unsigned char *p_text,
                                      unsigned char *max_p,
-                                     const char *delims,
+                                     const uint32_t *delimiters,
+                                     uint32_t max_len, /* 0 for no limit */
                                      uint32_t * p_toklen)
 {
   unsigned char *p_ini;         /* will be set to start of the next token */
   unsigned char *lim;           /* place beyond which we must not look;
-                                   normally max_p unless limit_token_size != 0 */
+                                   normally max_p unless max_len != 0 */
 
-#if 0
-  /* this code is in the inner loop, and we guarantee delims != NULL elsewhere */
-  if (delims == NULL)
-    return NULL;
-#endif
-
-#define DELIMP(P) (!isgraph((int) *(P)) || strchr (delims, (int) *(P)))
+#define DELIMP(P) IS_DELIMITER(delimiters, *(P))
 
   /* find nongraph delimited token */
   while (p_text < max_p && DELIMP(p_text))
     p_text++;
   p_ini = p_text;
 
-  if (limit_token_size) {
-    /* limit the tokens to max_token_size */
-    lim = p_ini + max_token_size;
+  if (max_len) {
+    /* limit the tokens to max_len */
+    lim = p_ini + max_len;
     if (lim > max_p)
       lim = max_p;
   } else {
@@ -148,9 +187,8 @@ static unsigned char *get_next_token(unsigned char *p_text,
     while (i < *p_toklen)
       fputc(p_ini[i++], stderr);
     fprintf(stderr, " - toklen: %" PRIu32
-            ", max_token_len: %" PRIu32
-            ", max_long_tokens: %" PRIu32 "\n",
-            *p_toklen, max_token_size, max_long_tokens);
+            ", max_len: %" PRIu32 "\n",
+            *p_toklen, max_len);
   }
 
 
@@ -161,18 +199,20 @@ static unsigned char *get_next_token(unsigned char *p_text,
 
 static uint32_t get_next_hash(struct token_search *pts)
 {
+  const OSBF_CONTEXT *ctx = pts->ctx;
+  uint32_t max_len = ctx->limit_token_size ? ctx->max_token_size : 0;
   uint32_t hash_acc = 0;
   uint32_t count_long_tokens = 0;
   int error = 0;
 
   pts->ptok += pts->toklen;
   pts->ptok = get_next_token(pts->ptok, pts->ptok_max,
-                             pts->delims, &(pts->toklen));
+                             pts->delimiters, max_len, &(pts->toklen));
 
 #ifdef OSBF_MAX_TOKEN_SIZE
   /* long tokens, probably encoded lines */
-  while (pts->toklen >= max_token_size
-         && count_long_tokens < max_long_tokens) {
+  while (pts->toklen >= ctx->max_token_size
+         && count_long_tokens < ctx->max_long_tokens) {
     count_long_tokens++;
     /* XOR new hash with previous one */
     hash_acc ^= strnhash(pts->ptok, pts->toklen);
@@ -180,7 +220,7 @@ static uint32_t get_next_hash(struct token_search *pts)
     /* advance the pointer and get next token */
     pts->ptok += pts->toklen;
     pts->ptok = get_next_token(pts->ptok, pts->ptok_max,
-                               pts->delims, &(pts->toklen));
+                               pts->delimiters, max_len, &(pts->toklen));
   }
 
 
@@ -199,79 +239,98 @@ static uint32_t get_next_hash(struct token_search *pts)
   return (error);
 }
 
-/******************************************************************/
-/* Train the specified class with the text pointed to by "p_text" */
-/******************************************************************/
-void osbf_bayes_train(const unsigned char *p_text,      /* pointer to text */
-                      unsigned long text_len,   /* length of text */
-                      const char *delims,       /* token delimiters */
-                      CLASS_STRUCT * class,     /* database to be trained */
-                      int sense,        /* 1 => learn;  -1 => unlearn */
-                      enum learn_flags flags,   /* flags */
-                      OSBF_HANDLER * h) {
-  uint32_t window_idx;
-  int32_t learn_error;
-  int32_t i;
-  uint32_t hashpipe[OSB_BAYES_WINDOW_LEN + 1]; 
-     // words in smaller positions are more recent in the text,
-     // i.e., hashpipe[0] appears to the *right* of hashpipe[1]
-   
-
-  /* on 5000 msgs from trec06, average number of tokens (including
-     sentinels at ends) is 150; 2/3 of msgs are under 150; 80% are
-     under 200; 90% are under 300.  99% are under 1000.  So if one
-     were to make a copy rather than pipelining, 200 would seem to
-     be a good starting length */
-
-  int32_t num_hash_paddings;
-  int microgroom;
-  struct token_search ts;
+/*****************************************************************/
 
-  /* fprintf(stderr, "Starting learning...\n"); */
+/* The trainer and the classifier consume a stream of features.  The
+   features come either from a text, which is tokenized as they are
+   consumed, or from a vector computed earlier by osbf_extract_features(),
+   so that a text classified and trained several times is tokenized only
+   once.  Either way the stream is the same. */
+
+struct feature_source {
+  const OSBF_FEATURE_VECTOR *fv; /* if not NULL, features come from here */
+  uint32_t next;                 /* index of the next feature in fv */
+  uint32_t limit;                /* number of features of fv to be used */
+  uint32_t num_shards, shard;    /* if num_shards > 1, only the features
+                                    of fv in that shard [Note Shards] */
+  struct token_search ts;        /* otherwise they come from the text */
+  uint32_t hashpipe[OSB_BAYES_WINDOW_LEN];
+     /* words in smaller positions are more recent in the text,
+        i.e., hashpipe[0] appears to the *right* of hashpipe[1] */
+  uint32_t window_idx;           /* window index of the next feature */
+  int32_t num_hash_paddings;     /* fake tokens still to come after eof */
+  int padding;                   /* nonzero once fake tokens are used */
+};
 
-  osbf_raise_unless(delims != NULL, h,
-                    "NULL delimiters; use empty string instead");
+static void text_feature_source(struct feature_source *src,
+                                const unsigned char *p_text,
+                                unsigned long text_len,
+                                const char *delims,
+                                int32_t num_hash_paddings,
+                                const OSBF_CONTEXT *ctx)
+{
+  int i;
 
-  ts.ptok = (unsigned char *) p_text;
-  ts.ptok_max = (unsigned char *) (p_text + text_len);
-  ts.toklen = 0;
-  ts.hash = 0;
-  ts.delims = delims;
+  src->fv = NULL;
+  init_token_search(&src->ts, p_text, text_len, delims, ctx);
+  /*   init the hashpipe with 0xDEADBEEF  */
+  for (i = 0; i < OSB_BAYES_WINDOW_LEN; i++)
+    src->hashpipe[i] = 0xDEADBEEF;
+  src->window_idx = OSB_BAYES_WINDOW_LEN;  /* must shift a token in */
+  src->num_hash_paddings = num_hash_paddings;
+  src->padding = 0;
+}
 
-  if (class->state == OSBF_CLOSED)
-    osbf_raise(h, "Trying to train a closed class\n");
-  if (class->usage != OSBF_WRITE_ALL)
-    osbf_raise(h, "Trying to train class %s without opening for write",
-               class->classname);
+static void vector_feature_source(struct feature_source *src,
+                                  const OSBF_FEATURE_VECTOR *fv,
+                                  uint32_t limit)
+{
+  src->fv = fv;
+  src->next = 0;
+  src->limit = limit;
+  src->num_shards = 1;
+  src->shard = 0;
+  src->padding = 0;
+}
 
-  microgroom = (flags & NO_MICROGROOM) == 0;
-  (void) microgroom; // not sure why unused
-  memset(class->bflags, 0,
-         class->header->num_buckets * sizeof(unsigned char));
+/* Stores the next feature of the stream in *f and returns 1, or
+   returns 0 if the stream is exhausted. */
+static int next_feature(struct feature_source *src, OSBF_FEATURE *f)
+{
+  uint32_t *hashpipe = src->hashpipe;
+  uint32_t window_idx;
+  int i;
 
-  /*   init the hashpipe with 0xDEADBEEF  */
-  for (i = 0; i < OSB_BAYES_WINDOW_LEN; i++)
-    hashpipe[i] = 0xDEADBEEF;
+  if (src->fv != NULL) {
+    while (src->next < src->limit) {
+      *f = src->fv->features[src->next++];
+      if (src->num_shards <= 1 || f->h2 % src->num_shards == src->shard)
+        return 1;
+    }
+    return 0;
+  }
 
-  learn_error = 0;
-  /* experimental code - set num_hash_paddings = 0 to disable */
-  /* num_hash_paddings = OSB_BAYES_WINDOW_LEN - 1; */
-  num_hash_paddings = OSB_BAYES_WINDOW_LEN - 1;
-  while (learn_error == 0 && ts.ptok <= ts.ptok_max) {
+  if (src->window_idx == OSB_BAYES_WINDOW_LEN) {
+    struct token_search *ts = &src->ts;
 
-    if (get_next_hash(&ts) != 0) {
+    if (ts->ptok > ts->ptok_max)
+      return 0;
+    if (get_next_hash(ts) != 0) {
       /* after eof, insert fake tokens until the last real */
       /* token comes out at the other end of the hashpipe */
-      if (num_hash_paddings-- > 0)
-        ts.hash = 0xDEADBEEF;
-      else
-        break;
+      if (src->num_hash_paddings-- > 0) {
+        ts->hash = 0xDEADBEEF;
+        src->padding = 1;
+      } else {
+        return 0;
+      }
     }
 
     /*  Shift the hash pipe down one and insert new hash */
     for (i = OSB_BAYES_WINDOW_LEN - 1; i > 0; i--)
       hashpipe[i] = hashpipe[i - 1];
-    hashpipe[0] = ts.hash;
+    hashpipe[0] = ts->hash;
+    src->window_idx = 1;
 
     if (DEBUG > 2) {
       int h;
@@ -280,134 +339,543 @@ void osbf_bayes_train(const unsigned char *p_text,      /* pointer to text */
         fprintf(stderr, " %" PRIu32, hashpipe[h]);
       fprintf(stderr, "\n");
     }
+  }
 
-    {
-      uint32_t hindex, bindex;
-      uint32_t h1, h2;
-
-      for (window_idx = 1; window_idx < OSB_BAYES_WINDOW_LEN; window_idx++) {
-
-        h1 = hashpipe[0] * hctable1[0] +
-            hashpipe[window_idx] * hctable1[window_idx];
-        h2 = hashpipe[0] * hctable2[0] +
-            hashpipe[window_idx] * hctable2[H2_COMPAT_INDEX(window_idx)];
-        hindex = h1 % class->header->num_buckets;
-        (void) hindex; // not sure why this is unused
-
-        if (DEBUG > 2)
-          fprintf(stderr,
-                  "Polynomial %" PRIu32 " has h1:%" PRIu32 "  h2: %"
-                  PRIu32 "\n", window_idx, h1, h2);
-
-        bindex = FAST_FIND_BUCKET(class, h1, h2);
-        if (bindex < class->header->num_buckets) {
-          if (BUCKET_IN_CHAIN(class, bindex)) {
-            if (!BUCKET_IS_LOCKED(class, bindex))
-              osbf_update_bucket(class, bindex, sense);
-          } else if (sense > 0) {
-            osbf_insert_bucket(class, bindex, h1, h2, sense);
-          }
-        } else {
-          char errmsg[100];
-          snprintf(errmsg, sizeof(errmsg), ".cfc file %s is full!",
-                   class->classname);
-          osbf_close_class(class, h);
-          osbf_raise(h, "%s", errmsg);
-          return;
-        }
+  window_idx = src->window_idx++;
+  f->h1 = hashpipe[0] * hctable1[0] +
+      hashpipe[window_idx] * hctable1[window_idx];
+  f->h2 = hashpipe[0] * hctable2[0] +
+      hashpipe[window_idx] * hctable2[H2_COMPAT_INDEX(window_idx)];
+  f->window_idx = window_idx;
+
+  if (DEBUG > 2)
+    fprintf(stderr,
+            "Polynomial %" PRIu32 " has h1:%" PRIu32 "  h2: %"
+            PRIu32 "\n", window_idx, f->h1, f->h2);
+  return 1;
+}
+
+/*****************************************************************/
+
+void osbf_extract_features(const unsigned char *p_text,
+                           unsigned long text_len,
+                           const char *delims,
+                           OSBF_FEATURE_VECTOR *fv,
+                           const OSBF_CONTEXT *ctx,
+                           OSBF_HANDLER *h)
+{
+  struct feature_source src;
+  OSBF_FEATURE f;
+
+  osbf_raise_unless(delims != NULL, h,
+                    "NULL delimiters; use empty string instead");
+
+  text_feature_source(&src, p_text, text_len, delims,
+                      OSB_BAYES_WINDOW_LEN - 1, ctx);
+  fv->text_len = text_len;
+  fv->num_features = fv->num_train_features = 0;
+  while (next_feature(&src, &f)) {
+    if (fv->num_train_features == fv->capacity) {
+      /* a token takes about six characters and yields four features */
+      uint32_t capacity = fv->capacity > 0 ? 2 * fv->capacity
+                                            : text_len / 2 + 4 * OSB_BAYES_WINDOW_LEN;
+      OSBF_FEATURE *features = realloc(fv->features,
+                                       capacity * sizeof(*features));
+      osbf_raise_unless(features != NULL, h,
+                        "Could not allocate memory for %" PRIu32 " features",
+                        capacity);
+      fv->features = features;
+      fv->capacity = capacity;
+    }
+    fv->features[fv->num_train_features++] = f;
+    if (!src.padding)
+      fv->num_features = fv->num_train_features;
+  }
+}
+
+void osbf_free_features(OSBF_FEATURE_VECTOR *fv)
+{
+  free(fv->features);
+  fv->features = NULL;
+  fv->capacity = fv->num_features = fv->num_train_features = 0;
+}
+
+/*****************************************************************/
+
+/* In a large database almost every bucket lookup misses the cache, and
+   the classifier used to wait for each miss in turn.  Instead, the
+   classifier reads features LOOKAHEAD positions ahead of the one it
+   scores, computes their home indexes in every class, and prefetches
+   those buckets, so that by the time a feature is scored its buckets
+   are usually in the cache and many misses are in flight at once. */
+
+#define LOOKAHEAD 16            /* must be a power of 2 */
+
+struct lookahead {
+  OSBF_FEATURE features[LOOKAHEAD];
+  uint32_t homes[LOOKAHEAD][OSBF_MAX_CLASSES];  /* home index per class */
+  unsigned first;               /* index of the oldest feature */
+  unsigned count;               /* number of features read ahead */
+  int eof;                      /* nonzero if the stream is exhausted */
+};
+
+static void init_lookahead(struct lookahead *la)
+{
+  la->first = la->count = 0;
+  la->eof = 0;
+}
+
+/* Stores the next feature of the stream in *f and the home indexes of
+   its buckets in homes, and returns 1, or returns 0 if the stream is
+   exhausted. */
+static int next_feature_ahead(struct feature_source *src,
+                              struct lookahead *la,
+                              CLASS_STRUCT *classes[], unsigned num_classes,
+                              OSBF_FEATURE *f, uint32_t *homes)
+{
+  unsigned i, ci;
+
+  while (!la->eof && la->count < LOOKAHEAD) {
+    i = (la->first + la->count) & (LOOKAHEAD - 1);
+    if (next_feature(src, &la->features[i])) {
+      for (ci = 0; ci < num_classes; ci++) {
+        CLASS_STRUCT *class = SHARD_OF(classes[ci], la->features[i].h2);
+        uint32_t home = HASH_INDEX(class, la->features[i].h1);
+        la->homes[i][ci] = home;
+        PREFETCH_BUCKET(class, home);
+      }
+      la->count++;
+    } else {
+      la->eof = 1;
+    }
+  }
+
+  if (la->count == 0)
+    return 0;
+  i = la->first;
+  *f = la->features[i];
+  memcpy(homes, la->homes[i], num_classes * sizeof(*homes));
+  la->first = (i + 1) & (LOOKAHEAD - 1);
+  la->count--;
+  return 1;
+}
+
+/******************************************************************/
+/* Update the buckets of the specified class with the features in  */
+/* the stream "src"                                                 */
+/******************************************************************/
+static void train_buckets(struct feature_source *src,
+                          CLASS_STRUCT * class,   /* database to be trained */
+                          int sense,      /* 1 => learn;  -1 => unlearn */
+                          enum learn_flags flags, /* flags */
+                          OSBF_HANDLER * h) {
+
+  /* on 5000 msgs from trec06, average number of tokens (including
+     sentinels at ends) is 150; 2/3 of msgs are under 150; 80% are
+     under 200; 90% are under 300.  99% are under 1000.  So if one
+     were to make a copy rather than pipelining, 200 would seem to
+     be a good starting length */
+
+  int microgroom;
+  OSBF_FEATURE f;
+
+  /* fprintf(stderr, "Starting learning...\n"); */
+
+  if (class->state == OSBF_CLOSED)
+    osbf_raise(h, "Trying to train a closed class\n");
+  if (class->usage != OSBF_WRITE_ALL)
+    osbf_raise(h, "Trying to train class %s without opening for write",
+               class->classname);
+
+  microgroom = (flags & NO_MICROGROOM) == 0;
+  (void) microgroom; // not sure why unused
+  osbf_reset_bflags(class);
+
+  while (next_feature(src, &f)) {
+    uint32_t bindex;
+
+    bindex = FAST_FIND_BUCKET(class, f.h1, f.h2);
+    if (bindex < class->header->num_buckets) {
+      if (BUCKET_IN_CHAIN(class, bindex)) {
+        if (!BUCKET_IS_LOCKED(class, bindex))
+          osbf_update_bucket(class, bindex, sense);
+      } else if (sense > 0) {
+        osbf_insert_bucket(class, bindex, f.h1, f.h2, sense);
       }
+    } else {
+      char errmsg[100];
+      snprintf(errmsg, sizeof(errmsg), ".cfc file %s is full!",
+               class->classname);
+      osbf_close_class(class, h);
+      osbf_raise(h, "%s", errmsg);
+      return;
     }
-  }                             /*   end the while k==0 */
+  }
 
+  if (0) {
+    unsigned n = 40;
+    unsigned j;
+    fprintf(stderr, "### %u nonzero buckets after training =", n);
+    for (j = 0; j < NUM_BUCKETS(class); j++)
+      if (BUCKET_IN_CHAIN(class, j)) {
+        fprintf(stderr, " %u", j);
+        if (--n == 0)
+          break;
+      }
+    fprintf(stderr, "\n");
+  }
+}
 
+/* Update the counters in a header for one training */
+static void count_training(OSBF_HEADER_STRUCT *header, int sense,
+                           enum learn_flags flags) {
   if (sense > 0) {
     /* extra learnings are all those done with the  */
     /* same document, after the first learning */
     if (flags & EXTRA_LEARNING) {
       /* increment extra learnings counter */
-      class->header->extra_learnings += 1;
+      header->extra_learnings += 1;
     } else {
       /* increment normal learnings counter */
 
       /* old code disabled because the databases are disjoint and
          this correction should be applied to both simultaneously
 
-         class->header->learnings += 1;
-         if (class->header->learnings >= OSBF_MAX_BUCKET_VALUE)
+         header->learnings += 1;
+         if (header->learnings >= OSBF_MAX_BUCKET_VALUE)
          {
          uint32_t i;
 
-         class->header->learnings >>= 1;
+         header->learnings >>= 1;
          for (i = 0; i < NUM_BUCKETS (class); i++)
          BUCKET_VALUE (class, i) = BUCKET_VALUE (class, i) >> 1;
          }
        */
 
-      if (class->header->learnings < OSBF_MAX_BUCKET_VALUE) {
-        class->header->learnings += 1;
+      if (header->learnings < OSBF_MAX_BUCKET_VALUE) {
+        header->learnings += 1;
       }
 
       /* increment false negative counter */
       if (flags & FALSE_NEGATIVE) {
-        class->header->false_negatives += 1;
+        header->false_negatives += 1;
       }
     }
   } else {
     if (flags & EXTRA_LEARNING) {
       /* decrement extra learnings counter */
-      if (class->header->extra_learnings > 0)
-        class->header->extra_learnings -= 1;
+      if (header->extra_learnings > 0)
+        header->extra_learnings -= 1;
     } else {
       /* decrement learnings counter */
-      if (class->header->learnings > 0)
-        class->header->learnings -= 1;
+      if (header->learnings > 0)
+        header->learnings -= 1;
       /* decrement false negative counter */
-      if ((flags & FALSE_NEGATIVE) && class->header->false_negatives > 0)
-        class->header->false_negatives -= 1;
+      if ((flags & FALSE_NEGATIVE) && header->false_negatives > 0)
+        header->false_negatives -= 1;
     }
   }
+}
 
-  if (0) {
-    unsigned n = 40;
-    unsigned j;
-    fprintf(stderr, "### %u nonzero buckets after training =", n);
-    for (j = 0; j < NUM_BUCKETS(class); j++)
-      if (BUCKET_IN_CHAIN(class, j)) {
-        fprintf(stderr, " %u", j);
-        if (--n == 0)
-          break;
+/* Train a sharded class [Note Shards]: each shard the features touch
+   is trained on its own, in order, with the features that fall in it.
+   The features are filtered rather than sorted into a copy: a shard
+   that fails to open or to train raises, and would leak the copy. */
+static void train_shards(const OSBF_FEATURE_VECTOR *fv,
+                         CLASS_STRUCT * class,
+                         int sense,
+                         enum learn_flags flags,
+                         OSBF_HANDLER * h) {
+  uint32_t n = class->num_shards, i, k;
+  struct feature_source src;
+  CLASS_STRUCT shard;
+
+  if (class->state == OSBF_CLOSED)
+    osbf_raise(h, "Trying to train a closed class\n");
+  if (class->usage != OSBF_WRITE_ALL)
+    osbf_raise(h, "Trying to train class %s without opening for write",
+               class->classname);
+
+  for (k = 0; k < n; k++) {
+    for (i = 0; i < fv->num_train_features && fv->features[i].h2 % n != k; i++)
+      ;
+    if (i == fv->num_train_features)
+      continue;
+    osbf_open_shard(class, k, OSBF_WRITE_ALL, &shard, h);
+    class->lock_wait += shard.lock_wait;
+    vector_feature_source(&src, fv, fv->num_train_features);
+    src.next = i;
+    src.num_shards = n;
+    src.shard = k;
+    train_buckets(&src, &shard, sense, flags, h);
+    class->microgrooms += shard.microgrooms;
+    osbf_close_class(&shard, h);
+    osbf_refresh_shard(class, k, h);
+  }
+
+  osbf_open_shard(class, 0, OSBF_WRITE_HEADER, &shard, h);
+  class->lock_wait += shard.lock_wait;
+  count_training(shard.header, sense, flags);
+  osbf_close_class(&shard, h);
+  osbf_refresh_shard(class, 0, h);
+}
+
+static void bayes_train(struct feature_source *src,
+                        CLASS_STRUCT * class,     /* database to be trained */
+                        int sense,        /* 1 => learn;  -1 => unlearn */
+                        enum learn_flags flags,   /* flags */
+                        OSBF_HANDLER * h) {
+  train_buckets(src, class, sense, flags, h);
+  count_training(class->header, sense, flags);
+}
+
+void osbf_bayes_train(const unsigned char *p_text,      /* pointer to text */
+                      unsigned long text_len,   /* length of text */
+                      const char *delims,       /* token delimiters */
+                      CLASS_STRUCT * class,     /* database to be trained */
+                      int sense,        /* 1 => learn;  -1 => unlearn */
+                      enum learn_flags flags,   /* flags */
+                      const OSBF_CONTEXT *ctx,  /* how to tokenize */
+                      OSBF_HANDLER * h) {
+  struct feature_source src;
+
+  osbf_raise_unless(delims != NULL, h,
+                    "NULL delimiters; use empty string instead");
+
+  if (class->shards != NULL) {
+    /* the class keeps the features and frees them on close */
+    osbf_extract_features(p_text, text_len, delims, &class->features, ctx, h);
+    train_shards(&class->features, class, sense, flags, h);
+    return;
+  }
+
+  /* experimental code - set num_hash_paddings = 0 to disable */
+  text_feature_source(&src, p_text, text_len, delims,
+                      OSB_BAYES_WINDOW_LEN - 1, ctx);
+  bayes_train(&src, class, sense, flags, h);
+}
+
+void osbf_bayes_train_features(const OSBF_FEATURE_VECTOR *fv,
+                               CLASS_STRUCT * class,
+                               int sense,
+                               enum learn_flags flags,
+                               OSBF_HANDLER * h) {
+  struct feature_source src;
+
+  if (class->shards != NULL) {
+    train_shards(fv, class, sense, flags, h);
+    return;
+  }
+  vector_feature_source(&src, fv, fv->num_train_features);
+  bayes_train(&src, class, sense, flags, h);
+}
+
+/* [Note Threads]
+   ~~~~~~~~~~~~~~~
+   A classification only reads its classes: the per-class counts it
+   accumulates live in a 'struct class_score' on its own stack, and the
+   features already seen in the message are kept in a private set
+   rather than in the bucket flags.  So any number of classifications
+   may run at once against the same open classes, as long as nothing
+   trains, imports, or closes those classes meanwhile.  The settings
+   come from a context that the classification only reads [Note
+   Contexts], so classifications with different settings may run at
+   once too.  Because the
+   error handler unwinds with longjmp, which cannot cross threads,
+   everything that may raise is checked by classify_prepare() before
+   classify_core() runs; the core reports its only possible failure,
+   running out of memory, by returning nonzero. */
+
+/* [Note Log scoring]
+   ~~~~~~~~~~~~~~~~~~~~
+   The PRODUCT engine multiplies each class probability by the adjusted
+   P(F|C) of every significant feature, clamps it at OSBF_SMALLP, and
+   renormalizes, which costs a division per class per feature.  The LOG
+   engine instead adds log P(F|C) to a sum per class and normalizes once
+   at the end, subtracting the largest sum before exponentiating so
+   that nothing underflows until the final probabilities are tiny.
+   Without the clamping of intermediate products, a class that falls
+   far behind stays behind; so the engines agree on all but extreme
+   messages, where LOG gives larger |pR|.  testing/scoring_agreement.lua
+   measures the difference. */
+
+struct class_score {
+  uint32_t learnings;
+  double hits;
+  uint32_t totalhits;
+  uint32_t uniquefeatures;
+  uint32_t missedfeatures;
+};
+
+/* [Note CF memo]
+   ~~~~~~~~~~~~~~~~
+   The confidence factor of a feature depends only on the hits of the
+   classes with min and max local probability, on which classes those
+   are, and on the window index; everything else in the formula is
+   fixed for the whole classification.  Hits are small integers, and
+   most features of a message share a few combinations of them, so
+   each classification keeps a direct-mapped memo of the factors it has
+   computed and calls pow() only on a miss.  The memo lives on the
+   stack and is cleared per call, so it never outlives a change to the
+   databases or to K1, K2, K3, and the factors are the same bits the
+   formula gives. */
+
+#define CF_MEMO_SIZE 256        /* must be a power of 2 */
+
+/* Packs the arguments of the factor into a key, which is never 0
+   because window_idx > 0.  Hits above OSBF_MAX_BUCKET_VALUE, which
+   only a damaged database has, are not memoized. */
+#define CF_MEMO_KEY(HMIN, HMAX, IMIN, IMAX, W)                      \
+  ((HMIN) > OSBF_MAX_BUCKET_VALUE || (HMAX) > OSBF_MAX_BUCKET_VALUE \
+   ? 0                                                              \
+   : (uint64_t) (HMIN) | (uint64_t) (HMAX) << 16                    \
+     | (uint64_t) (IMIN) << 32 | (uint64_t) (IMAX) << 40            \
+     | (uint64_t) (W) << 48)
+#define CF_MEMO_SLOT(KEY) \
+  ((uint32_t) (((KEY) * 0x9E3779B97F4A7C15u) >> 56) & (CF_MEMO_SIZE - 1))
+
+struct cf_memo {
+  uint64_t key;                 /* 0 marks an empty entry */
+  double cf;
+};
+
+/* Set of the features seen in a message, open addressing on (h1, h2).
+   Most messages fit in the slots on the stack. */
+
+#define SEEN_INITIAL_SLOTS 1024 /* must be a power of 2 */
+
+struct seen_set {
+  uint64_t *keys;               /* slots; 0 marks an empty slot */
+  uint32_t mask;                /* number of slots - 1 */
+  uint32_t count;               /* number of keys, not counting 0 */
+  int has_zero;                 /* nonzero if the key 0 is in the set */
+  uint64_t initial[SEEN_INITIAL_SLOTS];
+};
+
+#define SEEN_KEY(F) (((uint64_t) (F).h1 << 32) | (F).h2)
+#define SEEN_SLOT(S, KEY) \
+  ((uint32_t) ((KEY) ^ ((KEY) >> 32) * 0x9E3779B1u) & (S)->mask)
+
+static void seen_init(struct seen_set *s)
+{
+  memset(s->initial, 0, sizeof(s->initial));
+  s->keys = s->initial;
+  s->mask = SEEN_INITIAL_SLOTS - 1;
+  s->count = 0;
+  s->has_zero = 0;
+}
+
+static void seen_free(struct seen_set *s)
+{
+  if (s->keys != s->initial)
+    free(s->keys);
+}
+
+static int seen_contains(const struct seen_set *s, uint64_t key)
+{
+  uint32_t i;
+
+  if (key == 0)
+    return s->has_zero;
+  for (i = SEEN_SLOT(s, key); s->keys[i] != 0; i = (i + 1) & s->mask)
+    if (s->keys[i] == key)
+      return 1;
+  return 0;
+}
+
+/* Adds a key known not to be in the set; returns nonzero if out of memory */
+static int seen_insert(struct seen_set *s, uint64_t key)
+{
+  uint32_t i;
+
+  if (key == 0) {
+    s->has_zero = 1;
+    return 0;
+  }
+  if (2 * (s->count + 1) > s->mask) {
+    /* keep the load under 1/2 */
+    uint64_t *old = s->keys;
+    uint32_t j, old_mask = s->mask;
+
+    s->keys = calloc(2 * (old_mask + 1), sizeof(*s->keys));
+    if (s->keys == NULL) {
+      s->keys = old;
+      return -1;
+    }
+    s->mask = 2 * old_mask + 1;
+    for (j = 0; j <= old_mask; j++)
+      if (old[j] != 0) {
+        for (i = SEEN_SLOT(s, old[j]); s->keys[i] != 0; i = (i + 1) & s->mask)
+          ;
+        s->keys[i] = old[j];
       }
-    fprintf(stderr, "\n");
+    if (old != s->initial)
+      free(old);
   }
+  for (i = SEEN_SLOT(s, key); s->keys[i] != 0; i = (i + 1) & s->mask)
+    ;
+  s->keys[i] = key;
+  s->count++;
+  return 0;
+}
 
+/* raises unless the classes and the settings allow a classification */
+static void classify_prepare(CLASS_STRUCT * classes[], unsigned num_classes,
+                             uint32_t flags, const OSBF_CONTEXT *ctx,
+                             OSBF_HANDLER * h)
+{
+  unsigned ci;
 
+  osbf_raise_unless((flags & COUNT_CLASSIFICATIONS) == 0, h,
+                    "Asked to count classifications, but this must now be "
+                    "done as a separate operation");
+  osbf_raise_unless(num_classes > 0, h,
+                    "At least one class must be given.");
+  osbf_raise_unless(num_classes <= OSBF_MAX_CLASSES, h,
+                    "At most %d classes may be given.", OSBF_MAX_CLASSES);
+  osbf_raise_unless(ctx->a_priori < A_PRIORI_UPPER_LIMIT, h,
+                    "Given a-priori option (%d) is out of range [%d, %d]",
+                    ctx->a_priori, 0, A_PRIORI_UPPER_LIMIT - 1);
+  osbf_raise_unless(ctx->scoring < SCORING_UPPER_LIMIT, h,
+                    "Given scoring option (%d) is out of range [%d, %d]",
+                    ctx->scoring, 0, SCORING_UPPER_LIMIT - 1);
+
+  for (ci = 0; ci < num_classes; ci++) {
+    CLASS_STRUCT *class = classes[ci];
+    osbf_raise_unless(class->state != OSBF_CLOSED, h,
+                      "class number %d is closed", (int) ci);
+    if (ctx->a_priori == INSTANCES)
+      osbf_raise_unless(class->header->db_version >= OSBF_DB_FP_FN_VERSION, h,
+                        "Database version %" PRIu32 " doesn't support "
+                        "'INSTANCES' for a priori estimation. "
+                        "Try 'CLASSIFICATIONS' instead.",
+                        class->header->db_version);
+  }
 }
 
 /**********************************************************/
-/* Given the text pointed to by "p_text", for each class  */
+/* Given the features in the stream "src", for each class */
 /* in the array "classes", find the probability that the  */
-/* text belongs to that class                             */
+/* text belongs to that class.  Returns nonzero if out of */
+/* memory.  The classes must have passed classify_prepare */
 /**********************************************************/
-void osbf_bayes_classify(const unsigned char *p_text,   /* pointer to text */
-                         unsigned long text_len,        /* length of text */
-                         const char *delims,    /* token delimiters */
+static int classify_core(struct feature_source *src,
                          CLASS_STRUCT * classes[],      /* hash file names */
                          unsigned num_classes, uint32_t flags,  /* flags */
                          double min_pmax_pmin_ratio,
                          /* returned values */
                          double ptc[],  /* class probs */
-                         uint32_t ptt[],        /* number trainings per class */
-                         OSBF_HANDLER * h       /* error handler */
+                         uint32_t ptt[], /* number trainings per class */
+                         const OSBF_CONTEXT *ctx
     )
 {
   int32_t window_idx;
   unsigned class_idx;
   CLASS_STRUCT **class_lim = classes + num_classes;
   CLASS_STRUCT **pclass;
-  int32_t i;                    /* we use i for our hashpipe counter, as needed. */
+  struct class_score scores[OSBF_MAX_CLASSES];
 
   double renorm = 0.0;
-  uint32_t hashpipe[OSB_BAYES_WINDOW_LEN + 1];
 
   double zero_knowledge_prob;   /* inverse of the number of classes: 1/num_classes */
   uint32_t total_learnings = 0;
@@ -421,65 +889,48 @@ void osbf_bayes_classify(const unsigned char *p_text,   /* pointer to text */
   double confidence_factor;
   double a_priori_counter[OSBF_MAX_CLASSES];
   double total_a_priori;
+  /* with LOG_SCORING, log of the unnormalized probability of each class */
+  double log_ptc[OSBF_MAX_CLASSES];
+  enum scoring_options engine = ctx->scoring;
 
-  struct token_search ts;
-
-  osbf_raise_unless((flags & COUNT_CLASSIFICATIONS) == 0, h,
-                    "Asked to count classifications, but this must now be "
-                    "done as a separate operation");
-
-  osbf_raise_unless(delims != NULL, h,
-                    "NULL delimiters; use empty string instead");
-
-  ts.ptok = (unsigned char *) p_text;
-  ts.ptok_max = (unsigned char *) (p_text + text_len);
-  ts.toklen = 0;
-  ts.hash = 0;
-  ts.delims = delims;
+  OSBF_FEATURE f;
+  uint32_t homes[OSBF_MAX_CLASSES];  /* home indexes of f in each class */
+  struct lookahead la;
+  struct seen_set seen;         /* features already seen in the text */
+  struct cf_memo cf_memo[CF_MEMO_SIZE];
 
   /* fprintf(stderr, "Starting classification...\n"); */
 
-  osbf_raise_unless(text_len > 0, h, "Attempt to classify an empty text.");
-  osbf_raise_unless(num_classes > 0, h,
-                    "At least one class must be given.");
-
   total_a_priori = 0;
   for (pclass = classes; pclass < class_lim; pclass++) {
     CLASS_STRUCT *class = *pclass;
     int ci = pclass - classes; /* class index */
-    osbf_raise_unless(class->state != OSBF_CLOSED, h,
-                      "class number %d is closed", ci);
+    struct class_score *score = &scores[ci];
 
-    memset(class->bflags, 0,
-           class->header->num_buckets * sizeof(unsigned char));
-    ptt[ci] = class->learnings = class->header->learnings;
+    ptt[ci] = score->learnings = class->header->learnings;
     /*  avoid division by 0 */
-    if (class->learnings == 0)
-      class->learnings++;
+    if (score->learnings == 0)
+      score->learnings++;
 
     /* update total learnings */
-    total_learnings += class->learnings;
+    total_learnings += score->learnings;
     total_extra_learnings += class->header->learnings;
 
     /* select type of estimate for a-priori */
 #if (DEBUG > 0)
     fprintf(stderr, "Using %s for a-priori estimate\n",
-            a_priori_strings[a_priori]);
+            a_priori_strings[ctx->a_priori]);
 #endif
-    switch (a_priori) {
+    switch (ctx->a_priori) {
     case LEARNINGS:
       a_priori_counter[ci] = class->header->learnings;
       break;
     case INSTANCES:
-      if (class->header->db_version >= OSBF_DB_FP_FN_VERSION)
-        a_priori_counter[ci] =
-            class->header->classifications +
-            class->header->false_negatives -
-            class->header->false_positives;
-      else
-        osbf_raise(h,
-                   "Database version %s doesn't support 'INSTANCES' for a priori estimation. Try 'CLASSIFICATIONS' instead.",
-                   class->header->db_version);
+      /* classify_prepare() checked the version of the database */
+      a_priori_counter[ci] =
+          class->header->classifications +
+          class->header->false_negatives -
+          class->header->false_positives;
       break;
     case CLASSIFICATIONS:
       a_priori_counter[ci] = class->header->classifications;
@@ -487,9 +938,8 @@ void osbf_bayes_classify(const unsigned char *p_text,   /* pointer to text */
     case MISTAKES:
       a_priori_counter[ci] = class->header->false_negatives;
       break;
-    default:
-      osbf_raise(h, "Given a-priori option (%d) is out of range [%d, %d]",
-                 a_priori, 0, A_PRIORI_UPPER_LIMIT - 1);
+    default:                    /* ruled out by classify_prepare() */
+      a_priori_counter[ci] = 1;
       break;
     }
 
@@ -517,13 +967,15 @@ void osbf_bayes_classify(const unsigned char *p_text,   /* pointer to text */
   for (pclass = classes; pclass < class_lim; pclass++) {
     CLASS_STRUCT *class = *pclass;
     int ci = pclass - classes; /* class index */
+    struct class_score *score = &scores[ci];
     /*  initialize our arrays for N .cfc files */
-    class->hits = 0.0;          /* absolute hit counts */
-    class->totalhits = 0;       /* absolute hit counts */
-    class->uniquefeatures = 0;  /* features counted per class */
-    class->missedfeatures = 0;  /* missed features per class */
+    score->hits = 0.0;          /* absolute hit counts */
+    score->totalhits = 0;       /* absolute hit counts */
+    score->uniquefeatures = 0;  /* features counted per class */
+    score->missedfeatures = 0;  /* missed features per class */
     /* estimate class a-priori probability */
     ptc[ci] = a_priori_counter[ci] / total_a_priori;
+    log_ptc[ci] = log(ptc[ci]);
 
 #if 0
     {
@@ -540,350 +992,371 @@ void osbf_bayes_classify(const unsigned char *p_text,   /* pointer to text */
         }
       fprintf(stderr, "\n");
     }
+#else
+    (void) class;
 #endif
   }
 
   /*   now all of the files are mmapped into memory, */
   /*   and we can do the polynomials and add up points. */
 
-  /* init the hashpipe with 0xDEADBEEF  */
-  /* XXX last element is uninitialized.  consider NELEMS */
-  for (i = 0; i < OSB_BAYES_WINDOW_LEN; i++)
-    hashpipe[i] = 0xDEADBEEF;
-
   totalfeatures = 0;
 
-  while (ts.ptok <= ts.ptok_max && get_next_hash(&ts) == 0) {
-
+  seen_init(&seen);
+  memset(cf_memo, 0, sizeof(cf_memo));
+  init_lookahead(&la);
+  while (next_feature_ahead(src, &la, classes, num_classes, &f, homes)) {
     double htf;                 /* hits this feature got. */
+    uint32_t h1, h2;
+    /* remember indexes of classes with min and max local probabilities */
+    int i_min_p, i_max_p;
+    /* remember min and max local probabilities of a feature */
+    double min_local_p, max_local_p;
+    /* flag for already seen features */
+    int already_seen;
+    /* memo entry for the confidence factor of this feature */
+    uint64_t memo_key;
+    struct cf_memo *memo;
+    /* whether the feature was seen earlier, and whether it is found now */
+    int seen_before, found_any;
+
+    h1 = f.h1;
+    h2 = f.h2;
+    window_idx = f.window_idx;
+
+    htf = 0;                /* number of classes in which this feature is hit */
+    totalfeatures++;
+
+    min_local_p = 1.0;
+    max_local_p = 0;
+    i_min_p = i_max_p = 0;
+    already_seen = 0;
+    seen_before = seen_contains(&seen, SEEN_KEY(f));
+    found_any = 0;
+    for (pclass = classes; pclass < class_lim; pclass++) {
+      CLASS_STRUCT *class = SHARD_OF(*pclass, h2); /* [Note Shards] */
+      int ci = pclass - classes; /* class index */
+      struct class_score *score = &scores[ci];
+      uint32_t lh;
+      double p_feat = 0;
+
+      score->hits = 0;
+
+      /* look for feature with hashes h1 and h2 */
+      lh = FAST_FIND_BUCKET_AT(class, homes[ci], h1, h2);
+
+      /* the bucket is valid if its index is valid. if the     */
+      /* index "lh" is >= the number of buckets, it means that */
+      /* the .cfc file is full and the bucket wasn't found     */
+      if (VALID_BUCKET(class, lh) && !seen_before
+          && BUCKET_IN_CHAIN(class, lh)) {
+        /* only not previously seen features are considered */
+        found_any = 1;
+        score->uniquefeatures += 1; /* count unique features used */
+        score->hits = BUCKET_VALUE(class, lh);
+        score->totalhits += score->hits;    /* remember totalhits */
+        htf += score->hits; /* and hits-this-feature */
+        p_feat = score->hits / score->learnings;
+
+        /* set i_{min,max}_p to classes with {minimum,maxmum} P(F) */
+        if (p_feat <= min_local_p) {
+          i_min_p = ci;
+          min_local_p = p_feat;
+        }
+        if (p_feat >= max_local_p) {
+          i_max_p = ci;
+          max_local_p = p_feat;
+        }
+      } else if (!VALID_BUCKET(class, lh)
+                 || !BUCKET_IN_CHAIN(class, lh)) {
+        /* either bucket is invalid or it is not in a chain */
+        /* invalid bucket is treated like feature not found */
+        /*
+         * If a feature is not found in any class, it will have
+         * zero count on all classes and will be ignored anyway,
+         * so only found features are added to the seen set.
+         */
+        i_min_p = ci;
+        min_local_p = p_feat = 0;
+        /* for statistics only (for now...) */
+        score->missedfeatures += 1;
+      } else {              /* found, but seen earlier in the text */
+        already_seen = 1;
+      }
 
-    /* Shift the hash pipe down one and insert new hash */
-    memmove(hashpipe + 1, hashpipe,
-            sizeof(hashpipe) - sizeof(hashpipe[0]));
-    hashpipe[0] = ts.hash;
-    ts.hash = 0;                /* clean hash */
+    }
 
-    {
-      uint32_t hindex;
-      uint32_t h1, h2;
-      /* remember indexes of classes with min and max local probabilities */
-      int i_min_p, i_max_p;
-      /* remember min and max local probabilities of a feature */
-      double min_local_p, max_local_p;
-      /* flag for already seen features */
-      int already_seen;
-
-      for (window_idx = 1; window_idx < OSB_BAYES_WINDOW_LEN; window_idx++) {
-        h1 = hashpipe[0] * hctable1[0] +
-            hashpipe[window_idx] * hctable1[window_idx];
-        h2 = hashpipe[0] * hctable2[0] +
-            hashpipe[window_idx] * hctable2[H2_COMPAT_INDEX(window_idx)];
-
-        hindex = h1;
-
-        if (DEBUG > 2)
-          fprintf(stderr, "Polynomial %" PRIu32 " has h1:%i" PRIu32 "  h2: %"
-                  PRIu32 "\n", window_idx, h1, h2);
-
-        htf = 0;                /* number of classes in which this feature is hit */
-        totalfeatures++;
-
-        min_local_p = 1.0;
-        max_local_p = 0;
-        i_min_p = i_max_p = 0;
-        already_seen = 0;
-        for (pclass = classes; pclass < class_lim; pclass++) {
-          CLASS_STRUCT *class = *pclass;
-          int ci = pclass - classes; /* class index */
-          uint32_t lh, lh0;
-          double p_feat = 0;
-
-          lh = HASH_INDEX(class, hindex);
-          lh0 = lh;
-          (void) lh0; // not sure why unused
-          class->hits = 0;
-
-          /* look for feature with hashes h1 and h2 */
-          lh = FAST_FIND_BUCKET(class, h1, h2);
-
-          /* the bucket is valid if its index is valid. if the     */
-          /* index "lh" is >= the number of buckets, it means that */
-          /* the .cfc file is full and the bucket wasn't found     */
-          if (VALID_BUCKET(class, lh) && BUCKET_FLAGS(class, lh) == 0
-              && BUCKET_IN_CHAIN(class, lh)) {
-            /* only not previously seen features are considered */
-            class->bflags[lh] = 1;      /* mark the feature as seen */
-            class->uniquefeatures += 1; /* count unique features used */
-            class->hits = BUCKET_VALUE(class, lh);
-            class->totalhits += class->hits;    /* remember totalhits */
-            htf += class->hits; /* and hits-this-feature */
-            p_feat = class->hits / class->learnings;
-
-            /* set i_{min,max}_p to classes with {minimum,maxmum} P(F) */
-            if (p_feat <= min_local_p) {
-              i_min_p = ci;
-              min_local_p = p_feat;
-            }
-            if (p_feat >= max_local_p) {
-              i_max_p = ci;
-              max_local_p = p_feat;
-            }
-          } else if (!VALID_BUCKET(class, lh)
-                     || BUCKET_FLAGS(class, lh) == 0) {
-            /* either bucket is invalid or it is not in a chain */
-            /* invalid bucket is treated like feature not found */
-            /*
-             * a feature that wasn't found can't be marked as
-             * already seen in the doc because the index lh
-             * doesn't refer to it, but to the first empty bucket
-             * after the chain, which is common to all not-found
-             * features in the same chain. This is not a problem
-             * though, because if the feature is found in another
-             * class, it'll be marked as seen on that class,
-             * which is enough to mark it as seen. If it's not
-             * found in any class, it will have zero count on
-             * all classes and will be ignored as well. So, only
-             * found features are marked as seen.
-             */
-            i_min_p = ci;
-            min_local_p = p_feat = 0;
-            /* for statistics only (for now...) */
-            class->missedfeatures += 1;
-          } else {              /* bucket is valid, flags not zero */
-            already_seen = 1;
-          }
+    if (found_any && seen_insert(&seen, SEEN_KEY(f)) != 0) {
+      seen_free(&seen);
+      return -1;
+    }
 
-        }
 
 
 
 
+        /*=======================================================
+         * Update the probabilities using Bayes:
+         *
+         *                      P(F|S) P(S)
+         *     P(S|F) = -------------------------------
+         *               P(F|S) P(S) +  P(F|H) P(H)
+         *
+         * S = class spam; H = class ham; F = feature
+         *
+         * Here we adopt a different method for estimating
+         * P(F|S). Instead of estimating P(F|S) as (hits[S][F] /
+         * (hits[S][F] + hits[H][F])), like in the original
+         * code, we use (hits[S][F] / learnings[S]) which is the
+         * ratio between the number of messages of the class S
+         * where the feature F was observed during learnings and
+         * the total number of learnings of that class. Both
+         * values are kept in the respective .cfc file, the
+         * number of learnings in the header and the number of
+         * occurrences of the feature F as the value of its
+         * feature bucket.
+         *
+         * It's worth noting another important difference here:
+         * as we want to estimate the *number of messages* of a
+         * given class where a certain feature F occurs, we
+         * count only the first occurrence of each feature in a
+         * message (repetitions are ignored), both when learning
+         * and when classifying.
+         * 
+         * Advantages of this method, compared to the original:
+         *
+         * - First of all, and the most important: accuracy is
+         * really much better, at about the same speed! With
+         * this higher accuracy, it's also possible to increase
+         * the speed, at the cost of a low decrease in accuracy,
+         * using smaller .cfc files;
+         *
+         * - It is not affected by different sized classes
+         * because the numerator and the denominator belong to
+         * the same class;
+         *
+         * - It allows a simple and fast pruning method that
+         * seems to introduce little noise: just zero features
+         * with lower count in a overflowed chain, zeroing first
+         * those in their right places, to increase the chances
+         * of deleting older ones.
+         *
+         * Disadvantages:
+         *
+         * - It breaks compatibility with previous .css file
+         * format because of different header structure and
+         * meaning of the counts.
+         *
+         * Confidence factors
+         *
+         * The motivation for confidence factors is to reduce
+         * the noise introduced by features with small counts
+         * and/or low significance. This is an attempt to mimic
+         * what we do when inspecting a message to tell if it is
+         * spam or not. We intuitively consider only a few
+         * tokens, those which carry strong indications,
+         * according to what we've learned and remember, and
+         * discard the ones that may occur (approximately)
+         * equally in both classes.
+         *
+         * Once P(Feature|Class) is estimated as above, the
+         * calculated value is adjusted using the following
+         * formula:
+         *
+         *  CP(Feature|Class) = 1/num_classes + 
+         *     CF(Feature) * (P(Feature|Class) - 1/num_classes)
+         *
+         * Where CF(Feature) is the confidence factor and
+         * CP(Feature|Class) is the adjusted estimate for the
+         * probability.
+         *
+         * CF(Feature) is calculated taking into account the
+         * weight, the max and the min frequency of the feature
+         * over the classes, using the empirical formula:
+         *
+         *     (((Hmax - Hmin)^2 + Hmax*Hmin - K1/SH) / SH^2) ^ K2
+         * CF(Feature) = ------------------------------------------
+         *                    1 +  K3 / (SH * Weight)
+         *
+         * Hmax  - Number of documents with the feature "F" on
+         * the class with max local probability;
+         * Hmin  - Number of documents with the feature "F" on
+         * the class with min local probability;
+         * SH - Sum of Hmax and Hmin
+         * K1, K2, K3 - Empirical constants
+         *
+         * OBS: - Hmax and Hmin are normalized to the max number
+         *  of learnings of the 2 classes involved.
+         *  - Besides modulating the estimated P(Feature|Class),
+         *  reducing the noise, 0 <= CF < 1 is also used to
+         *  restrict the probability range, avoiding the
+         *  certainty falsely implied by a 0 count for a given
+         *  class.
+         *
+         * -- Fidelis Assis
+         *=======================================================*/
+
+    /* ignore already seen features */
+    /* ignore less significant features (CF = 0) */
+    if ((already_seen != 0) || ((max_local_p - min_local_p) < 1E-6))
+      continue;
+    if ((min_local_p > 0)
+        && ((max_local_p / min_local_p) < min_pmax_pmin_ratio))
+      continue;
+
+    /* look the confidence factor up in the memo [Note CF memo] */
+    memo_key = CF_MEMO_KEY(scores[i_min_p].hits, scores[i_max_p].hits,
+                           i_min_p, i_max_p, window_idx);
+    memo = &cf_memo[CF_MEMO_SLOT(memo_key)];
+    if (memo_key != 0 && memo->key == memo_key) {
+      confidence_factor = memo->cf;
+    }
+    /* code under testing... */
+    /* calculate confidence_factor */
+    else {
+      uint32_t hits_max_p, hits_min_p, sum_hits;
+      int32_t diff_hits;
+      double cfx = 1;
+      /* constants used in the CF formula */
+      /* K1 = 0.25; K2 = 10; K3 = 8;      */
+      /* const double K1 = 0.25, K2 = 10, K3 = 8; */
+
+      hits_min_p = scores[i_min_p].hits;
+      hits_max_p = scores[i_max_p].hits;
+
+      /* normalize hits to max learnings */
+      if (scores[i_min_p].learnings < scores[i_max_p].learnings)
+        hits_min_p *=
+            (double) scores[i_max_p].learnings /
+            (double) scores[i_min_p].learnings;
+      else
+        hits_max_p *=
+            (double) scores[i_min_p].learnings /
+            (double) scores[i_max_p].learnings;
+
+      sum_hits = hits_max_p + hits_min_p;
+      diff_hits = hits_max_p - hits_min_p;
+      if (diff_hits < 0)
+        diff_hits = -diff_hits;
+
+      /* calculate confidence factor (CF) */
+      if (flags & NO_EDDC)  /* || min_local_p > 0 ) */
+        confidence_factor = 1 - OSBF_DBL_MIN;
+      else {
+        cfx =
+            0.8 + (classes[i_min_p]->header->learnings +
+                   classes[i_max_p]->header->learnings) / 20.0;
+        if (cfx > 1)
+          cfx = 1;
+        confidence_factor = cfx *
+            pow(((double)diff_hits * diff_hits - ctx->K1 /
+                 (scores[i_max_p].hits + scores[i_min_p].hits)) /
+                ((double)sum_hits * sum_hits), 2) /
+            (1.0 +
+             ctx->K3 / ((scores[i_max_p].hits + scores[i_min_p].hits) *
+                        feature_weight[window_idx]));
+      }
 
-            /*=======================================================
-             * Update the probabilities using Bayes:
-             *
-             *                      P(F|S) P(S)
-             *     P(S|F) = -------------------------------
-             *               P(F|S) P(S) +  P(F|H) P(H)
-             *
-             * S = class spam; H = class ham; F = feature
-             *
-             * Here we adopt a different method for estimating
-             * P(F|S). Instead of estimating P(F|S) as (hits[S][F] /
-             * (hits[S][F] + hits[H][F])), like in the original
-             * code, we use (hits[S][F] / learnings[S]) which is the
-             * ratio between the number of messages of the class S
-             * where the feature F was observed during learnings and
-             * the total number of learnings of that class. Both
-             * values are kept in the respective .cfc file, the
-             * number of learnings in the header and the number of
-             * occurrences of the feature F as the value of its
-             * feature bucket.
-             *
-             * It's worth noting another important difference here:
-             * as we want to estimate the *number of messages* of a
-             * given class where a certain feature F occurs, we
-             * count only the first occurrence of each feature in a
-             * message (repetitions are ignored), both when learning
-             * and when classifying.
-             * 
-             * Advantages of this method, compared to the original:
-             *
-             * - First of all, and the most important: accuracy is
-             * really much better, at about the same speed! With
-             * this higher accuracy, it's also possible to increase
-             * the speed, at the cost of a low decrease in accuracy,
-             * using smaller .cfc files;
-             *
-             * - It is not affected by different sized classes
-             * because the numerator and the denominator belong to
-             * the same class;
-             *
-             * - It allows a simple and fast pruning method that
-             * seems to introduce little noise: just zero features
-             * with lower count in a overflowed chain, zeroing first
-             * those in their right places, to increase the chances
-             * of deleting older ones.
-             *
-             * Disadvantages:
-             *
-             * - It breaks compatibility with previous .css file
-             * format because of different header structure and
-             * meaning of the counts.
-             *
-             * Confidence factors
-             *
-             * The motivation for confidence factors is to reduce
-             * the noise introduced by features with small counts
-             * and/or low significance. This is an attempt to mimic
-             * what we do when inspecting a message to tell if it is
-             * spam or not. We intuitively consider only a few
-             * tokens, those which carry strong indications,
-             * according to what we've learned and remember, and
-             * discard the ones that may occur (approximately)
-             * equally in both classes.
-             *
-             * Once P(Feature|Class) is estimated as above, the
-             * calculated value is adjusted using the following
-             * formula:
-             *
-             *  CP(Feature|Class) = 1/num_classes + 
-             *     CF(Feature) * (P(Feature|Class) - 1/num_classes)
-             *
-             * Where CF(Feature) is the confidence factor and
-             * CP(Feature|Class) is the adjusted estimate for the
-             * probability.
-             *
-             * CF(Feature) is calculated taking into account the
-             * weight, the max and the min frequency of the feature
-             * over the classes, using the empirical formula:
-             *
-             *     (((Hmax - Hmin)^2 + Hmax*Hmin - K1/SH) / SH^2) ^ K2
-             * CF(Feature) = ------------------------------------------
-             *                    1 +  K3 / (SH * Weight)
-             *
-             * Hmax  - Number of documents with the feature "F" on
-             * the class with max local probability;
-             * Hmin  - Number of documents with the feature "F" on
-             * the class with min local probability;
-             * SH - Sum of Hmax and Hmin
-             * K1, K2, K3 - Empirical constants
-             *
-             * OBS: - Hmax and Hmin are normalized to the max number
-             *  of learnings of the 2 classes involved.
-             *  - Besides modulating the estimated P(Feature|Class),
-             *  reducing the noise, 0 <= CF < 1 is also used to
-             *  restrict the probability range, avoiding the
-             *  certainty falsely implied by a 0 count for a given
-             *  class.
-             *
-             * -- Fidelis Assis
-             *=======================================================*/
-
-        /* ignore already seen features */
-        /* ignore less significant features (CF = 0) */
-        if ((already_seen != 0) || ((max_local_p - min_local_p) < 1E-6))
-          continue;
-        if ((min_local_p > 0)
-            && ((max_local_p / min_local_p) < min_pmax_pmin_ratio))
-          continue;
-
-        /* code under testing... */
-        /* calculate confidence_factor */
-        {
-          uint32_t hits_max_p, hits_min_p, sum_hits;
-          int32_t diff_hits;
-          double cfx = 1;
-          /* constants used in the CF formula */
-          /* K1 = 0.25; K2 = 10; K3 = 8;      */
-          /* const double K1 = 0.25, K2 = 10, K3 = 8; */
-
-          hits_min_p = classes[i_min_p]->hits;
-          hits_max_p = classes[i_max_p]->hits;
-
-          /* normalize hits to max learnings */
-          if (classes[i_min_p]->learnings < classes[i_max_p]->learnings)
-            hits_min_p *=
-                (double) classes[i_max_p]->learnings /
-                (double) classes[i_min_p]->learnings;
-          else
-            hits_max_p *=
-                (double) classes[i_min_p]->learnings /
-                (double) classes[i_max_p]->learnings;
-
-          sum_hits = hits_max_p + hits_min_p;
-          diff_hits = hits_max_p - hits_min_p;
-          if (diff_hits < 0)
-            diff_hits = -diff_hits;
-
-          /* calculate confidence factor (CF) */
-          if (flags & NO_EDDC)  /* || min_local_p > 0 ) */
-            confidence_factor = 1 - OSBF_DBL_MIN;
-          else {
-            cfx =
-                0.8 + (classes[i_min_p]->header->learnings +
-                       classes[i_max_p]->header->learnings) / 20.0;
-            if (cfx > 1)
-              cfx = 1;
-            confidence_factor = cfx *
-                pow(((double)diff_hits * diff_hits - K1 /
-                     (classes[i_max_p]->hits + classes[i_min_p]->hits)) /
-                    ((double)sum_hits * sum_hits), 2) /
-                (1.0 +
-                 K3 / ((classes[i_max_p]->hits + classes[i_min_p]->hits) *
-                       feature_weight[window_idx]));
-          }
-
-          if (DEBUG > 1) {
-            fprintf
-                (stderr,
-                 "CF: %.4f, max_hits = %3" PRIu32 ", min_hits = %3" PRIu32
-                 ", " "weight: %5.1f\n", confidence_factor, hits_max_p,
-                 hits_min_p, feature_weight[window_idx]);
-          }
-        }
+      if (DEBUG > 1) {
+        fprintf
+            (stderr,
+             "CF: %.4f, max_hits = %3" PRIu32 ", min_hits = %3" PRIu32
+             ", " "weight: %5.1f\n", confidence_factor, hits_max_p,
+             hits_min_p, feature_weight[window_idx]);
+      }
 
-        /* calculate the numerators - P(F|C) * P(C) */
-        renorm = 0.0;
-        for (class_idx = 0; class_idx < num_classes; class_idx++) {
-          /*
-           * P(C) = learnings[k] / total_learnings
-           * P(F|C) = hits[k]/learnings[k], adjusted by the
-           * confidence factor.
-           */
-          if (0)
-            fprintf(stderr, "## %g hits for class %s\n",
-                    classes[class_idx]->hits,
-                    classes[class_idx]->classname);
-
-          ptc[class_idx] = ptc[class_idx] *
-              (zero_knowledge_prob + confidence_factor *
-               (classes[class_idx]->hits / classes[class_idx]->learnings -
-                zero_knowledge_prob));
-
-          if (ptc[class_idx] < OSBF_SMALLP)
-            ptc[class_idx] = OSBF_SMALLP;
-          renorm += ptc[class_idx];
-          if (DEBUG > 1) {
-            fprintf(stderr, "CF: %.4f, classes[k]->totalhits: %" PRIu32 ", "
-                    "missedfeatures[k]: %" PRIu32
-                    ", uniquefeatures[k]: %" PRIu32 ", "
-                    "totalfeatures: %" PRIu32 ", weight: %5.1f\n",
-                    confidence_factor, classes[class_idx]->totalhits,
-                    classes[class_idx]->missedfeatures,
-                    classes[class_idx]->uniquefeatures, totalfeatures,
-                    feature_weight[window_idx]);
-          }
+      memo->key = memo_key;
+      memo->cf = confidence_factor;
+    }
 
-        }
+    if (engine == LOG_SCORING) {
+      /* add log P(F|C), adjusted by the confidence factor; the sums
+         are normalized only once, after the last feature
+         [Note Log scoring] */
+      for (class_idx = 0; class_idx < num_classes; class_idx++) {
+        double p_feat = zero_knowledge_prob + confidence_factor *
+            (scores[class_idx].hits / scores[class_idx].learnings -
+             zero_knowledge_prob);
+
+        if (p_feat < OSBF_SMALLP)
+          p_feat = OSBF_SMALLP;
+        log_ptc[class_idx] += log(p_feat);
+      }
+      continue;
+    }
 
-        /* renormalize probabilities */
-        for (class_idx = 0; class_idx < num_classes; class_idx++)
-          ptc[class_idx] = ptc[class_idx] / renorm;
-
-     if (DEBUG > 2)
-        {
-          for (class_idx = 0; class_idx < num_classes; class_idx++) {
-            fprintf(stderr,
-                    " poly: %" PRIu32 "  filenum: %" PRIu32
-                    ", HTF: %7.0f, " "learnings: %7" PRIu32
-                    ", hits: %7.0f, " "Pc: %6.4e\n",
-                    window_idx, class_idx, htf,
-                    classes[class_idx]->header->learnings,
-                    classes[class_idx]->hits, ptc[class_idx]);
-          }
-        }
+    /* calculate the numerators - P(F|C) * P(C) */
+    renorm = 0.0;
+    for (class_idx = 0; class_idx < num_classes; class_idx++) {
+      /*
+       * P(C) = learnings[k] / total_learnings
+       * P(F|C) = hits[k]/learnings[k], adjusted by the
+       * confidence factor.
+       */
+      if (0)
+        fprintf(stderr, "## %g hits for class %s\n",
+                scores[class_idx].hits,
+                classes[class_idx]->classname);
+
+      ptc[class_idx] = ptc[class_idx] *
+          (zero_knowledge_prob + confidence_factor *
+           (scores[class_idx].hits / scores[class_idx].learnings -
+            zero_knowledge_prob));
+
+      if (ptc[class_idx] < OSBF_SMALLP)
+        ptc[class_idx] = OSBF_SMALLP;
+      renorm += ptc[class_idx];
+      if (DEBUG > 1) {
+        fprintf(stderr, "CF: %.4f, classes[k]->totalhits: %" PRIu32 ", "
+                "missedfeatures[k]: %" PRIu32
+                ", uniquefeatures[k]: %" PRIu32 ", "
+                "totalfeatures: %" PRIu32 ", weight: %5.1f\n",
+                confidence_factor, scores[class_idx].totalhits,
+                scores[class_idx].missedfeatures,
+                scores[class_idx].uniquefeatures, totalfeatures,
+                feature_weight[window_idx]);
+      }
+
+    }
+
+    /* renormalize probabilities */
+    for (class_idx = 0; class_idx < num_classes; class_idx++)
+      ptc[class_idx] = ptc[class_idx] / renorm;
+
+    if (DEBUG > 2) {
+      for (class_idx = 0; class_idx < num_classes; class_idx++) {
+        fprintf(stderr,
+                " poly: %" PRIu32 "  filenum: %" PRIu32
+                ", HTF: %7.0f, " "learnings: %7" PRIu32
+                ", hits: %7.0f, " "Pc: %6.4e\n",
+                window_idx, class_idx, htf,
+                classes[class_idx]->header->learnings,
+                scores[class_idx].hits, ptc[class_idx]);
       }
     }
   }
 
-  if (renorm == 0.0) {          /* could happen if we get, say, a one-word message
+  if (engine == LOG_SCORING) {
+    double max_log = log_ptc[0];
+
+    /* subtract the largest sum, so that the largest exp() is 1 */
+    for (class_idx = 1; class_idx < num_classes; class_idx++)
+      if (log_ptc[class_idx] > max_log)
+        max_log = log_ptc[class_idx];
+    renorm = 0.0;
+    for (class_idx = 0; class_idx < num_classes; class_idx++) {
+      ptc[class_idx] = exp(log_ptc[class_idx] - max_log);
+      if (ptc[class_idx] < OSBF_SMALLP)
+        ptc[class_idx] = OSBF_SMALLP;
+      renorm += ptc[class_idx];
+    }
+    for (class_idx = 0; class_idx < num_classes; class_idx++)
+      ptc[class_idx] = ptc[class_idx] / renorm;
+  } else if (renorm == 0.0) {   /* could happen if we get, say, a one-word message
                                    like 'gurgle:' -- code above is not reached */
     /* renormalize probabilities */
     if (0)
-      fprintf(stderr,
-              "## NO SIGNIFICANT HITS FOR ANY CLASS!!!\n## (text is %.50s...)\n",
-              p_text);
+      fprintf(stderr, "## NO SIGNIFICANT HITS FOR ANY CLASS!!!\n");
     for (class_idx = 0; class_idx < num_classes; class_idx++)
       renorm += ptc[class_idx];
 
@@ -898,4 +1371,178 @@ void osbf_bayes_classify(const unsigned char *p_text,   /* pointer to text */
               class_idx, ptc[class_idx]);
   }
 
+  seen_free(&seen);
+  return 0;
+}
+
+/* raises unless the classification succeeded */
+static void bayes_classify(struct feature_source *src,
+                           CLASS_STRUCT * classes[], unsigned num_classes,
+                           uint32_t flags, double min_pmax_pmin_ratio,
+                           double ptc[], uint32_t ptt[],
+                           const OSBF_CONTEXT *ctx, OSBF_HANDLER * h)
+{
+  classify_prepare(classes, num_classes, flags, ctx, h);
+  osbf_raise_unless(classify_core(src, classes, num_classes, flags,
+                                  min_pmax_pmin_ratio, ptc, ptt, ctx) == 0, h,
+                    "Could not allocate memory to classify");
+}
+
+void osbf_bayes_classify(const unsigned char *p_text,   /* pointer to text */
+                         unsigned long text_len,        /* length of text */
+                         const char *delims,    /* token delimiters */
+                         CLASS_STRUCT * classes[],      /* hash file names */
+                         unsigned num_classes, uint32_t flags,  /* flags */
+                         double min_pmax_pmin_ratio,
+                         /* returned values */
+                         double ptc[],  /* class probs */
+                         uint32_t ptt[],        /* number trainings per class */
+                         const OSBF_CONTEXT *ctx,       /* settings */
+                         OSBF_HANDLER * h       /* error handler */
+    )
+{
+  struct feature_source src;
+
+  osbf_raise_unless(delims != NULL, h,
+                    "NULL delimiters; use empty string instead");
+  osbf_raise_unless(text_len > 0, h, "Attempt to classify an empty text.");
+
+  text_feature_source(&src, p_text, text_len, delims, 0, ctx);
+  bayes_classify(&src, classes, num_classes, flags, min_pmax_pmin_ratio,
+                 ptc, ptt, ctx, h);
+}
+
+void osbf_bayes_classify_features(const OSBF_FEATURE_VECTOR *fv,
+                                  CLASS_STRUCT * classes[],
+                                  unsigned num_classes, uint32_t flags,
+                                  double min_pmax_pmin_ratio,
+                                  double ptc[], uint32_t ptt[],
+                                  const OSBF_CONTEXT *ctx,
+                                  OSBF_HANDLER * h)
+{
+  struct feature_source src;
+
+  osbf_raise_unless(fv->text_len > 0, h,
+                    "Attempt to classify an empty text.");
+
+  /* the classifier ignores the padding the trainer uses at end of text */
+  vector_feature_source(&src, fv, fv->num_features);
+  bayes_classify(&src, classes, num_classes, flags, min_pmax_pmin_ratio,
+                 ptc, ptt, ctx, h);
+}
+
+/*****************************************************************/
+
+/* A batch is shared by the threads classifying it.  Each thread takes
+   the next unclassified text until none is left; the results of text
+   i go to ptc[i * num_classes ...], so no two threads write the same
+   memory [Note Threads]. */
+
+struct batch {
+  const OSBF_TEXT *texts;
+  unsigned num_texts;
+  const char *delims;
+  CLASS_STRUCT **classes;
+  unsigned num_classes;
+  uint32_t flags;
+  double min_pmax_pmin_ratio;
+  double *ptc;
+  const OSBF_CONTEXT *ctx;      /* read by all threads, written by none */
+  pthread_mutex_t lock;         /* protects next and failed */
+  unsigned next;                /* index of the next text to classify */
+  int failed;                   /* nonzero if some classification failed */
+};
+
+static void *classify_texts(void *arg)
+{
+  struct batch *b = arg;
+  uint32_t ptt[OSBF_MAX_CLASSES];
+
+  for (;;) {
+    struct feature_source src;
+    const OSBF_TEXT *t;
+    unsigned i;
+
+    pthread_mutex_lock(&b->lock);
+    i = b->failed ? b->num_texts : b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (i >= b->num_texts)
+      break;
+
+    t = &b->texts[i];
+    if (t->text != NULL)
+      text_feature_source(&src, t->text, t->len, b->delims, 0, b->ctx);
+    else
+      vector_feature_source(&src, t->fv, t->fv->num_features);
+    if (classify_core(&src, b->classes, b->num_classes, b->flags,
+                      b->min_pmax_pmin_ratio,
+                      b->ptc + (size_t) i * b->num_classes, ptt,
+                      b->ctx) != 0) {
+      pthread_mutex_lock(&b->lock);
+      b->failed = 1;
+      pthread_mutex_unlock(&b->lock);
+    }
+  }
+  return NULL;
+}
+
+#define MAX_BATCH_THREADS 64
+
+void osbf_bayes_classify_batch(const OSBF_TEXT texts[],
+                               unsigned num_texts,
+                               const char *delims,
+                               CLASS_STRUCT * classes[],
+                               unsigned num_classes, uint32_t flags,
+                               double min_pmax_pmin_ratio,
+                               unsigned num_threads,
+                               double ptc[], uint32_t ptt[],
+                               const OSBF_CONTEXT *ctx,
+                               OSBF_HANDLER * h)
+{
+  struct batch b;
+  pthread_t threads[MAX_BATCH_THREADS];
+  unsigned i, started = 0;
+
+  classify_prepare(classes, num_classes, flags, ctx, h);
+  for (i = 0; i < num_texts; i++) {
+    const OSBF_TEXT *t = &texts[i];
+    if (t->text != NULL)
+      osbf_raise_unless(delims != NULL, h,
+                        "NULL delimiters; use empty string instead");
+    osbf_raise_unless(t->text != NULL ? t->len > 0 : t->fv->text_len > 0, h,
+                      "Attempt to classify an empty text (number %d).",
+                      (int) i + 1);
+  }
+  for (i = 0; i < num_classes; i++)
+    ptt[i] = classes[i]->header->learnings;
+
+  b.texts = texts;
+  b.num_texts = num_texts;
+  b.delims = delims;
+  b.classes = classes;
+  b.num_classes = num_classes;
+  b.flags = flags;
+  b.min_pmax_pmin_ratio = min_pmax_pmin_ratio;
+  b.ptc = ptc;
+  b.ctx = ctx;
+  b.next = 0;
+  b.failed = 0;
+  osbf_raise_unless(pthread_mutex_init(&b.lock, NULL) == 0, h,
+                    "Could not create a mutex to classify");
+
+  if (num_threads > num_texts)
+    num_threads = num_texts;
+  if (num_threads > MAX_BATCH_THREADS)
+    num_threads = MAX_BATCH_THREADS;
+  /* this thread is one of the workers; if a thread cannot be
+     started, the others do its share */
+  while (started + 1 < num_threads
+         && pthread_create(&threads[started], NULL, classify_texts, &b) == 0)
+    started++;
+  classify_texts(&b);
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&b.lock);
+
+  osbf_raise_unless(!b.failed, h, "Could not allocate memory to classify");
 }
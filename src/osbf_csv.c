@@ -25,15 +25,24 @@ osbf_dump (const CLASS_STRUCT *class, const char *csvfile, OSBF_HANDLER *h)
 
   if (class->state == OSBF_CLOSED)
     osbf_raise(h, "Cannot dump a closed class");
+  if (class->shards != NULL)
+    osbf_raise(h, "Cannot dump sharded class %s", class->classname);
   fp_csv = fopen (csvfile, "w");
   if (fp_csv == NULL)
     osbf_raise(h, "Can't open csv file %s", csvfile);
 
+  /* the second field was once the flags; it now holds the base of a
+     class that grows, and then the ceiling follows [Note Growth] */
+  if (CLASS_GROWS(class))
+    fprintf(fp_csv, "%" SCNu32 ";%" SCNu32 ";%" SCNu32 "\n",
+            class->header->db_version, class->header->base_buckets,
+            class->header->max_buckets);
+  else
+    fprintf(fp_csv, "%" SCNu32 ";%" SCNu32 "\n", class->header->db_version, 0);
   fprintf(fp_csv,
-          "%" SCNu32 ";%" SCNu32 "\n%" SCNu32 ";%" SCNu32 "\n"
+          "%" SCNu32 ";%" SCNu32 "\n"
           "%" SCNu32 ";%" SCNu32 "\n"
           "%" SCNu64 ";%" SCNu32 "\n",
-          class->header->db_version, 0,
           class->header->num_buckets, class->header->learnings,
           class->header->false_negatives, class->header->false_positives,
           class->header->classifications, class->header->extra_learnings);
@@ -42,13 +51,18 @@ osbf_dump (const CLASS_STRUCT *class, const char *csvfile, OSBF_HANDLER *h)
   buckets = class->buckets;
   for (i = 0; i < num_buckets; i++)
     fprintf (fp_csv, "%" PRIu32 ";%" PRIu32 ";%" PRIu32 "\n",
-               buckets[i].hash1, buckets[i].hash2, buckets[i].count);
+               buckets[i].hash1, FINGERPRINT_KEY(buckets[i].fingerprint),
+               (uint32_t) buckets[i].count);
   fclose (fp_csv);
 }
 
 static int read_bucket(OSBF_BUCKET_STRUCT *bucket, FILE *fp) {
-  return 3 == fscanf (fp, "%" SCNu32 ";%" SCNu32 ";%" SCNu32 "\n",
-                      &bucket->hash1, &bucket->hash2, &bucket->count);
+  OSBF_UNIVERSAL_BUCKET uni;
+  if (3 != fscanf (fp, "%" SCNu32 ";%" SCNu32 ";%" SCNu32 "\n",
+                   &uni.hash1, &uni.hash2, &uni.count))
+    return 0;
+  osbf_native_bucket_of_universal(bucket, &uni);
+  return 1;
 }
 
 void
@@ -58,7 +72,10 @@ osbf_restore (const char *cfcfile, const char *csvfile, OSBF_HANDLER *h)
   CLASS_STRUCT class;
   OSBF_BUCKET_STRUCT *buckets;
   uint32_t i;
-  uint32_t garbage; /* placeholder for flags in legacy formats */
+  uint32_t base_buckets = 0, max_buckets = 0;
+    /* without max_buckets, base_buckets holds flags of legacy formats */
+  int first_fields = 0;
+  char first_line[100];
   OSBF_UNIVERSAL_HEADER uheader;
 
   memset(&class, 0, sizeof(class));
@@ -74,11 +91,14 @@ osbf_restore (const char *cfcfile, const char *csvfile, OSBF_HANDLER *h)
   osbf_raise_unless(fp_csv != NULL, h, "Cannot open csv file %s", csvfile);
   /* read header */
   UNLESS_CLEANUP_RAISE(
-     8 == fscanf (fp_csv,
-		  "%" SCNu32 ";%" SCNu32 "\n%" SCNu32 ";%" SCNu32 "\n"
+     fgets (first_line, sizeof(first_line), fp_csv) != NULL
+     && 2 <= (first_fields =
+                sscanf (first_line, "%" SCNu32 ";%" SCNu32 ";%" SCNu32,
+                        &uheader.db_version, &base_buckets, &max_buckets))
+     && 6 == fscanf (fp_csv,
+                  "%" SCNu32 ";%" SCNu32 "\n"
                   "%" SCNu32 ";%" SCNu32 "\n"
                   "%" SCNu64 ";%" SCNu32 "\n",
-                  &uheader.db_version, &garbage,
 		  &uheader.num_buckets, &uheader.learnings,
                   &uheader.false_negatives, &uheader.false_positives,
                   &uheader.classifications, &uheader.extra_learnings),
@@ -94,6 +114,17 @@ osbf_restore (const char *cfcfile, const char *csvfile, OSBF_HANDLER *h)
   }
   class.header = osbf_calloc(1, sizeof(*class.header), h, "header");
   osbf_native_header_of_universal(class.header, &uheader);
+  if (first_fields == 3 && base_buckets != 0) {
+    UNLESS_CLEANUP_RAISE(base_buckets <= uheader.num_buckets
+                         && uheader.num_buckets < 2 * (uint64_t) base_buckets
+                         && uheader.num_buckets <= max_buckets,
+          (fclose(fp_csv), free(class.header), free(class.buckets)),
+          (h, "csv file %s has an inconsistent header", csvfile));
+    class.header->base_buckets = base_buckets;
+    class.header->max_buckets  = max_buckets;
+    for (i = 0; i < uheader.num_buckets; i++)
+      class.header->used_buckets += buckets[i].count != 0;
+  }
 
   UNLESS_CLEANUP_RAISE(feof(fp_csv),
         (fclose(fp_csv), free(class.header), free(class.buckets)),
@@ -7,6 +7,9 @@
  *
  */
 
+/* for ftruncate */
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +20,7 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include "osbflib.h"
 #include "osbf_disk.h"
@@ -58,15 +62,147 @@ static void check_format_uniqueness(OSBF_HANDLER *h) {
 
 /*****************************************************************/
 
-void
-osbf_open_class(const char *classname, osbf_class_usage usage,
-                CLASS_STRUCT * class, OSBF_HANDLER *h)
+/* [Note Locks]
+   ~~~~~~~~~~~~
+   A writer holds an exclusive lock on the header region of its class
+   from open to close, so writers take turns.  Readers don't take that
+   lock, or a batch training would stall every classification.  What a
+   reader must not see is a writer halfway through writing the file at
+   close: between the writing of the buckets at a checkpoint and the
+   removal of the journal, when it might map the old buckets and miss
+   the journal [Note Journal], or with the file longer than its header
+   says [Note Growth].  So a writer also
+   locks the flush region, the byte after the header, while it writes,
+   and a reader holds a shared lock on that region while it maps the
+   class and applies the journal; readers wait only for writes, never
+   for one another.  Only methods that lock regions apart and share
+   locks (osbf_lock_regions) lock the flush region; with the others a
+   reader locks nothing, as before.  Nor is the flush region locked
+   with snapshots [Note Snapshots in osbflib.h]: a writer that
+   publishes a generation never changes a file that bears the class
+   name, so a reader has nothing to wait for, and the whole write and
+   sync of the new generation would otherwise keep readers out.
+
+   A lock is waited for at most the lock_timeout seconds of the class's
+   context [Note Contexts].  The time a class spent waiting for its
+   locks is kept in class->lock_wait and reported by the statistics, so
+   that callers can see contention. */
+
+#define FLUSH_START sizeof(OSBF_HEADER_STRUCT)
+#define FLUSH_LEN   1
+#define LOCK_FLUSHES (USE_LOCKING && osbf_lock_regions)
+#define READER_LOCKS(ctx) (LOCK_FLUSHES && !(ctx)->snapshots)
+
+static double seconds(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* takes a lock, adding the time waited for it to class->lock_wait */
+static int timed_lock(CLASS_STRUCT *class, int shared,
+                      uint32_t start, uint32_t len) {
+  double t = seconds();
+  int r = shared ? osbf_lock_class_shared (class, start, len)
+                 : osbf_lock_class (class, start, len);
+  class->lock_wait += seconds() - t;
+  return r;
+}
+
+/* A writer may wait for the lock of a class while the class is being
+   replaced (see [Note Online resize]); once it has the lock, the file
+   it opened may no longer be the one that bears the class name, and
+   whatever it wrote there would be lost.  Locks a region of the file
+   open on class->fd and checks that the name still refers to that
+   file.  Returns 1 if so, with the lock held; 0 if the file has been
+   replaced, with the lock released, so that the caller can open the
+   name again; and -1 if the file couldn't be locked.
+
+   With snapshots every writer replaces the file as it closes it [Note
+   Snapshots], so under steady training a waiter may find the file
+   replaced any number of times, each time because another writer
+   made progress.  So the name is opened again for as long as the lock
+   timeout allows, counted from the first open, not a fixed number of
+   times (see may_reopen). */
+
+static int lock_named_file(CLASS_STRUCT *class, int shared,
+                           uint32_t start, uint32_t len) {
+  struct stat opened, named;
+
+  if (timed_lock (class, shared, start, len) != 0)
+    return -1;
+  if (fstat(class->fd, &opened) == 0 && stat(class->classname, &named) == 0
+      && (opened.st_ino != named.st_ino || opened.st_dev != named.st_dev)) {
+    osbf_unlock_class (class, start, len);
+    return 0;
+  }
+  return 1;
+}
+
+/* whether a caller that first opened a class at time start may open it
+   again after finding it replaced */
+static int may_reopen(const CLASS_STRUCT *class, double start) {
+  return seconds() - start <= class->ctx->lock_timeout;
+}
+
+/*****************************************************************/
+
+/* Shard k > 0 of a sharded class is the file named after the class
+   with "." and k appended [Note Shards]; shard 0 is the file bearing
+   the class name.  Room for the suffix: */
+
+#define SHARD_SUFFIX_LEN 12
+
+static void shard_name(char *name, const char *classname, uint32_t k) {
+  if (k == 0)
+    strcpy(name, classname);
+  else
+    sprintf(name, "%s.%d", classname, (int) k);
+}
+
+/* Returns the number of shards of the class whose file is open on fd,
+   storing in *shard which of them the file is, or returns 0 if the
+   file is not a native image of a sharded class. */
+
+static uint32_t file_shards(int fd, uint32_t *shard) {
+  union { OSBF_HEADER_STRUCT header; char bytes[4096]; } image;
+    /* room for the header of any format we might recognize */
+  OSBF_FORMAT **pformat;
+
+  memset(&image, 0, sizeof(image));
+  if (lseek(fd, 0, SEEK_SET) != 0
+      || read(fd, image.bytes, sizeof(image.bytes)) < (ssize_t) sizeof(image.header))
+    return 0;
+  for (pformat = osbf_image_formats; *pformat; pformat++)
+    if ((*pformat)->i_recognize_image(&image)) {
+      if (!(*pformat)->native)
+        return 0;
+      *shard = image.header.shard;
+      return image.header.num_shards;
+    }
+  return 0;
+}
+
+static void open_shards(CLASS_STRUCT *class, osbf_class_usage usage,
+                        uint32_t num_shards, OSBF_HANDLER *h);
+
+/* Opens a class under the context ctx, or with member set, only the
+   file named classname, even if it is shard 0 of a sharded class
+   [Note Shards]. */
+
+static void
+open_class(const char *classname, osbf_class_usage usage,
+           CLASS_STRUCT * class, int member, const OSBF_CONTEXT *ctx,
+           OSBF_HANDLER *h)
 {
   static int open_flags[] = { O_RDONLY, O_RDWR, O_RDWR }; /* map usage to flags */
   int prot, mmap_flags;
   void *image;
   OSBF_FORMAT **pformat;
   int native = 0;
+  int locked;
+  double start;
+  uint32_t num_shards, shard = 0;
 
   check_format_uniqueness(h);
 
@@ -78,34 +214,61 @@ osbf_open_class(const char *classname, osbf_class_usage usage,
   class->header    = NULL;
   class->buckets   = NULL;
   class->bflags    = NULL;
+  class->dirty     = NULL;
+  class->microgrooms = 0;
+  class->file_buckets = 0;
+  class->journal_limit = 0;
+  class->journal_size  = 0;
+  class->journaled = NULL;
+  class->publish   = 0;
+  class->lock_wait = 0;
+  class->shards    = NULL;
+  class->num_shards = 0;
+  memset(&class->features, 0, sizeof(class->features));
+  class->ctx       = ctx;
   class->state     = OSBF_COPIED;
                          /* the default unless overwritten by a native format */
 
-  class->fsize = check_file (classname);
-  osbf_raise_unless(class->fsize >= 0,
-                    h, "File %s cannot be opened for read.", classname);
-
   /* open the class and mmap it into memory */
   
   osbf_raise_unless((unsigned)usage < NELEMS(open_flags), h,
                     "This can't happen: usage w/o flags");
-  class->fd = open (classname, open_flags[(unsigned)usage]);
-  osbf_raise_unless(class->fd >= 0, h,
-                    "Couldn't open the file %s for read/write.", classname);
 
   class->classname = osbf_malloc(strlen(classname)+1, h, "class name");
   strcpy(class->classname, classname);
 
-  if ((usage != OSBF_READ_ONLY) && USE_LOCKING) {
-    /* if (osbf_lock_file (class->fd, 0, sizeof(*class->header)) != 0) { */
-    if (osbf_lock_class (class, 0, sizeof(*class->header)) != 0) {
-      close (class->fd);
+  for (start = seconds(); ; ) {
+    class->fsize = check_file (classname);
+    UNLESS_CLEANUP_RAISE(class->fsize >= 0, free(class->classname),
+                         (h, "File %s cannot be opened for read.", classname));
+    class->fd = open (classname, open_flags[(unsigned)usage]);
+    UNLESS_CLEANUP_RAISE(class->fd >= 0, free(class->classname),
+                         (h, "Couldn't open the file %s for read/write.", classname));
+    if (!member && (num_shards = file_shards(class->fd, &shard)) > 1 && shard == 0) {
+      close(class->fd);
       class->fd = -1;
+      open_shards(class, usage, num_shards, h);
+      return;
+    }
+    if (usage == OSBF_READ_ONLY ? !READER_LOCKS(ctx) : !USE_LOCKING)
+      break;
+    if (usage == OSBF_READ_ONLY) /* [Note Locks] */
+      locked = lock_named_file(class, 1, FLUSH_START, FLUSH_LEN);
+    else
+      locked = lock_named_file(class, 0, 0, sizeof(*class->header));
+    if (locked > 0)
+      break;
+    close (class->fd);
+    class->fd = -1;
+    if (locked < 0 || !may_reopen(class, start)) {
       free(class->classname);
       class->classname = NULL;
       osbf_raise(h, "Couldn't lock the file %s.", classname);
     }
   }
+  /* the size again, now that the file is locked; not with check_file,
+     as closing any descriptor of the file would release the lock */
+  class->fsize = lseek (class->fd, 0, SEEK_END);
 
   prot  = (usage == OSBF_READ_ONLY) ? PROT_READ : PROT_READ + PROT_WRITE;
   mmap_flags = prot & PROT_WRITE ? MAP_PRIVATE : MAP_SHARED;
@@ -129,7 +292,12 @@ osbf_open_class(const char *classname, osbf_class_usage usage,
         if (DEBUG)
           fprintf(stderr, "Recognized file %s as %s (uid %d: %s)\n",
                   classname, format->name, format->unique_id, format->longname);
-        if (format->expected_size(image) != class->fsize)
+        /* the file of a class that grows may be longer than its
+           image [Note Growth]; a native image starts with its header */
+        if (format->expected_size(image) != class->fsize
+            && !(format->native
+                 && ((OSBF_HEADER_STRUCT *) image)->base_buckets != 0
+                 && format->expected_size(image) < class->fsize))
           osbf_raise(h, "This can't happen: "
                      "expected %d-byte image but size of file %s is %d bytes", 
                       (int) format->expected_size(image), classname,
@@ -139,6 +307,21 @@ osbf_open_class(const char *classname, osbf_class_usage usage,
           class->header  = format->header.find(image, class, h);
           class->buckets = format->buckets.find(image, class, h);
           class->state = OSBF_MAPPED;
+          if (CLASS_GROWS(class)) {
+            /* map up to the ceiling, so buckets added later are mapped */
+            off_t reserve = osbf_native_size_of(class->header->max_buckets);
+            class->file_buckets =
+              (class->fsize - osbf_native_size_of(0)) / sizeof(*class->buckets);
+            munmap(image, class->fsize);
+            image = mmap (NULL, reserve, prot, MAP_PRIVATE, class->fd, 0);
+            UNLESS_CLEANUP_RAISE(image != MAP_FAILED,
+                                 (close(class->fd), free(class->classname)),
+                                 (h, "Couldn't mmap %s up to its ceiling: %s.",
+                                  classname, strerror(errno)));
+            class->fsize = reserve;
+            class->header  = format->header.find(image, class, h);
+            class->buckets = format->buckets.find(image, class, h);
+          }
         } else {
           class->header = osbf_malloc(sizeof(*class->header), h, "header");
           format->header.copy(class->header, image, class, h);
@@ -146,10 +329,14 @@ osbf_open_class(const char *classname, osbf_class_usage usage,
             osbf_malloc(class->header->num_buckets * sizeof(*class->buckets),
                         h, "buckets");
           format->buckets.copy(class->buckets, image, class, h);
-          close(class->fd);
-          class->fd = -1;
           munmap(image, class->fsize);
           class->fsize = 0;
+          /* a writer keeps the file, and its lock, until the class is
+             written back in the native format [Note Migration] */
+          if (usage == OSBF_READ_ONLY) {
+            close(class->fd);
+            class->fd = -1;
+          }
         }
         native = format->native;
         break;
@@ -159,7 +346,9 @@ osbf_open_class(const char *classname, osbf_class_usage usage,
   if (class->header == NULL)
     osbf_raise(h, "File %s is not in a format that OSBF understands\n", classname);
 
-  class->bflags = malloc (class->header->num_buckets * sizeof (unsigned char));
+  /* calloc'd, so pages of flags never touched are never faulted in */
+  class->bflags = calloc (MAX_BUCKETS(class), sizeof (*class->bflags));
+  class->bflags_epoch = 1;
   if (class->bflags == NULL) {
     if (!native) { free(class->header); free(class->buckets); }
     free(class->classname);
@@ -169,10 +358,125 @@ osbf_open_class(const char *classname, osbf_class_usage usage,
     osbf_raise(h, "Couldn't allocate memory for seen features array.");
   }
 
+  if (native && usage == OSBF_WRITE_ALL) {
+    class->dirty = calloc ((MAX_BUCKETS(class) + 31) / 32,
+                           sizeof (*class->dirty));
+    if (class->dirty == NULL) {
+      free(class->bflags);
+      free(class->classname);
+      class->bflags = NULL;
+      class->header = NULL;
+      class->buckets = NULL;
+      class->classname = NULL;
+      osbf_raise(h, "Couldn't allocate memory for dirty-buckets bitmap.");
+    }
+  }
+
+  if (osbf_journal_replay(class) != 0) {
+    int saved_errno = errno;
+    if (usage != OSBF_READ_ONLY && USE_LOCKING)
+      osbf_unlock_class(class, 0, sizeof(*class->header));
+    class->usage = OSBF_READ_ONLY; /* so that closing writes nothing */
+    osbf_close_class(class, h);
+    osbf_raise(h, "Couldn't read the journal of %s: %s", classname,
+               strerror(saved_errno));
+  }
+  if (native && usage == OSBF_WRITE_ALL && !CLASS_GROWS(class))
+    class->journal_limit = ctx->journal_limit;
+  if (native && usage == OSBF_WRITE_ALL)
+    class->publish = ctx->snapshots;
+  if (usage == OSBF_READ_ONLY && READER_LOCKS(ctx) && class->fd >= 0)
+    osbf_unlock_class(class, FLUSH_START, FLUSH_LEN);
+
   if (class->buckets == NULL || class->header == NULL || class->bflags == NULL)
     osbf_raise(h, "This can't happen: class not fully initialized");
 }
 
+void
+osbf_open_class(const char *classname, osbf_class_usage usage,
+                CLASS_STRUCT * class, const OSBF_CONTEXT *ctx, OSBF_HANDLER *h)
+{
+  open_class(classname, usage, class, 0, ctx, h);
+}
+
+/* Opens every shard of a sharded class read-only [Note Shards].  The
+   class name is already in class->classname.  The files are checked
+   before any is opened, so that a missing or foreign shard leaves
+   nothing open. */
+
+static void open_shards(CLASS_STRUCT *class, osbf_class_usage usage,
+                        uint32_t num_shards, OSBF_HANDLER *h) {
+  char *name;
+  uint32_t k;
+
+  name = malloc(strlen(class->classname) + SHARD_SUFFIX_LEN);
+  UNLESS_CLEANUP_RAISE(name != NULL,
+                       (free(class->classname), class->classname = NULL),
+                       (h, "Couldn't allocate memory for the shard names"));
+  for (k = 0; k < num_shards; k++) {
+    uint32_t n = 0, shard = 0;
+    int fd;
+
+    shard_name(name, class->classname, k);
+    fd = open(name, O_RDONLY);
+    if (fd >= 0) {
+      n = file_shards(fd, &shard);
+      close(fd);
+    }
+    if (n != num_shards || shard != k) {
+      char shown[200];
+      strncpy(shown, name, sizeof(shown));
+      shown[sizeof(shown)-1] = '\0';
+      free(name);
+      free(class->classname);
+      class->classname = NULL;
+      osbf_raise(h, "File %s is missing or is not shard %d of %d of its class",
+                 shown, (int) k, (int) num_shards);
+    }
+  }
+
+  class->shards = calloc(num_shards, sizeof(*class->shards));
+  UNLESS_CLEANUP_RAISE(class->shards != NULL,
+                       (free(name), free(class->classname), class->classname = NULL),
+                       (h, "Couldn't allocate memory for %d shards", (int) num_shards));
+  for (k = 0; k < num_shards; k++)
+    class->shards[k].state = OSBF_CLOSED;
+  class->num_shards = num_shards;
+  for (k = 0; k < num_shards; k++) {
+    shard_name(name, class->classname, k);
+    open_class(name, OSBF_READ_ONLY, &class->shards[k], 1, class->ctx, h);
+    class->lock_wait += class->shards[k].lock_wait;
+  }
+  free(name);
+
+  class->header   = class->shards[0].header;
+  class->fmt_name = class->shards[0].fmt_name;
+  class->usage    = usage;
+  class->state    = OSBF_MAPPED;
+}
+
+void
+osbf_open_shard (CLASS_STRUCT *class, uint32_t k, osbf_class_usage usage,
+                 CLASS_STRUCT *shard, OSBF_HANDLER *h)
+{
+  osbf_raise_unless(class->shards != NULL && k < class->num_shards, h,
+                    "Class %s has no shard %d", class->classname, (int) k);
+  open_class(class->shards[k].classname, usage, shard, 1, class->ctx, h);
+}
+
+void
+osbf_refresh_shard (CLASS_STRUCT *class, uint32_t k, OSBF_HANDLER *h)
+{
+  CLASS_STRUCT fresh;
+
+  osbf_open_shard(class, k, OSBF_READ_ONLY, &fresh, h);
+  class->lock_wait += fresh.lock_wait;
+  osbf_close_class(&class->shards[k], h);
+  class->shards[k] = fresh;
+  if (k == 0)
+    class->header = fresh.header;
+}
+
 void cleanup_partial_class(void *image, CLASS_STRUCT *class, int native) {
   if (class->classname) {
     free(class->classname);
@@ -194,6 +498,80 @@ void cleanup_partial_class(void *image, CLASS_STRUCT *class, int native) {
 
 /*****************************************************************/
 
+/* [Note Migration]
+   ~~~~~~~~~~~~~~~~
+   A class in an older format is copied into memory when it is opened,
+   and a writer writes it back in the native format when it closes it.
+   The writer keeps the old file open, and so its lock, from open to
+   close; the native image goes into a new file that is then renamed
+   over the class, so other processes see either the whole old file
+   or the whole new one, and a writer waiting for the lock opens the
+   new one (see lock_named_file).  The conversion loses information,
+   as the second hash is cut to its fingerprint [Note Fingerprint], so
+   the old file stays behind under the class name with ".v" and its
+   version appended (e.g., spam.cfc.v7), where the file system allows
+   a second link; renaming it back undoes the conversion, and the
+   trainings made since. */
+
+#define BACKUP_SUFFIX_LEN 12
+
+static int write_native_file(CLASS_STRUCT *class, uint32_t old_version) {
+  size_t len = NUM_BUCKETS(class) * sizeof(*class->buckets);
+  char *name = malloc(strlen(class->classname) + BACKUP_SUFFIX_LEN);
+  char image[OSBF_HEADER_SIZE];
+  struct stat st;
+  int fd, ok, saved_errno;
+
+  if (name == NULL)
+    return -1;
+  sprintf(name, "%s.new", class->classname);
+  class->header->db_version = OSBF_CURRENT_VERSION;  /* what we're writing now */
+  class->header->generation = osbf_new_generation(); /* [Note Journal] */
+  memset(image, 0, sizeof(image));
+  memcpy(image, class->header, sizeof(*class->header));
+  fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  ok = fd >= 0
+    && (class->fd < 0
+        || (fstat(class->fd, &st) == 0 && fchmod(fd, st.st_mode & 07777) == 0))
+    && write(fd, image, sizeof(image)) == (ssize_t) sizeof(image)
+    && write(fd, class->buckets, len) == (ssize_t) len
+    && fsync(fd) == 0;
+  saved_errno = errno;
+  if (fd >= 0 && close(fd) != 0 && ok) {
+    ok = 0;
+    saved_errno = errno;
+  }
+  if (ok && class->fd >= 0 && old_version != OSBF_CURRENT_VERSION) {
+    char *backup = malloc(strlen(class->classname) + BACKUP_SUFFIX_LEN);
+    if (backup != NULL) {
+      sprintf(backup, "%s.v%d", class->classname, (int) old_version);
+      (void) link(class->classname, backup); /* an older copy is kept */
+      free(backup);
+    }
+  }
+  if (ok && rename(name, class->classname) != 0) {
+    ok = 0;
+    saved_errno = errno;
+  }
+  if (!ok)
+    remove(name);
+  free(name);
+  errno = saved_errno;
+  return ok ? 0 : -1;
+}
+
+/* releases the lock and file of a class being migrated */
+static void drop_file(CLASS_STRUCT *class) {
+  int saved_errno = errno;
+  if (class->fd >= 0) {
+    if (USE_LOCKING)
+      osbf_unlock_class(class, 0, sizeof(*class->header));
+    close(class->fd);
+    class->fd = -1;
+  }
+  errno = saved_errno;
+}
+
 static void flush_if_needed(CLASS_STRUCT * class, OSBF_HANDLER *h);
   /* flush header and buckets to disk if needed, then free 
      them and set to NULL (even on error).  May be called only
@@ -202,6 +580,7 @@ static void flush_if_needed(CLASS_STRUCT * class, OSBF_HANDLER *h);
 
 static void flush_if_needed(CLASS_STRUCT * class, OSBF_HANDLER *h) {
   FILE *fp;
+  uint32_t old_version = class->header->db_version;
 
   /* if a new version and we are writing, write everything */
   if (class->usage != OSBF_READ_ONLY &&
@@ -216,12 +595,11 @@ static void flush_if_needed(CLASS_STRUCT * class, OSBF_HANDLER *h) {
     case OSBF_READ_ONLY:
       break;  /* read-only; disk is good */
     case OSBF_WRITE_ALL: 
-      /* write a complete new file */
-      fp = fopen(class->classname, "wb");
-      UNLESS_CLEANUP_RAISE(fp != NULL, CLEANUP,
-             (h, "Could not open class file %s for writing", class->classname));
-      class->header->db_version = OSBF_CURRENT_VERSION;  /* what we're writing now */
-      osbf_native_write_class(class, fp, h);
+      /* write a complete new file and rename it over the class [Note Migration] */
+      UNLESS_CLEANUP_RAISE(write_native_file(class, old_version) == 0,
+             (CLEANUP, drop_file(class)),
+             (h, "Could not write class file %s: %s", class->classname,
+              strerror(errno)));
       break;
     case OSBF_WRITE_HEADER:
       /* overwrite a new header onto the existing new file */
@@ -238,6 +616,8 @@ static void flush_if_needed(CLASS_STRUCT * class, OSBF_HANDLER *h) {
           (h, "Image of file %s is %d bytes; expected to write %d bytes", 
            class->classname, (int) ftell(fp),
            (int) osbf_native_image_size(class)));
+      UNLESS_CLEANUP_RAISE(fclose(fp) == 0, CLEANUP,
+             (h, "Could not write header to class file %s", class->classname));
       break;
     default:
       CLEANUP;
@@ -249,10 +629,30 @@ static void flush_if_needed(CLASS_STRUCT * class, OSBF_HANDLER *h) {
 }
 
 static void touch_fd(int fd);
+static int write_dirty(CLASS_STRUCT * class);
+static int publish_generation(CLASS_STRUCT * class);
 
 void
 osbf_close_class (CLASS_STRUCT * class, OSBF_HANDLER *h)
 {
+  int write_failed = 0;
+
+  if (class->shards) {
+    uint32_t k;
+    for (k = 0; k < class->num_shards; k++)
+      if (class->shards[k].state != OSBF_CLOSED)
+        osbf_close_class(&class->shards[k], h);
+    free(class->shards);
+    class->shards = NULL;
+    class->num_shards = 0;
+    osbf_free_features(&class->features);
+    class->header = NULL;
+    class->state = OSBF_CLOSED;
+    free(class->classname);
+    class->classname = NULL;
+    return;
+  }
+
   if (class->bflags) {
     free (class->bflags);
     class->bflags = NULL;
@@ -273,12 +673,45 @@ osbf_close_class (CLASS_STRUCT * class, OSBF_HANDLER *h)
         osbf_raise(h, "This can't happen: close class with non-NULL header field");
         break;
       case OSBF_MAPPED:
-        if (class->fsize != osbf_native_image_size(class))
+        if (class->fsize != (CLASS_GROWS(class)
+                             ? osbf_native_size_of(class->header->max_buckets)
+                             : osbf_native_image_size(class)))
           osbf_raise(h, "This can't happen: native-mapped class has the wrong size");
         if (class->usage != OSBF_READ_ONLY) {
-          if (lseek(class->fd, 0, SEEK_SET) == (off_t)-1)
-            osbf_raise(h, "This can't happen: failed to seek to beginning of file");
-          write(class->fd, class->header, class->fsize);
+          /* a file without a generation id takes no journal [Note Journal] */
+          int journaled = class->journal_size > 0
+            || (class->journal_limit > 0 && class->header->generation != 0);
+          int checkpoint = class->usage == OSBF_WRITE_ALL
+            && class->journal_size >= class->journal_limit;
+          /* [Note Locks]; a reader that holds the flush region longer
+             than the lock timeout is stuck, and the training is kept anyway */
+          int flush_locked = LOCK_FLUSHES && !class->publish
+            && timed_lock(class, 0, FLUSH_START, FLUSH_LEN) == 0;
+
+          /* [Note Journal] */
+          if (journaled)
+            write_failed =
+              osbf_journal_append(class, checkpoint && !class->publish) != 0;
+          if (!write_failed && (!journaled || checkpoint)) {
+            if (class->usage == OSBF_WRITE_ALL && class->header->generation == 0)
+              class->header->generation = osbf_new_generation();
+            if (class->publish)
+              write_failed = publish_generation(class) != 0
+                             || osbf_journal_remove(class) != 0;
+            else if (journaled) {
+              osbf_journal_mark_dirty(class);
+              write_failed = write_dirty(class) != 0 || fsync(class->fd) != 0
+                             || osbf_journal_remove(class) != 0;
+            } else
+              write_failed = write_dirty(class) != 0;
+          }
+          /* give back the room made ahead of growth */
+          if (!write_failed && !class->publish
+              && class->file_buckets > NUM_BUCKETS(class))
+            write_failed =
+              ftruncate(class->fd, osbf_native_image_size(class)) != 0;
+          if (flush_locked)
+            osbf_unlock_class(class, FLUSH_START, FLUSH_LEN);
 
           if (DEBUG) {
             unsigned j;
@@ -291,6 +724,10 @@ osbf_close_class (CLASS_STRUCT * class, OSBF_HANDLER *h)
 
         munmap ((void *)class->header, class->fsize);
           /* cast should be redundant but on solaris it is not */
+        if (class->dirty) {
+          free (class->dirty);
+          class->dirty = NULL;
+        }
         break;
       case OSBF_COPIED:
         flush_if_needed(class, h);
@@ -302,6 +739,11 @@ osbf_close_class (CLASS_STRUCT * class, OSBF_HANDLER *h)
     class->state = OSBF_CLOSED;
   }
 
+  if (class->journaled) {
+    free (class->journaled);
+    class->journaled = NULL;
+  }
+
   if (class->fd >= 0) {
       int unlock_failed = 0;
       if (class->usage != OSBF_READ_ONLY)
@@ -320,6 +762,11 @@ osbf_close_class (CLASS_STRUCT * class, OSBF_HANDLER *h)
       class->fd = -1;
   }
 
+  if (write_failed)
+    osbf_raise(h, "Couldn't write class %s back to disk: %s",
+               class->classname ? class->classname : "(unknown)",
+               strerror(errno));
+
   if (class->classname) {
     free(class->classname);
     class->classname = NULL;
@@ -328,6 +775,412 @@ osbf_close_class (CLASS_STRUCT * class, OSBF_HANDLER *h)
 
 /*****************************************************************/
 
+/* Write a mapped class back to its file: the header always, and the
+   buckets only as far as they are marked dirty [Note Dirty].  Nearby
+   dirty runs are coalesced to save system calls.  Returns 0 on success. */
+
+#define DIRTY_GAP 256 /* clean buckets worth rewriting to join two runs */
+
+static int write_at(int fd, const char *image, off_t off, size_t len) {
+  return lseek(fd, off, SEEK_SET) == off
+      && write(fd, image + off, len) == (ssize_t) len;
+}
+
+static int write_dirty(CLASS_STRUCT * class) {
+  const char *image = (const char *) class->header;
+  off_t boffset = (const char *) class->buckets - image;
+  uint32_t nwords, w, start, end;
+  int have_run = 0;
+
+  if (!write_at(class->fd, image, 0, boffset))
+    return -1;
+  if (class->dirty == NULL)
+    return 0;
+
+  nwords = (NUM_BUCKETS(class) + 31) / 32;
+  start = end = 0;
+  for (w = 0; w < nwords; w++) {
+    uint32_t bits = class->dirty[w], i;
+    if (bits == 0)
+      continue;
+    for (i = w * 32; bits != 0; i++, bits >>= 1) {
+      if ((bits & 1) == 0)
+        continue;
+      if (have_run && i - end <= DIRTY_GAP) {
+        end = i + 1;
+      } else {
+        if (have_run) {
+          size_t len = (end - start) * sizeof(*class->buckets);
+          off_t off = boffset + (off_t) start * sizeof(*class->buckets);
+          if (!write_at(class->fd, image, off, len))
+            return -1;
+        }
+        start = i; end = i + 1; have_run = 1;
+      }
+    }
+  }
+  if (have_run) {
+    size_t len = (end - start) * sizeof(*class->buckets);
+    off_t off = boffset + (off_t) start * sizeof(*class->buckets);
+    if (!write_at(class->fd, image, off, len))
+      return -1;
+  }
+  return 0;
+}
+
+/*****************************************************************/
+
+/* Writes the whole image of a mapped class into a new file, with a
+   new generation id, which is then renamed over the class file [Note
+   Snapshots].  The caller holds the lock of the old file.  Returns 0
+   on success; on failure the class file is left as it was. */
+
+#define GENERATION_SUFFIX ".new"
+
+static int publish_generation(CLASS_STRUCT * class) {
+  size_t len = osbf_native_image_size(class);
+  char *name = malloc(strlen(class->classname) + sizeof(GENERATION_SUFFIX));
+  struct stat st;
+  int fd, ok, saved_errno;
+
+  if (name == NULL)
+    return -1;
+  strcpy(name, class->classname);
+  strcat(name, GENERATION_SUFFIX);
+  class->header->generation = osbf_new_generation();
+  fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  ok = fd >= 0
+    && fstat(class->fd, &st) == 0
+    && fchmod(fd, st.st_mode & 07777) == 0
+    && write(fd, class->header, len) == (ssize_t) len
+    && fsync(fd) == 0;
+  saved_errno = errno;
+  if (fd >= 0 && close(fd) != 0 && ok) {
+    ok = 0;
+    saved_errno = errno;
+  }
+  if (ok && rename(name, class->classname) != 0) {
+    ok = 0;
+    saved_errno = errno;
+  }
+  if (!ok)
+    remove(name);
+  free(name);
+  errno = saved_errno;
+  return ok ? 0 : -1;
+}
+
+/*****************************************************************/
+
+/* Makes room for num_buckets buckets in a class that grows [Note
+   Growth].  The mapping already reaches the ceiling, so only the file
+   is lengthened, by an eighth more than needed, to save system calls;
+   the header on disk is not changed until the class is closed.
+   Returns 0 on success. */
+
+int
+osbf_extend_class (CLASS_STRUCT *class, uint32_t num_buckets)
+{
+  uint32_t room;
+
+  if (num_buckets <= class->file_buckets)
+    return 0;
+  if (class->state != OSBF_MAPPED || class->usage != OSBF_WRITE_ALL
+      || !CLASS_GROWS(class) || num_buckets > class->header->max_buckets)
+    return -1;
+  room = num_buckets + num_buckets / 8;
+  if (room > class->header->max_buckets)
+    room = class->header->max_buckets;
+  if (ftruncate(class->fd, osbf_native_size_of(room)) != 0)
+    return -1;
+  class->file_buckets = room;
+  return 0;
+}
+
+/*****************************************************************/
+
+static void *counter_field(OSBF_HEADER_STRUCT *header, enum osbf_counter counter,
+                           size_t *width, OSBF_HANDLER *h) {
+  switch (counter) {
+    case OSBF_COUNT_CLASSIFICATIONS:
+      *width = sizeof(header->classifications);
+      return &header->classifications;
+    case OSBF_COUNT_LEARNINGS:
+      *width = sizeof(header->learnings);
+      return &header->learnings;
+    case OSBF_COUNT_EXTRA_LEARNINGS:
+      *width = sizeof(header->extra_learnings);
+      return &header->extra_learnings;
+    case OSBF_COUNT_FALSE_NEGATIVES:
+      *width = sizeof(header->false_negatives);
+      return &header->false_negatives;
+    case OSBF_COUNT_FALSE_POSITIVES:
+      *width = sizeof(header->false_positives);
+      return &header->false_positives;
+  }
+  osbf_raise(h, "This can't happen: unknown header counter %d", (int) counter);
+  return NULL;
+}
+
+uint64_t
+osbf_add_to_counter (OSBF_HEADER_STRUCT *header, enum osbf_counter counter,
+                     int64_t delta, OSBF_HANDLER *h)
+{
+  size_t width = 0;
+  void *field = counter_field(header, counter, &width, h);
+  uint64_t value, max;
+
+  if (width == sizeof(uint64_t)) {
+    value = *(uint64_t *) field;
+    max   = UINT64_MAX;
+  } else {
+    value = *(uint32_t *) field;
+    max   = UINT32_MAX;
+  }
+  if (delta < 0) {
+    uint64_t decrement = (uint64_t) -(delta + 1) + 1; /* no overflow */
+    value = value < decrement ? 0 : value - decrement;
+  } else {
+    value = max - value < (uint64_t) delta ? max : value + delta;
+  }
+  if (width == sizeof(uint64_t))
+    *(uint64_t *) field = value;
+  else
+    *(uint32_t *) field = (uint32_t) value;
+  return value;
+}
+
+/* Counters are bumped after most classifications, so rather than map
+   the whole class and write its header back, read the header under a
+   lock on the header region and write back just the counter.  Only
+   native images without a journal can be patched this way: the
+   counters of a journaled class are those of the journal's last
+   transaction, which would undo a change made in the file [Note
+   Journal].  Anything else goes through osbf_open_class, which applies
+   the journal and converts other formats to the native one.  */
+
+uint64_t
+osbf_increment_counter (const char *cfcfile, enum osbf_counter counter,
+                        int64_t delta, const OSBF_CONTEXT *ctx, OSBF_HANDLER *h)
+{
+  CLASS_STRUCT class;
+  union { OSBF_HEADER_STRUCT header; char bytes[4096]; } image;
+    /* room for the header of any format we might recognize */
+  OSBF_FORMAT **pformat, *format = NULL;
+  struct stat st;
+  size_t width = 0;
+  uint64_t value;
+  int locked = 1;
+  double start;
+
+  check_format_uniqueness(h);
+  memset(&class, 0, sizeof(class));
+  memset(&image, 0, sizeof(image));
+  (void) counter_field(&image.header, counter, &width, h); /* check counter */
+
+  class.classname = (char *) cfcfile; /* only read by the lock functions */
+  class.ctx = ctx;
+  for (start = seconds(); ; ) {
+    class.fd = open(cfcfile, O_RDWR);
+    osbf_raise_unless(class.fd >= 0, h,
+                      "Couldn't open the file %s for read/write.", cfcfile);
+    if (!USE_LOCKING
+        || (locked = lock_named_file(&class, 0, 0, sizeof(image.header))) > 0)
+      break;
+    close(class.fd);
+    osbf_raise_unless(locked == 0 && may_reopen(&class, start), h,
+                      "Couldn't lock the file %s.", cfcfile);
+  }
+
+  if (read(class.fd, image.bytes, sizeof(image.bytes))
+        >= (ssize_t) sizeof(image.header)
+      && fstat(class.fd, &st) == 0)
+    for (pformat = osbf_image_formats; *pformat; pformat++)
+      if ((*pformat)->i_recognize_image(&image)) {
+        format = *pformat;
+        break;
+      }
+
+  class.header = &image.header;
+  if (format != NULL && format->native
+      && image.header.db_version == format->unique_id
+      && format->expected_size(&image) == st.st_size
+      && !osbf_journal_applies(&class)) {
+    char *field;
+    int ok;
+
+    value = osbf_add_to_counter(&image.header, counter, delta, h);
+    field = counter_field(&image.header, counter, &width, h);
+    ok = write_at(class.fd, (char *) &image.header,
+                  field - (char *) &image.header, width);
+    if (USE_LOCKING)
+      osbf_unlock_class(&class, 0, sizeof(image.header));
+    close(class.fd);
+    osbf_raise_unless(ok, h, "Couldn't write header of class %s: %s",
+                      cfcfile, strerror(errno));
+    return value;
+  }
+
+  if (USE_LOCKING)
+    osbf_unlock_class(&class, 0, sizeof(image.header));
+  close(class.fd);
+
+  open_class(cfcfile, OSBF_WRITE_HEADER, &class, 1, ctx, h);
+  value = osbf_add_to_counter(class.header, counter, delta, h);
+  osbf_close_class(&class, h);
+  return value;
+}
+
+/*****************************************************************/
+
+/* [Note Online resize]
+   ~~~~~~~~~~~~~~~~~~~~
+   osbf_resize_class gives a class a new number of buckets while the
+   class stays in use.  It works in three steps:
+
+     1. Under the class lock, the header and buckets are copied to
+        memory.  The lock is then released.
+     2. The copy is merged (osbf_merge) into a new file named after the
+        class with RESIZE_SUFFIX appended.  Meanwhile readers go on
+        classifying with the old file and writers go on training it.
+        Because the new file must not exist, two resizes of one class
+        cannot overlap.
+     3. Under the class lock again, the changes made to the old file
+        since the copy are replayed into the new one (osbf_replay),
+        and the new file is renamed over the old.  The lock is released
+        only after the rename.
+
+   The lock is held only while copying, replaying and renaming.
+   Readers that have the old file mapped keep using it until they open
+   the class again; the daemon does so when it sees that the file has
+   changed.  A writer that was waiting for the lock during step 3 finds
+   that the class name now refers to another file and opens that one
+   (see lock_named_file), so no training is lost.  The copy and the
+   replay see the class with its journal applied, and the new file is
+   written in place.  Once the new file bears the class name, the
+   journal of the old one, whose trainings the replay carried over, is
+   removed; should a crash come first, the journal is ignored, as the
+   new file has a generation id of its own [Note Journal].  Each shard of a sharded class is resized
+   in turn, to its share of the buckets [Note Shards]. */
+
+#define RESIZE_SUFFIX ".resize"
+
+static void
+resize_file (const char *classname, uint32_t num_buckets,
+             unsigned num_threads, const OSBF_CONTEXT *ctx, OSBF_HANDLER *h)
+{
+  CLASS_STRUCT old, copy, new;
+  CLASS_STRUCT *const from[1] = { &copy };
+  char *tmpname;
+  int rename_errno, remove_errno;
+
+  tmpname = osbf_malloc(strlen(classname) + sizeof(RESIZE_SUFFIX), h, "file name");
+  strcpy(tmpname, classname);
+  strcat(tmpname, RESIZE_SUFFIX);
+  UNLESS_CLEANUP_RAISE(check_file(tmpname) < 0, free(tmpname),
+      (h, "Cannot resize %s: file %s%s exists; either another resize is running "
+       "or one failed, in which case remove the file", classname, classname,
+       RESIZE_SUFFIX));
+
+  /* step 1: copy the class */
+  open_class(classname, OSBF_WRITE_HEADER, &old, 1, ctx, h);
+  memset(&copy, 0, sizeof(copy));
+  copy.fd       = -1;
+  copy.fmt_name = old.fmt_name;
+  copy.header   = malloc(sizeof(*copy.header));
+  copy.buckets  = malloc(NUM_BUCKETS(&old) * sizeof(*copy.buckets));
+  UNLESS_CLEANUP_RAISE(copy.header != NULL && copy.buckets != NULL,
+      (free(copy.header), free(copy.buckets), free(tmpname),
+       osbf_close_class(&old, h)),
+      (h, "Couldn't allocate memory to copy class %s", classname));
+  memcpy(copy.header, old.header, sizeof(*copy.header));
+  memcpy(copy.buckets, old.buckets, NUM_BUCKETS(&old) * sizeof(*copy.buckets));
+  copy.state = OSBF_COPIED;
+  copy.usage = OSBF_READ_ONLY;
+  osbf_close_class(&old, h);
+
+#define CLEANUP (free(copy.header), free(copy.buckets), free(tmpname))
+
+  /* step 2: build the new class, unlocked */
+  osbf_create_shard(tmpname, num_buckets,
+                    CLASS_GROWS(&copy) ? copy.header->max_buckets : 0,
+                    copy.header->num_shards, copy.header->shard, h);
+  open_class(tmpname, OSBF_WRITE_ALL, &new, 1, ctx, h);
+  new.journal_limit = 0;  /* a journal would not follow the rename */
+  osbf_merge(&new, from, 1, num_threads, h);
+
+  /* step 3: catch up and swap, locked */
+  open_class(classname, OSBF_WRITE_HEADER, &old, 1, ctx, h);
+  osbf_replay(&new, &copy, &old, h);
+  osbf_close_class(&new, h);
+  rename_errno = rename(tmpname, classname) == 0 ? 0 : errno;
+  UNLESS_CLEANUP_RAISE(rename_errno == 0,
+      (remove(tmpname), osbf_close_class(&old, h), CLEANUP),
+      (h, "Couldn't replace class %s with its resized copy: %s", classname,
+       strerror(rename_errno)));
+  remove_errno = osbf_journal_remove(&old) == 0 ? 0 : errno;
+  UNLESS_CLEANUP_RAISE(remove_errno == 0, (osbf_close_class(&old, h), CLEANUP),
+      (h, "Couldn't remove the journal of the old %s: %s", classname,
+       strerror(remove_errno)));
+  osbf_close_class(&old, h);
+  CLEANUP;
+#undef CLEANUP
+}
+
+void
+osbf_resize_class (const char *classname, uint32_t num_buckets,
+                   unsigned num_threads, const OSBF_CONTEXT *ctx,
+                   OSBF_HANDLER *h)
+{
+  uint32_t num_shards = 0, shard = 0, k;
+  int fd = open(classname, O_RDONLY);
+  char *name;
+
+  if (fd >= 0) {
+    num_shards = file_shards(fd, &shard);
+    close(fd);
+  }
+  if (num_shards <= 1 || shard != 0) {
+    resize_file(classname, num_buckets, num_threads, ctx, h);
+    return;
+  }
+  osbf_raise_unless(num_buckets >= num_shards, h,
+                    "Cannot resize %s to fewer buckets than its %d shards",
+                    classname, (int) num_shards);
+  name = osbf_malloc(strlen(classname) + SHARD_SUFFIX_LEN, h, "file name");
+  for (k = 0; k < num_shards; k++) {
+    shard_name(name, classname, k);
+    resize_file(name, num_buckets / num_shards, num_threads, ctx, h);
+  }
+  free(name);
+}
+
+/*****************************************************************/
+
+void
+osbf_create_sharded (const char *cfcfile, uint32_t num_buckets,
+                     uint32_t max_buckets, uint32_t num_shards, OSBF_HANDLER *h)
+{
+  char *name;
+  uint32_t k;
+
+  if (num_shards <= 1) {
+    osbf_create_cfcfile(cfcfile, num_buckets, max_buckets, h);
+    return;
+  }
+  osbf_raise_unless(num_buckets >= num_shards, h,
+                    "Cannot split %d buckets into %d shards",
+                    (int) num_buckets, (int) num_shards);
+  name = osbf_malloc(strlen(cfcfile) + SHARD_SUFFIX_LEN, h, "file name");
+  /* shard 0 last, so the class cannot be opened before it is complete */
+  for (k = num_shards; k-- > 0; ) {
+    shard_name(name, cfcfile, k);
+    osbf_create_shard(name, num_buckets / num_shards, max_buckets / num_shards,
+                      num_shards, k, h);
+  }
+  free(name);
+}
+
 /*****************************************************************/
 
 extern FILE *create_file_if_absent(const char *filename, OSBF_HANDLER *h) {
@@ -368,9 +1221,10 @@ static void touch_fd(int fd) {
 
 /* when more formats are added, they should be added here as well */
 
-extern OSBF_FORMAT osbf_format_5, osbf_format_6, osbf_format_7;
+extern OSBF_FORMAT osbf_format_5, osbf_format_6, osbf_format_7, osbf_format_8;
 
 OSBF_FORMAT *osbf_image_formats[] = {
+  &osbf_format_8,
   &osbf_format_7,
   &osbf_format_6,
   &osbf_format_5,
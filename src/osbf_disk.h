@@ -22,7 +22,8 @@
    in the headers for the addition of new fields.  Unique ID 6
    identifies a transitional format.  Unique IDs 7 and above will be
    associated with formats whose on-disk representation begins with
-   the letters OSBF.
+   the letters OSBF.  Unique ID 7 has 12-byte buckets; unique ID 8
+   has the 8-byte buckets of [Note Fingerprint] in osbflib.h.
 
    Formats come in two flavors: native and non-native.
 
@@ -132,6 +133,30 @@ extern OSBF_FORMAT *osbf_image_formats[];
 extern void  osbf_native_write_class (CLASS_STRUCT *class, FILE *fp, OSBF_HANDLER *h);
 extern void  osbf_native_write_header(CLASS_STRUCT *class, FILE *fp, OSBF_HANDLER *h);
 extern off_t osbf_native_image_size  (CLASS_STRUCT *class);
+extern off_t osbf_native_size_of     (uint32_t num_buckets);
+  /* size of a native image with num_buckets buckets */
+
+/* the journal of a mapped class [Note Journal] in osbflib.h */
+extern int  osbf_journal_replay (CLASS_STRUCT *class);
+  /* applies the journal, if any, to a class just opened; 0 on success */
+extern int  osbf_journal_append (CLASS_STRUCT *class, int sync);
+  /* appends the changes since the open or the last append, syncing the
+     journal if sync is nonzero; 0 on success */
+extern void osbf_journal_mark_dirty (CLASS_STRUCT *class);
+  /* marks dirty every bucket the journal set, for a checkpoint */
+extern int  osbf_journal_remove (CLASS_STRUCT *class);
+  /* removes the journal; 0 on success */
+extern int  osbf_journal_applies (const CLASS_STRUCT *class);
+  /* nonzero if the class has a journal of its generation, which opening
+     it would apply; needs only the classname and header */
+extern uint64_t osbf_new_generation (void);
+  /* a random nonzero id for a class file written anew [Note Journal] */
+
+extern void osbf_create_shard (const char *cfcfile, uint32_t num_buckets,
+                               uint32_t max_buckets, uint32_t num_shards,
+                               uint32_t shard, OSBF_HANDLER *h);
+  /* creates a native class file whose header names it shard number shard
+     of num_shards [Note Shards], or an ordinary one if num_shards is 0 */
 
 extern FILE *create_file_if_absent(const char *filename, OSBF_HANDLER *h);
   /* if file cannot be opened for read, attempt fopen(filename, "wb")
@@ -37,7 +37,7 @@ struct osbf_format MY_FORMAT = {
 
 /* complete header */
 /* define header size to be a multiple of the bucket size, approx. 4 Kbytes */
-#define OBSOLETE_OSBF_CFC_HEADER_SIZE (4096 / sizeof(OSBF_BUCKET_STRUCT))
+#define OBSOLETE_OSBF_CFC_HEADER_SIZE (4096 / sizeof(MY_BUCKET_STRUCT))
 
 typedef struct
 {
@@ -120,31 +120,14 @@ copy_header (OSBF_HEADER_STRUCT *xxxheader, void *p,
 
 static unsigned upconvert_bucket(OSBF_UNIVERSAL_BUCKET *dst, void *src);
 
-/* all this goo is meant to be evaluated at compile time; hence the macros */
-
-#define FIELD_OFFSET(P, f) ((char *)&(P)->f - (char *)(P))
-#define FIELDS_EQ(P1, P2, f) \
-  sizeof((P1)->f) == sizeof((P2)->f) && FIELD_OFFSET(P1, f) == FIELD_OFFSET(P2, f)
-
 static void 
 copy_buckets(OSBF_BUCKET_STRUCT *buckets, void *p,
              CLASS_STRUCT *class, OSBF_HANDLER *h) {
   MY_DISK_IMAGE *image = p;
-  OSBF_UNIVERSAL_BUCKET uni;
-
-  if (sizeof(uni) == sizeof(*buckets) && FIELDS_EQ(buckets, &uni, hash1) &&
-      FIELDS_EQ(buckets, &uni, hash2) && FIELDS_EQ(buckets, &uni, count)) {
-    /* everything matches */
-    memcpy(buckets, (OSBF_BUCKET_STRUCT *)image + image->header.buckets_start,
-           image->header.num_buckets * sizeof(*buckets));
-  } else {
-    osbf_raise(h, "bucket format has changed; upconverter in osbf_read5.c needs "
-               "to be checked");
-    osbf_native_buckets_of_universal(buckets,
-            (OSBF_BUCKET_STRUCT *)image + image->header.buckets_start,
-                                     upconvert_bucket, image->header.num_buckets);
-  }
-  (void)class; /* not otherwise used */
+  osbf_native_buckets_of_universal(buckets,
+            (MY_BUCKET_STRUCT *)image + image->header.buckets_start,
+                                   upconvert_bucket, image->header.num_buckets);
+  (void)class; (void)h; /* not otherwise used */
 }
 
 static unsigned upconvert_bucket(OSBF_UNIVERSAL_BUCKET *dst, void *src) {
@@ -28,7 +28,7 @@ typedef struct /* used for disk image, so avoiding enum type for db_version */
 } OSBF_HEADER_STRUCT_2007_12;
 
 typedef OSBF_HEADER_STRUCT_2007_12 MY_HEADER_STRUCT;
-typedef OSBF_BUCKET_STRUCT MY_BUCKET_STRUCT;
+typedef OSBF_BUCKET_STRUCT_2007_11 MY_BUCKET_STRUCT;
 
 typedef struct {
   OSBF_HEADER_STRUCT_2007_12 headers[1];
@@ -57,7 +57,7 @@ struct osbf_format MY_FORMAT = {
 
 static long image_size(const MY_HEADER_STRUCT *header);
 static long image_size(const MY_HEADER_STRUCT *header) {
-  return sizeof(MY_DISK_IMAGE) + header->num_buckets * sizeof(OSBF_BUCKET_STRUCT);
+  return sizeof(MY_DISK_IMAGE) + header->num_buckets * sizeof(MY_BUCKET_STRUCT);
 }
 
 static int i_recognize_image(void *p) {
@@ -90,8 +90,8 @@ copy_header (OSBF_HEADER_STRUCT *xxxheader, void *p,
   uni.db_version      = image->headers[0].db_version;
   uni.db_id           = image->headers[0].db_id;
   uni.db_flags        = image->headers[0].db_flags;
-  uni.buckets_start   = (OSBF_BUCKET_STRUCT *) &image->headers[1] -
-                        (OSBF_BUCKET_STRUCT *) &image->headers[0];
+  uni.buckets_start   = (MY_BUCKET_STRUCT *) &image->headers[1] -
+                        (MY_BUCKET_STRUCT *) &image->headers[0];
   uni.num_buckets     = image->headers[0].num_buckets;
   uni.learnings       = image->headers[0].learnings;
   uni.false_negatives = image->headers[0].false_negatives;
@@ -106,30 +106,13 @@ copy_header (OSBF_HEADER_STRUCT *xxxheader, void *p,
 
 static unsigned upconvert_bucket(OSBF_UNIVERSAL_BUCKET *dst, void *src);
 
-/* all this goo is meant to be evaluated at compile time; hence the macros */
-
-#define FIELD_OFFSET(P, f) ((char *)&(P)->f - (char *)(P))
-#define FIELDS_EQ(P1, P2, f) \
-  sizeof((P1)->f) == sizeof((P2)->f) && FIELD_OFFSET(P1, f) == FIELD_OFFSET(P2, f)
-
 static void 
 copy_buckets(OSBF_BUCKET_STRUCT *buckets, void *p,
              CLASS_STRUCT *class, OSBF_HANDLER *h) {
   MY_DISK_IMAGE *image = p;
-  OSBF_UNIVERSAL_BUCKET uni;
-
-  if (sizeof(uni) == sizeof(*buckets) && FIELDS_EQ(buckets, &uni, hash1) &&
-      FIELDS_EQ(buckets, &uni, hash2) && FIELDS_EQ(buckets, &uni, count)) {
-    /* everything matches */
-    memcpy(buckets, (OSBF_BUCKET_STRUCT *)(image + 1),
-           image->headers[0].num_buckets * sizeof(*buckets));
-  } else {
-    osbf_raise(h, "bucket format has changed; upconverter in osbf_fmt_6.c needs "
-               "to be checked");
-    osbf_native_buckets_of_universal(buckets, (OSBF_BUCKET_STRUCT *)(image + 1),
-                                     upconvert_bucket, image->headers[0].num_buckets);
-  }
-  (void)class; /* not otherwise used */
+  osbf_native_buckets_of_universal(buckets, (MY_BUCKET_STRUCT *)(image + 1),
+                                   upconvert_bucket, image->headers[0].num_buckets);
+  (void)class; (void)h; /* not otherwise used */
 }
 
 static unsigned upconvert_bucket(OSBF_UNIVERSAL_BUCKET *dst, void *src) {
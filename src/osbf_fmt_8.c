@@ -0,0 +1,276 @@
+/*
+ * Format for database version 8: 8-byte buckets [Note Fingerprint].
+ *
+ * See Copyright Notice in osbflib.h
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "osbflib.h"
+#include "osbf_disk.h"
+
+#include "osbfcvt.h"
+
+static int i_recognize_image(void *image);
+static off_t expected_size(void *image);
+static void *find_header (void *image, CLASS_STRUCT *class, OSBF_HANDLER *h);
+static void *find_buckets(void *image, CLASS_STRUCT *class, OSBF_HANDLER *h);
+
+#define DEBUG 0
+
+#define MY_FORMAT osbf_format_8
+
+struct osbf_format MY_FORMAT = {
+  8,  /* my unique id */
+  "OSBF-COMPACT",
+  "OSBF_Bayes-spectrum file with 8-byte buckets",
+  1,  /* I am native */
+  i_recognize_image,
+  expected_size,
+  OSBF_FIND_FUNCTIONS(find_header, find_buckets),
+};
+
+/****************************************************************/
+
+/* The image is the header, padded with zeros to OSBF_HEADER_SIZE bytes,
+   followed by the buckets.  As in version 7, the first four characters
+   of the file are OSBF or FBSO, depending on the endianness of the
+   machine that wrote it; files of the wrong endianness are recognized
+   only to be refused with a helpful message.
+*/
+
+typedef OSBF_HEADER_STRUCT MY_DISK_IMAGE;
+typedef OSBF_BUCKET_STRUCT MY_BUCKET_STRUCT;
+
+/* fails to compile unless the header fits in its padded space */
+typedef char header_fits_in_image[sizeof(MY_DISK_IMAGE) <= OSBF_HEADER_SIZE ? 1 : -1];
+
+#define U(c) ((unsigned char)(c))
+#define MK_BIG_ENDIAN(A, B, C, D) (U(D) | (U(C) << 8) | (U(B) << 16) | (U(A) << 24))
+
+enum magic {
+  OSBF_BIG    = MK_BIG_ENDIAN('O', 'S', 'B', 'F'),
+  OSBF_LITTLE = MK_BIG_ENDIAN('F', 'B', 'S', 'O')
+};
+
+static uint32_t swap(uint32_t n) {
+  return MK_BIG_ENDIAN(n & 0xff, n >> 8 & 0xff, n >> 16 & 0xff, n >> 24 & 0xff);
+}
+
+static int i_recognize_image(void *p) {
+  MY_DISK_IMAGE *image = p;
+  if (swap(OSBF_BIG) != OSBF_LITTLE) abort();
+  return (image->magic == OSBF_LITTLE && image->db_version == MY_FORMAT.unique_id)
+      || (image->magic == OSBF_BIG && swap(image->db_version) == MY_FORMAT.unique_id);
+}
+
+static off_t expected_size(void *p) {
+  MY_DISK_IMAGE *image = p;
+  uint32_t num_buckets =
+    image->magic == OSBF_LITTLE ? image->num_buckets : swap(image->num_buckets);
+  assert(i_recognize_image(p));
+  return OSBF_HEADER_SIZE + (off_t) sizeof(MY_BUCKET_STRUCT) * num_buckets;
+}
+
+off_t osbf_native_image_size  (CLASS_STRUCT *class) {
+  assert(i_recognize_image(class->header));
+  return expected_size(class->header);
+}
+
+off_t osbf_native_size_of (uint32_t num_buckets) {
+  return OSBF_HEADER_SIZE + (off_t) sizeof(MY_BUCKET_STRUCT) * num_buckets;
+}
+
+static void *find_header (void *p, CLASS_STRUCT *class, OSBF_HANDLER *h) {
+  MY_DISK_IMAGE *image = p;
+  if (image->magic == OSBF_BIG) {
+    char classname[200];
+    strncpy(classname, class->classname, sizeof(classname));
+    classname[sizeof(classname)-1] = '\0';
+    cleanup_partial_class(image, class, MY_FORMAT.native);
+    osbf_raise(h, "OSBF class file %s has its bytes swapped---may have been copied"
+               " from a machine of the wrong endianness", classname);
+  }
+  return p;
+}
+
+static void *find_buckets (void *p, CLASS_STRUCT *class, OSBF_HANDLER *h) {
+  char *image = p;
+  (void)class; (void)h; /* not used */
+  return image + OSBF_HEADER_SIZE;
+}
+
+/* the header as it is on disk, padding included */
+static void padded_header(char image[OSBF_HEADER_SIZE], const MY_DISK_IMAGE *header) {
+  memset(image, 0, OSBF_HEADER_SIZE);
+  memcpy(image, header, sizeof(*header));
+}
+
+static void check_native(CLASS_STRUCT *class, OSBF_HANDLER *h) {
+  if (class->header->db_version != MY_FORMAT.unique_id)
+    osbf_raise(h, "Version %d format asked to write version %d database as native\n",
+               MY_FORMAT.unique_id, class->header->db_version);
+
+  if (!i_recognize_image(class->header))
+    osbf_raise(h, "Tried to write class without suitable magic number in header");
+}
+
+void osbf_native_write_class(CLASS_STRUCT *class, FILE *fp, OSBF_HANDLER *h) {
+  char classname[200];
+  char image[OSBF_HEADER_SIZE];
+  strncpy(classname, class->classname, sizeof(classname));
+  classname[sizeof(classname)-1] = '\0';
+
+  check_native(class, h);
+
+  if (DEBUG) {
+    unsigned j;
+    fprintf(stderr, "Writing native class with header");
+    for (j = 0; j < sizeof(*class->header) / sizeof(unsigned); j++)
+      fprintf(stderr, " %u", ((uint32_t *)class->header)[j]);
+    fprintf(stderr, "\n");
+  }
+
+  padded_header(image, class->header);
+  if (fwrite(image, 1, sizeof(image), fp) != sizeof(image)) {
+    cleanup_partial_class(class->header, class, 1);
+    osbf_raise(h, "Could not write header to class file %s", classname);
+  }
+  if (fwrite(class->buckets, sizeof(*class->buckets), class->header->num_buckets, fp)
+      != class->header->num_buckets) {
+    cleanup_partial_class(class->header, class, 1);
+    remove(classname); /* salvage is impossible */
+    osbf_raise(h, "Could not write buckets to class file %s", classname);
+  }
+  if (expected_size(class->header) != ftell(fp)) {
+    long size = expected_size(class->header);
+    cleanup_partial_class(class->header, class, 1);
+    osbf_raise(h, "Wrote %ld bytes to file %s; expected to write %ld bytes",
+               ftell(fp), classname, size);
+  }
+}
+
+void osbf_native_write_header(CLASS_STRUCT *class, FILE *fp, OSBF_HANDLER *h) {
+  char image[OSBF_HEADER_SIZE];
+
+  check_native(class, h);
+
+  if (DEBUG) {
+    unsigned j;
+    fprintf(stderr, "Writing native header");
+    for (j = 0; j < sizeof(*class->header) / sizeof(unsigned); j++)
+      fprintf(stderr, " %u", ((unsigned *)class->header)[j]);
+    fprintf(stderr, "\n");
+  }
+
+  padded_header(image, class->header);
+  if (fwrite(image, 1, sizeof(image), fp) != sizeof(image)) {
+    char classname[200];
+    strncpy(classname, class->classname, sizeof(classname));
+    classname[sizeof(classname)-1] = '\0';
+    cleanup_partial_class(class->header, class, 1);
+    osbf_raise(h, "Could not write header to class file %s", classname);
+  }
+}
+
+
+
+/*****************************************************************/
+
+void
+osbf_create_cfcfile (const char *cfcfile, uint32_t num_buckets, uint32_t max_buckets,
+                     OSBF_HANDLER *h)
+{
+  osbf_create_shard(cfcfile, num_buckets, max_buckets, 0, 0, h);
+}
+
+void
+osbf_create_shard (const char *cfcfile, uint32_t num_buckets, uint32_t max_buckets,
+                   uint32_t num_shards, uint32_t shard, OSBF_HANDLER *h)
+{
+  FILE *f;
+  uint32_t i_aux;
+  MY_DISK_IMAGE header;
+  char image[OSBF_HEADER_SIZE];
+  OSBF_BUCKET_STRUCT bucket = { 0, 0, 0 };
+
+  /* homes are taken modulo twice the base [Note Growth] */
+  osbf_raise_unless(max_buckets <= UINT32_MAX / 2, h,
+                    "Cannot let a class grow to more than %d buckets",
+                    (int) (UINT32_MAX / 2));
+
+  f = create_file_if_absent(cfcfile, h);
+
+  /* zero all fields in header and buckets */
+  memset(&header, 0, sizeof(header));
+
+  /* Set the header. */
+  header.magic       = OSBF_LITTLE;
+  header.db_version  = MY_FORMAT.unique_id;
+  header.num_buckets = num_buckets;
+  if (max_buckets > num_buckets) {
+    header.base_buckets = num_buckets;
+    header.max_buckets  = max_buckets;
+  }
+  header.num_shards  = num_shards;
+  header.shard       = shard;
+  header.generation  = osbf_new_generation();
+
+  /* Write header */
+  padded_header(image, &header);
+  osbf_raise_unless (fwrite (image, 1, sizeof(image), f) == sizeof(image), h,
+                     "Couldn't write the file header: '%s'", cfcfile);
+
+  /*  Initialize CFC hashes - zero all buckets */
+  for (i_aux = 0; i_aux < num_buckets; i_aux++)
+    if (fwrite (&bucket, sizeof (bucket), 1, f) != 1)
+      osbf_raise(h, "Couldn't write to: '%s'", cfcfile);
+
+  osbf_raise_unless(ftell(f) == expected_size(&header), h,
+                    "Internal fault: bad size calculation");
+  fclose (f);
+}
+
+void osbf_native_header_of_universal(OSBF_HEADER_STRUCT *dst,
+                                     const OSBF_UNIVERSAL_HEADER *src) {
+  dst->magic           = OSBF_LITTLE;
+  dst->db_version      = src->db_version;
+  dst->num_buckets     = src->num_buckets;
+  dst->learnings       = src->learnings;
+  dst->false_negatives = src->false_negatives;
+  dst->false_positives = src->false_positives;
+  dst->classifications = src->classifications;
+  dst->extra_learnings = src->extra_learnings;
+  dst->base_buckets    = 0;  /* no older format grows */
+  dst->max_buckets     = 0;
+  dst->used_buckets    = 0;
+  dst->num_shards      = 0;  /* nor is sharded */
+  dst->shard           = 0;
+  dst->generation      = 0;  /* given one when written [Note Journal] */
+}
+
+void osbf_native_bucket_of_universal(OSBF_BUCKET_STRUCT *dst,
+                                     const OSBF_UNIVERSAL_BUCKET *src) {
+  dst->hash1       = src->hash1;
+  dst->fingerprint = KEY_FINGERPRINT(src->hash2);
+  dst->count       = src->count > OSBF_MAX_BUCKET_VALUE
+                       ? OSBF_MAX_BUCKET_VALUE : src->count;
+}
+
+void osbf_native_buckets_of_universal(OSBF_BUCKET_STRUCT *dst,
+                                      const void *src,
+                                      osbf_bucket_upconverter cvt,
+                                      unsigned num_buckets) {
+  const char *p = src;
+  OSBF_UNIVERSAL_BUCKET uni;
+  unsigned i;
+
+  for (i = 0; i < num_buckets; i++) {
+    p += cvt(&uni, (void *) p);
+    osbf_native_bucket_of_universal(&dst[i], &uni);
+  }
+}
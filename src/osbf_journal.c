@@ -0,0 +1,359 @@
+/*
+ * osbf_journal.c: the journal of trainings not yet written into a class
+ *
+ * See Copyright Notice in osbflib.h
+ */
+
+/* for fsync and ftruncate */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "osbflib.h"
+#include "osbf_disk.h"
+
+#define JOURNAL_SUFFIX ".log"
+#define JOURNAL_MAGIC  0x4a425342  /* "BSBJ" in a little-endian file */
+#define TXN_MAGIC      0x4e585442  /* "BTXN" */
+#define JOURNAL_VERSION 3
+
+/* A journal is a file header followed by transactions, each a
+   txn_header, its records and a checksum of both.  Everything is in
+   the byte order of the host, like a native image.  A transaction
+   holds the values of the header counters after it, not their
+   changes, so replaying it again does no harm [Note Journal]. */
+
+struct file_header {
+  uint32_t magic, version;
+  uint64_t generation;          /* of the class file the journal belongs to */
+};
+
+struct txn_header {
+  uint32_t magic, num_records;
+  uint32_t learnings, extra_learnings;      /* the header counters */
+  uint32_t false_negatives, false_positives;
+  uint64_t classifications;
+};
+
+struct record {
+  uint32_t index;
+  OSBF_BUCKET_STRUCT bucket;    /* the bucket's new contents */
+};
+
+#define TXN_SIZE(n) \
+  (sizeof(struct txn_header) + (n) * sizeof(struct record) + sizeof(uint32_t))
+
+/*****************************************************************/
+
+/* the journal's name, malloc'd, or NULL */
+static char *
+journal_name (const CLASS_STRUCT *class)
+{
+  char *name = malloc (strlen (class->classname) + sizeof (JOURNAL_SUFFIX));
+  if (name != NULL)
+    {
+      strcpy (name, class->classname);
+      strcat (name, JOURNAL_SUFFIX);
+    }
+  return name;
+}
+
+/* a journal left by a class since replaced or rewritten is ignored */
+static int
+belongs_to (const struct file_header *fh, const CLASS_STRUCT *class)
+{
+  return fh->magic == JOURNAL_MAGIC && fh->version == JOURNAL_VERSION
+    && fh->generation != 0 && fh->generation == class->header->generation;
+}
+
+/*****************************************************************/
+
+/* Applies the transactions from p up to end, stopping at the first one
+   that is incomplete, fails its checksum or names a bucket the class
+   doesn't have.  Returns the end of the last transaction applied. */
+static const char *
+apply_transactions (CLASS_STRUCT * class, const char *p, const char *end)
+{
+  OSBF_HEADER_STRUCT *header = class->header;
+
+  for (;;)
+    {
+      struct txn_header t;
+      struct record r;
+      uint32_t checksum, k;
+      const char *records = p + sizeof (t);
+
+      if ((size_t) (end - p) < TXN_SIZE (0))
+        return p;
+      memcpy (&t, p, sizeof (t));
+      if (t.magic != TXN_MAGIC
+          || t.num_records > ((size_t) (end - p) - TXN_SIZE (0)) / sizeof (r))
+        return p;
+      memcpy (&checksum, p + TXN_SIZE (t.num_records) - sizeof (checksum),
+              sizeof (checksum));
+      if (checksum != strnhash ((const unsigned char *) p,
+                                TXN_SIZE (t.num_records) - sizeof (checksum)))
+        return p;
+      for (k = 0; k < t.num_records; k++)
+        {
+          memcpy (&r, records + k * sizeof (r), sizeof (r));
+          if (r.index >= header->num_buckets)
+            return p;
+        }
+
+      for (k = 0; k < t.num_records; k++)
+        {
+          memcpy (&r, records + k * sizeof (r), sizeof (r));
+          class->buckets[r.index] = r.bucket;
+          if (class->journaled != NULL)
+            class->journaled[r.index / 32] |= 1u << (r.index % 32);
+        }
+      header->learnings       = t.learnings;
+      header->extra_learnings = t.extra_learnings;
+      header->false_negatives = t.false_negatives;
+      header->false_positives = t.false_positives;
+      header->classifications = t.classifications;
+      p += TXN_SIZE (t.num_records);
+    }
+}
+
+int
+osbf_journal_replay (CLASS_STRUCT * class)
+{
+  char *name, *log = NULL;
+  int fd, err = 0, writable;
+  struct stat st;
+  struct file_header fh;
+
+  class->journal_size = 0;
+  class->journal_header = *class->header;
+  if (class->state != OSBF_MAPPED)
+    return 0;                   /* only a mapped class is journaled */
+
+  if ((name = journal_name (class)) == NULL)
+    return -1;
+  fd = open (name, O_RDONLY);
+  free (name);
+  if (fd < 0)
+    return errno == ENOENT ? 0 : -1;
+
+  if (fstat (fd, &st) != 0
+      || (log = malloc (st.st_size > 0 ? st.st_size : 1)) == NULL
+      || read (fd, log, st.st_size) != st.st_size)
+    err = -1;
+  close (fd);
+  if (err != 0 || (size_t) st.st_size < sizeof (fh))
+    {
+      free (log);
+      return err;
+    }
+
+  memcpy (&fh, log, sizeof (fh));
+  if (!belongs_to (&fh, class))
+    {
+      free (log);
+      return 0;
+    }
+
+  if (class->usage == OSBF_WRITE_ALL)
+    {
+      class->journaled = calloc ((MAX_BUCKETS (class) + 31) / 32,
+                                 sizeof (*class->journaled));
+      if (class->journaled == NULL)
+        {
+          free (log);
+          return -1;
+        }
+    }
+
+  /* a read-only class is mapped read-only, but its pages are private */
+  writable = class->usage != OSBF_READ_ONLY;
+  if (!writable && mprotect (class->header, class->fsize,
+                             PROT_READ | PROT_WRITE) != 0)
+    {
+      free (log);
+      return -1;
+    }
+  class->journal_size =
+    apply_transactions (class, log + sizeof (fh), log + st.st_size) - log;
+  if (!writable)
+    mprotect (class->header, class->fsize, PROT_READ);
+  class->journal_header = *class->header;
+  free (log);
+  return 0;
+}
+
+/*****************************************************************/
+
+int
+osbf_journal_append (CLASS_STRUCT * class, int sync)
+{
+  const OSBF_HEADER_STRUCT *now = class->header, *then = &class->journal_header;
+  struct file_header fh;
+  struct txn_header t;
+  char *name, *buf, *p;
+  uint32_t n = 0, w, i, checksum;
+  size_t len, hlen;
+  int fd, ok;
+
+  t.magic           = TXN_MAGIC;
+  t.learnings       = now->learnings;
+  t.extra_learnings = now->extra_learnings;
+  t.false_negatives = now->false_negatives;
+  t.false_positives = now->false_positives;
+  t.classifications = now->classifications;
+
+  if (class->dirty != NULL)
+    for (w = 0; w < (NUM_BUCKETS (class) + 31) / 32; w++)
+      for (i = class->dirty[w]; i != 0; i &= i - 1)
+        n++;
+  t.num_records = n;
+  if (n == 0 && now->learnings == then->learnings
+      && now->extra_learnings == then->extra_learnings
+      && now->false_negatives == then->false_negatives
+      && now->false_positives == then->false_positives
+      && now->classifications == then->classifications)
+    return 0;
+
+  /* a new journal starts with its file header */
+  hlen = class->journal_size > 0 ? 0 : sizeof (fh);
+  len = hlen + TXN_SIZE (n);
+  if ((buf = malloc (len)) == NULL)
+    return -1;
+  if (hlen > 0)
+    {
+      memset (&fh, 0, sizeof (fh));
+      fh.magic      = JOURNAL_MAGIC;
+      fh.version    = JOURNAL_VERSION;
+      fh.generation = class->header->generation;
+      memcpy (buf, &fh, sizeof (fh));
+    }
+
+  p = buf + hlen;
+  memcpy (p, &t, sizeof (t));
+  p += sizeof (t);
+  if (n > 0)
+    for (w = 0; w < (NUM_BUCKETS (class) + 31) / 32; w++)
+      {
+        uint32_t bits = class->dirty[w];
+        for (i = w * 32; bits != 0; i++, bits >>= 1)
+          if (bits & 1)
+            {
+              struct record r;
+              r.index = i;
+              r.bucket = class->buckets[i];
+              memcpy (p, &r, sizeof (r));
+              p += sizeof (r);
+            }
+      }
+  checksum = strnhash ((const unsigned char *) buf + hlen,
+                       TXN_SIZE (n) - sizeof (checksum));
+  memcpy (p, &checksum, sizeof (checksum));
+
+  /* written where the valid part ends, so a torn tail is overwritten;
+     a journal left by an older generation of the class is unlinked
+     rather than overwritten, as a reader of that generation may be
+     reading it [Note Snapshots] */
+  if ((name = journal_name (class)) == NULL)
+    {
+      free (buf);
+      return -1;
+    }
+  if (class->journal_size == 0)
+    unlink (name);
+  fd = open (name, O_WRONLY | O_CREAT, 0666);
+  free (name);
+  ok = fd >= 0
+    && lseek (fd, (off_t) class->journal_size, SEEK_SET)
+       == (off_t) class->journal_size
+    && write (fd, buf, len) == (ssize_t) len
+    && ftruncate (fd, (off_t) (class->journal_size + len)) == 0
+    && (!sync || fsync (fd) == 0);
+  if (fd >= 0)
+    close (fd);
+  free (buf);
+  if (!ok)
+    return -1;
+  class->journal_size += len;
+  class->journal_header = *class->header;
+  return 0;
+}
+
+/*****************************************************************/
+
+void
+osbf_journal_mark_dirty (CLASS_STRUCT * class)
+{
+  uint32_t w;
+
+  if (class->journaled != NULL && class->dirty != NULL)
+    for (w = 0; w < (NUM_BUCKETS (class) + 31) / 32; w++)
+      class->dirty[w] |= class->journaled[w];
+}
+
+int
+osbf_journal_applies (const CLASS_STRUCT * class)
+{
+  char *name = journal_name (class);
+  struct file_header fh;
+  int fd, r = 0;
+
+  if (name == NULL)
+    return 1;                   /* the caller had better open the class */
+  fd = open (name, O_RDONLY);
+  free (name);
+  if (fd < 0)
+    return errno != ENOENT;
+  if (read (fd, &fh, sizeof (fh)) == (ssize_t) sizeof (fh))
+    r = belongs_to (&fh, class);
+  close (fd);
+  return r;
+}
+
+int
+osbf_journal_remove (CLASS_STRUCT * class)
+{
+  char *name = journal_name (class);
+  int r;
+
+  if (name == NULL)
+    return -1;
+  r = unlink (name) == 0 || errno == ENOENT ? 0 : -1;
+  free (name);
+  if (r == 0)
+    class->journal_size = 0;
+  return r;
+}
+
+/*****************************************************************/
+
+uint64_t
+osbf_new_generation (void)
+{
+  uint64_t g = 0;
+  int fd = open ("/dev/urandom", O_RDONLY);
+
+  if (fd >= 0)
+    {
+      if (read (fd, &g, sizeof (g)) != (ssize_t) sizeof (g))
+        g = 0;
+      close (fd);
+    }
+  if (g == 0)
+    {
+      /* no random device; the time and process are unique enough */
+      struct timespec t;
+      clock_gettime (CLOCK_REALTIME, &t);
+      g = ((uint64_t) t.tv_sec << 30 ^ (uint64_t) t.tv_nsec)
+        ^ (uint64_t) getpid () << 40;
+    }
+  return g != 0 ? g : 1;
+}
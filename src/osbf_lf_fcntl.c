@@ -1,26 +1,61 @@
+/* for nanosleep and clock_gettime */
+#define _POSIX_C_SOURCE 199309L
+
 #include "osbf_lockfile.h"
 
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 
-static int lock_file_fcntl(int fd, uint32_t start, uint32_t len)
+const int osbf_lock_regions = 1;
+
+#define FIRST_WAIT 0.001 /* seconds before the first retry */
+#define MAX_WAIT   0.05  /* longest wait between retries */
+
+static double seconds(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void pause_for(double s) {
+  struct timespec t;
+  t.tv_sec = (time_t) s;
+  t.tv_nsec = (long) ((s - (double) t.tv_sec) * 1e9);
+  nanosleep(&t, NULL);
+}
+
+/* Tries the lock until it is granted or timeout seconds have passed,
+   waiting twice as long each time up to MAX_WAIT, as osbf_lf_ofd.c
+   does.  Polling once a second, as this used to, let a waiter lose
+   the lock to others again and again when writers follow one another
+   closely, as they do with snapshots, until it timed out. */
+static int lock_file_fcntl(int fd, short type, uint32_t start, uint32_t len,
+                           double timeout)
 {
-  int max_lock_attempts = 20;
-  int r;
   struct flock fl;
+  double deadline, wait = FIRST_WAIT, now;
+  int r;
 
-  fl.l_type = F_WRLCK;          /* write lock */
+  fl.l_type = type;             /* F_WRLCK or F_RDLCK */
   fl.l_whence = SEEK_SET;
   fl.l_start = start;
   fl.l_len = len;
 
-  do {
-      r = fcntl(fd, F_SETLK, &fl);
-  } while (r == -1 && (errno == EAGAIN || errno == EACCES) &&
-           (max_lock_attempts-- > 0) && (sleep(1) || 1));
-
-  return r;
+  deadline = seconds() + timeout;
+  for (;;) {
+    r = fcntl(fd, F_SETLK, &fl);
+    if (r == 0 || (errno != EAGAIN && errno != EACCES && errno != EINTR))
+      return r;
+    now = seconds();
+    if (now >= deadline) {
+      errno = EAGAIN;
+      return -1;
+    }
+    pause_for(wait < deadline - now ? wait : deadline - now);
+    wait = 2 * wait < MAX_WAIT ? 2 * wait : MAX_WAIT;
+  }
 }
 
 static int unlock_file_fcntl(int fd, uint32_t start, uint32_t len)
@@ -38,7 +73,13 @@ static int unlock_file_fcntl(int fd, uint32_t start, uint32_t len)
 }
 
 int osbf_lock_class(CLASS_STRUCT *class, uint32_t start, uint32_t len) {
-  return lock_file_fcntl(class->fd, start, len);
+  return lock_file_fcntl(class->fd, F_WRLCK, start, len,
+                         class->ctx->lock_timeout);
+}
+
+int osbf_lock_class_shared(CLASS_STRUCT *class, uint32_t start, uint32_t len) {
+  return lock_file_fcntl(class->fd, F_RDLCK, start, len,
+                         class->ctx->lock_timeout);
 }
 
 int osbf_unlock_class (CLASS_STRUCT *class, uint32_t start, uint32_t len) {
@@ -4,6 +4,9 @@
 #include <string.h>
 #include <lockfile.h>
 
+/* one lock file per class, whatever the region */
+const int osbf_lock_regions = 0;
+
 static int make_linkname(const char *classname, char *linkname, int size);
 static int make_linkname(const char *classname, char *linkname, int size) {
   int len = strlen(classname);
@@ -46,6 +49,11 @@ int osbf_lock_class(CLASS_STRUCT *class, uint32_t start, uint32_t len)
   return lock_file_lockfile(class->classname);
 }
 
+int osbf_lock_class_shared(CLASS_STRUCT *class, uint32_t start, uint32_t len)
+{
+  (void)class, (void)start, (void)len; /* keep compiler quiet */
+  return 0;
+}
 
 int
 osbf_unlock_class (CLASS_STRUCT *class, uint32_t start, uint32_t len)
@@ -0,0 +1,92 @@
+/* for F_OFD_SETLK, nanosleep and clock_gettime */
+#define _GNU_SOURCE
+
+#include "osbf_lockfile.h"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/* Open file description locks belong to the descriptor's open file, not
+   to the process, so closing another descriptor of the same file doesn't
+   release them, and two opens of a class in one process exclude each
+   other like two processes do. */
+
+const int osbf_lock_regions = 1;
+
+#define FIRST_WAIT 0.001 /* seconds before the first retry */
+#define MAX_WAIT   0.05  /* longest wait between retries */
+
+static double seconds(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void pause_for(double s) {
+  struct timespec t;
+  t.tv_sec = (time_t) s;
+  t.tv_nsec = (long) ((s - (double) t.tv_sec) * 1e9);
+  nanosleep(&t, NULL);
+}
+
+/* A blocking F_OFD_SETLKW can only be interrupted by a signal, and a
+   library must not take over the disposition of a signal or a timer
+   that belong to the program, least of all in a threaded one.  So the
+   lock is tried without blocking, again and again, waiting twice as
+   long each time up to MAX_WAIT, until it is granted or the timeout
+   has passed.  A released lock is thus taken within MAX_WAIT. */
+
+static int lock_file_ofd(int fd, short type, uint32_t start, uint32_t len,
+                         double timeout)
+{
+  struct flock fl;
+  double deadline, wait = FIRST_WAIT, now;
+  int r;
+
+  memset(&fl, 0, sizeof(fl)); /* l_pid must be 0 */
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = start;
+  fl.l_len = len;
+
+  deadline = seconds() + timeout;
+  for (;;) {
+    r = fcntl(fd, F_OFD_SETLK, &fl);
+    if (r == 0 || (errno != EAGAIN && errno != EACCES && errno != EINTR))
+      return r;
+    now = seconds();
+    if (now >= deadline) {
+      errno = EAGAIN;
+      return -1;
+    }
+    pause_for(wait < deadline - now ? wait : deadline - now);
+    wait = 2 * wait < MAX_WAIT ? 2 * wait : MAX_WAIT;
+  }
+}
+
+static int unlock_file_ofd(int fd, uint32_t start, uint32_t len)
+{
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = start;
+  fl.l_len = len;
+  return fcntl(fd, F_OFD_SETLK, &fl) == -1 ? -1 : 0;
+}
+
+int osbf_lock_class(CLASS_STRUCT *class, uint32_t start, uint32_t len) {
+  return lock_file_ofd(class->fd, F_WRLCK, start, len, class->ctx->lock_timeout);
+}
+
+int osbf_lock_class_shared(CLASS_STRUCT *class, uint32_t start, uint32_t len) {
+  return lock_file_ofd(class->fd, F_RDLCK, start, len, class->ctx->lock_timeout);
+}
+
+int osbf_unlock_class (CLASS_STRUCT *class, uint32_t start, uint32_t len) {
+  return unlock_file_ofd(class->fd, start, len);
+}
@@ -7,3 +7,11 @@ extern int osbf_unlock_class (CLASS_STRUCT *class, uint32_t start, uint32_t len)
   /* class is class to be locked/unlocked, which includes file name 
      start and len are the region within the file to be locked (ignored
      by some locking methods) */
+
+extern int osbf_lock_class_shared (CLASS_STRUCT *class, uint32_t start, uint32_t len);
+  /* the same, but the lock is shared with other shared locks; unlocked
+     by osbf_unlock_class.  Does nothing if !osbf_lock_regions */
+
+extern const int osbf_lock_regions;
+  /* nonzero if locks on disjoint regions of a class don't conflict and
+     shared locks are shared [Note Locks in osbf_disk.c] */
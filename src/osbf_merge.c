@@ -0,0 +1,578 @@
+/*
+ * osbf_merge.c: merge class databases by rebuilding the destination
+ *
+ * See Copyright Notice in osbflib.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "osbflib.h"
+
+/* [Note Merge]
+   ~~~~~~~~~~~~
+   osbf_import inserts the source buckets one at a time, each one at a
+   random place in the destination, microgrooming chains on the way.
+   osbf_merge instead rebuilds the destination in one sweep:
+
+     1. The nonempty buckets of the destination and of every source
+        (the "items") are sorted by their right positions in the
+        destination, and items for the same bigram, which must share a
+        right position, are combined by adding their counts.
+     2. If there are too many buckets left, those with the smallest
+        counts are dropped.
+     3. The buckets are laid down in order of right position, each one
+        in the first free bucket at or after its right position.  That
+        is where linear insertion in the same order would have put it,
+        so the result is a well-formed class.  A bucket that would land
+        farther from its right position than the microgroom trigger
+        makes room as the microgroomer would: the weakest bucket between
+        its right position and its place is dropped, and the buckets
+        after it move one place back.  The new bucket itself is dropped
+        if it is no stronger.
+
+   Step 1 runs in several threads.  The items are split into slices and
+   the right positions into ranges, one of each per thread.  Each
+   thread first counts the items of its slice that fall in every range,
+   then copies them to the part of the staging array reserved for that
+   range and slice; finally each thread sorts the items of its range by
+   right position, with a radix sort.  The threads never write to the
+   same memory.  Steps 2 and 3 are sequential sweeps through memory.
+
+   The last chain of the class may wrap around to its first buckets.
+   Step 3 therefore starts at a right position that no chain crosses,
+   found by laying down the buckets without drops and without writing
+   them.
+   Drops can only shorten chains, so no chain crosses that position in
+   the final class either.
+
+   A merge into an empty destination of another size resizes a class.
+   The buckets kept are where insertion would have put them, but the
+   buckets dropped may differ from those osbf_import would drop.
+
+   A destination that grows [Note Growth] keeps its size during the
+   merge; it grows with the trainings that follow.
+*/
+
+/* use of the destination above which the weakest buckets are dropped
+   before placement, leaving room for learning; step 3 then shortens
+   the long chains */
+#define MERGE_MAX_USE 0.9
+
+#define MAX_MERGE_THREADS 64
+
+struct merge {
+  CLASS_STRUCT *const *parts;   /* destination, then the sources */
+  unsigned num_parts;
+  size_t num_items;             /* buckets in all parts, empty or not */
+  uint32_t num_buckets;         /* of the destination */
+  unsigned num_jobs;
+  uint32_t width;               /* right positions in a range */
+  uint32_t *slots;              /* slots[slice * num_jobs + range] */
+  OSBF_BUCKET_STRUCT *staged;   /* nonempty items, by range */
+  uint32_t *staged_homes;       /* their right positions */
+  OSBF_BUCKET_STRUCT *sorted;   /* combined buckets, by right position */
+  uint32_t *sorted_homes;       /* their right positions */
+  uint32_t num_sorted;
+};
+
+/* A job is the share of one thread: the slice of items lo_item to
+   hi_item - 1, and the range of right positions lo to hi - 1, whose
+   items go to staged[base ...] and then to sorted[base ...]; sorting
+   uses both arrays. */
+struct merge_job {
+  struct merge *m;
+  unsigned id;
+  size_t lo_item, hi_item;
+  uint32_t lo, hi;
+  uint32_t base;
+  uint32_t items;               /* nonempty items in the range */
+  uint32_t distinct;            /* buckets left after combining */
+};
+
+/* Items are numbered through the buckets of all parts in order.  An
+   item cursor walks them, moving from part to part. */
+struct item_cursor {
+  struct merge *m;
+  unsigned part;
+  uint32_t i;                   /* index in the part */
+};
+
+static void
+seek_item (struct item_cursor *c, struct merge *m, size_t k)
+{
+  c->m = m;
+  for (c->part = 0; k >= m->parts[c->part]->header->num_buckets; c->part++)
+    k -= m->parts[c->part]->header->num_buckets;
+  c->i = (uint32_t) k;
+}
+
+/* returns the current item and moves to the next one */
+static const OSBF_BUCKET_STRUCT *
+next_item (struct item_cursor *c)
+{
+  const OSBF_BUCKET_STRUCT *b = &c->m->parts[c->part]->buckets[c->i];
+
+  if (++c->i == c->m->parts[c->part]->header->num_buckets)
+    {
+      /* skip to the next part that has buckets */
+      c->i = 0;
+      do
+        c->part++;
+      while (c->part < c->m->num_parts
+             && c->m->parts[c->part]->header->num_buckets == 0);
+    }
+  return b;
+}
+
+/* step 1, first part: count the items of a slice in every range */
+static void *
+count_slice (void *arg)
+{
+  struct merge_job *job = arg;
+  struct merge *m = job->m;
+  uint32_t *slots = m->slots + job->id * m->num_jobs;
+  struct item_cursor c;
+  size_t k;
+
+  memset (slots, 0, m->num_jobs * sizeof (*slots));
+  if (job->lo_item == job->hi_item)
+    return NULL;
+  seek_item (&c, m, job->lo_item);
+  for (k = job->lo_item; k < job->hi_item; k++)
+    {
+      const OSBF_BUCKET_STRUCT *b = next_item (&c);
+      if (b->count != 0)
+        slots[HASH_INDEX (m->parts[0], b->hash1) / m->width]++;
+    }
+  return NULL;
+}
+
+/* step 1, second part: copy the items of a slice to their ranges */
+static void *
+stage_slice (void *arg)
+{
+  struct merge_job *job = arg;
+  struct merge *m = job->m;
+  uint32_t *slots = m->slots + job->id * m->num_jobs;
+  struct item_cursor c;
+  size_t k;
+  uint32_t h, w;
+
+  if (job->lo_item == job->hi_item)
+    return NULL;
+  seek_item (&c, m, job->lo_item);
+  for (k = job->lo_item; k < job->hi_item; k++)
+    {
+      const OSBF_BUCKET_STRUCT *b = next_item (&c);
+      if (b->count != 0)
+        {
+          h = HASH_INDEX (m->parts[0], b->hash1);
+          w = slots[h / m->width]++;
+          m->staged[w] = *b;
+          m->staged_homes[w] = h;
+        }
+    }
+  return NULL;
+}
+
+/* is bucket a before bucket b in a group? */
+static int
+bucket_before (const OSBF_BUCKET_STRUCT *a, const OSBF_BUCKET_STRUCT *b)
+{
+  return a->hash1 < b->hash1
+    || (a->hash1 == b->hash1 && a->fingerprint < b->fingerprint);
+}
+
+#define RADIX_BITS 11
+
+/* step 1, last part: sort the items of a range by right position and
+   combine the items of each bigram */
+static void *
+sort_range (void *arg)
+{
+  struct merge_job *job = arg;
+  struct merge *m = job->m;
+  OSBF_BUCKET_STRUCT *from = m->staged + job->base, *to = m->sorted + job->base;
+  uint32_t *from_homes = m->staged_homes + job->base;
+  uint32_t *to_homes = m->sorted_homes + job->base;
+  uint32_t counts[1 << RADIX_BITS];
+  uint32_t n = job->items, shift, digit, sum, i, j, w, group, count;
+
+  /* least significant digit first; every pass is stable */
+  for (shift = 0; shift == 0 || (job->hi - job->lo - 1) >> shift != 0;
+       shift += RADIX_BITS)
+    {
+      memset (counts, 0, sizeof (counts));
+      for (i = 0; i < n; i++)
+        counts[(from_homes[i] - job->lo) >> shift & ((1 << RADIX_BITS) - 1)]++;
+      for (sum = 0, digit = 0; digit < 1 << RADIX_BITS; digit++)
+        {
+          count = counts[digit];
+          counts[digit] = sum;
+          sum += count;
+        }
+      for (i = 0; i < n; i++)
+        {
+          j = counts[(from_homes[i] - job->lo) >> shift & ((1 << RADIX_BITS) - 1)]++;
+          to[j] = from[i];
+          to_homes[j] = from_homes[i];
+        }
+      if ((job->hi - job->lo - 1) >> shift >> RADIX_BITS == 0)
+        break;
+      /* swap the roles of the arrays */
+      {
+        OSBF_BUCKET_STRUCT *b = from; uint32_t *h = from_homes;
+        from = to; from_homes = to_homes;
+        to = b; to_homes = h;
+      }
+    }
+  if (to != m->sorted + job->base)
+    {
+      memcpy (m->sorted + job->base, to, n * sizeof (*to));
+      memcpy (m->sorted_homes + job->base, to_homes, n * sizeof (*to_homes));
+    }
+
+  /* sort each group, which is short, and combine equal buckets */
+  to = m->sorted + job->base;
+  to_homes = m->sorted_homes + job->base;
+  w = 0;
+  for (i = 0; i < n; i = j)
+    {
+      for (j = i + 1; j < n && to_homes[j] == to_homes[i]; j++)
+        {
+          OSBF_BUCKET_STRUCT b = to[j];
+          uint32_t k;
+          for (k = j; k > i && bucket_before (&b, &to[k - 1]); k--)
+            to[k] = to[k - 1];
+          to[k] = b;
+        }
+      for (group = w; i < j; i++)
+        if (w > group && to[w - 1].hash1 == to[i].hash1
+            && to[w - 1].fingerprint == to[i].fingerprint)
+          {
+            count = to[w - 1].count + to[i].count;
+            to[w - 1].count = count > OSBF_MAX_BUCKET_VALUE
+              ? OSBF_MAX_BUCKET_VALUE : count;
+          }
+        else
+          {
+            to_homes[w] = to_homes[i];
+            to[w++] = to[i];
+          }
+    }
+  job->distinct = w;
+  return NULL;
+}
+
+/* runs f on every job; this thread is one of the workers, and does
+   the share of any thread that cannot be started */
+static void
+run_jobs (void *(*f) (void *), struct merge_job jobs[], unsigned n)
+{
+  pthread_t threads[MAX_MERGE_THREADS];
+  int started[MAX_MERGE_THREADS];
+  unsigned i;
+
+  for (i = 1; i < n; i++)
+    started[i] = pthread_create (&threads[i], NULL, f, &jobs[i]) == 0;
+  f (&jobs[0]);
+  for (i = 1; i < n; i++)
+    if (started[i])
+      pthread_join (threads[i], NULL);
+    else
+      f (&jobs[i]);
+}
+
+/* step 2: drop the weakest buckets so that at most limit buckets are
+   left; the buckets kept among those of equal count are spread evenly
+   over the class */
+static void
+drop_weakest (struct merge *m, uint32_t limit, uint32_t *histogram)
+{
+  uint32_t above, threshold, i, w;
+  uint64_t quota, ties, k;
+
+  memset (histogram, 0, (OSBF_MAX_BUCKET_VALUE + 1) * sizeof (*histogram));
+  for (i = 0; i < m->num_sorted; i++)
+    histogram[m->sorted[i].count]++;
+  above = 0;
+  for (threshold = OSBF_MAX_BUCKET_VALUE; threshold > 0; threshold--)
+    {
+      if (above + histogram[threshold] > limit)
+        break;
+      above += histogram[threshold];
+    }
+  quota = limit - above;
+  ties = histogram[threshold];
+  k = 0;
+  for (i = w = 0; i < m->num_sorted; i++)
+    {
+      if (m->sorted[i].count < threshold)
+        continue;
+      if (m->sorted[i].count == threshold)
+        {
+          /* keep the k-th tie if it takes the quota to a new integer */
+          k++;
+          if (k * quota / ties == (k - 1) * quota / ties)
+            continue;
+        }
+      m->sorted_homes[w] = m->sorted_homes[i];
+      m->sorted[w++] = m->sorted[i];
+    }
+  m->num_sorted = w;
+}
+
+/* Step 3, first part: finds the first bucket whose right position no
+   chain crosses, laying down the buckets without drops.  The positions
+   taken by the last chain after wrapping around are found by repeating
+   the lay down until they no longer change.  Returns 0 if the class is
+   full. */
+static int
+find_start (const struct merge *m, uint32_t *first)
+{
+  uint64_t num_buckets = m->num_buckets;
+  uint64_t wrapped = 0, next;
+  uint32_t i;
+
+  for (;;)
+    {
+      next = wrapped;
+      for (i = 0; i < m->num_sorted; i++)
+        next = (next < m->sorted_homes[i] ? m->sorted_homes[i] : next) + 1;
+      if (next <= num_buckets + wrapped)
+        break;
+      wrapped = next - num_buckets;
+      if (wrapped >= num_buckets)
+        return 0;
+    }
+  next = wrapped;
+  for (i = 0; i < m->num_sorted; i++, next++)
+    if (next <= m->sorted_homes[i])
+      {
+        *first = i;
+        return 1;
+      }
+  /* no buckets at all */
+  *first = 0;
+  return m->num_sorted == 0;
+}
+
+/* writes bucket b to bucket i, marking it dirty if changed */
+static void
+put_bucket (CLASS_STRUCT *class, uint32_t i, const OSBF_BUCKET_STRUCT *b)
+{
+  if (memcmp (&class->buckets[i], b, sizeof (*b)) != 0)
+    {
+      class->buckets[i] = *b;
+      MARK_BUCKET_DIRTY (class, i);
+    }
+}
+
+/* Step 3, second part: lays the buckets down starting with sorted[first].
+   Positions are virtual, from the right position of that bucket on;
+   right positions before it are moved to the end by adding num_buckets
+   to them. */
+static void
+lay_down (const struct merge *m, uint32_t first, uint32_t trigger,
+          CLASS_STRUCT *class)
+{
+  static const OSBF_BUCKET_STRUCT empty = { 0, 0, 0 };
+  uint64_t num_buckets = m->num_buckets;
+  uint64_t start, next, v, p, weakest;
+  uint32_t n, i, min;
+
+#define INDEX(p) ((uint32_t) ((p) < num_buckets ? (p) : (p) - num_buckets))
+
+  start = next = m->num_sorted > 0 ? m->sorted_homes[first] : 0;
+  for (n = 0, i = first; n < m->num_sorted; n++, i++)
+    {
+      const OSBF_BUCKET_STRUCT *b;
+
+      if (i == m->num_sorted)
+        i = 0;
+      b = &m->sorted[i];
+      v = m->sorted_homes[i] + (i < first ? num_buckets : 0);
+      for (; next < v; next++)
+        put_bucket (class, INDEX (next), &empty);
+      if (next - v <= trigger)
+        {
+          put_bucket (class, INDEX (next), b);
+          next++;
+          continue;
+        }
+      /* too far: drop the weakest bucket in the way, or b */
+      min = b->count;
+      weakest = next;
+      for (p = v; p < next; p++)
+        if (class->buckets[INDEX (p)].count < min)
+          {
+            min = class->buckets[INDEX (p)].count;
+            weakest = p;
+          }
+      if (weakest < next)
+        {
+          for (p = weakest; p + 1 < next; p++)
+            put_bucket (class, INDEX (p), &class->buckets[INDEX (p + 1)]);
+          put_bucket (class, INDEX (next - 1), b);
+        }
+    }
+  for (; next < start + num_buckets; next++)
+    put_bucket (class, INDEX (next), &empty);
+
+#undef INDEX
+}
+
+void
+osbf_merge (CLASS_STRUCT *class_to, CLASS_STRUCT *const classes_from[],
+            unsigned num_from, unsigned num_threads, OSBF_HANDLER *h)
+{
+  struct merge m;
+  struct merge_job jobs[MAX_MERGE_THREADS];
+  CLASS_STRUCT **parts;
+  uint32_t *histogram;
+  uint64_t num_items;
+  uint32_t num_buckets, base, first = 0;
+  unsigned i, s, t;
+
+  if (class_to->state == OSBF_CLOSED || class_to->usage < OSBF_WRITE_ALL)
+    osbf_raise(h, "Destination class %s is not open for full write",
+               class_to->classname == NULL ? "(name unknown)" : class_to->classname);
+  for (i = 0; i < num_from; i++)
+    if (classes_from[i]->state == OSBF_CLOSED)
+      osbf_raise(h, "Source class %s is not open",
+                 classes_from[i]->classname == NULL
+                   ? "(name unknown)"
+                   : classes_from[i]->classname);
+  if (class_to->shards != NULL)
+    osbf_raise(h, "Cannot merge into sharded class %s", class_to->classname);
+  for (i = 0; i < num_from; i++)
+    if (classes_from[i]->shards != NULL)
+      osbf_raise(h, "Cannot merge from sharded class %s",
+                 classes_from[i]->classname);
+
+  num_buckets = NUM_BUCKETS (class_to);
+  num_items = num_buckets;
+  for (i = 0; i < num_from; i++)
+    num_items += classes_from[i]->header->num_buckets;
+  osbf_raise_unless (num_items < UINT32_MAX, h,
+                     "Too many buckets to merge into %s", class_to->classname);
+
+  if (num_threads < 1)
+    num_threads = 1;
+  if (num_threads > MAX_MERGE_THREADS)
+    num_threads = MAX_MERGE_THREADS;
+  if (num_threads > num_buckets)
+    num_threads = num_buckets;
+
+  parts = osbf_malloc ((num_from + 1) * sizeof (*parts), h, "merge");
+  parts[0] = class_to;
+  for (i = 0; i < num_from; i++)
+    parts[i + 1] = classes_from[i];
+  m.parts = parts;
+  m.num_parts = num_from + 1;
+  m.num_items = num_items;
+  m.num_buckets = num_buckets;
+  m.num_jobs = num_threads;
+  m.width = (num_buckets + num_threads - 1) / num_threads;
+  m.slots = malloc (num_threads * num_threads * sizeof (*m.slots));
+  UNLESS_CLEANUP_RAISE (m.slots != NULL, free (parts),
+                        (h, "Couldn't allocate memory to merge into %s",
+                         class_to->classname));
+
+  /* step 1: count, stage and sort */
+  for (t = 0; t < num_threads; t++)
+    {
+      jobs[t].m = &m;
+      jobs[t].id = t;
+      jobs[t].lo_item = num_items * t / num_threads;
+      jobs[t].hi_item = num_items * (t + 1) / num_threads;
+      jobs[t].lo = t * m.width < num_buckets ? t * m.width : num_buckets;
+      jobs[t].hi = jobs[t].lo + m.width < num_buckets
+                     ? jobs[t].lo + m.width : num_buckets;
+    }
+  run_jobs (count_slice, jobs, num_threads);
+  base = 0;
+  for (t = 0; t < num_threads; t++)
+    {
+      jobs[t].base = base;
+      for (s = 0; s < num_threads; s++)
+        {
+          uint32_t n = m.slots[s * num_threads + t];
+          m.slots[s * num_threads + t] = base;
+          base += n;
+        }
+      jobs[t].items = base - jobs[t].base;
+    }
+  if (base == 0)
+    base = 1;
+  m.staged = malloc (base * sizeof (*m.staged));
+  m.staged_homes = malloc (base * sizeof (*m.staged_homes));
+  m.sorted = malloc (base * sizeof (*m.sorted));
+  m.sorted_homes = malloc (base * sizeof (*m.sorted_homes));
+  UNLESS_CLEANUP_RAISE (m.staged != NULL && m.staged_homes != NULL
+                        && m.sorted != NULL && m.sorted_homes != NULL,
+                        (free (m.staged), free (m.staged_homes),
+                         free (m.sorted), free (m.sorted_homes),
+                         free (m.slots), free (parts)),
+                        (h, "Couldn't allocate memory to merge into %s",
+                         class_to->classname));
+  run_jobs (stage_slice, jobs, num_threads);
+  run_jobs (sort_range, jobs, num_threads);
+  free (m.staged);
+  free (m.staged_homes);
+  free (m.slots);
+  free (parts);
+
+  /* close the gaps left between ranges by combining */
+  m.num_sorted = 0;
+  for (t = 0; t < num_threads; t++)
+    {
+      memmove (m.sorted + m.num_sorted, m.sorted + jobs[t].base,
+               jobs[t].distinct * sizeof (*m.sorted));
+      memmove (m.sorted_homes + m.num_sorted, m.sorted_homes + jobs[t].base,
+               jobs[t].distinct * sizeof (*m.sorted_homes));
+      m.num_sorted += jobs[t].distinct;
+    }
+
+  /* step 2 */
+  if (m.num_sorted > MERGE_MAX_USE * num_buckets)
+    {
+      histogram = malloc ((OSBF_MAX_BUCKET_VALUE + 1) * sizeof (*histogram));
+      UNLESS_CLEANUP_RAISE (histogram != NULL,
+                            (free (m.sorted), free (m.sorted_homes)),
+                            (h, "Couldn't allocate memory to merge into %s",
+                             class_to->classname));
+      drop_weakest (&m, (uint32_t) (MERGE_MAX_USE * num_buckets), histogram);
+      free (histogram);
+    }
+
+  /* step 3 */
+  UNLESS_CLEANUP_RAISE (find_start (&m, &first),
+                        (free (m.sorted), free (m.sorted_homes)),
+                        (h, ".cfc file %s is full!", class_to->classname));
+  lay_down (&m, first, osbf_displacement_trigger (class_to), class_to);
+  free (m.sorted);
+  free (m.sorted_homes);
+
+  for (i = 0; i < num_from; i++)
+    {
+      const OSBF_HEADER_STRUCT *from = classes_from[i]->header;
+      class_to->header->learnings       += from->learnings;
+      class_to->header->extra_learnings += from->extra_learnings;
+      class_to->header->classifications += from->classifications;
+      class_to->header->false_negatives += from->false_negatives;
+      class_to->header->false_positives += from->false_positives;
+    }
+
+  if (CLASS_GROWS (class_to))
+    {
+      uint32_t used = 0;
+      for (i = 0; i < num_buckets; i++)
+        used += class_to->buckets[i].count != 0;
+      class_to->header->used_buckets = used;
+    }
+
+  osbf_reset_bflags (class_to);
+}
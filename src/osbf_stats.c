@@ -1,6 +1,6 @@
 /*
- *  osbf_stats.c 
- *  
+ *  osbf_stats.c
+ *
  * See Copyright Notice in osbflib.h
  */
 
@@ -10,17 +10,43 @@
 
 /*****************************************************************/
 
+/* the histogram bin of a value: its length in bits */
+static unsigned
+histogram_bin (uint32_t n)
+{
+  static const unsigned char small[16] =
+    { 0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4 };
+  unsigned bin = 0;
+
+  if (n >= 1u << 16) { bin += 16; n >>= 16; }
+  if (n >= 1u << 8)  { bin += 8;  n >>= 8;  }
+  if (n >= 1u << 4)  { bin += 4;  n >>= 4;  }
+  return bin + small[n];
+}
+
+static void shard_stats (const CLASS_STRUCT *class, STATS_STRUCT * stats,
+                         OSBF_HANDLER *h, int verbose);
+
+/*
+ * The full statistics take a single pass over the buckets.  The pass
+ * starts right after an empty bucket, so that every chain is seen from
+ * its first bucket.  A bucket is reachable if no empty bucket lies
+ * between its right position and itself, that is, if it is no farther
+ * from its right position than from the start of its chain.  In a
+ * full file there is a single chain and every bucket is reachable.
+ */
 void
 osbf_stats (const CLASS_STRUCT *class, STATS_STRUCT * stats,
 	    OSBF_HANDLER *h, int verbose)
 {
 
-  uint32_t i = 0;
+  uint32_t i, n, num_buckets;
+  int full;
 
   uint32_t used_buckets = 0, unreachable = 0;
   uint32_t max_chain = 0, num_chains = 0;
-  uint32_t max_count = 0, first_chain_len = 0;
   uint32_t max_displacement = 0, chain_len_sum = 0;
+  double displacement_sum = 0;
 
   uint32_t chain_len = 0, count;
 
@@ -29,85 +55,80 @@ osbf_stats (const CLASS_STRUCT *class, STATS_STRUCT * stats,
   if (class->state == OSBF_CLOSED)
     osbf_raise(h, "Cannot dump a closed class");
 
+  if (class->shards != NULL)
+    {
+      shard_stats (class, stats, h, verbose);
+      return;
+    }
+
+  memset(stats, 0, sizeof(*stats));
+
   if (verbose == 1) {
     buckets = class->buckets;
-    for (i = 0; i <= class->header->num_buckets; i++) {
+    num_buckets = class->header->num_buckets;
+
+    /* start after an empty bucket, if there is one */
+    for (i = 0; i < num_buckets && buckets[i].count != 0; i++)
+      ;
+    full = i == num_buckets;
+    i = full ? 0 : i + 1;
+
+    for (n = 0; n < num_buckets; n++, i++) {
+      if (i >= num_buckets)
+        i = 0;
       if ((count = buckets[i].count) != 0) {
         uint32_t distance, right_position;
-        uint32_t real_position, rp;
 
         used_buckets++;
         chain_len++;
-        if (count > max_count)
-          max_count = count;
-
-        /* calculate max displacement */
-        right_position = buckets[i].hash1 % class->header->num_buckets;
-	real_position = i;
-	if (right_position <= real_position)
-	  distance = real_position - right_position;
-	else
-	  distance = class->header->num_buckets + real_position -
-	    right_position;
-	if (distance > max_displacement)
-	  max_displacement = distance;
-
-	/* check if the bucket is unreachable */
-	for (rp = right_position; rp != real_position; rp++)
-	  {
-	    if (rp >= class->header->num_buckets)
-	      {
-	        rp = 0;
-	        if (rp == real_position)
-	          break;
-	      }
-	    if (buckets[rp].count == 0)
-	      break;
-	  }
-	if (rp != real_position)
-	  {
-	    unreachable++;
-	  }
-	
-	if (chain_len > 0)
-	  {
-	    if (chain_len > max_chain)
-	      max_chain = chain_len;
-	    chain_len_sum += chain_len;
-	    num_chains++;
-	    chain_len = 0;
-	    /* check if the first chain starts */
-	    /* at the the first bucket */
-	    if (i == 0 && num_chains == 1 && buckets[0].count != 0)
-	      first_chain_len = chain_len;
-          }
+        stats->count_histogram[histogram_bin(count)]++;
 
-      }
-    }
-    
-    /* check if last and first chains are the same */
-    /* not sure this makes sense any longer XXX */
-    if (chain_len > 0)
-      {
-        if (first_chain_len == 0)
-          num_chains++;
+        right_position = HASH_INDEX(class, buckets[i].hash1);
+        if (right_position <= i)
+          distance = i - right_position;
         else
-          chain_len += first_chain_len;
-        chain_len_sum += chain_len;
+          distance = num_buckets + i - right_position;
+        if (distance > max_displacement)
+          max_displacement = distance;
+        displacement_sum += distance;
+        stats->displacement_histogram[histogram_bin(distance)]++;
+
+        /* chain_len - 1 is the distance from the start of the chain */
+        if (distance >= chain_len && !full)
+          unreachable++;
+      } else if (chain_len > 0) {
         if (chain_len > max_chain)
           max_chain = chain_len;
+        chain_len_sum += chain_len;
+        num_chains++;
+        stats->chain_histogram[histogram_bin(chain_len)]++;
+        chain_len = 0;
       }
+    }
+
+    /* a chain can end only at the end of the pass if the file is full */
+    if (chain_len > 0) {
+      if (chain_len > max_chain)
+        max_chain = chain_len;
+      chain_len_sum += chain_len;
+      num_chains++;
+      stats->chain_histogram[histogram_bin(chain_len)]++;
+    }
   }
 
   stats->db_version = class->header->db_version;
   stats->total_buckets = class->header->num_buckets;
+  stats->max_buckets = MAX_BUCKETS(class);
   stats->bucket_size = sizeof(*class->buckets);
-  stats->header_size = sizeof(class->header);
+  stats->header_size = OSBF_HEADER_SIZE;
   stats->learnings = class->header->learnings;
   stats->extra_learnings = class->header->extra_learnings;
   stats->false_negatives = class->header->false_negatives;
   stats->false_positives = class->header->false_positives;
   stats->classifications = class->header->classifications;
+  stats->microgrooms = class->microgrooms;
+  stats->lock_wait = class->lock_wait;
+  stats->num_shards = 1;
   if (verbose == 1)
     {
       stats->used_buckets = used_buckets;
@@ -118,7 +139,55 @@ osbf_stats (const CLASS_STRUCT *class, STATS_STRUCT * stats,
       else
         stats->avg_chain = 0;
       stats->max_displacement = max_displacement;
+      stats->avg_displacement =
+        used_buckets > 0 ? displacement_sum / used_buckets : 0;
       stats->unreachable = unreachable;
     }
 }
 
+/*
+ * The statistics of a sharded class [Note Shards] add up those of its
+ * shards; its counters are those of shard 0, and the averages are
+ * weighted by the number of chains or of buckets in use.
+ */
+static void
+shard_stats (const CLASS_STRUCT *class, STATS_STRUCT * stats,
+             OSBF_HANDLER *h, int verbose)
+{
+  STATS_STRUCT s;
+  double chain_len_sum, displacement_sum;
+  uint32_t k, b;
+
+  osbf_stats (&class->shards[0], stats, h, verbose);
+  chain_len_sum = stats->avg_chain * stats->num_chains;
+  displacement_sum = stats->avg_displacement * stats->used_buckets;
+  for (k = 1; k < class->num_shards; k++)
+    {
+      osbf_stats (&class->shards[k], &s, h, verbose);
+      stats->total_buckets += s.total_buckets;
+      stats->max_buckets += s.max_buckets;
+      stats->used_buckets += s.used_buckets;
+      stats->num_chains += s.num_chains;
+      stats->unreachable += s.unreachable;
+      if (s.max_chain > stats->max_chain)
+        stats->max_chain = s.max_chain;
+      if (s.max_displacement > stats->max_displacement)
+        stats->max_displacement = s.max_displacement;
+      chain_len_sum += s.avg_chain * s.num_chains;
+      displacement_sum += s.avg_displacement * s.used_buckets;
+      for (b = 0; b < OSBF_HISTOGRAM_BINS; b++)
+        {
+          stats->displacement_histogram[b] += s.displacement_histogram[b];
+          stats->chain_histogram[b] += s.chain_histogram[b];
+          stats->count_histogram[b] += s.count_histogram[b];
+        }
+    }
+  if (stats->num_chains > 0)
+    stats->avg_chain = chain_len_sum / stats->num_chains;
+  if (stats->used_buckets > 0)
+    stats->avg_displacement = displacement_sum / stats->used_buckets;
+  /* the shards were trained through copies opened by the class */
+  stats->microgrooms = class->microgrooms;
+  stats->lock_wait = class->lock_wait;
+  stats->num_shards = class->num_shards;
+}
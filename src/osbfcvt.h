@@ -23,7 +23,15 @@
      2. The universal rep can always be downconverted into the preferred native rep
 */
 
-typedef OSBF_BUCKET_STRUCT OSBF_UNIVERSAL_BUCKET;
+/* the bucket of database versions 5 through 7 */
+typedef struct
+{
+  uint32_t hash1;
+  uint32_t hash2;
+  uint32_t count;
+} OSBF_BUCKET_STRUCT_2007_11;
+
+typedef OSBF_BUCKET_STRUCT_2007_11 OSBF_UNIVERSAL_BUCKET;
 typedef struct osbf_uni_header {
   uint32_t db_version;		/* database version as it was on disk */
   uint32_t db_id;		/* database identification -- which is what, exactly?*/
@@ -46,14 +54,18 @@ typedef unsigned (*osbf_bucket_upconverter)(OSBF_UNIVERSAL_BUCKET *dst, void *sr
   /* take a single bucket in any format and upconvert it to the universal
      format */
 
+void osbf_native_bucket_of_universal(OSBF_BUCKET_STRUCT *dst,
+                                     const OSBF_UNIVERSAL_BUCKET *src);
+  /* downconvert a universal bucket; the count is capped at
+     OSBF_MAX_BUCKET_VALUE and hash2 reduced to its fingerprint */
+
 void osbf_native_buckets_of_universal(OSBF_BUCKET_STRUCT *dst,
                                       const void *src,
                                       osbf_bucket_upconverter cvt,
                                       unsigned num_buckets);
   /* Initialize a native array of buckets from a pointer an array of non-native
      buckets.  The upconverter writes a universal bucket from a non-native bucket,
-     then returns the size in bytes of the non-native bucket.
-     Nobody will call this function until the bucket format changes */
+     then returns the size in bytes of the non-native bucket. */
 
 /* Database version */
 enum osbf_database_ids {  
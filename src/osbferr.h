@@ -5,6 +5,8 @@
 #ifndef OSBF_ERR
 #define OSBF_ERR 1
 
+#include <stddef.h>
+
 /* error handling for OSBF */
 
 typedef struct osbf_error_handler OSBF_HANDLER;  /* abstract type */
@@ -26,11 +28,19 @@ const char *osbf_pcall(osbf_error_fun f, void *data);
    pointer to an error message.  The client must call free()
    on the pointer to reclaim the memory. */
 
+int osbf_pcall_buf(osbf_error_fun f, void *data, char *msg, size_t size);
+/* the same, but returns 0 if f terminates normally and nonzero if
+   it raises, copying the error message into msg, truncated to size
+   bytes, unless msg is NULL.  Nothing is allocated, so an error can
+   be reported even when memory has run out. */
+
 
 /* This interface is intended to have multiple potential implementations.
    If the library is linked to Lua, OSBF_HANDLER will be equivalent to lua_State;
    osbf_raise will be equivalent to luaL_error; and osbf_pcall will not be
-   implemented.  */
+   implemented.  Otherwise (osbferrs.c) the handler holds a jmp_buf on
+   the stack of osbf_pcall, so calls made in different threads don't
+   interfere.  */
 
 
 #endif
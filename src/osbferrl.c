@@ -21,6 +21,15 @@ const char *osbf_pcall(osbf_error_fun f, void *data) {
   return "Lua-aware code called osbf_pcall instead of using Lua protected calls";
 }
 
+int osbf_pcall_buf(osbf_error_fun f, void *data, char *msg, size_t size) {
+  (void)f, (void)data;
+  if (msg != NULL && size > 0) {
+    strncpy(msg, osbf_pcall(f, data), size);
+    msg[size-1] = '\0';
+  }
+  return 1;
+}
+
 int osbf_raise(OSBF_HANDLER *L, const char *fmt, ...) {
   va_list args;
   va_start(args, fmt);
@@ -10,23 +10,38 @@
 
 #include "osbferr.h"
 
+#define ERR_BUF_SIZE 1000
+
 struct osbf_error_handler {
   jmp_buf env;
-  char err_buf[1000];
+  char err_buf[ERR_BUF_SIZE];
 };
 
-const char *osbf_pcall(osbf_error_fun f, void *data) {
+int osbf_pcall_buf(osbf_error_fun f, void *data, char *msg, size_t size) {
   OSBF_HANDLER h;
   h.err_buf[0] = '\0';
   if (setjmp(h.env)) {
-    char *s = malloc(strlen(h.err_buf)+1);
-    strcpy(s, h.err_buf);
-    return s;
-  } else {
-    return NULL;
+    if (msg != NULL && size > 0) {
+      strncpy(msg, h.err_buf, size);
+      msg[size-1] = '\0';
+    }
+    return 1;
   }
   f(&h, data);
-  return NULL;
+  return 0;
+}
+
+const char *osbf_pcall(osbf_error_fun f, void *data) {
+  char err_buf[ERR_BUF_SIZE];
+  char *s;
+
+  if (osbf_pcall_buf(f, data, err_buf, sizeof(err_buf)) == 0)
+    return NULL;
+  s = malloc(strlen(err_buf)+1);
+  if (s == NULL)
+    abort(); /* no way to report it; osbf_pcall_buf allocates nothing */
+  strcpy(s, err_buf);
+  return s;
 }
 
 int osbf_raise(OSBF_HANDLER *h, const char *fmt, ...) {
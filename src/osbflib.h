@@ -42,8 +42,9 @@ g * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
 #include "osbferr.h"
 
 enum db_version { OSBF_DB_BASIC_VERSION = 0, OSBF_DB_2007_11_VERSION = 5,
-                  OSBF_DB_FP_FN_VERSION = 6, OSBF_DB_MAGIC_VERSION = 7 };
-#define OSBF_CURRENT_VERSION OSBF_DB_MAGIC_VERSION
+                  OSBF_DB_FP_FN_VERSION = 6, OSBF_DB_MAGIC_VERSION = 7,
+                  OSBF_DB_COMPACT_VERSION = 8 };
+#define OSBF_CURRENT_VERSION OSBF_DB_COMPACT_VERSION
 extern const char *db_version_names[];
   /* Array pointing to names, indexable by any enum_db_version */
 
@@ -53,14 +54,34 @@ extern const char *db_version_names[];
 
 typedef struct
 {
-  uint32_t hash1; /* bigram hashed with function 1 */
-  uint32_t hash2; /* bigram hashed with function 2 */
-  uint32_t count; /* number of msgs trained in which bigram has been seen */
+  uint32_t hash1;       /* bigram hashed with function 1 */
+  uint16_t fingerprint; /* high bits of bigram hashed with function 2 */
+  uint16_t count;       /* number of msgs trained in which bigram has been seen */
 } OSBF_BUCKET_STRUCT;
 
+/* [Note Fingerprint]
+   ~~~~~~~~~~~~~~~~~~
+   Through database version 7 a bucket held both 32-bit hashes of its
+   bigram and a 32-bit count, 12 bytes in all.  Counts never exceed
+   OSBF_MAX_BUCKET_VALUE, so they now take 16 bits, and of the second
+   hash, which only tells apart bigrams with the same first hash, only
+   the high 16 bits are kept as a fingerprint.  The first hash is kept
+   whole, because the microgroomer moves buckets back toward
+   hash1 % num_buckets.  A bucket now takes 8 bytes, so a cache line
+   holds 8 of them instead of 5.
+
+   Functions that take a 'key' still take the whole second hash and
+   compare only its fingerprint.  Where a key must be made from a
+   bucket, as when importing or dumping a class, FINGERPRINT_KEY gives
+   a key with the same fingerprint. */
+
+#define KEY_FINGERPRINT(k) ((uint16_t) ((k) >> 16))
+#define FINGERPRINT_KEY(f) ((uint32_t) (f) << 16)
+
 /* The following terminology and invariants apply to the array of buckets:
 
-  - If the count is nonzero, both hash1 and hash2 are nonzero.
+  - If the count is nonzero, hash1 and the fingerprint identify the bigram
+    [Note Fingerprint].
   - If the count is zero, the bucket is available to be allocated.
   - A maxmimal sequence of buckets with nonzero counts is called a *chain*.
     A sequence may wrap around from buckets[num_buckets-1] to buckets[0].
@@ -74,11 +95,12 @@ typedef struct
   - The number of probes required to find an existing bucket is its
     displacement plus one.
   - To keep probing cost down, the maximum displacement is capped at the value
-    of 'microgroom_displacement_trigger'. This number can be built in by means
-    of the macro OSBF_MICROGROOM_DISPLACEMENT_TRIGGER, but it is more typical
-    for the macro to be zero, in which case the maximum permissible
-    displacement is calculated by max(14.85 + 1.5E-4 * NUM_BUCKETS (class), 29)
-    in the function osbf_insert_bucket. The expression is a line that passes
+    of the context's 'microgroom_displacement_trigger' [Note Contexts]. Its
+    default can be built in by means of the macro
+    OSBF_MICROGROOM_DISPLACEMENT_TRIGGER, but it is more typical for the
+    trigger to be zero, in which case the maximum permissible displacement
+    is calculated by max(14.85 + 1.5E-4 * NUM_BUCKETS (class), 29) in the
+    function osbf_displacement_trigger. The expression is a line that passes
     through the points (94321, 29) and (4000037, 615), determined by
     experiments. For databases with less than 94321 buckets, the maximum
     displacement is constant and equal to 29.
@@ -94,9 +116,81 @@ typedef struct
       . Move buckets as needed to re-establish the invariant that every bucket
         b is located in the chain containing buckets[b->hash1 % num_buckets].
 
+  - A new bucket is placed either at the end of its chain or, with Robin Hood
+    insertion, ahead of the first bucket that is closer to its own home
+    [Note Robin Hood].  Either way the invariant above holds, so nothing
+    that reads a class needs to know which was used.
+
+  - In a class that grows [Note Growth], a bucket's right position is not
+    hash1 % num_buckets but HASH_INDEX(class, hash1).  Everything above
+    holds with that right position.
+
 */
 
+/* [Note Growth]
+   ~~~~~~~~~~~~~
+   A class created with a ceiling above its number of buckets grows
+   instead of microgrooming, in the manner of linear hashing.  Its
+   header records base_buckets, B, which starts as the number of
+   buckets and doubles each time the class does.  The class has
+   num_buckets = B + s buckets, and its right positions are
+
+       i = hash1 % B,  or hash1 % 2B if i < s,
+
+   so that the homes below s have been split: each bucket at home i
+   either stays there or moves to home i + B, the bucket past the
+   last one.  When used_buckets exceeds growth_use * num_buckets after
+   an insertion, or when an insertion makes a chain long enough to be
+   microgroomed, the class begins a round of splits: each insertion
+   that follows splits a few homes, until the class has doubled or
+   reached max_buckets, so the cost of growing is spread over the
+   trainings.  Until it reaches max_buckets, the class is never
+   microgroomed.  A round goes on even if the use falls back under
+   growth_use, because the homes not yet split take twice as many
+   buckets as the others and their chains would grow long; for the
+   same reason, a class that stops at a ceiling below 2B is more
+   crowded than its use shows.  A split adds the bucket at the end and
+   lays down again the chain holding home s, as well as the chain that
+   wraps around the end, whose buckets must now wrap one bucket later.
+
+   The file of a growing class is lengthened at once, but its header
+   is written only at close, so a file may be longer than its header
+   says; the excess is ignored.  Every process maps a growing class at
+   the size of its ceiling, so that a reader whose header shows the
+   buckets added by a writer can read them.  A class with base_buckets
+   zero doesn't grow, and its right positions are hash1 % num_buckets,
+   as in every class before version 8 and in every version 8 class
+   written before growth was possible, which had zeros in the header
+   padding. */
+
+
+
+/* A feature is a sparse bigram: the newest token of the text window
+   paired with the token window_idx positions before it, hashed two ways.
+   A feature vector holds the features of a text in the order in which
+   the trainer and the classifier compute them, so that a text may be
+   tokenized once and then trained and classified many times.  The
+   trainer adds OSB_BAYES_WINDOW_LEN-1 fake tokens at the end of the text,
+   the classifier doesn't; so the classifier uses only the first
+   num_features features, and the trainer all num_train_features.
+   The features depend on the token-size limits in effect when
+   they are computed. */
+
+typedef struct
+{
+  uint32_t h1;          /* feature hashed with function 1 */
+  uint32_t h2;          /* feature hashed with function 2 */
+  uint32_t window_idx;  /* distance between the tokens of the bigram */
+} OSBF_FEATURE;
 
+typedef struct
+{
+  OSBF_FEATURE *features;      /* managed with malloc/free */
+  uint32_t capacity;           /* number of elements allocated */
+  uint32_t num_features;       /* features seen by the classifier */
+  uint32_t num_train_features; /* those plus end-of-text padding */
+  unsigned long text_len;      /* length of the text tokenized */
+} OSBF_FEATURE_VECTOR;
 
 typedef struct /* used for disk image, so avoiding enum type for db_version */
 {
@@ -108,9 +202,33 @@ typedef struct /* used for disk image, so avoiding enum type for db_version */
   uint32_t false_positives;	/* number of false classifications as this class */
   uint64_t classifications;	/* number of classifications */
   uint32_t extra_learnings;	/* number of extra trainings done */
-} OSBF_HEADER_STRUCT_2008_01;
+} OSBF_HEADER_STRUCT_2008_01;  /* version 7 */
 
-typedef OSBF_HEADER_STRUCT_2008_01 OSBF_HEADER_STRUCT;
+typedef struct /* the header of version 8, padded to OSBF_HEADER_SIZE */
+{
+  uint32_t magic;               /* OSBF or FBSO */
+  uint32_t db_version;		/* database version as it was on disk */
+  uint32_t num_buckets;		/* number of buckets in the file */
+  uint32_t learnings;		/* number of trainings done */
+  uint32_t false_negatives;	/* number of false not classifications as this class */
+  uint32_t false_positives;	/* number of false classifications as this class */
+  uint64_t classifications;	/* number of classifications */
+  uint32_t extra_learnings;	/* number of extra trainings done */
+  uint32_t base_buckets;	/* buckets before the class last doubled, or 0
+                                   if it doesn't grow [Note Growth] */
+  uint32_t max_buckets;		/* ceiling on growth */
+  uint32_t used_buckets;	/* nonzero buckets, counted if it grows */
+  uint32_t num_shards;		/* files of a sharded class, or 0 [Note Shards] */
+  uint32_t shard;		/* which of them this file is */
+  uint64_t generation;		/* random id of this file's contents, or 0
+                                   if written before ids [Note Journal] */
+} OSBF_HEADER_STRUCT_2026_10;
+
+typedef OSBF_HEADER_STRUCT_2026_10 OSBF_HEADER_STRUCT;
+
+/* in a native image the header is padded to this many bytes, so the
+   buckets start on a cache-line boundary */
+#define OSBF_HEADER_SIZE 64
 
 /* what the client promises to do with a class */
 typedef enum osbf_class_usage {
@@ -130,7 +248,7 @@ typedef enum osbf_class_state {
 } osbf_class_state;
 
 /* class structure */
-typedef struct
+typedef struct osbf_class
 {
   char *classname;               /* managed with malloc/free */
   const char *fmt_name;          /* short name of the on-disk format;
@@ -138,35 +256,194 @@ typedef struct
   OSBF_HEADER_STRUCT *header;
   OSBF_BUCKET_STRUCT *buckets;
   osbf_class_state state;
-  unsigned char *bflags;	/* bucket flags [Note Flags] */
+  uint32_t *bflags;             /* epoch-stamped bucket flags [Note Flags] */
+  uint32_t bflags_epoch;        /* current epoch of bflags */
+  uint32_t *dirty;              /* bitmap of modified buckets [Note Dirty] */
   int fd;                       /* file descriptor of on-disk image */
-  off_t fsize;                  /* size of on-disk image */
+  off_t fsize;                  /* size of on-disk image, or of its
+                                   mapping if the class grows */
+  uint32_t file_buckets;        /* buckets the file has room for, if the
+                                   class grows and is open for writing */
   osbf_class_usage usage;
-  uint32_t learnings;
-  double hits;
-  uint32_t totalhits;
-  uint32_t uniquefeatures;
-  uint32_t missedfeatures;
+  uint32_t microgrooms;         /* microgroomings since the class was opened */
+  uint32_t journal_limit;       /* journal size to checkpoint at, or 0 if
+                                   the class is written in place [Note Journal] */
+  off_t journal_size;           /* bytes of the journal applied, or 0 */
+  uint32_t *journaled;          /* bitmap of the buckets set by the journal,
+                                   if open for OSBF_WRITE_ALL; or NULL */
+  OSBF_HEADER_STRUCT journal_header; /* header as of the journal's end */
+  int publish;                  /* nonzero if written as a new generation
+                                   of its file [Note Snapshots] */
+  double lock_wait;             /* seconds spent waiting for locks since the
+                                   class was opened [Note Locks in osbf_disk.c] */
+  struct osbf_class *shards;    /* the shards of a sharded class, each open
+                                   read-only, or NULL [Note Shards] */
+  uint32_t num_shards;          /* number of shards, if shards is not NULL */
+  OSBF_FEATURE_VECTOR features; /* features of a text trained into a
+                                   sharded class, kept with the class so
+                                   that an error in a shard leaks nothing */
+  const struct osbf_context *ctx; /* settings the class was opened under,
+                                     not owned [Note Contexts] */
 } CLASS_STRUCT;
 
 /* [Note Flags]
    ~~~~~~~~~~~~
-   The 'bucket flags' are used to track which buckets have been seen
-   during a classification.  They are also used by the microgroomer,
-   and so could be consulted during an import operation.  Otherwise 
-   the flags are not meaningful.   Therefore the data-structure invariant 
-   is as follows:
+   The 'bucket flags' are used by the microgroomer, and so could be
+   consulted during a training or an import operation.  Otherwise the
+   flags are not meaningful.  (The classifier once used them to track
+   which features had been seen in a message, but it now keeps its own
+   set of features, so that a classification writes nothing into the
+   class and several classifications may run at once [Note Threads].)
+
+   Clearing one byte per bucket on every call costs far more than a
+   message touches, so each entry is stamped with an epoch: the low 8
+   bits hold the flags and the high 24 bits the epoch in which they were
+   set.  Flags stamped with an older epoch read as zero, and
+   osbf_reset_bflags() clears every flag at once by starting a new epoch.
+   The array is scrubbed only when the epoch wraps around.  The
+   data-structure invariant is as follows:
      - If the class is open, class->bflags points to private memory
-       containing class->header->num_buckets bytes.
+       containing class->header->num_buckets entries, none of them
+       stamped with an epoch later than class->bflags_epoch, which is
+       never zero.
      - If the classifier or importer is not running, the contents 
        of those flags are meaningless.
 */
 
+/* [Note Dirty]
+   ~~~~~~~~~~~~
+   A class mapped for OSBF_WRITE_ALL is mapped MAP_PRIVATE, so changes
+   reach the disk only when the class is closed.  Rather than rewrite
+   the whole image, every bucket modified in memory is recorded in
+   class->dirty, one bit per bucket, and osbf_close_class() writes the
+   header plus the runs of dirty buckets.  Any code that changes a
+   bucket must call MARK_BUCKET_DIRTY.  For every other class dirty is
+   NULL and marking is a no-op: copied classes are written in full,
+   and read-only or header-only classes never change their buckets.
+*/
+
+/* [Note Journal]
+   ~~~~~~~~~~~~~~
+   With journal_limit set, a writer doesn't write the buckets it
+   changed into the class file when it closes the class.  It appends
+   them instead, with the new values of the header counters, as one
+   transaction to the class's journal, a file named after the class
+   with ".log" appended, so the writes of a training are sequential and
+   proportional to the buckets it touched.  Whoever opens the class
+   applies the journal to its private mapping.  A transaction ends
+   with a checksum, and one that was torn by a crash is ignored and
+   then overwritten.
+
+   A journal belongs to one generation of the class file: the header
+   holds a random 64-bit id, drawn anew whenever the file is created
+   or written whole, and the journal starts with the id of the file it
+   was written for.  A journal whose id isn't that of the file, left
+   over by a file since replaced or rewritten, is ignored; an inode
+   number would not do, as a file system reuses the inode of a file
+   just removed.  A file written before ids has id 0 and never takes a
+   journal; its first writer writes it in place and gives it an id.
+
+   Once the journal has reached journal_limit bytes, the next writer
+   to close the class checkpoints it: having appended and synced its own
+   transaction, it writes into the class file every bucket the journal
+   set as well as its own, syncs the file and removes the journal.  A
+   crash before the removal leaves a journal that sets the buckets and
+   the counters to the values they already have, since a transaction
+   records values rather than changes.  A writer without journal_limit,
+   or whose class grows [Note Growth], always checkpoints a journal it
+   finds.  A writer that changes only the header appends it to the
+   journal if there is one; written in place, it would be undone by
+   the counters of the journal's last transaction.
+
+   A reader that opens the class during a checkpoint may map the file
+   before the writer's buckets reach it and look for the journal after
+   it has been removed, and so miss the last trainings until it opens
+   the class again.  The locking methods that lock the flush region
+   [Note Locks in osbf_disk.c] keep readers out for the checkpoint;
+   with the others the miss is possible.
+*/
+
+/* [Note Snapshots]
+   ~~~~~~~~~~~~~~~~
+   Readers don't hold a lock while they use a class [Note Locks in
+   osbf_disk.c].  A writer that updates the class file in place may
+   therefore change buckets under a classification that is going on
+   in another process, whose private mapping shows the pages of the
+   file that it hasn't touched.  With snapshots set, a
+   writer instead writes the whole image of the class into a new file,
+   named after the class with ".new" appended, syncs it and renames it
+   over the class file while it still holds the lock of the old one.
+   Each file is thus a generation that nobody changes once it bears the
+   class name, and a reader maps a consistent generation however long
+   it keeps it open; it sees the trainings published since when it
+   opens the class again.  A writer waiting for the lock opens the new
+   generation, as after an online resize [Note Online resize in
+   osbf_disk.c].
+
+   Writing a generation costs a write of the whole file, so snapshots
+   go best with a journal [Note Journal]: trainings are then appended
+   to the journal, whose transactions a reader applies only whole, and
+   a generation is written only at a checkpoint.  The new generation
+   gets a new id [Note Journal], and once it bears the class name the
+   writer removes the journal, whose transactions it holds; a journal
+   that a crash kept from being removed is ignored.  A class opened
+   only to write its header is still written in place, a single write
+   of a few bytes.
+
+   As no file is changed once it bears the class name, readers take
+   no lock when snapshots are set, and a publishing writer doesn't
+   lock the flush region [Note Locks in osbf_disk.c], so readers never
+   wait for the write of a generation.  Every process that opens the
+   class must then set snapshots, or a reader may see a checkpoint
+   written in place half done.  A reader that maps the old generation
+   just before a checkpoint and looks for the journal just after its
+   removal misses the trainings in it until it opens the class again.
+*/
+
+/* [Note Shards]
+   ~~~~~~~~~~~~~
+   A class is one file, and a writer locks it from open to close, so
+   two processes that train the same class take turns for the whole
+   training.  A sharded class is instead split into num_shards files:
+   the file bearing the class name is shard 0, and shard k > 0 is the
+   file named after the class with "." and k appended.  Every file is
+   an ordinary class whose header records num_shards and its own shard
+   number, and feature f lives in shard f.h2 % num_shards.  The second
+   hash chooses the shard because the first chooses the home within
+   it: with h1 % num_shards, a shard would only ever use the homes
+   congruent to its number.  The counters of the logical class are
+   those of shard 0; the others keep theirs at zero.
+
+   Opening a sharded class by its name opens every shard read-only,
+   as a member, and holds no lock; class->header is that of shard 0,
+   and class->buckets is NULL, so code that looks up a feature must
+   first pick its shard with SHARD_OF.  A training splits the features
+   by shard, then opens for writing, trains and closes each shard it
+   touches in turn, and finally updates the counters in the header of
+   shard 0.  A trainer holds one shard lock at a time, always taking
+   them in shard order, so concurrent trainers of one class follow
+   each other through the shards like a pipeline instead of waiting
+   for the whole class, and they cannot deadlock.  Each shard
+   trained is opened again read-only afterwards, so the class shows
+   the training whether or not it went to a journal [Note Journal] or
+   to a new generation [Note Snapshots].  A training is thus no longer
+   atomic: a reader may see it in some shards and not yet in others.
+
+   A class opened for writing is locked shard by shard, so it cannot
+   be changed directly: importing, merging, dumping and setting its
+   counters are refused.  Resizing resizes each shard to its share of
+   the buckets. */
+
+/* Histograms in the statistics have one bin per bit length: bin 0
+   counts the zeros, and bin k counts the values from 2^(k-1) to 2^k-1. */
+#define OSBF_HISTOGRAM_BINS 33
+
 /* database statistics structure */
 typedef struct
 {
   uint32_t db_version;
   uint32_t total_buckets;
+  uint32_t max_buckets;         /* ceiling on growth; total_buckets if none */
   uint32_t bucket_size;
   uint32_t used_buckets;
   uint32_t header_size;
@@ -179,7 +456,14 @@ typedef struct
   uint32_t max_chain;
   double avg_chain;
   uint32_t max_displacement;
+  double avg_displacement;
   uint32_t unreachable;
+  uint32_t microgrooms;
+  double lock_wait;             /* seconds waited for locks */
+  uint32_t num_shards;          /* 1 unless the class is sharded [Note Shards] */
+  uint32_t displacement_histogram[OSBF_HISTOGRAM_BINS];
+  uint32_t chain_histogram[OSBF_HISTOGRAM_BINS];
+  uint32_t count_histogram[OSBF_HISTOGRAM_BINS];
 } STATS_STRUCT;
 
 #define NELEMS(A) (sizeof(A)/sizeof((A)[0]))
@@ -188,25 +472,50 @@ typedef struct
 
 enum osbf_bucket_flags { BUCKET_LOCK_MASK = 0x80, BUCKET_FREE_MASK = 0x40 };
 
-#define HASH_INDEX(cd, h)       (h % NUM_BUCKETS(cd))
+#define BFLAGS_EPOCH_SHIFT 8
+#define BFLAGS_MAX_EPOCH   (UINT32_MAX >> BFLAGS_EPOCH_SHIFT)
+
+#define HASH_INDEX(cd, h)       HOME_INDEX((cd)->header, h)
+#define SHARD_OF(cd, h2) \
+  ((cd)->shards != NULL ? &(cd)->shards[(h2) % (cd)->num_shards] : (cd))
+#define HOME_INDEX(hd, h) \
+  ((hd)->base_buckets == 0 ? (h) % (hd)->num_buckets \
+   : (h) % (hd)->base_buckets < (hd)->num_buckets - (hd)->base_buckets \
+   ? (h) % (2 * (hd)->base_buckets) : (h) % (hd)->base_buckets)
 #define NUM_BUCKETS(cd)         ((cd)->header->num_buckets)
+#define CLASS_GROWS(cd)         ((cd)->header->base_buckets != 0)
+#define MAX_BUCKETS(cd) \
+  (CLASS_GROWS(cd) ? (cd)->header->max_buckets : NUM_BUCKETS(cd))
 #define VALID_BUCKET(cd, i)     (i < NUM_BUCKETS(cd))
-#define BUCKET_FLAGS(cd, i)     (((cd)->bflags)[i])
-#define BUCKET_IS_LOCKED(cd, i) (((cd)->bflags[i]) &  BUCKET_LOCK_MASK)
-#define MARKED_FREE(cd, i)      (((cd)->bflags[i]) &  BUCKET_FREE_MASK)
-#define MARK_IT_FREE(cd, i)     (((cd)->bflags[i]) |= BUCKET_FREE_MASK)
-#define UNMARK_IT_FREE(cd, i)   (((cd)->bflags[i]) &= ~BUCKET_FREE_MASK)
-#define LOCK_BUCKET(cd, i)      (((cd)->bflags[i]) |= BUCKET_LOCK_MASK)
-#define UNLOCK_BUCKET(cd, i)    (((cd)->bflags[i]) &= ~BUCKET_LOCK_MASK)
+#define BUCKET_FLAGS(cd, i) \
+  (((cd)->bflags[i] >> BFLAGS_EPOCH_SHIFT) == (cd)->bflags_epoch \
+   ? ((cd)->bflags[i] & 0xff) : 0)
+#define SET_BUCKET_FLAGS(cd, i, f) \
+  ((cd)->bflags[i] = ((cd)->bflags_epoch << BFLAGS_EPOCH_SHIFT) | (f))
+#define BUCKET_IS_LOCKED(cd, i) (BUCKET_FLAGS(cd, i) &  BUCKET_LOCK_MASK)
+#define MARKED_FREE(cd, i)      (BUCKET_FLAGS(cd, i) &  BUCKET_FREE_MASK)
+#define MARK_IT_FREE(cd, i) \
+  SET_BUCKET_FLAGS(cd, i, BUCKET_FLAGS(cd, i) | BUCKET_FREE_MASK)
+#define UNMARK_IT_FREE(cd, i) \
+  SET_BUCKET_FLAGS(cd, i, BUCKET_FLAGS(cd, i) & ~BUCKET_FREE_MASK)
+#define LOCK_BUCKET(cd, i) \
+  SET_BUCKET_FLAGS(cd, i, BUCKET_FLAGS(cd, i) | BUCKET_LOCK_MASK)
+#define UNLOCK_BUCKET(cd, i) \
+  SET_BUCKET_FLAGS(cd, i, BUCKET_FLAGS(cd, i) & ~BUCKET_LOCK_MASK)
+
+#define MARK_BUCKET_DIRTY(cd, i) \
+  ((cd)->dirty ? (void) ((cd)->dirty[(i) / 32] |= (uint32_t) 1 << ((i) % 32)) \
+               : (void) 0)
+#define BUCKET_IS_DIRTY(cd, i) ((cd)->dirty[(i) / 32] & ((uint32_t) 1 << ((i) % 32)))
 
 #define BUCKET(cd, i) ((cd)->buckets[i])
 #define BUCKET_VALUE(cd, i) (BUCKET(cd, i).count)
 #define BUCKET_HASH(cd, i)  (BUCKET(cd, i).hash1)
-#define BUCKET_KEY(cd, i)   (BUCKET(cd, i).hash2)
+#define BUCKET_KEY(cd, i)   (BUCKET(cd, i).fingerprint)
 
 #define BUCKET_IN_CHAIN(cd, i) ((cd)->buckets[i].count > 0)
 #define BUCKET_HASH_COMPARE(cd, i, h, k) (((cd)->buckets[i].hash1) == (h) && \
-                                          ((cd)->buckets[i].hash2) == (k))
+                  ((cd)->buckets[i].fingerprint) == KEY_FINGERPRINT(k))
 #define NEXT_BUCKET(cd, i) ((i) == (NUM_BUCKETS(cd) - 1) ? 0 : (i) + 1)
 #define PREV_BUCKET(cd, i) ((i) == 0 ?  (NUM_BUCKETS(cd) - 1) : (i) - 1)
 
@@ -216,8 +525,29 @@ enum osbf_bucket_flags { BUCKET_LOCK_MASK = 0x80, BUCKET_FREE_MASK = 0x40 };
      ? HASH_INDEX(cd, h) \
      : osbf_slow_find_bucket(class, HASH_INDEX(cd, h), h, k))
 
+/* as FAST_FIND_BUCKET, but with the home index HASH_INDEX(cd, h)
+   already computed */
+#define FAST_FIND_BUCKET_AT(cd, home, h, k) \
+  ((BUCKET_HASH_COMPARE(cd, home, h, k) || !BUCKET_IN_CHAIN(cd, home)) \
+     ? (home) \
+     : osbf_slow_find_bucket(cd, home, h, k))
+
+/* hint that a bucket will soon be read; a large database doesn't fit in
+   the cache, and almost every lookup in it would otherwise stall.
+   Building with -DOSBF_PREFETCH=0 leaves the hint out, to measure what
+   it gains (see testing/classify_bench.lua) */
+#ifndef OSBF_PREFETCH
+#define OSBF_PREFETCH 1
+#endif
+#if OSBF_PREFETCH && defined(__GNUC__)
+#define PREFETCH_BUCKET(cd, i) __builtin_prefetch(&BUCKET(cd, i), 0, 1)
+#else
+#define PREFETCH_BUCKET(cd, i) ((void) 0)
+#endif
+
 #define HASH_INDEX2(N, i) ((i) % (N))
-#define BUCKET_MATCHES_2(b, h1, h2) ((b).hash1 == (h1) && (b).hash2 == (h2))
+#define BUCKET_MATCHES_2(b, h1, h2) \
+  ((b).hash1 == (h1) && (b).fingerprint == KEY_FINGERPRINT(h2))
 #define FAST_FIND_BUCKET2(class, buckets, num_buckets, h1, h2) \
   (BUCKET_MATCHES_2(buckets[HASH_INDEX2(num_buckets, h1)], h1, h2) || \
    buckets[HASH_INDEX2(num_buckets, h1)].count == 0 \
@@ -245,6 +575,9 @@ enum osbf_bucket_flags { BUCKET_LOCK_MASK = 0x80, BUCKET_FREE_MASK = 0x40 };
 /* if the value is zero the length will be calculated automatically */
 #define OSBF_MICROGROOM_DISPLACEMENT_TRIGGER 0
 
+/* use above which a class that grows is split, instead of microgroomed */
+#define OSBF_GROWTH_USE 0.75
+
 /* max number of buckets groom-zeroed */
 #define OSBF_MICROGROOM_STOP_AFTER 128
 
@@ -301,11 +634,70 @@ enum a_priori_options {
   A_PRIORI_UPPER_LIMIT         /* upper limit */
 };
 
-extern enum a_priori_options a_priori; 
-     /* which method to use for prior probabilities */
-
 /* mapping for a_priori_options enum */
 extern const char *a_priori_strings[];
+
+/* ways to combine the probabilities of features [Note Log scoring] */
+enum scoring_options {
+  PRODUCT_SCORING = 0,         /* product renormalized at each feature */
+  LOG_SCORING,                 /* sum of logs, normalized at the end */
+ /* end of valid values */
+  SCORING_UPPER_LIMIT          /* upper limit */
+};
+
+/* mapping for scoring_options enum */
+extern const char *scoring_strings[];
+
+/* where a new bucket goes in its chain [Note Robin Hood] */
+enum insertion_options {
+  LINEAR_INSERTION = 0,        /* at the first free bucket */
+  ROBIN_HOOD_INSERTION,        /* ahead of buckets closer to home */
+ /* end of valid values */
+  INSERTION_UPPER_LIMIT        /* upper limit */
+};
+
+/* mapping for insertion_options enum */
+extern const char *insertion_strings[];
+
+/* [Note Contexts]
+   ~~~~~~~~~~~~~~~~
+   Everything that tunes the engine is kept in an OSBF_CONTEXT rather
+   than in globals, so that several threads, or several Lua states, can
+   use the core at once with settings of their own.  The context is
+   given to the tokenizer and the classifier with each call, and to
+   osbf_open_class(), which leaves a pointer to it in the class: the
+   trainer, the microgroomer, the growth of the class, its journal, and
+   its locks follow the settings of the context the class was opened
+   under.  The core only reads a context, so one context may be shared
+   by any number of threads as long as nobody changes it meanwhile; it
+   must outlive the classes opened under it.  A new context should be
+   a copy of osbf_default_context. */
+
+typedef struct osbf_context
+{
+  uint32_t max_token_size;      /* tokens this long are hashed together */
+  uint32_t max_long_tokens;     /* with at most this many that follow */
+  uint32_t limit_token_size;    /* nonzero to cut tokens at max_token_size */
+  enum a_priori_options a_priori;   /* which method to use for prior
+                                       probabilities */
+  enum scoring_options scoring; /* which engine classifications use */
+  double K1, K2, K3;            /* constants of the confidence factor */
+  uint32_t microgroom_displacement_trigger;
+                                /* displacement that starts a microgrooming,
+                                   or 0 to compute it per class */
+  uint32_t microgroom_stop_after; /* buckets zeroed by one microgrooming */
+  enum insertion_options insertion; /* how the trainer places new buckets */
+  double growth_use;            /* use above which a class that grows is
+                                   split [Note Growth] */
+  uint32_t journal_limit;       /* journal size at which it is checkpointed,
+                                   or 0 [Note Journal] */
+  int snapshots;                /* nonzero to write classes as new
+                                   generations [Note Snapshots] */
+  double lock_timeout;          /* seconds to wait for the lock of a class
+                                   [Note Locks in osbf_disk.c] */
+} OSBF_CONTEXT;
+
+extern const OSBF_CONTEXT osbf_default_context;
  
 /****************************************************************/
 
@@ -321,7 +713,18 @@ extern void
 osbf_insert_bucket (CLASS_STRUCT * dbclass, uint32_t bindex,
 		    uint32_t hash, uint32_t key, int value);
 extern void
-osbf_create_cfcfile (const char *cfcfile, uint32_t buckets, OSBF_HANDLER *h);
+osbf_reset_bflags (CLASS_STRUCT * dbclass);
+extern void
+osbf_create_cfcfile (const char *cfcfile, uint32_t buckets, uint32_t max_buckets,
+                     OSBF_HANDLER *h);
+  /* max_buckets above buckets makes a class that grows [Note Growth] */
+extern void
+osbf_create_sharded (const char *cfcfile, uint32_t buckets, uint32_t max_buckets,
+                     uint32_t num_shards, OSBF_HANDLER *h);
+  /* a class of num_shards files sharing the buckets [Note Shards] */
+extern int
+osbf_extend_class (CLASS_STRUCT *class, uint32_t num_buckets);
+  /* makes room in memory and on disk for num_buckets buckets; 0 on success */
 
 extern void
 osbf_dump    (const CLASS_STRUCT *cfcfile, const char *csvfile, OSBF_HANDLER *h);
@@ -329,6 +732,17 @@ extern void
 osbf_restore (const char *cfcfile, const char *csvfile, OSBF_HANDLER *h);
 extern void 
 osbf_import  (CLASS_STRUCT *class_to, const CLASS_STRUCT *class_from, OSBF_HANDLER *h);
+extern void
+osbf_merge   (CLASS_STRUCT *class_to, CLASS_STRUCT *const classes_from[],
+              unsigned num_from, unsigned num_threads, OSBF_HANDLER *h);
+extern void
+osbf_replay  (CLASS_STRUCT *class_to, CLASS_STRUCT *class_before,
+              CLASS_STRUCT *class_after, OSBF_HANDLER *h);
+extern void
+osbf_resize_class (const char *classname, uint32_t num_buckets,
+                   unsigned num_threads, const OSBF_CONTEXT *ctx,
+                   OSBF_HANDLER *h);
+extern uint32_t osbf_displacement_trigger (CLASS_STRUCT *class);
 extern void osbf_stats   (const CLASS_STRUCT *cfcfile, STATS_STRUCT * stats,
                           OSBF_HANDLER *h, int full);
 
@@ -342,21 +756,80 @@ osbf_bayes_classify (const unsigned char *text,
                      unsigned nclasses,
 		     enum classify_flags flags,
 		     double min_pmax_pmin_ratio, double ptc[],
-		     uint32_t ptt[], OSBF_HANDLER *h);
+		     uint32_t ptt[], const OSBF_CONTEXT *ctx, OSBF_HANDLER *h);
 
 extern void
 osbf_bayes_train (const unsigned char *text,
 		  unsigned long len,
                   const char *delims,      /* token delimiters */
 		  CLASS_STRUCT *class,
-		  int sense, enum learn_flags flags, OSBF_HANDLER *h);
+		  int sense, enum learn_flags flags,
+		  const OSBF_CONTEXT *ctx, OSBF_HANDLER *h);
+   /* ctx tokenizes the text; the buckets are trained under the class's
+      own context [Note Contexts] */
 
    /* token delimiters are never NULL but may be the empty string */
 
+extern void
+osbf_extract_features (const unsigned char *text,
+		       unsigned long len,
+		       const char *delims,  /* token delimiters */
+		       OSBF_FEATURE_VECTOR *fv, const OSBF_CONTEXT *ctx,
+		       OSBF_HANDLER *h);
+   /* fv must be zeroed or hold features previously extracted;
+      it is reused, and on error it still must be freed */
+
+extern void osbf_free_features (OSBF_FEATURE_VECTOR *fv);
+
+extern void
+osbf_bayes_classify_features (const OSBF_FEATURE_VECTOR *fv,
+                              CLASS_STRUCT *classes[],
+                              unsigned nclasses,
+                              enum classify_flags flags,
+                              double min_pmax_pmin_ratio, double ptc[],
+                              uint32_t ptt[], const OSBF_CONTEXT *ctx,
+                              OSBF_HANDLER *h);
+
+/* one of the texts of a batch: either a text or its features */
+typedef struct
+{
+  const unsigned char *text;      /* text to be tokenized, or NULL */
+  unsigned long len;              /* length of text */
+  const OSBF_FEATURE_VECTOR *fv;  /* features, used if text is NULL */
+} OSBF_TEXT;
+
+extern void
+osbf_bayes_classify_batch (const OSBF_TEXT texts[],
+                           unsigned ntexts,
+                           const char *delims,  /* token delimiters */
+                           CLASS_STRUCT *classes[],
+                           unsigned nclasses,
+                           enum classify_flags flags,
+                           double min_pmax_pmin_ratio,
+                           unsigned nthreads,
+                           double ptc[],  /* ntexts * nclasses probs */
+                           uint32_t ptt[], const OSBF_CONTEXT *ctx,
+                           OSBF_HANDLER *h);
+   /* ptc[i * nclasses + k] is the probability that text i belongs to
+      class k; nthreads > 1 classifies in that many threads */
+
+extern void
+osbf_bayes_train_features (const OSBF_FEATURE_VECTOR *fv,
+                           CLASS_STRUCT *class,
+                           int sense, enum learn_flags flags,
+                           OSBF_HANDLER *h);
+
 extern void
 osbf_open_class (const char *classname, osbf_class_usage usage, CLASS_STRUCT * class,
-		 OSBF_HANDLER *h);
+		 const OSBF_CONTEXT *ctx, OSBF_HANDLER *h);
 extern void osbf_close_class (CLASS_STRUCT * class, OSBF_HANDLER *h);
+extern void
+osbf_open_shard (CLASS_STRUCT *class, uint32_t k, osbf_class_usage usage,
+                 CLASS_STRUCT *shard, OSBF_HANDLER *h);
+  /* opens shard k of a sharded class on its own [Note Shards] */
+extern void
+osbf_refresh_shard (CLASS_STRUCT *class, uint32_t k, OSBF_HANDLER *h);
+  /* opens shard k of a sharded class again, to see what was written */
 extern int osbf_lock_file (int fd, uint32_t start, uint32_t len);
 extern int osbf_lock_class (CLASS_STRUCT *class, uint32_t start, uint32_t len);
 extern int osbf_unlock_file (int fd, uint32_t start, uint32_t len);
@@ -366,8 +839,23 @@ extern off_t check_file (const char *file);
 
 uint32_t strnhash (const unsigned char *str, uint32_t len);
 
-extern void
-osbf_increment_false_positives (const char *cfcfile, int delta, OSBF_HANDLER *h);
+/* header counters that can be changed without opening the class */
+enum osbf_counter {
+  OSBF_COUNT_CLASSIFICATIONS, OSBF_COUNT_LEARNINGS, OSBF_COUNT_EXTRA_LEARNINGS,
+  OSBF_COUNT_FALSE_NEGATIVES, OSBF_COUNT_FALSE_POSITIVES
+};
+
+extern uint64_t
+osbf_add_to_counter (OSBF_HEADER_STRUCT *header, enum osbf_counter counter,
+                     int64_t delta, OSBF_HANDLER *h);
+  /* add delta to a counter, clamping at zero and at the counter's maximum;
+     return the new value */
+
+extern uint64_t
+osbf_increment_counter (const char *cfcfile, enum osbf_counter counter,
+                        int64_t delta, const OSBF_CONTEXT *ctx, OSBF_HANDLER *h);
+  /* same for a class on disk, writing only the counter under a lock on
+     the header */
 
 /* We can't use assert() because the mail must be filtered no matter what.
    We use either osbf_raise or UNLESS_CLEANUP_RAISE */
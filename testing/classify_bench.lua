@@ -0,0 +1,146 @@
+#! /usr/bin/env lua
+
+-- Measures the classification rate of the core on databases filled to a
+-- given fraction of their buckets.  With large databases (4000037 buckets)
+-- almost every bucket lookup misses the cache, so this is the benchmark
+-- to watch when changing the way buckets are found.  Because lookup
+-- cost depends on the layout as much as on the code, it also reports
+-- the size of a class and how far its buckets are from home.  To see
+-- what prefetching the buckets gains, run it again with the core built
+-- with -DOSBF_PREFETCH=0.
+--
+-- Messages come from a TREC index if one is given; otherwise they are
+-- synthetic, made of words drawn from a skewed random vocabulary.
+
+local core         = require 'osbf3.core'
+local options      = require 'osbf3.options'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+local util         = require 'osbf3.util'
+
+local opts, args = testlib.parse {
+  { long = 'fill', type = options.std.num,
+    usage = '-fill <fraction of buckets used>' },
+  { long = 'n', type = options.std.num,
+    usage = '-n <number of classifications>' },
+  { long = 'threads', type = options.std.num,
+    usage = '-threads <number> # classify with core.classify_batch' },
+}
+
+local num_buckets = testlib.num_buckets 'large'
+local fill = opts.fill or 0.5
+local num_classifications = opts.n or 2000
+local trecdir = args[1] and util.append_slash(args[1])
+
+local test_dir = testlib.scratch_dir 'bench'
+
+----------------------------------------------------------------
+-- sources of messages
+
+local messages -- iterator returning class, text
+
+if trecdir then
+  -- after the end of the corpus, starts over
+  local lines
+  messages = function()
+    lines = lines or io.lines(trecdir .. 'index')
+    local l = lines()
+    if l then
+      local labelled, file = string.match(l, '^(%w+)%s+(.*)')
+      return labelled, util.file_contents(trecdir .. file)
+    else
+      lines = nil
+    end
+  end
+else
+  local text = testlib.skewed_texts()
+  local n = 0
+  messages = function()
+    n = n + 1
+    local class = n % 2 == 0 and 'ham' or 'spam'
+    local offset = class == 'ham' and 0 or 997 -- classes share some words
+    return class, text(offset)
+  end
+end
+
+----------------------------------------------------------------
+-- fill the databases
+
+local files = { ham = test_dir .. '/ham.cfc', spam = test_dir .. '/spam.cfc' }
+for _, file in pairs(files) do
+  core.create_db(file, num_buckets)
+end
+
+local function use()
+  local min = 1
+  for _, file in pairs(files) do
+    min = math.min(min, core.stats(core.open_class(file, 'r'), true).use)
+  end
+  return min
+end
+
+local learnings, start, exhausted = 0, os.clock(), false
+repeat
+  for i = 1, 100 do
+    local class, text = messages()
+    if not class then exhausted = true; break end
+    core.learn(text, core.open_class(files[class], 'rw'))
+    learnings = learnings + 1
+  end
+  core.close() -- write the databases back to disk
+until exhausted or use() >= fill
+io.stderr:write(string.format('%d learnings filled %.0f%% of %d buckets in %.1fs\n',
+                              learnings, 100 * use(), num_buckets,
+                              os.clock() - start))
+do
+  local s = core.stats(core.open_class(files.ham, 'r'), true)
+  io.stderr:write(string.format(
+    '%d bytes per class, max displacement %d buckets\n',
+    s.bytes, s.max_displacement))
+  core.close()
+end
+
+----------------------------------------------------------------
+-- time the classifications
+
+local texts = { }
+for i = 1, num_classifications do
+  local class, text = messages()
+  if not class and i == 1 then class, text = messages() end
+  if not class then break end
+  texts[i] = text
+end
+
+local dbtable = { }
+for class, file in pairs(files) do
+  dbtable[class] = core.open_class(file, 'r')
+end
+
+-- with several threads os.clock() adds up their times, so the batch
+-- is timed by the wall clock
+local function wall_clock()
+  return tonumber(testlib.capture 'date +%s.%N') or os.time()
+end
+
+local sec
+if opts.threads then
+  start = wall_clock()
+  core.classify_batch(texts, dbtable, nil, nil, nil, opts.threads)
+  sec = wall_clock() - start
+else
+  start = os.clock()
+  for _, text in ipairs(texts) do
+    core.classify(text, dbtable)
+  end
+  sec = os.clock() - start
+end
+
+io.write(string.format(
+  'Using %d buckets %.0f%% full, %d classifications%s (%.1f/s, %.0f us each)\n',
+  num_buckets, 100 * use(), #texts,
+  opts.threads and string.format(' in %d threads', opts.threads) or '',
+  #texts / sec, 1e6 * sec / #texts))
+
+core.close()
+testlib.cleanup()
@@ -0,0 +1,195 @@
+#! /usr/bin/env lua
+
+-- Checks 'osbf daemon' and osbf-client.  A client written here sends
+-- FILTER and CLASSIFY requests and checks the answers, including PASS
+-- for a message with a subject-line command; the classification
+-- counts must reach the databases once the daemon is idle, and a
+-- training made by another process must show in the next answer.  A
+-- second daemon must not take over the socket of a live one, and a
+-- new one must take over the socket left by a dead one.  Finally
+-- osbf-client must fall back, or write the message unchanged, when no
+-- daemon listens and when the daemon never answers.
+--
+-- The script runs itself with -server as the daemon.  The osbf-client
+-- checks need the program, given with -client or found in the PATH.
+
+local osbf         = require 'osbf3'
+local command_line = require 'osbf3.command_line'
+local commands     = require 'osbf3.commands'
+local options      = require 'osbf3.options'
+local cfg          = require 'osbf3.cfg'
+local core         = require 'osbf3.core'
+local msg          = require 'osbf3.msg'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+
+local opts, args = testlib.parse {
+  { long = 'server', type = options.std.val,
+    usage = '-server <user directory>' },
+  { long = 'client', type = options.std.val,
+    usage = '-client <osbf-client program>' },
+}
+
+if opts.server then
+  osbf.init({ udir = opts.server }, false)
+  command_line.daemon('-socket', opts.server .. '/osbf.sock')
+  return
+end
+
+local test_dir = testlib.scratch_dir 'daemon'
+
+osbf.init({ udir = test_dir }, true)
+commands.init('test@test', 94321, 'buckets')
+core.close()
+
+local check = testlib.check
+local socket = test_dir .. '/osbf.sock'
+local pidfile = test_dir .. '/daemon.pid'
+
+local function start_daemon()
+  os.execute(string.format([[sh -c 'echo $$ > %s; exec %s %s -server %s' &]],
+                           pidfile, testlib.lua, arg[0], test_dir))
+end
+
+local function kill_daemon(signal)
+  local f = io.open(pidfile)
+  local pid = f and f:read '*l'
+  if f then f:close() end
+  if pid then os.execute(string.format('kill %s %s', signal or '', pid)) end
+end
+
+local function connect()
+  local fd
+  for _ = 1, 100 do
+    fd = core.socket_connect(socket)
+    if fd then return fd end
+    os.execute 'sleep 0.1'
+  end
+  error('cannot connect to the daemon')
+end
+
+-- sends a request and returns the first word of the answer and the
+-- text that follows it
+local function request(command, text, ...)
+  local fd = connect()
+  local line = table.concat({ command, #text, ... }, ' ')
+  assert(core.fd_write(fd, line, '\n', text))
+  local answer = assert(core.fd_read(fd, '*l'), 'no answer')
+  local word, len = answer:match '^(%S+)%s*(%d*)'
+  local body = word == 'OK' and core.fd_read(fd, tonumber(len)) or answer
+  core.fd_close(fd)
+  return word, body
+end
+
+local function message(subject, words)
+  return table.concat({ 'From: someone@example.com', 'To: test@test',
+                        'Subject: ' .. subject, '', words, '' }, '\r\n')
+end
+
+local function classifications()
+  local n = 0
+  for _, t in pairs(cfg.classes) do
+    local class = core.open_class(t.db, 'r')
+    n = n + class.classifications
+    core.close()
+  end
+  return n
+end
+
+----------------------------------------------------------------
+-- the protocol
+
+start_daemon()
+
+local text = message('lunch', 'shall we meet for lunch tomorrow at noon')
+local word, answer = request('CLASSIFY', text)
+check(word == 'OK', 'CLASSIFY answered ' .. tostring(word))
+local class = answer:match '^class=(%S+) confidence=%S+ train=%a+\n$'
+check(cfg.classes[class or ''], 'bad CLASSIFY answer ' .. answer)
+
+word, answer = request('FILTER', text)
+check(word == 'OK', 'FILTER answered ' .. tostring(word))
+local prefix = cfg.header_prefix .. '-'
+local m = msg.of_string(answer)
+check(m[prefix .. cfg.header_suffixes.class] == class,
+      'the filtered message has no class header, or a different class')
+check(m.subject ~= 'lunch', 'the subject was not tagged')
+word, answer = request('FILTER', text, '-notag')
+check(msg.of_string(answer).subject == 'lunch', '-notag tagged the subject')
+
+-- the password commands.init wrote into the daemon's configuration
+local f = assert(io.open(cfg.configfile))
+local pwd = f:read '*a':match 'pwd%s*=%s*"([^"]*)"'
+f:close()
+word = request('FILTER', message('stats ' .. pwd, 'no text'))
+check(word == 'PASS', 'a subject-line command was answered ' .. tostring(word))
+word = request('NONSENSE', text)
+check(word == 'ERR', 'a bad request was answered ' .. tostring(word))
+
+-- three requests were classified; the counts are written when the
+-- daemon has been idle for a second
+os.execute 'sleep 2'
+check(classifications() == 3, 'the classification counts were not written')
+
+-- a training by another process shows at once
+local other
+for c in pairs(cfg.classes) do
+  if c ~= class then other = c end
+end
+commands.learn_msg(msg.of_string(text), other)
+core.close()
+word, answer = request('CLASSIFY', text)
+check(answer:match '^class=(%S+)' == other, 'the daemon missed a training')
+
+----------------------------------------------------------------
+-- the socket
+
+check(os.execute(string.format('%s %s -server %s 2>/dev/null', testlib.lua,
+                               arg[0], test_dir)) ~= 0,
+      'a second daemon took over the socket')
+check(request('CLASSIFY', text) == 'OK', 'the first daemon stopped answering')
+kill_daemon '-9'
+os.execute 'sleep 0.5'
+check(core.filestat(socket), 'the dead daemon left no socket behind')
+start_daemon()
+check(request('CLASSIFY', text) == 'OK', 'a new daemon did not take over the socket')
+kill_daemon()
+os.execute 'sleep 0.5'
+
+----------------------------------------------------------------
+-- osbf-client falls back
+
+local client = opts.client or 'osbf-client'
+if os.execute('command -v ' .. client .. ' >/dev/null 2>&1') ~= 0 then
+  io.write('no ', client, '; the checks of osbf-client are skipped\n')
+  testlib.finish()
+end
+
+local input = test_dir .. '/message'
+f = assert(io.open(input, 'w'))
+f:write(text)
+f:close()
+
+local function run_client(path, fallback)
+  local cmd = string.format('%s -s %s -t 1 %s < %s', client, path,
+                            fallback or '', input)
+  local start = os.time()
+  local out = testlib.capture(cmd, true)
+  return out, os.time() - start
+end
+
+os.remove(socket)
+local out = run_client(socket)
+check(out == text, 'with no daemon, the message was changed')
+out = run_client(socket, '-- tr a-z A-Z')
+check(out == text:upper(), 'with no daemon, the fallback was not run')
+
+-- a server that takes connections but never answers
+local stuck = assert(core.socket_listen(socket))
+local sec
+out, sec = run_client(socket)
+check(out == text and sec < 5, 'a daemon that never answers held up the client')
+core.fd_close(stuck)
+
+testlib.finish()
@@ -0,0 +1,101 @@
+#! /usr/bin/env lua
+
+-- Checks that a database that grows loses nothing while it grows.  The
+-- same messages are learned into a database created small with a high
+-- ceiling and into one created at the ceiling, which never microgrooms.
+-- As long as it stays under its ceiling, the growing database must end
+-- up with the same buckets as the big one, all of them reachable, and
+-- it must survive a dump and restore as a database that still grows.
+-- A table compares both databases as the learnings proceed.
+--
+-- Messages are synthetic, made of random words.
+
+local core         = require 'osbf3.core'
+local options      = require 'osbf3.options'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+
+local opts, args = testlib.parse {
+  { long = 'max', type = options.std.num,
+    usage = '-max <ceiling>' },
+}
+
+local num_buckets = testlib.num_buckets(4099)
+local max_buckets = opts.max or 2000003
+local num_messages = opts.n or 400
+
+local function message(m) return testlib.message(m, 200000) end
+
+local test_dir = testlib.scratch_dir 'growth'
+
+local grown, big = test_dir .. '/grown.cfc', test_dir .. '/big.cfc'
+core.create_db(grown, num_buckets, max_buckets)
+core.create_db(big, max_buckets)
+
+----------------------------------------------------------------
+-- learn, a tenth of the messages per open
+
+io.write(string.format('  %8s %9s %9s %9s %7s %9s\n', 'messages', 'buckets',
+                       'used', 'big used', 'use', 'max disp'))
+local step = math.ceil(num_messages / 10)
+for first = 1, num_messages, step do
+  local last = math.min(first + step - 1, num_messages)
+  for _, db in ipairs { grown, big } do
+    local class = core.open_class(db, 'rw')
+    for m = first, last do
+      core.learn(message(m), class)
+    end
+    core.close()
+  end
+  local s = core.stats(core.open_class(grown, 'r'), true)
+  local sb = core.stats(core.open_class(big, 'r'), true)
+  core.close()
+  io.write(string.format('  %8d %9d %9d %9d %7.3f %9d\n', last, s.buckets,
+                         s.used_buckets, sb.used_buckets, s.use,
+                         s.max_displacement))
+end
+
+----------------------------------------------------------------
+-- compare
+
+local function contents(file)
+  local class = core.open_class(file, 'r')
+  local s = core.stats(class, true)
+  local buckets = { }
+  for i = 1, s.buckets do
+    local b = class[i]
+    if b.count > 0 then
+      buckets[#buckets+1] = string.format('%d %d %d', b.hash1, b.hash2, b.count)
+    end
+  end
+  core.close()
+  table.sort(buckets)
+  return table.concat(buckets, '\n'), s
+end
+
+local check = testlib.check
+
+local grown_buckets, s = contents(grown)
+local big_buckets = contents(big)
+check(grown_buckets == big_buckets, 'buckets differ from those of the big database')
+check(s.unreachable == 0, 'unreachable buckets')
+check(s.buckets > num_buckets and s.max_buckets == max_buckets, 'did not grow')
+
+local csv, restored = test_dir .. '/grown.csv', test_dir .. '/restored.cfc'
+core.dump(grown, csv)
+core.restore(restored, csv)
+local restored_buckets, sr = contents(restored)
+check(restored_buckets == grown_buckets and sr.buckets == s.buckets
+      and sr.max_buckets == max_buckets, 'restore differs')
+
+-- the restored database must go on growing where the dumped one left off
+local class = core.open_class(restored, 'rw')
+core.learn(message(num_messages + 1), class)
+core.close()
+class = core.open_class(grown, 'rw')
+core.learn(message(num_messages + 1), class)
+core.close()
+check(contents(restored) == contents(grown), 'restored database grows differently')
+
+testlib.finish()
@@ -0,0 +1,149 @@
+#! /usr/bin/env lua
+
+-- Checks that training through a journal gives the same databases as
+-- training in place.  The same messages are trained into a database
+-- without journal and into databases journaled with several limits,
+-- from the smallest, which checkpoints at every other training, to one
+-- that never checkpoints.  The script then tears the last transaction
+-- of a journal, as a crash would, and checks that the database goes on
+-- as if that training had not happened; it changes counters of a
+-- journaled database with core.increment; it puts back a journal that
+-- a checkpoint removed, as a crash before the removal would leave it,
+-- which must change nothing; and it replaces a journaled database,
+-- whose journal must then be ignored.
+--
+-- Messages are synthetic, made of random words.
+
+local core         = require 'osbf3.core'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+
+local opts, args = testlib.parse()
+
+local num_buckets  = testlib.num_buckets(100003)
+local num_messages = opts.n or 100
+local limits       = { 1, 100000, 1000000, 1e9 }
+
+local message = testlib.message
+
+-- trains messages first to last, one open at a time, unlearning an
+-- older message instead of every seventh one
+local function train(db, first, last, limit)
+  core.config { journal_limit = limit }
+  for m = first, last do
+    local class = core.open_class(db, 'rw')
+    if m % 7 == 0 then
+      core.unlearn(message(m - 50), class)
+    else
+      core.learn(message(m), class)
+    end
+    core.close()
+  end
+  core.config { journal_limit = 0 }
+end
+
+local function contents(file)
+  local class = core.open_class(file, 'r')
+  local s = core.stats(class, true)
+  local buckets = { }
+  for i = 1, s.buckets do
+    local b = class[i]
+    buckets[i] = string.format('%d %d %d', b.hash1, b.hash2, b.count)
+  end
+  core.close()
+  return table.concat(buckets, '\n'), s
+end
+
+local function size(file)
+  local f = io.open(file, 'rb')
+  if not f then return 0 end
+  local n = f:seek('end')
+  f:close()
+  return n
+end
+
+local test_dir = testlib.scratch_dir 'journal'
+
+local check = testlib.check
+
+----------------------------------------------------------------
+-- journaled and in place
+
+local plain = test_dir .. '/plain.cfc'
+core.create_db(plain, num_buckets)
+train(plain, 1, num_messages, 0)
+local expected, s = contents(plain)
+
+io.write(string.format('  %12s %12s %9s\n', 'limit', 'journal', 'learnings'))
+for _, limit in ipairs(limits) do
+  local db = string.format('%s/journaled-%d.cfc', test_dir, limit)
+  core.create_db(db, num_buckets)
+  train(db, 1, num_messages, limit)
+  local got, sj = contents(db)
+  io.write(string.format('  %12d %12d %9d\n', limit, size(db .. '.log'), sj.learnings))
+  check(got == expected and sj.learnings == s.learnings,
+        'journal limit ' .. limit .. ' gives another database')
+end
+
+----------------------------------------------------------------
+-- a torn transaction
+
+local db = string.format('%s/journaled-%d.cfc', test_dir, limits[#limits])
+core.open_class(db, 'rw') -- checkpoints, as journal_limit is 0
+core.close()
+check(io.open(db .. '.log') == nil and contents(db) == expected,
+      'a checkpoint did not empty the journal into the database')
+
+local torn = test_dir .. '/torn.cfc'
+core.create_db(torn, num_buckets)
+train(torn, 1, num_messages + 3, 0)
+
+train(db, num_messages + 1, num_messages + 3, limits[#limits])
+local log = assert(io.open(db .. '.log', 'rb')):read('*a')
+train(db, num_messages + 4, num_messages + 4, limits[#limits])
+local full = assert(io.open(db .. '.log', 'rb')):read('*a')
+local f = assert(io.open(db .. '.log', 'wb'))
+f:write(full:sub(1, #log + math.floor((#full - #log) / 2)))
+f:close()
+check(contents(db) == contents(torn), 'a torn transaction is not ignored')
+
+-- the next transaction takes the place of the torn one
+train(db, num_messages + 5, num_messages + 5, limits[#limits])
+train(torn, num_messages + 5, num_messages + 5, 0)
+check(contents(db) == contents(torn), 'a torn transaction is not overwritten')
+
+----------------------------------------------------------------
+-- counters changed by core.increment while there is a journal
+
+local _, before_increment = contents(db)
+core.increment(db, 'classifications')
+core.increment(db, 'learnings', -1)
+local _, after_increment = contents(db)
+check(io.open(db .. '.log')
+        and after_increment.classifications == before_increment.classifications + 1
+        and after_increment.learnings == before_increment.learnings - 1,
+      'a counter changed beside the journal is lost')
+
+----------------------------------------------------------------
+-- a crash after a checkpoint, before the journal was removed
+
+local before, sb = contents(db)
+local saved = assert(io.open(db .. '.log', 'rb')):read('*a')
+core.open_class(db, 'rw') -- checkpoints
+core.close()
+f = assert(io.open(db .. '.log', 'wb'))
+f:write(saved)
+f:close()
+local after, sa = contents(db)
+check(after == before and sa.learnings == sb.learnings
+        and sa.extra_learnings == sb.extra_learnings,
+      'a journal replayed after its checkpoint changes the database')
+
+----------------------------------------------------------------
+-- a journal left by a replaced database
+
+os.execute(string.format('/bin/cp %s %s.new && /bin/mv %s.new %s', plain, db, db, db))
+check(contents(db) == expected, 'the journal of a replaced database is applied')
+
+testlib.finish()
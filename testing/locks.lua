@@ -0,0 +1,173 @@
+#! /usr/bin/env lua
+
+-- Checks the locks of a database under concurrent trainings.  Several
+-- processes train the same database at once, each with its own
+-- messages, and the database must end up with the buckets of one
+-- trained with all the messages in turn; the table shows how long the
+-- processes waited for the lock.  Then a process holds the lock for a
+-- few seconds while another gives up after core.config's lock_timeout,
+-- well before the holder lets go.  Last, the processes train a
+-- database of version 7 at once, which the first of them converts to
+-- the native format; none may fail, no training may be lost, and the
+-- old file must be kept.
+--
+-- Messages are synthetic, made of random words.  The script runs
+-- itself with -learner or -holder as the other processes.
+
+local core         = require 'osbf3.core'
+local options      = require 'osbf3.options'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+
+local opts, args = testlib.parse {
+  { long = 'n', type = options.std.num,
+    usage = '-n <number of messages per process>' },
+  { long = 'procs', type = options.std.num,
+    usage = '-procs <number of training processes>' },
+  { long = 'learner', type = options.std.val,
+    usage = '-learner <database>' },
+  { long = 'holder', type = options.std.val,
+    usage = '-holder <database>' },
+  { long = 'first', type = options.std.num,
+    usage = '-first <first message of a learner>' },
+}
+
+local num_buckets  = testlib.num_buckets(300007)
+local num_messages = opts.n or 25
+local num_procs    = opts.procs or 4
+local hold_time    = 3
+local timeout      = 1
+
+local message = testlib.message
+
+-- trains messages first to last, one open each; returns the seconds
+-- waited for the lock
+local function train(db, first, last)
+  local wait = 0
+  for m = first, last do
+    local class = core.open_class(db, 'rw')
+    core.learn(message(m), class)
+    wait = wait + core.stats(class).lock_wait
+    core.close()
+  end
+  return wait
+end
+
+if opts.learner then
+  local wait = train(opts.learner, opts.first, opts.first + num_messages - 1)
+  local f = assert(io.open(string.format('%s.%d', opts.learner, opts.first), 'w'))
+  f:write(wait, '\n')
+  f:close()
+  return
+elseif opts.holder then
+  core.open_class(opts.holder, 'rw')
+  local f = assert(io.open(opts.holder .. '.held', 'w'))
+  f:close()
+  os.execute('sleep ' .. hold_time)
+  core.close()
+  return
+end
+
+local test_dir = testlib.scratch_dir 'locks'
+
+local function contents(file)
+  local class = core.open_class(file, 'r')
+  local buckets = { }
+  for i = 1, core.stats(class).buckets do
+    local b = class[i]
+    if b.count > 0 then
+      buckets[#buckets+1] = string.format('%d %d %d', b.hash1, b.hash2, b.count)
+    end
+  end
+  core.close()
+  table.sort(buckets)
+  return table.concat(buckets, '\n')
+end
+
+local check = testlib.check
+
+local lua = testlib.lua
+
+-- runs the learners at once, each with its own messages
+local function run_learners(db)
+  local learners = { }
+  for p = 1, num_procs do
+    learners[p] = string.format('%s %s -learner %s -first %d -n %d',
+                                lua, arg[0], db, (p - 1) * num_messages + 1,
+                                num_messages)
+  end
+  os.execute(table.concat(learners, ' & ') .. ' & wait')
+end
+
+----------------------------------------------------------------
+-- concurrent trainings
+
+local plain = test_dir .. '/plain.cfc'
+core.create_db(plain, num_buckets)
+train(plain, 1, num_procs * num_messages)
+
+local db = test_dir .. '/shared.cfc'
+core.create_db(db, num_buckets)
+run_learners(db)
+
+io.write(string.format('  %7s %12s\n', 'process', 'lock wait'))
+for p = 1, num_procs do
+  local f = io.open(string.format('%s.%d', db, (p - 1) * num_messages + 1))
+  local wait = f and f:read('*n')
+  if f then f:close() end
+  check(wait ~= nil, 'process ' .. p .. ' did not finish')
+  io.write(string.format('  %7d %12.6f\n', p, wait or 0))
+end
+check(contents(db) == contents(plain),
+      'concurrent trainings differ from trainings in turn')
+
+----------------------------------------------------------------
+-- timeout
+
+os.remove(db .. '.held')
+os.execute(string.format('%s %s -holder %s &', lua, arg[0], db))
+repeat until io.open(db .. '.held')
+core.config { lock_timeout = timeout }
+local start = os.time()
+local ok = pcall(core.open_class, db, 'rw')
+local waited = os.difftime(os.time(), start)
+core.close()
+io.write(string.format('gave up after about %d seconds with lock_timeout %d\n',
+                       waited, timeout))
+check(not ok, 'got a lock that another process holds')
+check(waited < hold_time, 'waited longer than lock_timeout')
+core.config { lock_timeout = 20 }
+os.execute('sleep ' .. hold_time)
+
+----------------------------------------------------------------
+-- concurrent trainings of a database of version 7
+
+local function uint32_string(n) -- little endian, as version 7 is on disk
+  return string.char(n % 256, math.floor(n / 2^8) % 256,
+                     math.floor(n / 2^16) % 256, math.floor(n / 2^24) % 256)
+end
+
+local old = test_dir .. '/old.cfc'
+local f = assert(io.open(old, 'wb'))
+-- magic, version, buckets, then zero counters: a 36-byte header
+f:write('OSBF', uint32_string(7), uint32_string(num_buckets), string.rep('\0', 24))
+f:write(string.rep('\0', 12 * num_buckets))
+f:close()
+run_learners(old)
+for p = 1, num_procs do
+  check(io.open(string.format('%s.%d', old, (p - 1) * num_messages + 1)),
+        'process ' .. p .. ' failed to train the database of version 7')
+end
+local class = core.open_class(old, 'r')
+local version = core.stats(class).db_version
+core.close()
+check(version == 8, 'the database was not converted')
+check(contents(old) == contents(plain),
+      'concurrent trainings of the old database differ from trainings in turn')
+local backup = io.open(old .. '.v7', 'rb')
+check(backup and backup:read(4) == 'OSBF' and backup:read(4) == uint32_string(7),
+      'the database of version 7 was not kept')
+if backup then backup:close() end
+
+testlib.finish()
@@ -0,0 +1,124 @@
+#! /usr/bin/env lua
+
+-- Checks core.merge against core.import.  A database is trained with
+-- synthetic messages, given some counts, and copied into empty
+-- databases of the same size, of twice the size and of a size too
+-- small to hold its buckets, once with import and once with merge
+-- using one thread and several.  Where nothing has to be dropped,
+-- merge must give the same buckets and counters as import.  Where
+-- buckets must be dropped, merge must keep the counters, keep no more
+-- than 90% of the buckets in use, keep each bucket it keeps unchanged
+-- and keep at least as much of the counts as import, whose
+-- microgroomer drops buckets as they come.  The number of threads
+-- must never change the result.
+
+local core         = require 'osbf3.core'
+local options      = require 'osbf3.options'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+
+local opts, args = testlib.parse {
+  { long = 'threads', type = options.std.num,
+    usage = '-threads <number of threads for the parallel merge>' },
+}
+
+local num_buckets = testlib.num_buckets(100003)
+local num_messages = opts.n or 60
+local threads = opts.threads or 4
+
+local check = testlib.check
+local test_dir = testlib.scratch_dir 'merge'
+
+local source = test_dir .. '/source.cfc'
+core.create_db(source, num_buckets)
+for m = 1, num_messages do
+  local class = core.open_class(source, 'rw')
+  core.learn(testlib.message(m), class)
+  core.close()
+end
+core.increment(source, 'classifications', 70)
+core.increment(source, 'fn', 3)
+core.increment(source, 'fp', 2)
+
+-- the nonempty buckets of the database, as a sorted list of
+-- 'hash1 hash2 count' strings, and its statistics
+local function contents(file)
+  local class = core.open_class(file, 'r')
+  local s = core.stats(class, true)
+  local buckets = { }
+  for i = 1, s.buckets do
+    local b = class[i]
+    if b.count > 0 then
+      buckets[#buckets+1] = string.format('%d %d %d', b.hash1, b.hash2, b.count)
+    end
+  end
+  core.close()
+  table.sort(buckets)
+  return buckets, s
+end
+
+local counters = { 'learnings', 'extra_learnings', 'classifications',
+                   'false_negatives', 'false_positives' }
+
+local function same_counters(s1, s2)
+  for _, c in ipairs(counters) do
+    if s1[c] ~= s2[c] then return false end
+  end
+  return true
+end
+
+local function total(buckets)
+  local sum = 0
+  for _, b in ipairs(buckets) do sum = sum + tonumber(b:match '(%d+)$') end
+  return sum
+end
+
+local from, s0 = contents(source)
+local in_source = { }
+for _, b in ipairs(from) do in_source[b] = true end
+io.write(string.format('source: %d buckets, %d in use, %d learnings\n',
+                       num_buckets, #from, s0.learnings))
+
+for _, case in ipairs {
+  { name = 'same size', buckets = num_buckets },
+  { name = 'grow',      buckets = 2 * num_buckets + 1 },
+  { name = 'shrink',    buckets = math.floor(#from / 2) },
+} do
+  local imported = test_dir .. '/imported.cfc'
+  local merged1, merged = test_dir .. '/merged1.cfc', test_dir .. '/merged.cfc'
+  for _, f in ipairs { imported, merged1, merged } do
+    os.remove(f)
+    core.create_db(f, case.buckets)
+  end
+  core.import(imported, source)
+  core.merge(merged1, source, 1)
+  core.merge(merged, source, threads)
+
+  local i, si = contents(imported)
+  local m1 = contents(merged1)
+  local m, sm = contents(merged)
+  io.write(string.format('%-9s %9d buckets: import keeps %6d, merge %6d\n',
+                         case.name, case.buckets, #i, #m))
+  local what = case.name .. ': '
+  check(table.concat(m, '\n') == table.concat(m1, '\n'),
+        what .. 'the number of threads changed the result of merge')
+  check(same_counters(sm, s0) and same_counters(si, s0),
+        what .. 'the counters were not carried over')
+  if #from <= 0.9 * case.buckets then
+    check(table.concat(m, '\n') == table.concat(from, '\n'),
+          what .. 'merge lost or changed buckets')
+    check(table.concat(m, '\n') == table.concat(i, '\n'),
+          what .. 'merge and import differ')
+  else
+    check(#m <= 0.9 * case.buckets, what .. 'merge filled the database too much')
+    local changed = 0
+    for _, b in ipairs(m) do
+      if not in_source[b] then changed = changed + 1 end
+    end
+    check(changed == 0, what .. 'merge changed ' .. changed .. ' buckets')
+    check(total(m) >= total(i), what .. 'merge kept less of the counts than import')
+  end
+end
+
+testlib.finish()
@@ -0,0 +1,132 @@
+#! /usr/bin/env lua
+
+-- Measures the latency of learning into a database that is already
+-- full, where learnings must microgroom chains to make room.  A class
+-- is first filled to a given fraction of its buckets; the script then
+-- times each of the next learnings and reports the distribution of
+-- their latencies, separately for learnings that microgroomed and for
+-- those that didn't.
+--
+-- Messages come from a TREC index if one is given; otherwise they are
+-- synthetic, made of words drawn from a skewed random vocabulary.
+
+local core         = require 'osbf3.core'
+local options      = require 'osbf3.options'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+local util         = require 'osbf3.util'
+
+local opts, args = testlib.parse {
+  { long = 'fill', type = options.std.num,
+    usage = '-fill <fraction of buckets used>' },
+  { long = 'n', type = options.std.num,
+    usage = '-n <number of timed learnings>' },
+}
+
+local num_buckets = testlib.num_buckets 'small'
+local fill = opts.fill or 0.75
+local num_learnings = opts.n or 2000
+local trecdir = args[1] and util.append_slash(args[1])
+
+local test_dir = testlib.scratch_dir 'groom'
+
+----------------------------------------------------------------
+-- source of messages
+
+local messages -- iterator returning text
+
+if trecdir then
+  -- after the end of the corpus, starts over
+  local lines
+  messages = function()
+    lines = lines or io.lines(trecdir .. 'index')
+    local l = lines()
+    if l then
+      local file = string.match(l, '^%w+%s+(.*)')
+      return util.file_contents(trecdir .. file)
+    else
+      lines = nil
+      return messages()
+    end
+  end
+else
+  messages = testlib.skewed_texts()
+end
+
+----------------------------------------------------------------
+-- fill the database
+
+local file = test_dir .. '/class.cfc'
+core.create_db(file, num_buckets)
+local db = core.open_class(file, 'rw')
+
+local learnings, start = 0, os.clock()
+repeat
+  for i = 1, 100 do
+    core.learn(messages(), db)
+  end
+  learnings = learnings + 100
+until core.stats(db, true).use >= fill
+io.stderr:write(string.format('%d learnings filled %.0f%% of %d buckets in %.1fs\n',
+                              learnings, 100 * core.stats(db, true).use,
+                              num_buckets, os.clock() - start))
+
+----------------------------------------------------------------
+-- time the learnings that follow
+
+local texts = { }
+for i = 1, num_learnings do
+  texts[i] = messages()
+end
+
+local groomed, plain, per_learning = { }, { }, { }
+local grooms = core.stats(db).microgrooms
+local total_grooms, total_sec = grooms, 0
+for i, text in ipairs(texts) do
+  start = os.clock()
+  core.learn(text, db)
+  local sec = os.clock() - start
+  local now = core.stats(db).microgrooms
+  table.insert(now > grooms and groomed or plain, sec)
+  per_learning[i] = now - grooms
+  total_sec = total_sec + sec
+  grooms = now
+end
+total_grooms = grooms - total_grooms
+table.sort(per_learning)
+
+local function report(what, times)
+  if #times == 0 then
+    io.write(string.format('  %-12s %6d\n', what, 0))
+    return
+  end
+  table.sort(times)
+  local sum = 0
+  for _, t in ipairs(times) do sum = sum + t end
+  local function percentile(p)
+    return times[math.max(1, math.ceil(p * #times))]
+  end
+  io.write(string.format('  %-12s %6d %9.0f %9.0f %9.0f %9.0f\n', what, #times,
+                         1e6 * sum / #times, 1e6 * percentile(0.5),
+                         1e6 * percentile(0.99), 1e6 * times[#times]))
+end
+
+io.write(string.format('%d learnings into %d buckets %.0f%% full, %d microgroomings\n',
+                       #texts, num_buckets, 100 * core.stats(db, true).use,
+                       total_grooms))
+io.write(string.format('  %-12s %6s %9s %9s %9s %9s\n', 'learnings', 'n',
+                       'mean us', 'p50 us', 'p99 us', 'max us'))
+report('groomed', groomed)
+report('not groomed', plain)
+io.write(string.format('  microgroomings per learning: p50 %d, p99 %d, max %d\n',
+                       per_learning[math.ceil(0.5 * #texts)],
+                       per_learning[math.ceil(0.99 * #texts)],
+                       per_learning[#texts]))
+if total_grooms > 0 then
+  io.write(string.format('  at most %.1f us per microgrooming\n',
+                         1e6 * total_sec / total_grooms))
+end
+
+core.close()
+testlib.cleanup()
@@ -0,0 +1,163 @@
+#! /usr/bin/env lua
+
+-- Checks 'osbf milter' with a small milter client playing the MTA.
+-- The client negotiates, sends the headers and body of a message and
+-- checks that the answer at the end of the message adds the headers
+-- 'osbf filter' adds and tags the subject; it sends a second message
+-- on the same connection while another connection is open, and the
+-- answer must be the same.  Finally it checks that an aborted message
+-- leaves nothing behind.
+--
+-- The script runs itself with -server as the milter.
+
+local osbf         = require 'osbf3'
+local command_line = require 'osbf3.command_line'
+local commands     = require 'osbf3.commands'
+local options      = require 'osbf3.options'
+local cfg          = require 'osbf3.cfg'
+local core         = require 'osbf3.core'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+
+local opts, args = testlib.parse {
+  { long = 'server', type = options.std.val,
+    usage = '-server <user directory>' },
+}
+
+if opts.server then
+  osbf.init({ udir = opts.server }, false)
+  command_line.milter('-socket', opts.server .. '/milter.sock')
+  return
+end
+
+local test_dir = testlib.scratch_dir 'milter'
+
+osbf.init({ udir = test_dir }, true)
+commands.init('test@test', 94321, 'buckets')
+core.close()
+
+local check = testlib.check
+
+local lua = testlib.lua
+local pidfile = test_dir .. '/milter.pid'
+os.execute(string.format([[sh -c 'echo $$ > %s; exec %s %s -server %s' &]],
+                         pidfile, lua, arg[0], test_dir))
+
+----------------------------------------------------------------
+-- the MTA's side of the protocol
+
+local function uint32_string(n)
+  return string.char(math.floor(n / 2^24) % 256, math.floor(n / 2^16) % 256,
+                     math.floor(n / 2^8) % 256, n % 256)
+end
+
+local function uint32(s, i)
+  local a, b, c, d = s:byte(i, i + 3)
+  return ((a * 256 + b) * 256 + c) * 256 + d
+end
+
+local function send(fd, command, data)
+  data = data or ''
+  assert(core.fd_write(fd, uint32_string(#data + 1), command, data))
+end
+
+local function receive(fd)
+  local head = assert(core.fd_read(fd, 4), 'milter closed the connection')
+  local packet = core.fd_read(fd, uint32(head, 1))
+  return packet:sub(1, 1), packet:sub(2)
+end
+
+local function connect()
+  local fd
+  for _ = 1, 100 do
+    fd = core.socket_connect(test_dir .. '/milter.sock')
+    if fd then break end
+    os.execute 'sleep 0.1'
+  end
+  assert(fd, 'cannot connect to the milter')
+  -- version 6, all actions, all stages
+  send(fd, 'O', uint32_string(6) .. uint32_string(0x1ff) .. uint32_string(0x1fffff))
+  local command, data = receive(fd)
+  check(command == 'O', 'no answer to option negotiation')
+  check(uint32(data, 1) == 6, 'wrong protocol version')
+  return fd
+end
+
+local headers = {
+  { 'From', 'someone@example.com' },
+  { 'To', 'test@test' },
+  { 'Subject', 'a message for the milter' },
+  { 'Message-ID', '<1@example.com>' },
+}
+local body = 'Nothing much to say here.\r\nJust testing the milter.\r\n'
+
+-- sends a message and returns its header changes, indexed by
+-- header name, or nil if the message is aborted
+local function filter(fd, abort)
+  send(fd, 'D', 'Ci\0ABC123\0') -- a macro, which gets no reply
+  for _, h in ipairs(headers) do
+    send(fd, 'L', h[1] .. '\0' .. h[2] .. '\0')
+    check(receive(fd) == 'c', 'header not acknowledged')
+  end
+  send(fd, 'N')
+  check(receive(fd) == 'c', 'end of headers not acknowledged')
+  send(fd, 'B', body)
+  check(receive(fd) == 'c', 'body not acknowledged')
+  if abort then
+    send(fd, 'A')
+    return nil
+  end
+  send(fd, 'E')
+  local changes = { }
+  while true do
+    local command, data = receive(fd)
+    if command == 'h' then
+      local name, value = data:match '^(%Z*)%z(%Z*)%z$'
+      changes[name] = value
+    elseif command == 'm' then
+      local name, value = data:match('^(%Z*)%z(%Z*)%z$', 5)
+      changes[name] = uint32(data, 1) .. ' ' .. value
+    else
+      check(command == 'c', 'unexpected reply ' .. command)
+      return changes
+    end
+  end
+end
+
+----------------------------------------------------------------
+
+local prefix = cfg.header_prefix .. '-'
+local suffixes = cfg.header_suffixes
+
+local fd = connect()
+local other = connect()
+local changes = filter(fd)
+for _, s in ipairs { 'summary', 'class', 'confidence', 'needs_training', 'sfid' } do
+  check(changes[prefix .. suffixes[s]], 'no header ' .. prefix .. suffixes[s])
+end
+local class = changes[prefix .. suffixes.class]
+io.write(string.format('class %s, confidence %s, sfid %s\n', tostring(class),
+                       tostring(changes[prefix .. suffixes.confidence]),
+                       tostring(changes[prefix .. suffixes.sfid])))
+check(cfg.classes[class or ''], 'unknown class ' .. tostring(class))
+check(changes.Subject and changes.Subject:find '^1 ', 'the subject was not tagged')
+
+check(filter(other, true) == nil, 'abort')
+local again = filter(fd)
+check(again[prefix .. suffixes.class] == class, 'the second message differs')
+check(again[prefix .. suffixes.sfid] ~= changes[prefix .. suffixes.sfid],
+      'the second message got the same sfid')
+local after_abort = filter(other)
+check(after_abort[prefix .. suffixes.class] == class,
+      'the aborted message left something behind')
+
+send(fd, 'Q')
+send(other, 'Q')
+core.fd_close(fd)
+core.fd_close(other)
+
+local pid = io.open(pidfile) and io.open(pidfile):read '*l'
+if pid then os.execute('kill ' .. pid) end
+
+testlib.finish()
@@ -0,0 +1,123 @@
+#! /usr/bin/env lua
+
+-- Checks that core.resize keeps the trainings made while it runs.  A
+-- database is trained with some messages and copied; a second process
+-- then trains the database with more messages, unlearning some of the
+-- first ones, while this one grows the database with core.resize.  The
+-- copy gets the same trainings and is grown afterwards.  As nothing is
+-- dropped in growing, both databases must end up with the same buckets
+-- and the same counters.  A database with a journal is then resized,
+-- which must carry the journal over and remove it.
+--
+-- Messages are synthetic, made of random words.  The script runs
+-- itself with -learner as the second process.
+
+local core         = require 'osbf3.core'
+local options      = require 'osbf3.options'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+
+local opts, args = testlib.parse {
+  { long = 'n', type = options.std.num,
+    usage = '-n <number of messages trained during the resize>' },
+  { long = 'learner', type = options.std.val,
+    usage = '-learner <database>' },
+}
+
+local num_buckets = testlib.num_buckets(3000017)
+local num_before  = 300
+local num_during  = opts.n or 400
+
+local message = testlib.message
+
+-- trains messages first to last into the database, one open at a time,
+-- unlearning an older message instead of every seventh one
+local function train(db, first, last)
+  for m = first, last do
+    local class = core.open_class(db, 'rw')
+    if m % 7 == 0 then
+      core.unlearn(message(m - 100), class)
+    else
+      core.learn(message(m), class)
+    end
+    core.close()
+  end
+end
+
+if opts.learner then
+  train(opts.learner, num_before + 1, num_before + num_during)
+  local f = assert(io.open(opts.learner .. '.done', 'w'))
+  f:close()
+  return
+end
+
+local test_dir = testlib.scratch_dir 'online-resize'
+
+local db, copy = test_dir .. '/class.cfc', test_dir .. '/copy.cfc'
+local new_buckets = 2 * num_buckets + 1
+
+core.create_db(db, num_buckets)
+train(db, 1, num_before)
+os.execute(string.format('/bin/cp %s %s', db, copy))
+
+----------------------------------------------------------------
+-- resize while the learner trains
+
+os.execute(string.format('%s %s -learner %s -n %d &', testlib.lua, arg[0],
+                         db, num_during))
+local start = os.time()
+core.resize(db, new_buckets)
+local sec = os.time() - start
+repeat
+  os.execute 'sleep 1'
+until io.open(db .. '.done')
+
+train(copy, num_before + 1, num_before + num_during)
+core.resize(copy, new_buckets)
+
+----------------------------------------------------------------
+-- compare
+
+local function contents(file)
+  local class = core.open_class(file, 'r')
+  local s = core.stats(class, true)
+  local buckets = { }
+  for i = 1, s.buckets do
+    local b = class[i]
+    if b.count > 0 then
+      buckets[#buckets+1] = string.format('%d %d %d', b.hash1, b.hash2, b.count)
+    end
+  end
+  core.close()
+  table.sort(buckets)
+  return table.concat(buckets, '\n'), s
+end
+
+local resized, s1 = contents(db)
+local expected, s2 = contents(copy)
+io.write(string.format('resized %d to %d buckets in about %ds\n',
+                       num_buckets, new_buckets, sec))
+io.write(string.format('  %-9s %9s %9s\n', '', 'used', 'learnings'))
+io.write(string.format('  %-9s %9d %9d\n', 'online', s1.used_buckets, s1.learnings))
+io.write(string.format('  %-9s %9d %9d\n', 'offline', s2.used_buckets, s2.learnings))
+testlib.check(resized == expected and s1.learnings == s2.learnings,
+              'trainings were lost or duplicated')
+
+----------------------------------------------------------------
+-- a journal is carried into the resized database, then removed
+
+local journaled, plain = test_dir .. '/journaled.cfc', test_dir .. '/plain.cfc'
+core.create_db(journaled, 30011)
+core.create_db(plain, 30011)
+core.config { journal_limit = 1e9 }
+train(journaled, 1, 50)
+core.config { journal_limit = 0 }
+train(plain, 1, 50)
+testlib.check(io.open(journaled .. '.log'), 'no journal was written')
+core.resize(journaled, 60013)
+core.resize(plain, 60013)
+testlib.check(io.open(journaled .. '.log') == nil, 'the resize left the journal behind')
+testlib.check(contents(journaled) == contents(plain),
+              'the resize lost the trainings in the journal')
+testlib.finish()
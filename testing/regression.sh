@@ -5,11 +5,15 @@ cd $dir
 
 TREC=trec06p_full
 
-case $1 in
-  -trec) TREC="$2" ; shift ; shift ;;
-esac
+UPDATE=
+while [ $# -gt 0 ]; do
+  case $1 in
+    -trec) TREC="$2" ; shift ; shift ;;
+    -update) UPDATE=1 ; shift ;;
+    *) echo "usage: $0 [-trec <dir>] [-update]" 1>&2; exit 1 ;;
+  esac
+done
 
-# sets udir to /tmp/osbf-lua
 if [ ! -x trec.lua ]; then
   echo 'trec.lua not found in testing dir ' 1>&2; exit 1
 fi
@@ -18,13 +22,35 @@ if [ ! -r $TREC/index ]; then
   echo "$TREC does not seem to point to a TREC index" 1>&2; exit 1
 fi
 
-./trec.lua "$TREC" > result
+/bin/rm -rf /tmp/osbf-lua
+mkdir /tmp/osbf-lua
+./trec.lua -udir /tmp/osbf-lua -o - "$TREC" > result
 
 /bin/rm -f *.md5
-md5sum result > result.md5
-md5sum /tmp/osbf-lua/*.cfc | sort > databases.md5
+# the lines starting with # hold timings
+grep -v '^#' result | md5sum | sed 's/-$/result/' > result.md5
+# bytes 57 to 64 of a database hold its generation id, which is random
+for f in /tmp/osbf-lua/*.cfc; do
+  sum=`{ dd if=$f bs=56 count=1 2>/dev/null; tail -c +65 $f; } | md5sum | sed 's/ .*//'`
+  echo "$sum  $f"
+done | sort > databases.md5
+# the date, time and serial number of an sfid vary from run to run
 md5sum /tmp/osbf-lua/cache/* | sort |
-  sed -e 's/\(sfid-.\)[0-9]*-[0-9]*/\1/' -e 's/-.@/@/' > cache.md5
+  sed -e 's/-[0-9]\{8\}-[0-9]\{6\}-/-/' -e 's/-[0-9]*@/@/' > cache.md5
+# -update makes databases.md5.ok and cache.md5.ok anew, as a change of
+# the database format or of the sfid requires, but only from a run
+# whose result and cached messages match the old ones
+if [ -n "$UPDATE" ]; then
+  if cmp -s result.md5 result.md5.ok &&
+     [ "`cut -c1-32 cache.md5 | sort`" = "`cut -c1-32 cache.md5.ok | sort`" ]
+  then
+    cp databases.md5 databases.md5.ok
+    cp cache.md5 cache.md5.ok
+    echo databases.md5.ok and cache.md5.ok updated
+  else
+    echo 'result or cache differ; nothing updated' 1>&2
+  fi
+fi
 > regression.txt
 for f in *.md5; do
   diff -u $f ${f}.ok >> regression.txt
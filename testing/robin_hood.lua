@@ -0,0 +1,70 @@
+#! /usr/bin/env lua
+
+-- Compares Robin Hood insertion with the default linear insertion (see
+-- core.config).  The same stream of synthetic messages is learned into
+-- a fresh database with each method; the script then reports the mean
+-- and largest number of probes needed to find a bucket, how often a
+-- chain had to be pruned, and how much training survived the pruning:
+-- the use of the buckets and the sum of their counts.
+--
+-- Messages are drawn from a skewed random vocabulary, so that, as in
+-- real mail, a few bigrams recur and most are seen once.
+
+local core         = require 'osbf3.core'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+
+local opts, args = testlib.parse()
+
+local num_buckets = testlib.num_buckets 'small'
+local num_messages = opts.n or 2000
+
+local test_dir = testlib.scratch_dir 'robin-hood'
+
+----------------------------------------------------------------
+-- the stream, the same for both methods
+
+local text = testlib.skewed_texts()
+local texts = { }
+for n = 1, num_messages do
+  texts[n] = text()
+end
+
+----------------------------------------------------------------
+-- learn it both ways
+
+local function run(method)
+  local file = test_dir .. '/' .. method .. '.cfc'
+  core.config { insertion = method }
+  core.create_db(file, num_buckets)
+  local db = core.open_class(file, 'rw')
+  local start = os.clock()
+  for _, text in ipairs(texts) do
+    core.learn(text, db)
+  end
+  local sec = os.clock() - start
+  local s = core.stats(db, true)
+  local kept = 0
+  for i = 1, s.buckets do
+    kept = kept + db[i].count
+  end
+  core.close()
+  return s, kept, sec
+end
+
+io.write(string.format('%d messages learned into %d buckets\n',
+                       #texts, num_buckets))
+io.write(string.format('  %-10s %6s %9s %7s %7s %11s %11s %7s\n', 'insertion',
+                       'use', 'counts', 'probes', 'max', 'microgrooms',
+                       'unreachable', 'time'))
+for _, method in ipairs { 'LINEAR', 'ROBIN_HOOD' } do
+  local s, kept, sec = run(method)
+  io.write(string.format('  %-10s %5.1f%% %9d %7.2f %7d %11d %11d %6.2fs\n',
+                         method, 100 * s.use, kept, s.avg_displacement + 1,
+                         s.max_displacement + 1, s.microgrooms,
+                         s.unreachable, sec))
+end
+core.config { insertion = 'LINEAR' }
+
+testlib.cleanup()
@@ -0,0 +1,149 @@
+#! /usr/bin/env lua
+
+-- Compares the LOG scoring engine with the default PRODUCT engine (see
+-- core.config).  Databases are trained on error with the first half of
+-- the messages; the second half is then classified by both engines,
+-- and the script reports how often they pick the same class and how
+-- far apart their pR values are.
+--
+-- Messages come from a TREC index if one is given (two classes, ham
+-- and spam); otherwise they are synthetic, drawn from a skewed random
+-- vocabulary, with as many classes as -classes asks for.
+
+local core         = require 'osbf3.core'
+local options      = require 'osbf3.options'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+local util         = require 'osbf3.util'
+
+local opts, args = testlib.parse {
+  { long = 'classes', type = options.std.num,
+    usage = '-classes <number of synthetic classes>' },
+}
+
+local num_buckets = testlib.num_buckets 'small'
+local num_messages = opts.n or 2000
+local trecdir = args[1] and util.append_slash(args[1])
+
+local test_dir = testlib.scratch_dir 'agreement'
+
+----------------------------------------------------------------
+-- sources of messages
+
+local classes  -- list of class names
+local messages -- iterator returning class, text
+
+if trecdir then
+  classes = { 'ham', 'spam' }
+  local lines = io.lines(trecdir .. 'index')
+  messages = function()
+    local l = lines()
+    if l then
+      local labelled, file = string.match(l, '^(%w+)%s+(.*)')
+      return labelled, util.file_contents(trecdir .. file)
+    end
+  end
+else
+  classes = { }
+  for i = 1, opts.classes or 2 do
+    classes[i] = 'c' .. i
+  end
+  local text = testlib.skewed_texts()
+  local n = 0
+  messages = function()
+    n = n + 1
+    local k = n % #classes + 1
+    local offset = 997 * (k - 1) -- classes share some words
+    return classes[k], text(offset)
+  end
+end
+
+----------------------------------------------------------------
+-- train on error with the first half
+
+local dbtable = { }
+for _, class in ipairs(classes) do
+  local file = test_dir .. '/' .. class .. '.cfc'
+  core.create_db(file, num_buckets)
+  dbtable[class] = core.open_class(file, 'rw')
+end
+
+local function best(probs)
+  local best_class, best_p = nil, -1
+  for class, p in pairs(probs) do
+    if p > best_p then best_class, best_p = class, p end
+  end
+  return best_class
+end
+
+local labels, texts = { }, { }
+for i = 1, num_messages do
+  labels[i], texts[i] = messages()
+  if not labels[i] then break end
+end
+
+local test = { }
+for i = 1, #texts do
+  if i <= #texts / 2 then
+    if best(core.classify(texts[i], dbtable)) ~= labels[i] then
+      core.learn(texts[i], dbtable[labels[i]])
+    end
+  else
+    table.insert(test, texts[i])
+  end
+end
+if #test == 0 then
+  util.die('no messages to classify')
+end
+
+----------------------------------------------------------------
+-- classify the second half with both engines
+
+local function scores(engine)
+  core.config { scoring = engine }
+  local names, probs = core.classify_batch(test, dbtable)
+  local decisions, pRs = { }, { }
+  for i = 1, #test do
+    local p = { }
+    for k, name in ipairs(names) do
+      p[name] = probs[(i-1) * #names + k]
+    end
+    local first = best(p)
+    local second_p = 0
+    for name, q in pairs(p) do
+      if name ~= first and q > second_p then second_p = q end
+    end
+    decisions[i], pRs[i] = first, core.pR(p[first], second_p)
+  end
+  return decisions, pRs
+end
+
+local product_decisions, product_pRs = scores 'PRODUCT'
+local log_decisions, log_pRs = scores 'LOG'
+core.config { scoring = 'PRODUCT' }
+
+local agree, near, near_agree, max_diff, sum_diff = 0, 0, 0, 0, 0
+for i = 1, #test do
+  local diff = math.abs(product_pRs[i] - log_pRs[i])
+  max_diff = math.max(max_diff, diff)
+  sum_diff = sum_diff + diff
+  if product_decisions[i] == log_decisions[i] then
+    agree = agree + 1
+  end
+  if product_pRs[i] < 20 then -- the range in which training decisions are made
+    near = near + 1
+    if diff < 0.01 then near_agree = near_agree + 1 end
+  end
+end
+
+io.write(string.format('%d classes, %d messages classified\n', #classes, #test))
+io.write(string.format('  same class chosen: %d (%.2f%%)\n',
+                       agree, 100 * agree / #test))
+io.write(string.format('  |pR difference|: mean %.4g, max %.4g\n',
+                       sum_diff / #test, max_diff))
+io.write(string.format('  pR < 20 under PRODUCT: %d, of which %d within 0.01\n',
+                       near, near_agree))
+
+core.close()
+testlib.cleanup()
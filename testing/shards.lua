@@ -0,0 +1,162 @@
+#! /usr/bin/env lua
+
+-- Checks sharded databases.  The same messages are trained into
+-- databases of one file and into databases split into shards, which
+-- must end up with the same buckets, in whatever order, and give the
+-- same classifications.  Then several processes train one sharded
+-- database at once, each with its own messages, and the database must
+-- end up with the buckets of one trained with all the messages in
+-- turn; the table shows how long the processes waited for locks.
+-- Finally the sharded database is resized and must keep its buckets.
+--
+-- Messages are synthetic, made of random words.  The script runs
+-- itself with -learner as the other processes.
+
+local core         = require 'osbf3.core'
+local options      = require 'osbf3.options'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+
+local opts, args = testlib.parse {
+  { long = 'n', type = options.std.num,
+    usage = '-n <number of messages per process>' },
+  { long = 'procs', type = options.std.num,
+    usage = '-procs <number of training processes>' },
+  { long = 'shards', type = options.std.num,
+    usage = '-shards <number of shards>' },
+  { long = 'learner', type = options.std.val,
+    usage = '-learner <database>' },
+  { long = 'first', type = options.std.num,
+    usage = '-first <first message of a learner>' },
+}
+
+local num_buckets  = testlib.num_buckets(300007)
+local num_messages = opts.n or 25
+local num_procs    = opts.procs or 4
+local num_shards   = opts.shards or 4
+
+local message = testlib.message
+
+-- trains messages first to last, one open each; returns the seconds
+-- waited for locks
+local function train(db, first, last)
+  local wait = 0
+  for m = first, last do
+    local class = core.open_class(db, 'rw')
+    core.learn(message(m), class)
+    wait = wait + core.stats(class).lock_wait
+    core.close()
+  end
+  return wait
+end
+
+if opts.learner then
+  local wait = train(opts.learner, opts.first, opts.first + num_messages - 1)
+  local f = assert(io.open(string.format('%s.done%d', opts.learner, opts.first), 'w'))
+  f:write(wait, '\n')
+  f:close()
+  return
+end
+
+local test_dir = testlib.scratch_dir 'shards'
+
+local function contents(file)
+  local class = core.open_class(file, 'r')
+  local buckets = { }
+  for i = 1, core.stats(class).buckets do
+    local b = class[i]
+    if b.count > 0 then
+      buckets[#buckets+1] = string.format('%d %d %d', b.hash1, b.hash2, b.count)
+    end
+  end
+  core.close()
+  table.sort(buckets)
+  return table.concat(buckets, '\n')
+end
+
+local check = testlib.check
+
+local lua = testlib.lua
+local total = num_procs * num_messages
+
+----------------------------------------------------------------
+-- sharded and plain
+
+local dbs = { }
+for _, shards in ipairs { 1, num_shards } do
+  for _, class in ipairs { 'ham', 'spam' } do
+    local db = string.format('%s/%s-%d.cfc', test_dir, class, shards)
+    core.create_db(db, num_buckets, nil, shards)
+    dbs[class .. shards] = db
+  end
+  for m = 1, total, 2 do
+    train(dbs['ham' .. shards], m, m)
+    train(dbs['spam' .. shards], m + 1, m + 1)
+  end
+end
+
+local s = core.stats(core.open_class(dbs['ham' .. num_shards], 'r'))
+core.close()
+io.write(string.format('%d shards of %d buckets in all, %d used, %d learnings\n',
+                       s.shards, s.buckets, s.used_buckets, s.learnings))
+check(s.shards == num_shards, 'the database does not have its shards')
+check(s.learnings == total / 2, 'the learnings were not counted once each')
+
+for _, class in ipairs { 'ham', 'spam' } do
+  check(contents(dbs[class .. 1]) == contents(dbs[class .. num_shards]),
+        'the shards of ' .. class .. ' hold other buckets than one file')
+end
+
+local differ = 0
+for m = total + 1, total + 20 do
+  local p1 = core.classify(message(m), { ham = core.open_class(dbs.ham1, 'r'),
+                                         spam = core.open_class(dbs.spam1, 'r') })
+  local pn = core.classify(message(m),
+                           { ham = core.open_class(dbs['ham' .. num_shards], 'r'),
+                             spam = core.open_class(dbs['spam' .. num_shards], 'r') })
+  if p1.ham ~= pn.ham or p1.spam ~= pn.spam then differ = differ + 1 end
+end
+core.close()
+check(differ == 0, differ .. ' classifications differ from those with one file')
+
+----------------------------------------------------------------
+-- concurrent trainings
+
+local plain = test_dir .. '/plain.cfc'
+core.create_db(plain, num_buckets, nil, num_shards)
+train(plain, 1, total)
+
+local db = test_dir .. '/shared.cfc'
+core.create_db(db, num_buckets, nil, num_shards)
+local learners = { }
+for p = 1, num_procs do
+  learners[p] = string.format('%s %s -learner %s -first %d -n %d',
+                              lua, arg[0], db, (p - 1) * num_messages + 1,
+                              num_messages)
+end
+os.execute(table.concat(learners, ' & ') .. ' & wait')
+
+io.write(string.format('  %7s %12s\n', 'process', 'lock wait'))
+for p = 1, num_procs do
+  local f = io.open(string.format('%s.done%d', db, (p - 1) * num_messages + 1))
+  local wait = f and f:read('*n')
+  if f then f:close() end
+  check(wait ~= nil, 'process ' .. p .. ' did not finish')
+  io.write(string.format('  %7d %12.6f\n', p, wait or 0))
+end
+check(contents(db) == contents(plain),
+      'concurrent trainings differ from trainings in turn')
+
+----------------------------------------------------------------
+-- resize
+
+local before = contents(db)
+core.resize(db, 2 * num_buckets)
+s = core.stats(core.open_class(db, 'r'))
+core.close()
+check(s.shards == num_shards and s.buckets >= 2 * num_buckets - num_shards,
+      'the shards were not resized')
+check(contents(db) == before, 'resizing lost buckets')
+
+testlib.finish()
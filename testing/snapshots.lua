@@ -0,0 +1,194 @@
+#! /usr/bin/env lua
+
+-- Checks that with core.config { snapshots = true } a reader sees a
+-- consistent database while another process trains it.  This process
+-- opens the database for reading and reads all its buckets again and
+-- again while a second process trains it, with and without a journal;
+-- the reader must see the same buckets every time until it opens the
+-- database again, and must then see the buckets of a database trained
+-- in place with the same messages.  Finally it checks that publishing
+-- a checkpoint removes the journal, and that a journal left from an
+-- older generation is ignored.  Last, several processes train the
+-- database at once while this one opens it for reading again and
+-- again: each publish replaces the file, and neither the trainers nor
+-- the reader may fail to get their locks, nor may a training be lost;
+-- the reader, which takes no lock, must never wait.
+--
+-- Messages are synthetic, made of random words.  The script runs
+-- itself with -learner as the other processes.
+
+local core         = require 'osbf3.core'
+local options      = require 'osbf3.options'
+
+package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+local testlib      = require 'testlib'
+
+local opts, args = testlib.parse {
+  { long = 'n', type = options.std.num,
+    usage = '-n <number of messages trained while reading>' },
+  { long = 'learner', type = options.std.val,
+    usage = '-learner <database>' },
+  { long = 'journal', type = options.std.num,
+    usage = '-journal <journal limit of the learner>' },
+  { long = 'first', type = options.std.num,
+    usage = '-first <first message of a learner>' },
+  { long = 'procs', type = options.std.num,
+    usage = '-procs <number of concurrent learners>' },
+}
+
+local num_buckets = testlib.num_buckets(30011)
+local num_before  = 50
+local num_during  = opts.n or 200
+local num_procs   = opts.procs or 4
+local num_each    = 20     -- messages per concurrent learner
+local big_buckets = 300007 -- room for them all, so that none is groomed
+
+local message = testlib.message
+
+local function train(db, first, last)
+  for m = first, last do
+    local class = core.open_class(db, 'rw')
+    core.learn(message(m), class)
+    core.close()
+  end
+end
+
+-- the file a learner starting at message first writes when it is
+-- done: 'ok', or the error that stopped it
+local function done_file(db, first)
+  return string.format('%s.%d', db, first)
+end
+
+if opts.learner then
+  local first = opts.first or num_before + 1
+  core.config { snapshots = true, journal_limit = opts.journal or 0 }
+  local ok, err = pcall(train, opts.learner, first, first + num_during - 1)
+  local f = assert(io.open(done_file(opts.learner, first), 'w'))
+  f:write(ok and 'ok' or tostring(err))
+  f:close()
+  return
+end
+
+local test_dir = testlib.scratch_dir 'snapshots'
+
+local function contents(class)
+  local buckets = { }
+  for i = 1, core.stats(class).buckets do
+    local b = class[i]
+    buckets[i] = string.format('%d %d %d', b.hash1, b.hash2, b.count)
+  end
+  return table.concat(buckets, '\n')
+end
+
+local check = testlib.check
+
+local plain = test_dir .. '/plain.cfc'
+core.create_db(plain, num_buckets)
+train(plain, 1, num_before + num_during)
+local expected = contents(core.open_class(plain, 'r'))
+core.close()
+
+for _, journal in ipairs { 0, 100000 } do
+  local db = string.format('%s/class-%d.cfc', test_dir, journal)
+  core.create_db(db, num_buckets)
+  train(db, 1, num_before)
+
+  local class = core.open_class(db, 'r')
+  local first = contents(class)
+  os.execute(string.format('%s %s -learner %s -n %d -journal %d &',
+                           testlib.lua, arg[0], db, num_during, journal))
+  local reads, changed = 0, 0
+  repeat
+    reads = reads + 1
+    if contents(class) ~= first then changed = changed + 1 end
+  until io.open(done_file(db, num_before + 1))
+  core.close()
+  io.write(string.format('journal limit %d: %d reads during the trainings, %d changed\n',
+                         journal, reads, changed))
+  check(changed == 0, 'the reader saw the database change')
+  check(contents(core.open_class(db, 'r')) == expected,
+        'the database differs from one trained in place')
+  core.close()
+end
+
+-- a checkpoint folds the journal into the generation it publishes and
+-- removes it; put back, as a crash before the removal would leave it,
+-- the journal must be ignored
+local db = string.format('%s/class-%d.cfc', test_dir, 0)
+core.config { snapshots = true, journal_limit = 1e9 }
+train(db, 1, 1)
+local log = io.open(db .. '.log', 'rb')
+check(log, 'no journal was written')
+local saved = log and log:read('*a')
+if log then log:close() end
+core.config { journal_limit = 0 }
+train(db, 2, 2)
+core.config { snapshots = false }
+check(io.open(db .. '.log') == nil, 'a published checkpoint left its journal behind')
+local published = contents(core.open_class(db, 'r'))
+core.close()
+log = assert(io.open(db .. '.log', 'wb'))
+log:write(saved or '')
+log:close()
+check(contents(core.open_class(db, 'r')) == published,
+      'the journal of an older generation was applied')
+core.close()
+
+-- several learners and a reader at once
+
+local function sorted_contents(file)
+  local class = core.open_class(file, 'r')
+  local buckets = { }
+  for i = 1, core.stats(class).buckets do
+    local b = class[i]
+    if b.count > 0 then
+      buckets[#buckets+1] = string.format('%d %d %d', b.hash1, b.hash2, b.count)
+    end
+  end
+  core.close()
+  table.sort(buckets)
+  return table.concat(buckets, '\n')
+end
+
+plain = test_dir .. '/plain-all.cfc'
+core.create_db(plain, big_buckets)
+train(plain, 1, num_before + num_procs * num_each)
+db = test_dir .. '/shared.cfc'
+core.create_db(db, big_buckets)
+train(db, 1, num_before)
+
+local learners = { }
+for p = 1, num_procs do
+  learners[p] = string.format('%s %s -learner %s -first %d -n %d',
+                              testlib.lua, arg[0], db,
+                              num_before + (p - 1) * num_each + 1, num_each)
+end
+os.execute('(' .. table.concat(learners, ' & ') .. ' & wait; touch '
+           .. db .. '.all) &')
+core.config { snapshots = true }
+local opens, failed, wait = 0, 0, 0
+repeat
+  opens = opens + 1
+  local ok, class = pcall(core.open_class, db, 'r')
+  if ok then
+    wait = wait + core.stats(class).lock_wait
+  else
+    failed = failed + 1
+    io.write('reader: ', tostring(class), '\n')
+  end
+  core.close()
+until io.open(db .. '.all')
+io.write(string.format('%d learners: %d opens for reading, %d failed, %.6f s waited\n',
+                       num_procs, opens, failed, wait))
+check(failed == 0, 'the reader could not open the database')
+check(wait == 0, 'the reader waited for the learners')
+for p = 1, num_procs do
+  local f = io.open(done_file(db, num_before + (p - 1) * num_each + 1))
+  local result = f and f:read('*a')
+  if f then f:close() end
+  check(result == 'ok', 'learner ' .. p .. ' failed: ' .. tostring(result))
+end
+check(sorted_contents(db) == sorted_contents(plain),
+      'concurrent trainings differ from trainings in turn')
+
+testlib.finish()
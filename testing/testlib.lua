@@ -0,0 +1,129 @@
+-- What the test and benchmark scripts in this directory share: the
+-- common options, a scratch directory, synthetic messages and the
+-- count of failed checks.  A script finds this file next to itself:
+--
+--   package.path = (arg[0]:match '^(.*/)' or './') .. '?.lua;' .. package.path
+--   local testlib = require 'testlib'
+
+local options = require 'osbf3.options'
+
+local M = { }
+
+M.lua = arg[-1] or 'lua' -- the interpreter, for scripts that run themselves
+
+M.bucket_sizes = { small = 94321, large = 4000037 }
+
+local common = {
+  { long = 'buckets', type = options.std.val,
+    usage = '-buckets <number>|small|large' },
+  { long = 'n', type = options.std.num, usage = '-n <number of messages>' },
+  { long = 'keep', type = options.std.bool,
+    help = 'keep temporary directory and files' },
+}
+
+-- registers the common options, unless extra has its own of the same
+-- name, and the options in extra; parses the command line
+function M.parse(extra)
+  local mine = { }
+  for _, t in ipairs(extra or { }) do
+    options.register(t)
+    mine[t.long] = true
+  end
+  for _, t in ipairs(common) do
+    if not mine[t.long] then options.register(t) end
+  end
+  M.opts, M.args = options.parse(arg)
+  return M.opts, M.args
+end
+
+-- the number of buckets asked for with -buckets, or default, which
+-- may also be the name of a size
+function M.num_buckets(default)
+  local b = M.opts.buckets or default
+  return assert(M.bucket_sizes[b] or tonumber(b), 'bad number of buckets')
+end
+
+function M.capture(cmd, raw)
+  local f, msg = io.popen(cmd, 'r')
+  if not f then return nil, msg end
+  local s = assert(f:read('*a'))
+  f:close()
+  if raw then return s end
+  s = string.gsub(s, '^%s+', '')
+  s = string.gsub(s, '%s+$', '')
+  s = string.gsub(s, '[\n\r]+', ' ')
+  return s
+end
+
+-- makes the scratch directory, /tmp/osbf-<name> if mktemp fails
+function M.scratch_dir(name)
+  local dir = M.capture 'mktemp -d' or ''
+  if dir:len() == 0 then
+    dir = '/tmp/osbf-' .. name
+    os.execute('/bin/rm -rf ' .. dir)
+    os.execute('/bin/mkdir ' .. dir)
+  end
+  M.dir = dir
+  return dir
+end
+
+-- message m of a stream of synthetic messages, each of 200 words
+-- drawn evenly from a vocabulary of the given size (default 30000)
+function M.message(m, vocabulary_size)
+  math.randomseed(m)
+  local words = { }
+  for i = 1, 200 do
+    words[i] = 'w' .. math.random(vocabulary_size or 30000)
+  end
+  return table.concat(words, ' ')
+end
+
+-- returns a function giving a text of 200 to 400 words drawn from a
+-- random vocabulary, skewed so that, as in real mail, a few words
+-- recur and most are rare; offset shifts the choice, so that texts
+-- with different offsets share only some of their words
+function M.skewed_texts(seed)
+  math.randomseed(seed or 2008)
+  local vocabulary = { }
+  for i = 1, 50000 do
+    local w = { }
+    for j = 1, math.random(2, 10) do
+      w[j] = string.char(string.byte('a') + math.random(0, 25))
+    end
+    vocabulary[i] = table.concat(w)
+  end
+  return function(offset)
+    local words = { }
+    for i = 1, math.random(200, 400) do
+      -- cubing skews the choice toward the start of the vocabulary
+      local k = math.floor(#vocabulary * math.random() ^ 3) + 1
+      words[i] = vocabulary[(k + (offset or 0)) % #vocabulary + 1]
+    end
+    return table.concat(words, ' ')
+  end
+end
+
+M.failures = 0
+
+function M.check(ok, what)
+  if not ok then
+    io.write('FAILED: ', what, '\n')
+    M.failures = M.failures + 1
+  end
+end
+
+-- removes the scratch directory unless -keep was given
+function M.cleanup()
+  if M.dir and not (M.opts and M.opts.keep) then
+    os.execute('/bin/rm -rf ' .. M.dir)
+  end
+end
+
+-- reports the checks, cleans up and exits
+function M.finish()
+  io.write(M.failures == 0 and 'ok\n' or '')
+  M.cleanup()
+  os.exit(M.failures == 0 and 0 or 1)
+end
+
+return M
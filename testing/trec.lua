@@ -30,7 +30,7 @@ local debug = os.getenv 'OSBF_DEBUG'
 
 local trecdir = args[1] 
 if not trecdir then
-  print('Usage: trec.lua [-ctimes] [-buckets <number>|small|large] [-max <n>] [-keep] [-o outfile] <trec_index_dir>')
+  print('Usage: trec.lua [-ctimes] [-buckets <number>|small|large] [-max <n>] [-keep] [-udir <dir>] [-o outfile] <trec_index_dir>')
   os.exit(1)
 end
 trecdir = util.append_slash(trecdir)
@@ -48,12 +48,15 @@ function os.capture(cmd, raw)
 end
 
 
--- try to avoid collisions on multiple tests
-local test_dir = os.capture 'mktemp -d' or ''
+-- try to avoid collisions on multiple tests, unless -udir names an
+-- empty directory, which is kept, as regression.sh does to find the
+-- databases and the cache
+local keep = opts.keep or opts.udir
+local test_dir = opts.udir or os.capture 'mktemp -d' or ''
 if test_dir:len() == 0 then
   test_dir = '/tmp/osbf-lua'
-  os.execute('/bin/mkdir ' .. test_dir)
   os.execute('/bin/rm -rf ' .. test_dir)
+  os.execute('/bin/mkdir ' .. test_dir)
 end
 
 opts.udir = test_dir
@@ -146,7 +149,7 @@ if result ~= io.stdout then
   result:close()
 end
 
-if not opts.keep then
+if not keep then
   os.execute('/bin/rm -rf ' .. test_dir)
 end
 